@@ -5,13 +5,27 @@ import android.os.Handler
 import android.os.Looper
 import android.os.SystemClock
 import com.squareup.stoic.jvmti.BreakpointRequest
+import com.squareup.stoic.jvmti.ExceptionRequest
+import com.squareup.stoic.jvmti.FieldPredicate
+import com.squareup.stoic.jvmti.FrameExitRequest
+import com.squareup.stoic.jvmti.JvmtiField
+import com.squareup.stoic.jvmti.JvmtiMethod
 import com.squareup.stoic.jvmti.Location
 import com.squareup.stoic.jvmti.MethodEntryRequest
+import com.squareup.stoic.jvmti.MethodExitListener
 import com.squareup.stoic.jvmti.MethodExitRequest
+import com.squareup.stoic.jvmti.MethodFilter
+import com.squareup.stoic.jvmti.MethodProbe
 import com.squareup.stoic.jvmti.OnBreakpoint
+import com.squareup.stoic.jvmti.OnException
 import com.squareup.stoic.jvmti.OnMethodEntry
 import com.squareup.stoic.jvmti.OnMethodExit
+import com.squareup.stoic.jvmti.OnStep
+import com.squareup.stoic.jvmti.OnWatchpoint
+import com.squareup.stoic.jvmti.StackFrame
+import com.squareup.stoic.jvmti.StepRequest
 import com.squareup.stoic.jvmti.VirtualMachine
+import com.squareup.stoic.jvmti.WatchpointRequest
 import com.squareup.stoic.threadlocals.stoic
 import java.io.InputStream
 import java.io.PrintStream
@@ -45,24 +59,193 @@ class StoicJvmti private constructor() {
     }
   }
 
-  fun methodEntries(onMethodEntry: OnMethodEntry): MethodEntryRequest {
+  /**
+   * Set breakpoints on source lines of `clazz`, all in one native call. Returns one request per
+   * armed location - lines without code are skipped.
+   */
+  fun breakpointsAtLines(clazz: Class<*>, vararg lines: Int, onBreakpoint: OnBreakpoint): List<BreakpointRequest> {
+    val pluginStoic = stoic
+    return VirtualMachine.eventRequestManager.createBreakpointRequestsAtLines(clazz, lines) { frame ->
+      pluginStoic.callWith {
+        onBreakpoint(frame)
+      }
+    }
+  }
+
+  fun methodEntries(filter: MethodFilter? = null, onMethodEntry: OnMethodEntry): MethodEntryRequest {
     val pluginStoic = stoic
-    return VirtualMachine.eventRequestManager.createMethodEntryRequest(Thread.currentThread()) { frame ->
+    return VirtualMachine.eventRequestManager.createMethodEntryRequest(Thread.currentThread(), filter) { frame ->
       pluginStoic.callWith {
         onMethodEntry(frame)
       }
     }
   }
 
-  fun methodExits(onMethodExit: OnMethodExit): MethodExitRequest {
+  fun methodExits(filter: MethodFilter? = null, onMethodExit: OnMethodExit): MethodExitRequest {
     val pluginStoic = stoic
-    return VirtualMachine.eventRequestManager.createMethodExitRequest(Thread.currentThread()) { frame, value, wasPoppedByException ->
+    return VirtualMachine.eventRequestManager.createMethodExitRequest(Thread.currentThread(), filter) { frame, value, wasPoppedByException ->
       pluginStoic.callWith {
         onMethodExit(frame, value, wasPoppedByException)
       }
     }
   }
 
+  /**
+   * Like methodExits(filter, onMethodExit), but primitive return values are delivered to the typed
+   * overloads of `listener` without being boxed
+   */
+  fun methodExits(filter: MethodFilter? = null, listener: MethodExitListener): MethodExitRequest {
+    return VirtualMachine.eventRequestManager.createMethodExitRequest(Thread.currentThread(), filter, listener.inPluginContext(stoic))
+  }
+
+  /**
+   * Observe exceptions thrown on any thread that are instances of one of `classes` (or all
+   * exceptions, if `classes` is empty). Requires can_generate_exception_events.
+   */
+  fun exceptions(vararg classes: Class<out Throwable>, onException: OnException): ExceptionRequest {
+    val pluginStoic = stoic
+    return VirtualMachine.eventRequestManager.createExceptionRequest(classes.toList()) { frame, exception, catchLocation ->
+      pluginStoic.callWith {
+        onException(frame, exception, catchLocation)
+      }
+    }
+  }
+
+  /**
+   * Observe reads of `field`. See WatchpointRequest for the filters, which are applied natively.
+   * Pass a null onAccess to only count matching reads. Requires can_generate_field_access_events.
+   */
+  fun fieldAccesses(
+    field: JvmtiField,
+    thread: Thread? = null,
+    predicate: FieldPredicate = FieldPredicate.any,
+    onAccess: OnWatchpoint?
+  ): WatchpointRequest {
+    return watchpoint(field, false, thread, false, predicate, onAccess)
+  }
+
+  /**
+   * Observe writes of `field`. See WatchpointRequest for the filters, which are applied natively.
+   * Pass a null onModification to only count matching writes. Requires
+   * can_generate_field_modification_events.
+   */
+  fun fieldModifications(
+    field: JvmtiField,
+    thread: Thread? = null,
+    onlyChanges: Boolean = false,
+    predicate: FieldPredicate = FieldPredicate.any,
+    onModification: OnWatchpoint?
+  ): WatchpointRequest {
+    return watchpoint(field, true, thread, onlyChanges, predicate, onModification)
+  }
+
+  private fun watchpoint(
+    field: JvmtiField,
+    isModification: Boolean,
+    thread: Thread?,
+    onlyChanges: Boolean,
+    predicate: FieldPredicate,
+    callback: OnWatchpoint?
+  ): WatchpointRequest {
+    val pluginStoic = stoic
+    var wrapped: OnWatchpoint? = null
+    if (callback != null) {
+      wrapped = { frame, obj, oldValue, newValue ->
+        pluginStoic.callWith {
+          callback(frame, obj, oldValue, newValue)
+        }
+      }
+    }
+    return VirtualMachine.eventRequestManager.createWatchpointRequest(field, isModification, thread, onlyChanges, predicate, wrapped)
+  }
+
+  /**
+   * Step from `frame` (which must be on the current thread), e.g. from within a breakpoint
+   * callback. onStep is called once the step completes - see StepRequest.
+   */
+  fun step(frame: StackFrame, depth: StepRequest.Depth, filter: MethodFilter? = null, onStep: OnStep): StepRequest {
+    val pluginStoic = stoic
+    return VirtualMachine.eventRequestManager.createStepRequest(frame, depth, filter) { stepFrame ->
+      pluginStoic.callWith {
+        onStep(stepFrame)
+      }
+    }
+  }
+
+  fun frameExit(frame: StackFrame, wantsReturnValue: Boolean, onMethodExit: OnMethodExit): FrameExitRequest {
+    val pluginStoic = stoic
+    return VirtualMachine.eventRequestManager.createFrameExitRequest(frame, wantsReturnValue) { exitFrame, value, wasPoppedByException ->
+      pluginStoic.callWith {
+        onMethodExit(exitFrame, value, wasPoppedByException)
+      }
+    }
+  }
+
+  fun frameExit(frame: StackFrame, wantsReturnValue: Boolean, listener: MethodExitListener): FrameExitRequest {
+    return VirtualMachine.eventRequestManager.createFrameExitRequest(frame, wantsReturnValue, listener.inPluginContext(stoic))
+  }
+
+  // Runs each of the listener's callbacks with pluginStoic, as the lambda-based APIs do
+  private fun MethodExitListener.inPluginContext(pluginStoic: Stoic): MethodExitListener {
+    val listener = this
+    return object : MethodExitListener {
+      override fun onExit(frame: StackFrame, value: Any?, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExit(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitZ(frame: StackFrame, value: Boolean, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitZ(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitB(frame: StackFrame, value: Byte, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitB(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitC(frame: StackFrame, value: Char, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitC(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitS(frame: StackFrame, value: Short, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitS(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitI(frame: StackFrame, value: Int, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitI(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitJ(frame: StackFrame, value: Long, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitJ(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitF(frame: StackFrame, value: Float, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitF(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitD(frame: StackFrame, value: Double, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitD(frame, value, wasPoppedByException) }
+      }
+
+      override fun onExitV(frame: StackFrame, wasPoppedByException: Boolean) {
+        pluginStoic.callWith { listener.onExitV(frame, wasPoppedByException) }
+      }
+    }
+  }
+
+  /**
+   * Observe entries (and, if onExit is non-null, exits) of the given methods on all threads,
+   * without enabling per-thread MethodEntry/MethodExit events. See MethodProbe.
+   */
+  fun probe(
+    methods: List<JvmtiMethod>,
+    wantsReturnValue: Boolean = false,
+    onExit: OnMethodExit? = null,
+    onEntry: OnMethodEntry,
+  ): MethodProbe {
+    val probe = MethodProbe(methods, wantsReturnValue, onEntry, onExit)
+    probe.arm { location, onBreakpoint -> breakpoint(location, onBreakpoint) }
+    return probe
+  }
+
   val virtualMachine: VirtualMachine get() {
     return VirtualMachine
   }
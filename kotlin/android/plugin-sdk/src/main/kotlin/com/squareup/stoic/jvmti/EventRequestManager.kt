@@ -17,6 +17,10 @@ class EventRequestManager {
   private val breakpointRequests = mutableMapOf<Pair<JMethodId, JLocation>, MutableList<BreakpointRequest>>()
   private val methodEntryRequests = mutableMapOf<Thread, MutableList<MethodEntryRequest>>()
   private val methodExitRequests = mutableMapOf<Thread, MutableList<MethodExitRequest>>()
+  private val frameExitRequests = mutableMapOf<Thread, MutableList<FrameExitRequest>>()
+  private val exceptionRequests = mutableListOf<ExceptionRequest>()
+  private val watchpointRequests = mutableMapOf<Long, WatchpointRequest>()
+  private val stepRequests = mutableMapOf<Thread, StepRequest>()
 
   @Synchronized
   fun createBreakpointRequest(location: Location, callback: OnBreakpoint): BreakpointRequest {
@@ -37,43 +41,170 @@ class EventRequestManager {
     return request
   }
 
+  /**
+   * Creates a breakpoint at the start of each of `lines` of `clazz` (one per method containing the
+   * line), resolving and arming them all in a single native call. Lines without code are skipped.
+   */
   @Synchronized
-  fun createMethodEntryRequest(thread: Thread, callback: OnMethodEntry): MethodEntryRequest {
+  fun createBreakpointRequestsAtLines(clazz: Class<*>, lines: IntArray, callback: OnBreakpoint): List<BreakpointRequest> {
+    // Native has already armed each location, so we only need to track the requests
+    val armed = decodeLineLocations(VirtualMachine.nativeSetBreakpointsAtLines(clazz, lines))
+    return armed.map { lineLocation ->
+      val location = lineLocation.location
+      val key = Pair(location.method.methodId, location.jlocation)
+      val request = BreakpointRequest(location, callback)
+      breakpointRequests.getOrPut(key) { mutableListOf() }.add(request)
+      request
+    }
+  }
+
+  @Synchronized
+  fun createMethodEntryRequest(thread: Thread, filter: MethodFilter?, callback: OnMethodEntry): MethodEntryRequest {
     var list = methodEntryRequests[thread]
     if (list == null) {
       list = mutableListOf()
       methodEntryRequests[thread] = list
     }
-    val request = MethodEntryRequest(thread, callback)
-    if (list.size == 0) {
-      VirtualMachine.nativeMethodEntryCallbacks(thread, true)
-    }
+    val request = MethodEntryRequest(thread, filter, callback)
+    request.nativeFilter = filter?.createNative() ?: 0
     list.add(request)
+    VirtualMachine.nativeMethodEntryCallbacks(thread, true, list.map { it.nativeFilter }.toLongArray())
 
     return request
   }
 
   @Synchronized
-  fun createMethodExitRequest(thread: Thread, callback: OnMethodExit): MethodExitRequest {
+  fun createMethodExitRequest(thread: Thread, filter: MethodFilter?, callback: OnMethodExit): MethodExitRequest {
+    return createMethodExitRequest(thread, filter, callback.toListener())
+  }
+
+  @Synchronized
+  fun createMethodExitRequest(thread: Thread, filter: MethodFilter?, listener: MethodExitListener): MethodExitRequest {
     var list = methodExitRequests[thread]
     if (list == null) {
       list = mutableListOf()
       methodExitRequests[thread] = list
     }
-    val request = MethodExitRequest(thread, callback)
-    if (list.size == 0) {
-      VirtualMachine.nativeMethodExitCallbacks(thread, true)
+    val request = MethodExitRequest(thread, filter, listener)
+    request.nativeFilter = filter?.createNative() ?: 0
+    list.add(request)
+    VirtualMachine.nativeMethodExitCallbacks(thread, true, list.map { it.nativeFilter }.toLongArray())
+
+    return request
+  }
+
+  /**
+   * Note: the frame must be on the current thread
+   */
+  @Synchronized
+  fun createFrameExitRequest(frame: StackFrame, wantsReturnValue: Boolean, callback: OnMethodExit): FrameExitRequest {
+    return createFrameExitRequest(frame, wantsReturnValue, callback.toListener())
+  }
+
+  /**
+   * Note: the frame must be on the current thread
+   */
+  @Synchronized
+  fun createFrameExitRequest(frame: StackFrame, wantsReturnValue: Boolean, listener: MethodExitListener): FrameExitRequest {
+    check(frame.thread == Thread.currentThread())
+    var list = frameExitRequests[frame.thread]
+    if (list == null) {
+      list = mutableListOf()
+      frameExitRequests[frame.thread] = list
     }
+    val request = FrameExitRequest(frame.thread, frame.height, wantsReturnValue, listener)
+
+    // Each request arms its own native watch. The native watch goes away when the frame exits, even
+    // if the request is closed before then.
+    VirtualMachine.nativeWatchFrameExit(frame.height, wantsReturnValue)
     list.add(request)
 
     return request
   }
 
+  @Synchronized
+  fun createExceptionRequest(classes: List<Class<out Throwable>>, callback: OnException): ExceptionRequest {
+    val request = ExceptionRequest(classes, callback)
+    exceptionRequests.add(request)
+    updateNativeExceptionCallbacks()
+
+    return request
+  }
+
+  // Native filters by the union of the requested classes. An unfiltered request means native must
+  // forward everything.
+  private fun updateNativeExceptionCallbacks() {
+    val isUnfiltered = exceptionRequests.any { it.classes.isEmpty() }
+    val classes = if (isUnfiltered) listOf() else exceptionRequests.flatMap { it.classes }.distinct()
+    VirtualMachine.nativeExceptionCallbacks(exceptionRequests.isNotEmpty(), classes.toTypedArray<Class<*>>())
+  }
+
+  // Native applies comparisons to the raw bits of primitives and null checks to objects, so anything
+  // else would silently match nothing (or everything)
+  private fun checkPredicateApplies(field: JvmtiField, predicate: FieldPredicate) {
+    val isObject = field.signature[0] == 'L' || field.signature[0] == '['
+    val applies = when (predicate.op) {
+      FieldPredicate.Op.ANY -> true
+      FieldPredicate.Op.IS_NULL, FieldPredicate.Op.IS_NOT_NULL -> isObject
+      else -> !isObject
+    }
+    if (!applies) {
+      throw IllegalArgumentException(
+        "${predicate.op} doesn't apply to ${field.name} of type ${field.signature}")
+    }
+  }
+
+  @Synchronized
+  fun createWatchpointRequest(
+    field: JvmtiField,
+    isModification: Boolean,
+    thread: Thread?,
+    onlyChanges: Boolean,
+    predicate: FieldPredicate,
+    callback: OnWatchpoint?
+  ): WatchpointRequest {
+    checkPredicateApplies(field, predicate)
+    val request = WatchpointRequest(field, isModification, thread, onlyChanges, predicate, callback)
+    request.nativeWatch = VirtualMachine.nativeCreateFieldWatch(
+      field.clazz,
+      field.fieldId,
+      isModification,
+      thread,
+      onlyChanges,
+      predicate.op.ordinal,
+      request.encode(predicate.operand),
+      callback != null)
+    watchpointRequests[request.nativeWatch] = request
+
+    return request
+  }
+
+  /**
+   * Note: the frame must be on the current thread. Only one step may be in progress on a thread at
+   * a time - this replaces any existing step request on the thread.
+   */
+  @Synchronized
+  fun createStepRequest(frame: StackFrame, depth: StepRequest.Depth, filter: MethodFilter?, callback: OnStep): StepRequest {
+    check(frame.thread == Thread.currentThread())
+    stepRequests[frame.thread]?.let { deleteStepRequest(it) }
+
+    val request = StepRequest(frame.thread, frame.height, depth, filter, callback)
+    request.nativeFilter = filter?.createNative() ?: 0
+    stepRequests[frame.thread] = request
+    VirtualMachine.nativeStartStep(frame.height, depth.ordinal, request.nativeFilter)
+
+    return request
+  }
+
   fun deleteEventRequest(request: EventRequest) {
     when (request) {
       is BreakpointRequest -> deleteBreakpointRequest(request)
       is MethodEntryRequest -> deleteMethodEntryRequest(request)
       is MethodExitRequest -> deleteMethodExitRequest(request)
+      is FrameExitRequest -> deleteFrameExitRequest(request)
+      is ExceptionRequest -> deleteExceptionRequest(request)
+      is WatchpointRequest -> deleteWatchpointRequest(request)
+      is StepRequest -> deleteStepRequest(request)
       else -> TODO()
     }
   }
@@ -100,24 +231,82 @@ class EventRequestManager {
   fun deleteMethodEntryRequest(request: MethodEntryRequest) {
     val list = methodEntryRequests[request.thread]
     check(list != null)
-    val sizeBefore = list.size
-    list.remove(request)
-    if (sizeBefore != 0 && list.size == 0) {
-      VirtualMachine.nativeMethodEntryCallbacks(request.thread, false)
+    if (!list.remove(request)) {
+      // Already deleted
+      return
+    }
+
+    // Native must stop using the filter before we destroy it
+    VirtualMachine.nativeMethodEntryCallbacks(request.thread, list.size != 0, list.map { it.nativeFilter }.toLongArray())
+    if (request.nativeFilter != 0L) {
+      VirtualMachine.nativeDestroyMethodFilter(request.nativeFilter)
     }
   }
 
   @Synchronized
   fun deleteMethodExitRequest(request: MethodExitRequest) {
-    var list = methodExitRequests[request.thread]
+    val list = methodExitRequests[request.thread]
     check(list != null)
-    val sizeBefore = list.size
-    list.remove(request)
-    if (sizeBefore != 0 && list.size == 0) {
-      VirtualMachine.nativeMethodExitCallbacks(request.thread, false)
+    if (!list.remove(request)) {
+      // Already deleted
+      return
+    }
+
+    // Native must stop using the filter before we destroy it
+    VirtualMachine.nativeMethodExitCallbacks(request.thread, list.size != 0, list.map { it.nativeFilter }.toLongArray())
+    if (request.nativeFilter != 0L) {
+      VirtualMachine.nativeDestroyMethodFilter(request.nativeFilter)
+    }
+  }
+
+  @Synchronized
+  fun deleteFrameExitRequest(request: FrameExitRequest) {
+    frameExitRequests[request.thread]?.remove(request)
+  }
+
+  @Synchronized
+  fun deleteExceptionRequest(request: ExceptionRequest) {
+    if (exceptionRequests.remove(request)) {
+      updateNativeExceptionCallbacks()
+    }
+  }
+
+  @Synchronized
+  fun deleteWatchpointRequest(request: WatchpointRequest) {
+    if (watchpointRequests.remove(request.nativeWatch) != null) {
+      VirtualMachine.nativeDestroyFieldWatch(request.nativeWatch)
     }
   }
 
+  /**
+   * Note: a step that is still in progress may only be deleted from its own thread
+   */
+  @Synchronized
+  fun deleteStepRequest(request: StepRequest) {
+    if (stepRequests[request.thread] != request) {
+      // Already completed or deleted
+      return
+    }
+    check(request.thread == Thread.currentThread())
+    stepRequests.remove(request.thread)
+
+    // Native must stop using the filter before we destroy it
+    VirtualMachine.nativeCancelStep()
+    if (request.nativeFilter != 0L) {
+      VirtualMachine.nativeDestroyMethodFilter(request.nativeFilter)
+    }
+  }
+
+  // Removes and returns the frame exit requests that are satisfied by the exit of `frame`. Requests
+  // for frames above it are included too, in case their exits were never reported.
+  private fun takeFrameExitRequests(frame: StackFrame, onlyWantsReturnValue: Boolean): List<FrameExitRequest> {
+    val list = frameExitRequests[frame.thread] ?: return listOf()
+    val taken = list.filter { it.height >= frame.height && (it.wantsReturnValue || !onlyWantsReturnValue) }
+    list.removeAll(taken)
+    taken.forEach { it.wasClosed = true }
+    return taken
+  }
+
   fun onBreakpoint(frame: StackFrame) {
     var requests: List<BreakpointRequest>
     synchronized(this) {
@@ -143,25 +332,92 @@ class EventRequestManager {
       requests = methodEntryRequests[Thread.currentThread()]!!.toList()
     }
 
+    // Native only filters out methods that no request wants, so we still need to check each request
     for (request in requests) {
-      if (!request.wasClosed) {
+      if (!request.wasClosed && request.filter?.matches(frame.location.method) != false) {
         request.callback(frame)
       }
     }
   }
 
-  fun onMethodExit(frame: StackFrame, value: Any?, wasPoppedByException: Boolean) {
+  /**
+   * The listeners that should receive the exit of `frame`. The caller delivers the value with the
+   * overload for its type, so that it's only boxed if a listener asks for it that way.
+   */
+  fun methodExitListeners(frame: StackFrame): List<MethodExitListener> {
     var requests: List<MethodExitRequest>
+    var frameExits: List<FrameExitRequest>
     synchronized(this) {
-      // This should always be non-null because we should only be getting callbacks for requests we
-      // set previously.
-      requests = methodExitRequests[Thread.currentThread()]!!.toList()
+      // This may be null if the exit was only reported for the sake of a FrameExitRequest
+      requests = methodExitRequests[Thread.currentThread()]?.toList() ?: listOf()
+      frameExits = takeFrameExitRequests(frame, onlyWantsReturnValue = true)
     }
 
+    val listeners = mutableListOf<MethodExitListener>()
     for (request in requests) {
-      if (!request.wasClosed) {
-        request.callback(frame, value, wasPoppedByException)
+      if (!request.wasClosed && request.filter?.matches(frame.location.method) != false) {
+        listeners.add(request.listener)
+      }
+    }
+    frameExits.mapTo(listeners) { it.listener }
+    return listeners
+  }
+
+  fun onFramePop(frame: StackFrame, wasPoppedByException: Boolean) {
+    var frameExits: List<FrameExitRequest>
+    synchronized(this) {
+      frameExits = takeFrameExitRequests(frame, onlyWantsReturnValue = false)
+    }
+
+    for (request in frameExits) {
+      request.listener.onExit(frame, null, wasPoppedByException)
+    }
+  }
+
+  fun onException(frame: StackFrame, exception: Throwable, catchLocation: Location?) {
+    var requests: List<ExceptionRequest>
+    synchronized(this) {
+      requests = exceptionRequests.toList()
+    }
+
+    // Native only filters by the union of the requested classes, so we still need to check each
+    // request
+    for (request in requests) {
+      if (!request.wasClosed && request.matches(exception)) {
+        request.callback(frame, exception, catchLocation)
       }
     }
   }
-}
\ No newline at end of file
+
+  fun onWatchpoint(nativeWatch: Long, frame: StackFrame, obj: Any?, oldBits: Long, oldObject: Any?, newBits: Long, newObject: Any?) {
+    var request: WatchpointRequest?
+    synchronized(this) {
+      // This may be null if the request was deleted after native decided to forward the event
+      request = watchpointRequests[nativeWatch]
+    }
+
+    val watch = request ?: return
+    if (!watch.wasClosed) {
+      watch.callback?.invoke(frame, obj, watch.decode(oldBits, oldObject), watch.decode(newBits, newObject))
+    }
+  }
+
+  fun onStep(frame: StackFrame) {
+    var request: StepRequest?
+    synchronized(this) {
+      // Native has already finished with the step, so it's safe to destroy the filter
+      request = stepRequests.remove(frame.thread)
+      request?.let {
+        if (it.nativeFilter != 0L) {
+          VirtualMachine.nativeDestroyMethodFilter(it.nativeFilter)
+        }
+      }
+    }
+
+    val step = request ?: return
+    if (!step.wasClosed) {
+      step.wasClosed = true
+      step.callback(frame)
+    }
+  }
+}
@@ -0,0 +1,22 @@
+package com.squareup.stoic.jvmti
+
+/**
+ * `frame` is where the exception was thrown. catchLocation is where it will be caught, or null if
+ * it won't be caught by Java code.
+ */
+typealias OnException = (frame: StackFrame, exception: Throwable, catchLocation: Location?) -> Unit
+
+/**
+ * Analogous to https://docs.oracle.com/javase/8/docs/jdk/api/jpda/jdi/com/sun/jdi/request/ExceptionRequest.html
+ *
+ * Reports exceptions thrown on any thread that are instances of one of `classes`, or all exceptions
+ * if `classes` is empty.
+ */
+class ExceptionRequest(
+  val classes: List<Class<out Throwable>>,
+  val callback: OnException
+): EventRequest() {
+  fun matches(exception: Throwable): Boolean {
+    return classes.isEmpty() || classes.any { it.isInstance(exception) }
+  }
+}
@@ -0,0 +1,16 @@
+package com.squareup.stoic.jvmti
+
+/**
+ * A request to be notified when a specific frame exits. Unlike MethodExitRequest, this is delivered
+ * at most once and only for the frame it was created for.
+ *
+ * Returned values are only delivered if wantsReturnValue was requested - otherwise the value passed
+ * to the callback is always null.
+ */
+class FrameExitRequest(
+  val thread: Thread,
+  val height: Int,
+  val wantsReturnValue: Boolean,
+  val listener: MethodExitListener
+): EventRequest() {
+}
@@ -6,15 +6,15 @@ import com.squareup.stoic.highlander
 class JvmtiClass private constructor(val clazz: Class<*>) {
   private var privateDeclaredFields: List<JvmtiField>? = null
   private var privateDeclaredMethods: List<JvmtiMethod>? = null
+  private var privateLineLocations: List<LineLocation>? = null
 
   val simpleName get(): String = clazz.name.substringAfterLast('.')
 
   val declaredFields get(): List<JvmtiField> {
     synchronized(this) {
       return privateDeclaredFields ?: run {
-        val result = VirtualMachine.nativeGetClassFields(clazz).toList()
-        privateDeclaredFields = result
-        result
+        loadMembers()
+        privateDeclaredFields!!
       }
     }
   }
@@ -22,13 +22,79 @@ class JvmtiClass private constructor(val clazz: Class<*>) {
   val declaredMethods get(): List<JvmtiMethod> {
     synchronized(this) {
       return privateDeclaredMethods ?: run {
-        val result = VirtualMachine.nativeGetClassMethods(clazz).toList()
-        privateDeclaredMethods = result
+        loadMembers()
+        privateDeclaredMethods!!
+      }
+    }
+  }
+
+  // Fetches every declared method and field along with their metadata in a single native call, so
+  // that indexing a class doesn't cost a native call per member
+  private fun loadMembers() {
+    val result = VirtualMachine.nativeGetClassMetadata(clazz)
+    // methodCount, (methodId, name, signature, generic, startLocation, endLocation, argsSize,
+    //   maxLocals, modifiers)*
+    // fieldCount, (fieldId, name, signature, generic, modifiers)*
+    // Strings are indexes into strings, or -1 for null
+    val packed = result[0] as LongArray
+    @Suppress("UNCHECKED_CAST")
+    val strings = result[1] as Array<String>
+    fun string(index: Long): String? = if (index == -1L) null else strings[index.toInt()]
+
+    var i = 0
+    privateDeclaredMethods = (0 until packed[i++].toInt()).map {
+      val method = JvmtiMethod[packed[i++]]
+      method.setCoreMetadata(
+        clazz = clazz,
+        name = string(packed[i++])!!,
+        signature = string(packed[i++])!!,
+        generic = string(packed[i++]),
+        startLocation = packed[i++],
+        endLocation = packed[i++],
+        argsSize = packed[i++].toInt(),
+        maxLocals = packed[i++].toInt(),
+        modifiers = packed[i++].toInt(),
+      )
+      method
+    }
+    privateDeclaredFields = (0 until packed[i++].toInt()).map {
+      val field = JvmtiField[clazz, packed[i++]]
+      field.setCoreMetadata(
+        name = string(packed[i++])!!,
+        signature = string(packed[i++])!!,
+        generic = string(packed[i++]),
+        modifiers = packed[i++].toInt(),
+      )
+      field
+    }
+  }
+
+  /**
+   * The SourceFile attribute of the class, or null if it was stripped
+   */
+  val sourceFileName get(): String? = VirtualMachine.nativeGetSourceFileName(clazz)
+
+  /**
+   * The start of every line in every method of the class, sorted by line
+   */
+  val lineLocations get(): List<LineLocation> {
+    synchronized(this) {
+      return privateLineLocations ?: run {
+        val result = decodeLineLocations(VirtualMachine.nativeGetLineLocations(clazz))
+        privateLineLocations = result
         result
       }
     }
   }
 
+  /**
+   * Analogous to JDI's ReferenceType.locationsOfLine - there may be several (e.g. if the line
+   * contains a lambda)
+   */
+  fun locationsOfLine(line: Int): List<Location> {
+    return lineLocations.filter { it.line == line }.map { it.location }
+  }
+
   fun declaredMethod(name: String, signature: String): JvmtiMethod {
     val filteredMethods = declaredMethods.filter { it.name == name && it.signature == signature }
     if (filteredMethods.isNotEmpty()) {
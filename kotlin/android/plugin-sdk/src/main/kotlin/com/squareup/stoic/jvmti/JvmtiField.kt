@@ -10,6 +10,14 @@ class JvmtiField private constructor(val clazz: Class<*>, val fieldId: JFieldId)
   private var privateGeneric: String? = null
   private var privateModifiers: Int = -1
 
+  // Fills in what nativeGetFieldCoreMetadata would, from JvmtiClass's bulk fetch
+  internal fun setCoreMetadata(name: String, signature: String, generic: String?, modifiers: Int) {
+    privateName = name
+    privateSignature = signature
+    privateGeneric = generic
+    privateModifiers = modifiers
+  }
+
   val name: String get() {
     val result = privateName
     if (result != null) {
@@ -27,6 +27,29 @@ class JvmtiMethod private constructor(val methodId: JMethodId) {
   private var privateModifiers: Int = -1
   private var privateReflected: Any? = null
 
+  // Fills in what nativeGetMethodCoreMetadata would, from JvmtiClass's bulk fetch
+  internal fun setCoreMetadata(
+    clazz: Class<*>,
+    name: String,
+    signature: String,
+    generic: String?,
+    startLocation: JLocation,
+    endLocation: JLocation,
+    argsSize: Int,
+    maxLocals: Int,
+    modifiers: Int,
+  ) {
+    privateClazz = clazz
+    privateName = name
+    privateSignature = signature
+    privateGeneric = generic
+    privateStartLocation = startLocation
+    privateEndLocation = endLocation
+    privateArgsSize = argsSize
+    privateMaxLocals = maxLocals
+    privateModifiers = modifiers
+  }
+
   // This is fetched by nativeGetLocalVariables(jmethodId).toList()
   private var privateVariables: List<LocalVariable<*>>? = null
 
@@ -218,6 +241,19 @@ class JvmtiMethod private constructor(val methodId: JMethodId) {
       return method
     }
 
+    /**
+     * Every method (static or not) declared by a loaded class that matches `pattern`, a qualified
+     * method name with globs - e.g. "com.example.*Repository.fetch*". `*` matches any run of
+     * characters (including '.' and '$') and `?` matches any one character. A method signature may
+     * follow, as in "com.example.Foo.bar(I)*".
+     *
+     * Classes that haven't been loaded yet aren't matched.
+     */
+    fun resolve(pattern: String): List<JvmtiMethod> {
+      require(pattern.substringBefore('(').contains('.')) { "Pattern must be Class.method: '$pattern'" }
+      return VirtualMachine.nativeResolveMethods(pattern).map { JvmtiMethod[it] }
+    }
+
     fun bySig(sig: String): JvmtiMethod {
       val match = Regex("""([^.]+)\.(\w+)(\([^()]*\)[^()]*)""").matchEntire(sig)
       check(match != null) { "Invalid sig: '$sig'" }
@@ -0,0 +1,18 @@
+package com.squareup.stoic.jvmti
+
+/**
+ * The start of source line `line` within `location.method`
+ */
+class LineLocation(val line: Int, val location: Location) {
+  override fun toString(): String {
+    return "LineLocation(line=$line, location=$location)"
+  }
+}
+
+// Decodes [line, methodId, location]* as packed by stoic.cc
+internal fun decodeLineLocations(packed: LongArray): List<LineLocation> {
+  return (0 until packed.size / 3).map {
+    val method = JvmtiMethod[packed[3 * it + 1]]
+    LineLocation(packed[3 * it].toInt(), Location(method, packed[3 * it + 2]))
+  }
+}
@@ -2,5 +2,11 @@ package com.squareup.stoic.jvmti
 
 typealias OnMethodEntry = (frame: StackFrame) -> Unit
 
-class MethodEntryRequest(val thread: Thread, val callback: OnMethodEntry): EventRequest() {
-}
\ No newline at end of file
+class MethodEntryRequest(
+  val thread: Thread,
+  val filter: MethodFilter?,
+  val callback: OnMethodEntry
+): EventRequest() {
+  // Handle to the compiled native filter, or 0 if unfiltered
+  internal var nativeFilter: Long = 0
+}
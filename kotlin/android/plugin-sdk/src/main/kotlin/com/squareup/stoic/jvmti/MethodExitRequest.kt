@@ -2,5 +2,42 @@ package com.squareup.stoic.jvmti
 
 typealias OnMethodExit = (frame: StackFrame, value: Any?, wasPoppedByException: Boolean) -> Unit
 
-class MethodExitRequest(val thread: Thread, val callback: OnMethodExit): EventRequest() {
-}
\ No newline at end of file
+/**
+ * Receives method exits with primitive return values unboxed. Each typed overload boxes the value
+ * and forwards to onExit by default - override the overloads for the return types you care about
+ * to observe them without allocating a box.
+ *
+ * onExitV is called for void methods, and onExit is called directly for reference return values.
+ */
+interface MethodExitListener {
+  fun onExit(frame: StackFrame, value: Any?, wasPoppedByException: Boolean)
+
+  fun onExitZ(frame: StackFrame, value: Boolean, wasPoppedByException: Boolean) = onExit(frame, value, wasPoppedByException)
+  fun onExitB(frame: StackFrame, value: Byte, wasPoppedByException: Boolean) = onExit(frame, value, wasPoppedByException)
+  fun onExitC(frame: StackFrame, value: Char, wasPoppedByException: Boolean) = onExit(frame, value, wasPoppedByException)
+  fun onExitS(frame: StackFrame, value: Short, wasPoppedByException: Boolean) = onExit(frame, value, wasPoppedByException)
+  fun onExitI(frame: StackFrame, value: Int, wasPoppedByException: Boolean) = onExit(frame, value, wasPoppedByException)
+  fun onExitJ(frame: StackFrame, value: Long, wasPoppedByException: Boolean) = onExit(frame, value, wasPoppedByException)
+  fun onExitF(frame: StackFrame, value: Float, wasPoppedByException: Boolean) = onExit(frame, value, wasPoppedByException)
+  fun onExitD(frame: StackFrame, value: Double, wasPoppedByException: Boolean) = onExit(frame, value, wasPoppedByException)
+  fun onExitV(frame: StackFrame, wasPoppedByException: Boolean) = onExit(frame, null, wasPoppedByException)
+}
+
+// Adapts a lambda, which always receives boxed values
+fun OnMethodExit.toListener(): MethodExitListener {
+  val callback = this
+  return object : MethodExitListener {
+    override fun onExit(frame: StackFrame, value: Any?, wasPoppedByException: Boolean) {
+      callback(frame, value, wasPoppedByException)
+    }
+  }
+}
+
+class MethodExitRequest(
+  val thread: Thread,
+  val filter: MethodFilter?,
+  val listener: MethodExitListener
+): EventRequest() {
+  // Handle to the compiled native filter, or 0 if unfiltered
+  internal var nativeFilter: Long = 0
+}
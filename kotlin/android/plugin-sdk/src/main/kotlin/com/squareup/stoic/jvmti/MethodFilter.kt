@@ -0,0 +1,40 @@
+package com.squareup.stoic.jvmti
+
+/**
+ * Restricts a MethodEntryRequest/MethodExitRequest to a subset of methods. A method matches if it's
+ * included (or nothing is explicitly included) and it isn't excluded. Class prefixes are matched
+ * against Class.getName (e.g. "com.example.checkout.").
+ *
+ * The filter is also compiled into native code when the request is created, so methods that don't
+ * match never make it to Kotlin (unless another request on the same thread wants them).
+ */
+class MethodFilter(
+  val includeMethods: List<JvmtiMethod> = listOf(),
+  val includeClassPrefixes: List<String> = listOf(),
+  val excludeMethods: List<JvmtiMethod> = listOf(),
+  val excludeClassPrefixes: List<String> = listOf(),
+) {
+  private val includeMethodIds = includeMethods.map { it.methodId }.toSet()
+  private val excludeMethodIds = excludeMethods.map { it.methodId }.toSet()
+
+  fun matches(method: JvmtiMethod): Boolean {
+    val isIncluded = (includeMethodIds.isEmpty() && includeClassPrefixes.isEmpty())
+        || method.methodId in includeMethodIds
+        || includeClassPrefixes.any { method.clazz.name.startsWith(it) }
+    val isExcluded = method.methodId in excludeMethodIds
+        || excludeClassPrefixes.any { method.clazz.name.startsWith(it) }
+    return isIncluded && !isExcluded
+  }
+
+  internal fun createNative(): Long {
+    return VirtualMachine.nativeCreateMethodFilter(
+      includeMethodIds.toLongArray(),
+      includeClassPrefixes.toTypedArray(),
+      excludeMethodIds.toLongArray(),
+      excludeClassPrefixes.toTypedArray())
+  }
+
+  companion object {
+    fun classPrefixes(vararg prefixes: String) = MethodFilter(includeClassPrefixes = prefixes.toList())
+  }
+}
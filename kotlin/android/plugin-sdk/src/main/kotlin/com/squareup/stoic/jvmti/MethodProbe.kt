@@ -0,0 +1,78 @@
+package com.squareup.stoic.jvmti
+
+import java.lang.reflect.Modifier
+
+/**
+ * Entry (and optionally exit) instrumentation for a specific set of methods.
+ *
+ * Unlike MethodEntryRequest/MethodExitRequest, this doesn't enable JVMTI_EVENT_METHOD_ENTRY/EXIT
+ * (which forces ART to interpret everything the thread runs). Instead, entries are observed via a
+ * breakpoint at each method's startLocation and exits via frame pops, so only the probed methods
+ * are deoptimized and the rest of the app stays on compiled code.
+ *
+ * Probes apply to all threads. Callbacks run on the thread that entered the method.
+ */
+class MethodProbe internal constructor(
+  val methods: List<JvmtiMethod>,
+  private val wantsReturnValue: Boolean,
+  private val onEntry: OnMethodEntry,
+  private val onExit: OnMethodExit?,
+) {
+  // Heights of the probed frames that are still running on each thread. A method whose body starts
+  // with a loop may branch back to its startLocation, which would look like a second entry.
+  private val activeHeights = ThreadLocal.withInitial { mutableSetOf<Int>() }
+
+  private var breakpointRequests: List<BreakpointRequest> = listOf()
+
+  @Volatile var wasClosed = false
+    private set
+
+  internal fun arm(createBreakpointRequest: (Location, OnBreakpoint) -> BreakpointRequest) {
+    // Native and abstract methods have no bytecode to put a breakpoint on
+    methods.forEach { method ->
+      require(!Modifier.isNative(method.modifiers) && !Modifier.isAbstract(method.modifiers)) {
+        "Can't probe $method: it has no bytecode"
+      }
+    }
+
+    // If arming fails part way, the breakpoints already created would otherwise never be closed
+    val armed = mutableListOf<BreakpointRequest>()
+    try {
+      methods.forEach { method ->
+        armed.add(createBreakpointRequest(method.startLocation) { frame -> onStart(frame) })
+      }
+    } catch (e: Throwable) {
+      armed.forEach { it.close() }
+      throw e
+    }
+    breakpointRequests = armed
+  }
+
+  private fun onStart(frame: StackFrame) {
+    if (wasClosed) {
+      return
+    }
+
+    if (onExit == null) {
+      // Without frame pops we have no way to tell a loop back to the start from a new entry
+      onEntry(frame)
+      return
+    }
+
+    val heights = activeHeights.get()!!
+    if (!heights.add(frame.height)) {
+      return
+    }
+
+    onEntry(frame)
+    frame.onExit(wantsReturnValue) { exitFrame, value, wasPoppedByException ->
+      heights.remove(frame.height)
+      onExit(exitFrame, value, wasPoppedByException)
+    }
+  }
+
+  fun close() {
+    wasClosed = true
+    breakpointRequests.forEach { it.close() }
+  }
+}
@@ -12,7 +12,23 @@ import com.squareup.stoic.threadlocals.jvmti
  * The pointer is just the pair of (Thread, frame-height), so if the exact same frame (that is, same
  * method-id, location) then everything will work fine. I'd say it's hacky to depend on that though!
  */
-class StackFrame(val thread: Thread, val height: Int, val location: Location) {
+class StackFrame(val thread: Thread, height: Int, val location: Location) {
+  private var privateHeight = height
+
+  /**
+   * The number of frames from the bottom of the stack to this frame (inclusive). Frames passed to
+   * event callbacks may be created with UNKNOWN_HEIGHT, since finding the height requires walking
+   * the whole stack - it's computed on first use instead, which must be during the callback. Read
+   * it during the callback if the frame will be used after the callback returns.
+   */
+  val height: Int get() {
+    if (privateHeight == UNKNOWN_HEIGHT) {
+      check(thread == Thread.currentThread())
+      privateHeight = VirtualMachine.nativeGetEventFrameHeight(location.method.methodId)
+    }
+    return privateHeight
+  }
+
   val stackTrace get(): List<StackTraceElement> {
     return thread.stackTrace.takeLast(height)
   }
@@ -44,6 +60,33 @@ class StackFrame(val thread: Thread, val height: Int, val location: Location) {
     }
   }
 
+  /**
+   * Like get, but reads all of `variables` in a single native call (and a single stack walk)
+   */
+  fun getAll(variables: List<LocalVariable<*>>): List<Any?> {
+    val slots = variables.map { it.slot }.toIntArray()
+    val types = variables.map { it.signature[0] }.joinToString("")
+    val result = VirtualMachine.nativeGetFrameLocals(Thread.currentThread(), height, slots, types)
+    val primitives = result[0] as LongArray
+    @Suppress("UNCHECKED_CAST")
+    val objects = result[1] as Array<Any?>
+
+    return variables.mapIndexed { i, variable ->
+      val bits = primitives[i]
+      when (variable.signature[0]) {
+        'Z' -> bits != 0L
+        'B' -> bits.toByte()
+        'C' -> bits.toInt().toChar()
+        'S' -> bits.toShort()
+        'I' -> bits.toInt()
+        'J' -> bits
+        'F' -> Float.fromBits(bits.toInt())
+        'D' -> Double.fromBits(bits)
+        else -> objects[i]
+      }
+    }
+  }
+
   fun <T> set(variable: LocalVariable<T>, value: T) {
     TODO()
   }
@@ -51,15 +94,38 @@ class StackFrame(val thread: Thread, val height: Int, val location: Location) {
   /**
    * Get a callback when the frame exits.
    *
-   * Note: This implementation is based on the MethodExit callback rather than the NotifyFramePop
-   * callback. The latter is probably more efficient because it only generates a callback for the
-   * frame we are interested in, but it doesn't provide access to the return value.
+   * Note: This is based on NotifyFramePop, so it generates a single event for the frame we are
+   * interested in. FramePop doesn't provide access to the return value though, so if
+   * wantsReturnValue then MethodExit is also enabled for the thread until the frame exits - the
+   * exits of other frames are filtered out natively.
    *
-   * If performance is problematic we could either
-   * 1. Expose NotifyFramePop separately, or
-   * 2. Filter out callbacks at the native layer
+   * The frame must be on the current thread.
+   */
+  fun onExit(wantsReturnValue: Boolean = true, callback: OnMethodExit) {
+    onExit(wantsReturnValue, callback.toListener())
+  }
+
+  /**
+   * Like onExit(wantsReturnValue, callback), but a primitive return value is delivered to the
+   * typed overload of `listener` without being boxed. On versions of Android without FramePop
+   * support the value is always delivered boxed, via listener.onExit.
    */
-  fun onExit(callback: OnMethodExit) {
+  fun onExit(wantsReturnValue: Boolean = true, listener: MethodExitListener) {
+    try {
+      jvmti.frameExit(this, wantsReturnValue, listener)
+    } catch (e: JvmtiException) {
+      if (e.errorCode != JVMTI_ERROR_MUST_POSSESS_CAPABILITY) {
+        throw e
+      }
+
+      // Older versions of Android can't generate FramePop events
+      onExitViaMethodExits(listener::onExit)
+    }
+  }
+
+  private fun onExitViaMethodExits(callback: OnMethodExit) {
+    // Resolved now, since the height can't be found lazily from another event
+    val height = this.height
     var exitRequest: MethodExitRequest? = null
     exitRequest = jvmti.methodExits { frame, value, wasPoppedByException ->
       // In the case of wasPoppedByException=true we may not see a method exit for the current frame
@@ -68,10 +134,15 @@ class StackFrame(val thread: Thread, val height: Int, val location: Location) {
       // https://docs.oracle.com/javase/8/docs/platform/jvmti/jvmti.html#MethodExit
       // but its what I see on my Android 14 emulator. So we need to check for `<=` and not simply
       // `==`.
-      if (frame.height <= this.height) {
+      if (frame.height <= height) {
         exitRequest!!.close()
         callback(frame, value, wasPoppedByException)
       }
     }
   }
-}
\ No newline at end of file
+
+  companion object {
+    // Must match kUnknownHeight in stoic.cc
+    const val UNKNOWN_HEIGHT = -1
+  }
+}
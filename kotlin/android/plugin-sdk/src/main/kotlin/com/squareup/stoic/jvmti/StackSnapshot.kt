@@ -0,0 +1,93 @@
+package com.squareup.stoic.jvmti
+
+/**
+ * A frame of a StackSnapshot. `line` is -1 if unknown. `arguments` is null if they weren't captured
+ * (see StackSnapshot.capture), and otherwise excludes `this`.
+ */
+class SnapshotFrame(
+  val location: Location,
+  val line: Int,
+  val arguments: List<Any?>?,
+) {
+  override fun toString(): String {
+    val method = location.method
+    val args = arguments?.joinToString(", ") ?: "..."
+    return "${method.simpleQualifiedName}($args) line $line"
+  }
+}
+
+/**
+ * A thread's stack (innermost frame first), captured in a single native call. The native encoding
+ * is kept as-is and frames are only decoded when `frames` is first read.
+ */
+class StackSnapshot private constructor(
+  val thread: Thread,
+  // [methodId, location, line, argCount (-1 if not captured), argBits*]*
+  private val packed: LongArray,
+  // An entry for each packed argument - non-null only for object arguments
+  private val objectArgs: Array<Any?>,
+) {
+  val frames: List<SnapshotFrame> by lazy { decode() }
+
+  private fun decode(): List<SnapshotFrame> {
+    val frames = mutableListOf<SnapshotFrame>()
+    var i = 0
+    var objectIndex = 0
+    while (i < packed.size) {
+      val method = JvmtiMethod[packed[i++]]
+      val location = Location(method, packed[i++])
+      val line = packed[i++].toInt()
+      val argCount = packed[i++].toInt()
+      val arguments = if (argCount == -1) null else {
+        val types = argumentTypes(method.signature)
+        (0 until argCount).map {
+          val bits = packed[i++]
+          val obj = objectArgs[objectIndex++]
+          when (types[it]) {
+            'Z' -> bits != 0L
+            'B' -> bits.toByte()
+            'C' -> bits.toInt().toChar()
+            'S' -> bits.toShort()
+            'I' -> bits.toInt()
+            'J' -> bits
+            'F' -> Float.fromBits(bits.toInt())
+            'D' -> Double.fromBits(bits)
+            else -> obj
+          }
+        }
+      }
+      frames.add(SnapshotFrame(location, line, arguments))
+    }
+
+    return frames
+  }
+
+  companion object {
+    /**
+     * Captures up to maxDepth frames of `thread`. Arguments are only captured if captureArgs, the
+     * thread is the current thread, and can_access_local_variables is available.
+     */
+    fun capture(thread: Thread = Thread.currentThread(), maxDepth: Int = 256, captureArgs: Boolean = false): StackSnapshot {
+      val result = VirtualMachine.nativeSnapshotStack(thread, maxDepth, captureArgs)
+      @Suppress("UNCHECKED_CAST")
+      return StackSnapshot(thread, result[0] as LongArray, result[1] as Array<Any?>)
+    }
+
+    // The first char of each argument type in a method signature like "(I[JLjava/lang/String;)V"
+    private fun argumentTypes(signature: String): List<Char> {
+      val types = mutableListOf<Char>()
+      var i = 1
+      while (signature[i] != ')') {
+        types.add(signature[i])
+        while (signature[i] == '[') {
+          i++
+        }
+        if (signature[i] == 'L') {
+          i = signature.indexOf(';', i)
+        }
+        i++
+      }
+      return types
+    }
+  }
+}
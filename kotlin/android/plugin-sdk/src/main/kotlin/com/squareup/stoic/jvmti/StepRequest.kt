@@ -0,0 +1,33 @@
+package com.squareup.stoic.jvmti
+
+typealias OnStep = (frame: StackFrame) -> Unit
+
+/**
+ * Analogous to https://docs.oracle.com/javase/8/docs/jdk/api/jpda/jdi/com/sun/jdi/request/StepRequest.html
+ *
+ * A single line step on `thread`, starting from the frame at `height`. Stepping is done in native -
+ * the callback is only invoked once, when the step completes:
+ * - INTO: on entry to a method that passes `filter` (if any), or as for OVER
+ * - OVER: when the starting frame reaches a new line (or loops back to the start of its line)
+ * - OUT: when the starting frame returns
+ *
+ * Every step completes if the starting frame returns, with the callback receiving the caller's
+ * frame.
+ */
+class StepRequest(
+  val thread: Thread,
+  val height: Int,
+  val depth: Depth,
+  val filter: MethodFilter?,
+  val callback: OnStep
+): EventRequest() {
+  // Must match StepDepth in stoic.cc
+  enum class Depth {
+    INTO,
+    OVER,
+    OUT,
+  }
+
+  // Handle to the compiled native filter, or 0 if unfiltered
+  internal var nativeFilter: Long = 0
+}
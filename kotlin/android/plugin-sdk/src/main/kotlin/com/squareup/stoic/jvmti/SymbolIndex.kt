@@ -0,0 +1,29 @@
+package com.squareup.stoic.jvmti
+
+/**
+ * An on-device index of class, method and field metadata (names, signatures, locations, modifiers
+ * and line tables), kept in the stoic dir so that later attaches to the same app don't need to
+ * fetch it from JVMTI.
+ *
+ * The agent maps the index at startup if it was built from the same APKs (compared by a hash of
+ * their contents) on the same system build. Metadata for classes in the index is then read from it
+ * rather than from JVMTI. Only boot classes and classes from the app's class loaders are indexed,
+ * since classes from other loaders (such as plugins) may differ between attaches.
+ *
+ * The server calls build() in the background on every attach, so plugins don't need to - unless
+ * they load many classes and want them indexed before the next attach.
+ */
+object SymbolIndex {
+  /**
+   * Whether an index from a previous attach was loaded
+   */
+  val isLoaded: Boolean get() = VirtualMachine.nativeIsSymbolIndexLoaded()
+
+  /**
+   * Scans every loaded class and writes the index. Unless `force`, this is skipped if the loaded
+   * index already covers as many classes as are loaded now. Returns whether the index was written.
+   */
+  fun build(force: Boolean = false): Boolean {
+    return VirtualMachine.nativeBuildSymbolIndex(force)
+  }
+}
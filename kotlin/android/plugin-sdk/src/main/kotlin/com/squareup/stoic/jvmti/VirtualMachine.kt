@@ -35,6 +35,191 @@ object VirtualMachine {
   @JvmStatic
   external fun nativeClearBreakpoint(jmethodId: JMethodId, jlocation: JLocation)
 
+  // See MethodTimer
+  @JvmStatic
+  external fun nativeProfileMethods(methodIds: LongArray)
+
+  @JvmStatic
+  external fun nativeUnprofileMethods(methodIds: LongArray)
+
+  @JvmStatic
+  external fun nativeResetMethodProfiles()
+
+  // Packed as [methodId, count, sum, min, max, N, (bucketUpperBound, bucketCount) * N]*
+  @JvmStatic
+  external fun nativeGetMethodProfiles(): LongArray
+
+  // See Sampler. threads may be empty, meaning all threads.
+  @JvmStatic
+  external fun nativeStartSampling(intervalMicros: Int, maxDepth: Int, threads: Array<Thread>)
+
+  @JvmStatic
+  external fun nativeStopSampling()
+
+  @JvmStatic
+  external fun nativeResetSamples()
+
+  // Packed as [parentIndex, methodId, location, samples, micros per SampledThreadState]*, parents
+  // first, with -1 for the root
+  @JvmStatic
+  external fun nativeGetSamples(): LongArray
+
+  // See JankDetector
+  @JvmStatic
+  external fun nativeStartJankWatchdog(thresholdMillis: Int, sampleIntervalMicros: Int)
+
+  @JvmStatic
+  external fun nativeStopJankWatchdog()
+
+  // Packed as [startNanos, durationNanos, nodeCount, <nodes as in nativeGetSamples>]*
+  @JvmStatic
+  external fun nativePollJankReports(): LongArray
+
+  // See LooperStats
+  @JvmStatic
+  external fun nativeStartLooperStats()
+
+  @JvmStatic
+  external fun nativeStopLooperStats()
+
+  @JvmStatic
+  external fun nativeResetLooperStats()
+
+  // Packed as [handlerClassId, callbackClassId, what, count, sum, min, max, N,
+  // (bucketUpperBound, bucketCount) * N]*
+  @JvmStatic
+  external fun nativeGetLooperStats(): LongArray
+
+  // Resolves a class ID used by native aggregations to a class signature, or "" if unknown
+  @JvmStatic
+  external fun nativeGetClassSignatureById(classId: Long): String
+
+  // See MonitorContention
+  @JvmStatic
+  external fun nativeStartMonitorContention(maxDepth: Int)
+
+  @JvmStatic
+  external fun nativeStopMonitorContention()
+
+  @JvmStatic
+  external fun nativeResetMonitorContention()
+
+  // Returns {LongArray, Array<String>} - see MonitorContention.snapshot
+  @JvmStatic
+  external fun nativeGetMonitorContention(): Array<Any>
+
+  // Aggregates exceptions of the given classes (or all exceptions, if empty) by (class, throw
+  // location, catch location)
+  @JvmStatic
+  external fun nativeStartExceptionStats(classes: Array<Class<*>>)
+
+  @JvmStatic
+  external fun nativeStopExceptionStats()
+
+  @JvmStatic
+  external fun nativeResetExceptionStats()
+
+  // Packed as [classId, throwMethodId, throwLocation, catchMethodId, catchLocation, count]*
+  @JvmStatic
+  external fun nativeGetExceptionStats(): LongArray
+
+  // Forwards exceptions of the given classes (or all exceptions, if empty) to
+  // nativeCallbackOnException
+  @JvmStatic
+  external fun nativeExceptionCallbacks(isEnabled: Boolean, classes: Array<Class<*>>)
+
+  // Watches accesses/modifications of a field, filtered natively. Returns a handle for
+  // nativeGetFieldWatchHits/nativeDestroyFieldWatch. See WatchpointRequest.
+  @JvmStatic
+  external fun nativeCreateFieldWatch(
+    clazz: Class<*>,
+    fieldId: JFieldId,
+    isModification: Boolean,
+    thread: Thread?,
+    onlyChanges: Boolean,
+    op: Int,
+    operandBits: Long,
+    isForwarded: Boolean
+  ): Long
+
+  @JvmStatic
+  external fun nativeDestroyFieldWatch(handle: Long)
+
+  @JvmStatic
+  external fun nativeGetFieldWatchHits(handle: Long): Long
+
+  // Starts a step from the frame at `height` on the current thread, reported via
+  // nativeCallbackOnStep. See StepRequest.
+  @JvmStatic
+  external fun nativeStartStep(height: Int, depth: Int, filter: Long)
+
+  @JvmStatic
+  external fun nativeCancelStep()
+
+  // Packed as [line, methodId, location]*, sorted by line
+  @JvmStatic
+  external fun nativeGetLineLocations(clazz: Class<*>): LongArray
+
+  @JvmStatic
+  external fun nativeGetSourceFileName(clazz: Class<*>): String?
+
+  // Arms a breakpoint at each of the lines, returning the armed locations packed as
+  // [line, methodId, location]*
+  @JvmStatic
+  external fun nativeSetBreakpointsAtLines(clazz: Class<*>, lines: IntArray): LongArray
+
+  // Arms self-clearing line coverage probes in each of the classes. See LineCoverage.
+  @JvmStatic
+  external fun nativeStartCoverage(classes: Array<Class<*>>)
+
+  @JvmStatic
+  external fun nativeStopCoverage()
+
+  @JvmStatic
+  external fun nativeResetCoverage()
+
+  // The binary report format is documented in stoic.cc and decoded by LineCoverage.decode
+  @JvmStatic
+  external fun nativeGetCoverageReport(): ByteArray
+
+  // Creates a log-point that captures the given local slots natively on each hit. types holds the
+  // first char of each local's signature. Returns a handle for nativeDestroyLogPoint.
+  @JvmStatic
+  external fun nativeCreateLogPoint(
+    jmethodId: JMethodId,
+    jlocation: JLocation,
+    slots: IntArray,
+    types: String,
+    captureThis: Boolean,
+    stackDepth: Int
+  ): Long
+
+  @JvmStatic
+  external fun nativeDestroyLogPoint(handle: Long)
+
+  // Waits up to timeoutMillis for log-point hits. See LogPoints.drain for the packing.
+  @JvmStatic
+  external fun nativeDrainLogPoints(timeoutMillis: Int): LongArray
+
+  @JvmStatic
+  external fun nativeStartCpuPoller(intervalMillis: Int, windowTicks: Int)
+
+  @JvmStatic
+  external fun nativeStopCpuPoller()
+
+  // Returns [LongArray packed, Array<Thread> threads] - see ThreadCpu for the encoding
+  @JvmStatic
+  external fun nativeGetTopCpuThreads(topN: Int): Array<Any>
+
+  // Returns [LongArray packed, Array<Thread> threads, Array<Any> monitors] - see ThreadDump for the
+  // encoding
+  @JvmStatic
+  external fun nativeDumpThreads(maxDepth: Int): Array<Any>
+
+  // Returns [LongArray packed, Array<Any?> objectArgs] - see StackSnapshot for the encoding
+  @JvmStatic
+  external fun nativeSnapshotStack(thread: Thread, maxDepth: Int, captureArgs: Boolean): Array<Any>
+
   @JvmStatic
   external fun nativeGetLocalVariables(jmethodId: JMethodId): Array<LocalVariable<*>>
 
@@ -47,6 +232,12 @@ object VirtualMachine {
   @JvmStatic
   external fun nativeGetLocalObject(thread: Thread, height: Int, slot: Int): Any
 
+  // Reads several locals of a frame with a single stack walk. types holds the first char of each
+  // local's signature. Returns [LongArray of primitives (floats/doubles as raw bits), Array<Any?>
+  // of objects], each indexed like slots.
+  @JvmStatic
+  external fun nativeGetFrameLocals(thread: Thread, height: Int, slots: IntArray, types: String): Array<Any>
+
   @JvmStatic
   external fun nativeGetLocalInt(thread: Thread, height: Int, slot: Int): Int
 
@@ -65,6 +256,21 @@ object VirtualMachine {
   @JvmStatic
   external fun nativeGetClassFields(clazz: Class<*>): Array<JvmtiField>
 
+  // See SymbolIndex
+  @JvmStatic
+  external fun nativeBuildSymbolIndex(force: Boolean): Boolean
+
+  @JvmStatic
+  external fun nativeIsSymbolIndexLoaded(): Boolean
+
+  // See JvmtiMethod.resolve for the pattern syntax
+  @JvmStatic
+  external fun nativeResolveMethods(pattern: String): LongArray
+
+  // Returns [LongArray packed, Array<String> strings] - see JvmtiClass.loadMembers for the encoding
+  @JvmStatic
+  external fun nativeGetClassMetadata(clazz: Class<*>): Array<Any>
+
   //@JvmStatic
   //external fun nativeInvokeMethod(isStatic: Boolean, methodId: JMethodId, args: Array<Any>)
 
@@ -80,15 +286,41 @@ object VirtualMachine {
   @JvmStatic
   external fun nativeGetClassSignature(clazz: Class<*>): String
 
+  // Compiles a MethodFilter into native code. The returned handle must be freed with
+  // nativeDestroyMethodFilter.
+  @JvmStatic
+  external fun nativeCreateMethodFilter(
+    includeMethodIds: LongArray,
+    includeClassPrefixes: Array<String>,
+    excludeMethodIds: LongArray,
+    excludeClassPrefixes: Array<String>,
+  ): Long
+
   @JvmStatic
-  external fun nativeMethodEntryCallbacks(thread: Thread, isEnabled: Boolean)
+  external fun nativeDestroyMethodFilter(handle: Long)
 
+  // filters holds the native filter handle of every request on the thread (0 if unfiltered)
   @JvmStatic
-  external fun nativeMethodExitCallbacks(thread: Thread, isEnabled: Boolean)
+  external fun nativeMethodEntryCallbacks(thread: Thread, isEnabled: Boolean, filters: LongArray)
+
+  // filters holds the native filter handle of every request on the thread (0 if unfiltered)
+  @JvmStatic
+  external fun nativeMethodExitCallbacks(thread: Thread, isEnabled: Boolean, filters: LongArray)
 
   @JvmStatic
   external fun nativeFromReflectedMethod(method: Method): JMethodId
 
+  // The height of the frame of the event being handled on the current thread. See
+  // StackFrame.UNKNOWN_HEIGHT.
+  @JvmStatic
+  external fun nativeGetEventFrameHeight(expectedMethodId: JMethodId): Int
+
+  // Arms a FramePop notification for the frame at `height` on the current thread. If
+  // wantsReturnValue then MethodExit is enabled for the thread until the frame exits, but only the
+  // exit of the watched frame is sent to Kotlin.
+  @JvmStatic
+  external fun nativeWatchFrameExit(height: Int, wantsReturnValue: Boolean)
+
   // Callback from native
   @JvmStatic
   fun nativeCallbackOnBreakpoint(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int) {
@@ -98,6 +330,47 @@ object VirtualMachine {
     eventRequestManager.onBreakpoint(frame)
   }
 
+  @JvmStatic
+  fun nativeCallbackOnException(
+    jmethodId: JMethodId,
+    jlocation: JLocation,
+    frameCount: Int,
+    exception: Throwable,
+    catchMethodId: JMethodId,
+    catchLocation: JLocation
+  ) {
+    val location = Location(JvmtiMethod[jmethodId], jlocation)
+    val frame = StackFrame(Thread.currentThread(), frameCount, location)
+    val catch = if (catchMethodId == 0L) null else Location(JvmtiMethod[catchMethodId], catchLocation)
+    eventRequestManager.onException(frame, exception, catch)
+  }
+
+  // Primitive values arrive as raw bits and object values as references - see FieldValueBits in
+  // stoic.cc
+  @JvmStatic
+  fun nativeCallbackOnFieldWatch(
+    nativeWatch: Long,
+    jmethodId: JMethodId,
+    jlocation: JLocation,
+    frameCount: Int,
+    obj: Any?,
+    oldBits: Long,
+    oldObject: Any?,
+    newBits: Long,
+    newObject: Any?
+  ) {
+    val location = Location(JvmtiMethod[jmethodId], jlocation)
+    val frame = StackFrame(Thread.currentThread(), frameCount, location)
+    eventRequestManager.onWatchpoint(nativeWatch, frame, obj, oldBits, oldObject, newBits, newObject)
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnStep(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int) {
+    val location = Location(JvmtiMethod[jmethodId], jlocation)
+    val frame = StackFrame(Thread.currentThread(), frameCount, location)
+    eventRequestManager.onStep(frame)
+  }
+
   @JvmStatic
   fun nativeCallbackOnMethodEntry(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int) {
     val method = JvmtiMethod[jmethodId]
@@ -106,16 +379,100 @@ object VirtualMachine {
     eventRequestManager.onMethodEntry(frame)
   }
 
+  // Method exit callbacks from native. There is one per return type so that primitive return values
+  // arrive unboxed rather than via a JNI-allocated box, and they stay unboxed unless a listener asks
+  // for them as Any? (see MethodExitListener). See FOR_EACH_PRIMITIVE_TYPE in stoic.cc.
+  @JvmStatic
+  fun nativeCallbackOnMethodExitZ(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Boolean, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitZ(frame, value, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnMethodExitB(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Byte, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitB(frame, value, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnMethodExitC(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Char, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitC(frame, value, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnMethodExitS(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Short, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitS(frame, value, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnMethodExitI(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Int, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitI(frame, value, wasPoppedByException)
+    }
+  }
+
   @JvmStatic
-  fun nativeCallbackOnMethodExit(
-      jmethodId: JMethodId,
-      jlocation: JLocation,
-      frameCount: Int,
-      value: Any?,
-      wasPoppedByException: Boolean) {
+  fun nativeCallbackOnMethodExitJ(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Long, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitJ(frame, value, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnMethodExitF(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Float, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitF(frame, value, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnMethodExitD(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Double, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitD(frame, value, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnMethodExitL(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, value: Any?, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExit(frame, value, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnMethodExitV(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, wasPoppedByException: Boolean) {
+    val frame = exitFrame(jmethodId, jlocation, frameCount)
+    for (listener in eventRequestManager.methodExitListeners(frame)) {
+      listener.onExitV(frame, wasPoppedByException)
+    }
+  }
+
+  @JvmStatic
+  fun nativeCallbackOnFramePop(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int, wasPoppedByException: Boolean) {
     val method = JvmtiMethod[jmethodId]
     val location = Location(method, jlocation)
     val frame = StackFrame(Thread.currentThread(), frameCount, location)
-    eventRequestManager.onMethodExit(frame, value, wasPoppedByException)
+    eventRequestManager.onFramePop(frame, wasPoppedByException)
+  }
+
+  private fun exitFrame(jmethodId: JMethodId, jlocation: JLocation, frameCount: Int): StackFrame {
+    val method = JvmtiMethod[jmethodId]
+    val location = Location(method, jlocation)
+    return StackFrame(Thread.currentThread(), frameCount, location)
   }
 }
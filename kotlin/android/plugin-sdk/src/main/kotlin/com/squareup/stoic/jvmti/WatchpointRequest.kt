@@ -0,0 +1,100 @@
+package com.squareup.stoic.jvmti
+
+/**
+ * `frame` is where the field was accessed or modified, and `obj` is the object whose field it is
+ * (null for static fields). For modifications, `oldValue` and `newValue` are the values before and
+ * after. For accesses, both are the value that was read.
+ */
+typealias OnWatchpoint = (frame: StackFrame, obj: Any?, oldValue: Any?, newValue: Any?) -> Unit
+
+/**
+ * A test applied natively to a watched field's value - the new value for modifications, or the
+ * value read for accesses. Comparisons are numeric, so they only apply to primitive fields.
+ * isNull/isNotNull only apply to object fields. Watching a field with a predicate that doesn't
+ * apply to it throws IllegalArgumentException.
+ */
+class FieldPredicate private constructor(internal val op: Op, internal val operand: Any?) {
+  // Must match FieldPredicateOp in stoic.cc
+  internal enum class Op {
+    ANY,
+    EQUALS,
+    NOT_EQUALS,
+    LESS_THAN,
+    GREATER_THAN,
+    IS_NULL,
+    IS_NOT_NULL,
+  }
+
+  companion object {
+    val any = FieldPredicate(Op.ANY, null)
+    val isNull = FieldPredicate(Op.IS_NULL, null)
+    val isNotNull = FieldPredicate(Op.IS_NOT_NULL, null)
+    fun equalTo(value: Any) = FieldPredicate(Op.EQUALS, value)
+    fun notEqualTo(value: Any) = FieldPredicate(Op.NOT_EQUALS, value)
+    fun lessThan(value: Number) = FieldPredicate(Op.LESS_THAN, value)
+    fun greaterThan(value: Number) = FieldPredicate(Op.GREATER_THAN, value)
+  }
+}
+
+/**
+ * Analogous to https://docs.oracle.com/javase/8/docs/jdk/api/jpda/jdi/com/sun/jdi/request/WatchpointRequest.html
+ *
+ * Watches accesses (or modifications, if isModification) of `field`. All filtering happens in
+ * native, so events that don't pass the filters cost no upcall:
+ * - thread: only events on this thread, or on any thread if null
+ * - onlyChanges: only modifications where the new value differs from the old one (by identity, for
+ *   objects)
+ * - predicate: see FieldPredicate
+ *
+ * If callback is null then matching events are only counted - see hits.
+ */
+class WatchpointRequest(
+  val field: JvmtiField,
+  val isModification: Boolean,
+  val thread: Thread?,
+  val onlyChanges: Boolean,
+  val predicate: FieldPredicate,
+  val callback: OnWatchpoint?
+): EventRequest() {
+  // Handle to the native watch
+  internal var nativeWatch: Long = 0
+
+  /**
+   * The number of events that passed the filters so far
+   */
+  val hits: Long get() = if (wasClosed) 0 else VirtualMachine.nativeGetFieldWatchHits(nativeWatch)
+
+  internal val typeChar: Char get() = field.signature[0]
+
+  // Encodes a value like FieldValueBits in stoic.cc
+  internal fun encode(value: Any?): Long {
+    return when (value) {
+      null -> 0
+      is Boolean -> if (value) 1 else 0
+      is Char -> value.code.toLong()
+      is Float -> if (typeChar == 'F') value.toRawBits().toLong() else value.toLong()
+      is Double -> if (typeChar == 'D') value.toRawBits() else value.toLong()
+      is Number -> when (typeChar) {
+        'F' -> value.toFloat().toRawBits().toLong()
+        'D' -> value.toDouble().toRawBits()
+        else -> value.toLong()
+      }
+      else -> throw IllegalArgumentException("Can't compare ${field.name} against $value")
+    }
+  }
+
+  // Reverses FieldValueBits in stoic.cc
+  internal fun decode(bits: Long, obj: Any?): Any? {
+    return when (typeChar) {
+      'Z' -> bits != 0L
+      'B' -> bits.toByte()
+      'C' -> bits.toInt().toChar()
+      'S' -> bits.toShort()
+      'I' -> bits.toInt()
+      'J' -> bits
+      'F' -> Float.fromBits(bits.toInt())
+      'D' -> Double.fromBits(bits)
+      else -> obj
+    }
+  }
+}
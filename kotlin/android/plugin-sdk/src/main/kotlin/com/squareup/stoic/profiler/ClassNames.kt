@@ -0,0 +1,16 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.VirtualMachine
+
+/**
+ * Resolves a class ID from native aggregations (see ClassTagIndex in stoic.cc) to a Class.getName
+ * style name, caching the results
+ */
+internal class ClassNames {
+  private val names = mutableMapOf<Long, String>()
+
+  operator fun get(classId: Long): String = names.getOrPut(classId) {
+    val signature = VirtualMachine.nativeGetClassSignatureById(classId)
+    if (signature.isEmpty()) "unknown" else signature.removePrefix("L").removeSuffix(";").replace('/', '.')
+  }
+}
@@ -0,0 +1,69 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.JvmtiMethod
+import com.squareup.stoic.jvmti.Location
+import com.squareup.stoic.jvmti.VirtualMachine
+
+/**
+ * How many times an exception of `exceptionClass` was thrown at `throwLocation` and caught at
+ * `catchLocation`. catchLocation is where the VM predicted the exception would be caught when it was
+ * thrown, or null if it found no Java handler.
+ */
+class ExceptionSiteStats(
+  val exceptionClass: String,
+  val throwLocation: Location,
+  val catchLocation: Location?,
+  val count: Long,
+) {
+  override fun toString(): String {
+    val thrower = throwLocation.method.simpleQualifiedName
+    val catcher = catchLocation?.method?.simpleQualifiedName ?: "uncaught"
+    return "$exceptionClass thrown from $thrower, caught by $catcher: count=$count"
+  }
+}
+
+/**
+ * Counts thrown exceptions natively by (exception class, throw location, catch location). Nothing
+ * is sent to Kotlin per exception - call snapshot() for a summary. Use
+ * StoicJvmti.exceptions to observe the exceptions themselves.
+ *
+ * Requires can_generate_exception_events.
+ */
+object ExceptionHotspots {
+  /**
+   * Start counting exceptions that are instances of one of `classes`, or all exceptions if
+   * `classes` is empty.
+   */
+  fun start(vararg classes: Class<out Throwable>) {
+    VirtualMachine.nativeStartExceptionStats(classes.toList().toTypedArray<Class<*>>())
+  }
+
+  fun stop() {
+    VirtualMachine.nativeStopExceptionStats()
+  }
+
+  fun reset() {
+    VirtualMachine.nativeResetExceptionStats()
+  }
+
+  /**
+   * Returns the counts so far, most frequent first
+   */
+  fun snapshot(): List<ExceptionSiteStats> {
+    val packed = VirtualMachine.nativeGetExceptionStats()
+    val classNames = ClassNames()
+    val stats = mutableListOf<ExceptionSiteStats>()
+    var i = 0
+    while (i < packed.size) {
+      val classId = packed[i++]
+      val throwLocation = Location(JvmtiMethod[packed[i++]], packed[i++])
+      val catchMethodId = packed[i++]
+      val catchLocation = packed[i++]
+      val count = packed[i++]
+      val catch = if (catchMethodId == 0L) null else Location(JvmtiMethod[catchMethodId], catchLocation)
+      stats.add(ExceptionSiteStats(classNames[classId], throwLocation, catch, count))
+    }
+
+    return stats.sortedByDescending { it.count }
+  }
+}
@@ -0,0 +1,53 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.VirtualMachine
+
+/**
+ * A main looper message that took longer than the JankDetector threshold to dispatch.
+ *
+ * `stacks` only covers the time after the threshold was crossed - that's when the watchdog starts
+ * sampling the main thread.
+ */
+class JankReport(
+  // In System.nanoTime() terms
+  val startNanos: Long,
+  val durationNanos: Long,
+  val stacks: CallTreeNode,
+)
+
+/**
+ * Detects slow main looper messages. The start and end of each message are observed natively (via
+ * a breakpoint at Handler.dispatchMessage and a FramePop), and a watchdog thread samples the main
+ * thread's stack at a high rate while a message is over `thresholdMillis`. Only slow messages
+ * produce reports.
+ *
+ * Requires can_generate_frame_pop_events.
+ */
+object JankDetector {
+  fun start(thresholdMillis: Int = 200, sampleIntervalMicros: Int = 1000) {
+    VirtualMachine.nativeStartJankWatchdog(thresholdMillis, sampleIntervalMicros)
+  }
+
+  fun stop() {
+    VirtualMachine.nativeStopJankWatchdog()
+  }
+
+  /**
+   * Removes and returns the reports of slow messages that have finished since the last poll. Only
+   * the most recent 32 are kept.
+   */
+  fun poll(): List<JankReport> {
+    val packed = VirtualMachine.nativePollJankReports()
+    val reports = mutableListOf<JankReport>()
+    var i = 0
+    while (i < packed.size) {
+      val startNanos = packed[i++]
+      val durationNanos = packed[i++]
+      val nodeCount = packed[i++].toInt()
+      reports.add(JankReport(startNanos, durationNanos, decodeCallTree(packed, i, nodeCount)))
+      i += nodeCount * CALL_TREE_NODE_SIZE
+    }
+
+    return reports
+  }
+}
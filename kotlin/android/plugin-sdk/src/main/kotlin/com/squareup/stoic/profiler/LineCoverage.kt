@@ -0,0 +1,98 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.VirtualMachine
+import java.io.File
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * Line coverage of a single method. `lines` maps each line with code to whether it executed.
+ */
+class MethodLineCoverage(
+  val className: String,
+  val methodName: String,
+  val methodSignature: String,
+  val lines: Map<Int, Boolean>,
+) {
+  val coveredLines: Int get() = lines.count { it.value }
+
+  override fun toString(): String {
+    return "$className.$methodName$methodSignature: $coveredLines/${lines.size} lines"
+  }
+}
+
+/**
+ * On-device line coverage, without rebuilding with coverage instrumentation. Each line start of the
+ * selected classes gets a breakpoint that records the line and clears itself the first time it's
+ * hit, so each line costs one event over the whole session.
+ *
+ * Requires can_get_line_numbers.
+ */
+object LineCoverage {
+  /**
+   * Start recording coverage of `classes`. May be called repeatedly to add classes.
+   */
+  fun start(vararg classes: Class<*>) {
+    VirtualMachine.nativeStartCoverage(classes.toList().toTypedArray<Class<*>>())
+  }
+
+  /**
+   * Disarm the remaining probes. Coverage recorded so far is kept until reset().
+   */
+  fun stop() {
+    VirtualMachine.nativeStopCoverage()
+  }
+
+  fun reset() {
+    VirtualMachine.nativeResetCoverage()
+  }
+
+  /**
+   * The compact binary report. See nativeGetCoverageReport in stoic.cc for the format.
+   */
+  fun report(): ByteArray {
+    return VirtualMachine.nativeGetCoverageReport()
+  }
+
+  fun writeReport(file: File) {
+    file.writeBytes(report())
+  }
+
+  fun snapshot(): List<MethodLineCoverage> {
+    return decode(report())
+  }
+
+  fun decode(report: ByteArray): List<MethodLineCoverage> {
+    val buffer = ByteBuffer.wrap(report).order(ByteOrder.LITTLE_ENDIAN)
+    val magic = ByteArray(4).also { buffer.get(it) }
+    check(String(magic, Charsets.US_ASCII) == "STCV") { "Not a coverage report" }
+    val version = buffer.int
+    check(version == 1) { "Unsupported coverage report version $version" }
+
+    val methodCount = buffer.int
+    return (0 until methodCount).map {
+      val classSignature = readString(buffer)
+      val methodName = readString(buffer)
+      val methodSignature = readString(buffer)
+      val probeCount = buffer.int
+      val probeLines = IntArray(probeCount) { buffer.int }
+      val bitmap = ByteArray((probeCount + 7) / 8).also { buffer.get(it) }
+
+      // A line may have several probes (e.g. a loop condition) - it's covered if any of them ran
+      val lines = sortedMapOf<Int, Boolean>()
+      probeLines.forEachIndexed { i, line ->
+        val isCovered = (bitmap[i / 8].toInt() shr (i % 8)) and 1 != 0
+        lines[line] = (lines[line] ?: false) || isCovered
+      }
+
+      val className = classSignature.removePrefix("L").removeSuffix(";").replace('/', '.')
+      MethodLineCoverage(className, methodName, methodSignature, lines)
+    }
+  }
+
+  private fun readString(buffer: ByteBuffer): String {
+    val length = buffer.short.toInt() and 0xffff
+    val bytes = ByteArray(length).also { buffer.get(it) }
+    return String(bytes, Charsets.UTF_8)
+  }
+}
@@ -0,0 +1,169 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.JvmtiMethod
+import com.squareup.stoic.jvmti.LocalVariable
+import com.squareup.stoic.jvmti.Location
+import com.squareup.stoic.jvmti.VirtualMachine
+import com.squareup.stoic.threadlocals.stoic
+import java.io.Closeable
+import java.io.PrintStream
+import java.util.concurrent.atomic.AtomicBoolean
+
+/**
+ * A log-point created by LogPoints.create. Each hit captures `locals` (primitives by value, objects
+ * by identity hash), the identity hash of `this` if captureThis, and the innermost `stackDepth`
+ * frames.
+ */
+class LogPoint internal constructor(
+  val location: Location,
+  val locals: List<LocalVariable<*>>,
+  val captureThis: Boolean,
+  val stackDepth: Int,
+  internal val handle: Long,
+) : Closeable {
+  override fun close() {
+    LogPoints.destroy(this)
+  }
+}
+
+/**
+ * A single hit of a log-point. values[i] corresponds to logPoint.locals[i], and is null if the
+ * local wasn't live at the log-point. Object locals are reported as their identity hash.
+ */
+class LogPointHit(
+  val logPoint: LogPoint,
+  // In System.nanoTime() terms
+  val timestampNanos: Long,
+  val tid: Int,
+  val values: List<Any?>,
+  val thisHash: Int?,
+  val stack: List<Location>,
+) {
+  override fun toString(): String {
+    val method = logPoint.location.method.simpleQualifiedName
+    val locals = logPoint.locals.zip(values).joinToString(", ") { (local, value) ->
+      val formatted = if (value != null && !isPrimitive(local.signature)) {
+        "@" + Integer.toHexString(value as Int)
+      } else {
+        value.toString()
+      }
+      "${local.name ?: "slot${local.slot}"}=$formatted"
+    }
+    val self = thisHash?.let { " this=@${Integer.toHexString(it)}" } ?: ""
+    val frames = stack.joinToString("") { "\n  at ${it.method.simpleQualifiedName}:${it.jlocation}" }
+    return "[$tid] $method:${logPoint.location.jlocation}$self $locals$frames"
+  }
+}
+
+/**
+ * Non-blocking log-points for always-on diagnostics. Unlike breakpoints, a hit doesn't run any
+ * Kotlin on the app thread - the capture is done natively into a ring buffer, and hits are drained
+ * later (e.g. by stream()). If hits aren't drained quickly enough then the oldest are dropped.
+ *
+ * Capturing locals requires can_access_local_variables.
+ */
+object LogPoints {
+  // At most this many locals and frames per log-point - see stoic.cc
+  const val MAX_LOCALS = 8
+  const val MAX_FRAMES = 16
+
+  private val logPoints = mutableMapOf<Long, LogPoint>()
+
+  /**
+   * The number of hits dropped because the ring buffer filled up before they were drained
+   */
+  @Volatile var droppedHits = 0L
+    private set
+
+  @Synchronized
+  fun create(
+    location: Location,
+    locals: List<LocalVariable<*>> = listOf(),
+    captureThis: Boolean = false,
+    stackDepth: Int = 0,
+  ): LogPoint {
+    val slots = locals.map { it.slot }.toIntArray()
+    val types = locals.map { it.signature[0] }.joinToString("")
+    val handle = VirtualMachine.nativeCreateLogPoint(
+      location.method.methodId, location.jlocation, slots, types, captureThis, stackDepth)
+    val logPoint = LogPoint(location, locals, captureThis, stackDepth, handle)
+    logPoints[handle] = logPoint
+    return logPoint
+  }
+
+  @Synchronized
+  internal fun destroy(logPoint: LogPoint) {
+    if (logPoints.remove(logPoint.handle) != null) {
+      VirtualMachine.nativeDestroyLogPoint(logPoint.handle)
+    }
+  }
+
+  /**
+   * Waits up to timeoutMillis for hits, then removes and returns all pending hits. Hits of
+   * log-points that have since been closed are discarded.
+   */
+  fun drain(timeoutMillis: Int = 0): List<LogPointHit> {
+    val packed = VirtualMachine.nativeDrainLogPoints(timeoutMillis)
+    droppedHits += packed[0]
+
+    val hits = mutableListOf<LogPointHit>()
+    var i = 1
+    while (i < packed.size) {
+      val handle = packed[i++]
+      val timestampNanos = packed[i++]
+      val tid = packed[i++].toInt()
+      val validValues = packed[i++]
+      val valueCount = packed[i++].toInt()
+      val rawValues = packed.copyOfRange(i, i + valueCount)
+      i += valueCount
+      val thisHash = packed[i++].toInt()
+      val depth = packed[i++].toInt()
+      val stack = (0 until depth).map {
+        val method = JvmtiMethod[packed[i++]]
+        Location(method, packed[i++])
+      }
+
+      val logPoint = synchronized(this) { logPoints[handle] } ?: continue
+      val values = rawValues.mapIndexed { index, bits ->
+        if ((validValues shr index) and 1L == 0L) null else decode(logPoint.locals[index].signature, bits)
+      }
+      val self = if (logPoint.captureThis && thisHash != 0) thisHash else null
+      hits.add(LogPointHit(logPoint, timestampNanos, tid, values, self, stack))
+    }
+
+    return hits
+  }
+
+  /**
+   * Prints hits to `out` from a background thread until the returned Closeable is closed
+   */
+  fun stream(out: PrintStream = stoic.stdout, pollMillis: Int = 100): Closeable {
+    val isClosed = AtomicBoolean(false)
+    val thread = stoic.thread(timeoutMs = null) {
+      while (!isClosed.get()) {
+        drain(pollMillis).forEach { out.println(it) }
+      }
+    }
+
+    return Closeable {
+      isClosed.set(true)
+      thread.join()
+    }
+  }
+
+  private fun decode(signature: String, bits: Long): Any {
+    return when (signature[0]) {
+      'Z' -> bits != 0L
+      'B' -> bits.toByte()
+      'C' -> bits.toInt().toChar()
+      'S' -> bits.toShort()
+      'I' -> bits.toInt()
+      'J' -> bits
+      'F' -> Float.fromBits(bits.toInt())
+      'D' -> Double.fromBits(bits)
+      else -> bits.toInt()
+    }
+  }
+}
+
+private fun isPrimitive(signature: String) = signature[0] != 'L' && signature[0] != '['
@@ -0,0 +1,84 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.VirtualMachine
+
+/**
+ * How long main looper messages with a given (handler class, callback class, what) took. Class
+ * names are in Class.getName form, and callbackClass is null for messages without a callback.
+ */
+class LooperMessageStats(
+  val handlerClass: String,
+  val callbackClass: String?,
+  val what: Int,
+  val count: Long,
+  val totalNanos: Long,
+  val maxNanos: Long,
+  private val bucketUpperBounds: LongArray,
+  private val bucketCounts: LongArray,
+) {
+  fun percentileNanos(percentile: Double): Long {
+    return histogramPercentileNanos(bucketUpperBounds, bucketCounts, count, maxNanos, percentile)
+  }
+
+  override fun toString(): String {
+    val callback = callbackClass ?: "what=$what"
+    val p50 = percentileNanos(50.0) / 1000
+    val p99 = percentileNanos(99.0) / 1000
+    return "$handlerClass ($callback): count=$count total=${totalNanos / 1000000}ms p50=${p50}us p99=${p99}us"
+  }
+}
+
+/**
+ * Continuous accounting of which Handlers/Runnables consume main thread time. Message dispatch is
+ * observed natively via a breakpoint at Handler.dispatchMessage and a FramePop, and durations are
+ * aggregated into native histograms, so nothing is sent to Kotlin until snapshot() is called.
+ *
+ * Requires can_generate_frame_pop_events and can_access_local_variables.
+ */
+object LooperStats {
+  fun start() {
+    VirtualMachine.nativeStartLooperStats()
+  }
+
+  fun stop() {
+    VirtualMachine.nativeStopLooperStats()
+  }
+
+  fun reset() {
+    VirtualMachine.nativeResetLooperStats()
+  }
+
+  /**
+   * Returns the stats so far, most total time first
+   */
+  fun snapshot(): List<LooperMessageStats> {
+    val packed = VirtualMachine.nativeGetLooperStats()
+    val classNames = ClassNames()
+
+    val stats = mutableListOf<LooperMessageStats>()
+    var i = 0
+    while (i < packed.size) {
+      val handlerClassId = packed[i++]
+      val callbackClassId = packed[i++]
+      val what = packed[i++].toInt()
+      val count = packed[i++]
+      val totalNanos = packed[i++]
+      i++  // min
+      val maxNanos = packed[i++]
+      val bucketCount = packed[i++].toInt()
+      val upperBounds = LongArray(bucketCount)
+      val counts = LongArray(bucketCount)
+      for (j in 0 until bucketCount) {
+        upperBounds[j] = packed[i++]
+        counts[j] = packed[i++]
+      }
+
+      val callbackClass = if (callbackClassId == 0L) null else classNames[callbackClassId]
+      stats.add(
+        LooperMessageStats(
+          classNames[handlerClassId], callbackClass, what, count, totalNanos, maxNanos, upperBounds, counts))
+    }
+
+    return stats.sortedByDescending { it.totalNanos }
+  }
+}
@@ -0,0 +1,114 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.JvmtiMethod
+import com.squareup.stoic.jvmti.VirtualMachine
+
+/**
+ * Latency of a method, as recorded by MethodTimer. Durations are in nanoseconds, and percentiles
+ * are accurate to within 1/16 of the value (see LatencyHistogram in stoic.cc).
+ */
+class MethodLatency(
+  val method: JvmtiMethod,
+  val count: Long,
+  val totalNanos: Long,
+  val minNanos: Long,
+  val maxNanos: Long,
+  // The (inclusive) upper bound of each non-empty bucket and its count, in ascending order
+  private val bucketUpperBounds: LongArray,
+  private val bucketCounts: LongArray,
+) {
+  val meanNanos: Long get() = if (count == 0L) 0 else totalNanos / count
+
+  /**
+   * The smallest duration that is >= `percentile` percent of the recorded durations
+   */
+  fun percentileNanos(percentile: Double): Long {
+    return histogramPercentileNanos(bucketUpperBounds, bucketCounts, count, maxNanos, percentile)
+  }
+
+  override fun toString(): String {
+    val p50 = percentileNanos(50.0) / 1000
+    val p99 = percentileNanos(99.0) / 1000
+    return "${method.simpleQualifiedName}: count=$count p50=${p50}us p99=${p99}us max=${maxNanos / 1000}us"
+  }
+}
+
+/**
+ * The smallest duration that is >= `percentile` percent of the durations in a histogram packed by
+ * LatencyHistogram::AppendTo (in stoic.cc)
+ */
+internal fun histogramPercentileNanos(
+  bucketUpperBounds: LongArray,
+  bucketCounts: LongArray,
+  count: Long,
+  maxNanos: Long,
+  percentile: Double,
+): Long {
+  check(percentile in 0.0..100.0)
+  if (count == 0L) {
+    return 0
+  }
+
+  val target = maxOf(1L, Math.ceil(count * percentile / 100.0).toLong())
+  var seen = 0L
+  for (i in bucketCounts.indices) {
+    seen += bucketCounts[i]
+    if (seen >= target) {
+      return minOf(bucketUpperBounds[i], maxNanos)
+    }
+  }
+
+  return maxNanos
+}
+
+/**
+ * Measures how long methods take, entirely in native code. Each timed method gets a breakpoint at
+ * its start (so the rest of the app stays on compiled code), and the FramePop of each call records
+ * its duration into a per-method histogram. Nothing is sent to Kotlin until snapshot() is called.
+ *
+ * Requires can_generate_frame_pop_events.
+ */
+object MethodTimer {
+  fun start(methods: List<JvmtiMethod>) {
+    VirtualMachine.nativeProfileMethods(methods.map { it.methodId }.toLongArray())
+  }
+
+  /**
+   * Stop timing `methods`. What they've recorded so far is still included in snapshot().
+   */
+  fun stop(methods: List<JvmtiMethod>) {
+    VirtualMachine.nativeUnprofileMethods(methods.map { it.methodId }.toLongArray())
+  }
+
+  /**
+   * Discard everything recorded so far
+   */
+  fun reset() {
+    VirtualMachine.nativeResetMethodProfiles()
+  }
+
+  fun snapshot(): List<MethodLatency> {
+    val packed = VirtualMachine.nativeGetMethodProfiles()
+    val latencies = mutableListOf<MethodLatency>()
+    var i = 0
+    while (i < packed.size) {
+      val methodId = packed[i++]
+      val count = packed[i++]
+      val totalNanos = packed[i++]
+      val minNanos = packed[i++]
+      val maxNanos = packed[i++]
+      val bucketCount = packed[i++].toInt()
+      val upperBounds = LongArray(bucketCount)
+      val counts = LongArray(bucketCount)
+      for (j in 0 until bucketCount) {
+        upperBounds[j] = packed[i++]
+        counts[j] = packed[i++]
+      }
+
+      latencies.add(
+        MethodLatency(JvmtiMethod[methodId], count, totalNanos, minNanos, maxNanos, upperBounds, counts))
+    }
+
+    return latencies
+  }
+}
@@ -0,0 +1,81 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.JvmtiMethod
+import com.squareup.stoic.jvmti.Location
+import com.squareup.stoic.jvmti.VirtualMachine
+
+/**
+ * Time spent waiting to enter contended monitors of `monitorClass` from `waiterStack` (innermost
+ * first) while `ownerThread` held the monitor. ownerThread is null if the owner couldn't be
+ * determined (e.g. can_get_monitor_info isn't available).
+ */
+class MonitorContentionStats(
+  val monitorClass: String,
+  val ownerThread: String?,
+  val waiterStack: List<Location>,
+  val count: Long,
+  val totalNanos: Long,
+  val maxNanos: Long,
+) {
+  override fun toString(): String {
+    val waiter = waiterStack.firstOrNull()?.method?.simpleQualifiedName ?: "unknown"
+    return "$monitorClass held by ${ownerThread ?: "unknown"}, waited on from $waiter: " +
+      "count=$count total=${totalNanos / 1000000}ms max=${maxNanos / 1000}us"
+  }
+}
+
+/**
+ * Aggregates contended monitor enters (MonitorContendedEnter/Entered) natively by (monitor class,
+ * waiter stack, owner thread). Nothing is sent to Kotlin per event - call snapshot() for a summary.
+ *
+ * Requires can_generate_monitor_events.
+ */
+object MonitorContention {
+  /**
+   * Start recording contention. Waiter stacks are truncated to their innermost `maxDepth` frames.
+   */
+  fun start(maxDepth: Int = 16) {
+    VirtualMachine.nativeStartMonitorContention(maxDepth)
+  }
+
+  fun stop() {
+    VirtualMachine.nativeStopMonitorContention()
+  }
+
+  fun reset() {
+    VirtualMachine.nativeResetMonitorContention()
+  }
+
+  /**
+   * Returns the contention so far, most total wait time first
+   */
+  fun snapshot(): List<MonitorContentionStats> {
+    val result = VirtualMachine.nativeGetMonitorContention()
+    val packed = result[0] as LongArray
+    @Suppress("UNCHECKED_CAST")
+    val ownerNames = result[1] as Array<String>
+
+    val classNames = ClassNames()
+    val stats = mutableListOf<MonitorContentionStats>()
+    var i = 0
+    while (i < packed.size) {
+      val monitorClassId = packed[i++]
+      val ownerName = ownerNames[packed[i++].toInt()]
+      val count = packed[i++]
+      val totalNanos = packed[i++]
+      val maxNanos = packed[i++]
+      val depth = packed[i++].toInt()
+      val waiterStack = (0 until depth).map {
+        val methodId = packed[i++]
+        val location = packed[i++]
+        Location(JvmtiMethod[methodId], location)
+      }
+
+      stats.add(
+        MonitorContentionStats(
+          classNames[monitorClassId], ownerName.ifEmpty { null }, waiterStack, count, totalNanos, maxNanos))
+    }
+
+    return stats.sortedByDescending { it.totalNanos }
+  }
+}
@@ -0,0 +1,149 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.JLocation
+import com.squareup.stoic.jvmti.JvmtiException
+import com.squareup.stoic.jvmti.JvmtiMethod
+import com.squareup.stoic.jvmti.VirtualMachine
+import com.squareup.stoic.threadlocals.stoic
+import java.io.PrintStream
+
+/**
+ * The state of a sampled thread. The order must match SampledThreadState in stoic.cc.
+ */
+enum class SampledThreadState {
+  RUNNABLE,
+  BLOCKED_ON_MONITOR,
+  WAITING,
+  SLEEPING,
+}
+
+/**
+ * A node of the call tree built by Sampler. The root has no method.
+ */
+class CallTreeNode(
+  val parent: CallTreeNode?,
+  val method: JvmtiMethod?,
+  val location: JLocation,
+  // The number of samples where this was the innermost frame
+  val samples: Long,
+  // The wall-clock time of those samples, indexed by SampledThreadState.ordinal
+  private val stateMicros: LongArray,
+) {
+  val children = mutableListOf<CallTreeNode>()
+
+  fun micros(state: SampledThreadState): Long = stateMicros[state.ordinal]
+
+  // Outermost first, excluding the root
+  val stack: List<CallTreeNode> get() {
+    val frames = mutableListOf<CallTreeNode>()
+    var node: CallTreeNode? = this
+    while (node?.method != null) {
+      frames.add(node)
+      node = node.parent
+    }
+    return frames.reversed()
+  }
+
+  /**
+   * Write this subtree in collapsed-stack format ("outer;inner count" per line), as consumed by
+   * flamegraph.pl and speedscope.
+   *
+   * By default each line counts samples, regardless of what the thread was doing. If `states` is
+   * given then each line is instead the wall-clock microseconds spent in those states - e.g. pass
+   * BLOCKED_ON_MONITOR, WAITING and SLEEPING for an off-CPU flame graph.
+   */
+  fun writeCollapsed(out: PrintStream = stoic.stdout, states: Set<SampledThreadState>? = null) {
+    val counts = linkedMapOf<String, Long>()
+    val pending = ArrayDeque(listOf(this))
+    while (pending.isNotEmpty()) {
+      val node = pending.removeFirst()
+      pending.addAll(node.children)
+      val count = if (states == null) node.samples else states.sumOf { node.micros(it) }
+      if (node.method != null && count != 0L) {
+        // Samples from different locations of the same methods get merged here
+        val key = node.stack.joinToString(";") { frameName(it.method!!) }
+        counts[key] = (counts[key] ?: 0L) + count
+      }
+    }
+
+    for ((stack, count) in counts) {
+      out.println("$stack $count")
+    }
+  }
+
+  private fun frameName(method: JvmtiMethod): String {
+    return try {
+      "${method.clazz.name}.${method.name}"
+    } catch (e: JvmtiException) {
+      // e.g. the class was unloaded after the sample was taken
+      "unknown"
+    }
+  }
+}
+
+/**
+ * Decodes `nodeCount` nodes of a call tree packed by CallTree::AppendTo (in stoic.cc), starting at
+ * packed[offset]. Returns the root.
+ */
+internal fun decodeCallTree(packed: LongArray, offset: Int, nodeCount: Int): CallTreeNode {
+  val root = CallTreeNode(null, null, -1, 0, LongArray(SampledThreadState.entries.size))
+  val nodes = mutableListOf<CallTreeNode>()
+  var i = offset
+  repeat(nodeCount) {
+    val parentIndex = packed[i++].toInt()
+    val methodId = packed[i++]
+    val location = packed[i++]
+    val samples = packed[i++]
+    val stateMicros = LongArray(SampledThreadState.entries.size) { packed[i++] }
+    val parent = if (parentIndex == -1) root else nodes[parentIndex]
+    val node = CallTreeNode(parent, JvmtiMethod[methodId], location, samples, stateMicros)
+    parent.children.add(node)
+    nodes.add(node)
+  }
+
+  return root
+}
+
+// The number of longs that CallTree::AppendTo uses for each node
+internal val CALL_TREE_NODE_SIZE = 4 + SampledThreadState.entries.size
+
+/**
+ * A sampling profiler. Stacks are sampled natively on a dedicated thread at a fixed interval and
+ * merged into a call tree, so the overhead depends on the interval and not on what the app is
+ * doing. No per-method events are enabled.
+ */
+object Sampler {
+  /**
+   * Start sampling `threads` (or all threads, if empty) every `intervalMicros`. Stacks deeper than
+   * `maxDepth` are truncated to their innermost frames.
+   */
+  fun start(intervalMicros: Int = 1000, maxDepth: Int = 128, threads: List<Thread> = listOf()) {
+    VirtualMachine.nativeStartSampling(intervalMicros, maxDepth, threads.toTypedArray())
+  }
+
+  fun stop() {
+    VirtualMachine.nativeStopSampling()
+  }
+
+  /**
+   * Discard the samples collected so far
+   */
+  fun reset() {
+    VirtualMachine.nativeResetSamples()
+  }
+
+  /**
+   * Returns the root of the call tree sampled so far
+   */
+  fun snapshot(): CallTreeNode {
+    val packed = VirtualMachine.nativeGetSamples()
+    return decodeCallTree(packed, 0, packed.size / CALL_TREE_NODE_SIZE)
+  }
+
+  /**
+   * Write the samples in collapsed-stack format. See CallTreeNode.writeCollapsed.
+   */
+  fun writeCollapsed(out: PrintStream = stoic.stdout, states: Set<SampledThreadState>? = null) {
+    snapshot().writeCollapsed(out, states)
+  }
+}
@@ -0,0 +1,74 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.VirtualMachine
+import com.squareup.stoic.threadlocals.stoic
+import java.io.PrintStream
+
+/**
+ * CPU used by `thread` over the last `windowNanos` of wall time, and in total since it started.
+ */
+class ThreadCpuUsage(
+  val thread: Thread,
+  val windowCpuNanos: Long,
+  val totalCpuNanos: Long,
+  val windowNanos: Long,
+) {
+  // Percent of one core - a thread can't exceed 100
+  val percent: Double
+    get() = if (windowNanos == 0L) 0.0 else 100.0 * windowCpuNanos / windowNanos
+
+  override fun toString(): String {
+    return "%5.1f%% %8dms  %s".format(percent, totalCpuNanos / 1000000, thread.name)
+  }
+}
+
+/**
+ * A "top" for Java threads. A native thread reads every thread's CPU time each interval and keeps
+ * the deltas over a rolling window, so reading the top threads doesn't enumerate threads in Java.
+ *
+ * Requires can_get_thread_cpu_time.
+ */
+object ThreadCpu {
+  /**
+   * Start polling every `intervalMillis`, with a window of the last `windowTicks` polls. Restarting
+   * discards what was collected.
+   */
+  fun start(intervalMillis: Int = 1000, windowTicks: Int = 5) {
+    VirtualMachine.nativeStartCpuPoller(intervalMillis, windowTicks)
+  }
+
+  fun stop() {
+    VirtualMachine.nativeStopCpuPoller()
+  }
+
+  /**
+   * Returns the `n` threads that used the most CPU within the window, most first
+   */
+  fun top(n: Int = 10): List<ThreadCpuUsage> {
+    val result = VirtualMachine.nativeGetTopCpuThreads(n)
+    // [windowNanos, (windowCpuNanos, totalCpuNanos)*]
+    val packed = result[0] as LongArray
+    @Suppress("UNCHECKED_CAST")
+    val threads = result[1] as Array<Thread>
+    val windowNanos = packed[0]
+    return threads.mapIndexed { i, thread ->
+      ThreadCpuUsage(thread, packed[1 + 2 * i], packed[2 + 2 * i], windowNanos)
+    }
+  }
+
+  /**
+   * Print the top `n` threads every `intervalMillis` until the current thread is interrupted
+   */
+  fun watch(n: Int = 10, intervalMillis: Long = 1000, out: PrintStream = stoic.stdout) {
+    while (!Thread.currentThread().isInterrupted) {
+      out.println("  CPU    TOTAL  THREAD")
+      top(n).forEach { out.println(it) }
+      out.println()
+      try {
+        Thread.sleep(intervalMillis)
+      } catch (e: InterruptedException) {
+        break
+      }
+    }
+  }
+}
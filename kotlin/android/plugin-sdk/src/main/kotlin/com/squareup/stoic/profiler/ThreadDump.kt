@@ -0,0 +1,102 @@
+package com.squareup.stoic.profiler
+
+import com.squareup.stoic.jvmti.JvmtiMethod
+import com.squareup.stoic.jvmti.Location
+import com.squareup.stoic.jvmti.VirtualMachine
+
+/**
+ * A monitor held by a thread. `depth` is the height of the frame that acquired it (0 is the
+ * innermost frame), or -1 if it was acquired via JNI.
+ */
+class OwnedMonitor(val monitor: Any, val depth: Int)
+
+/**
+ * A thread as of a ThreadDump. `state` is null if the thread isn't alive. `contendedMonitor` is the
+ * monitor the thread is blocked entering or waiting on, if any.
+ */
+class ThreadInfo(
+  val thread: Thread,
+  val state: SampledThreadState?,
+  val stack: List<Location>,
+  val ownedMonitors: List<OwnedMonitor>,
+  val contendedMonitor: Any?,
+) {
+  override fun toString(): String {
+    val sb = StringBuilder()
+    sb.append("\"${thread.name}\" ${state ?: "NOT_ALIVE"}")
+    contendedMonitor?.let { sb.append(" on ${describe(it)}") }
+    sb.append('\n')
+    stack.forEachIndexed { depth, location ->
+      sb.append("  at ${location.method.simpleQualifiedName} @${location.jlocation}\n")
+      ownedMonitors.filter { it.depth == depth }.forEach { sb.append("    - locked ${describe(it.monitor)}\n") }
+    }
+    ownedMonitors.filter { it.depth == -1 }.forEach { sb.append("  - locked via JNI ${describe(it.monitor)}\n") }
+    return sb.toString()
+  }
+
+  private fun describe(monitor: Any): String {
+    return "<${Integer.toHexString(System.identityHashCode(monitor))}> (a ${monitor.javaClass.name})"
+  }
+}
+
+/**
+ * All threads with their stacks and monitors, captured in one native call. `deadlocks` lists each
+ * cycle of threads where every thread is blocked entering a monitor held by the next.
+ *
+ * Monitor information requires can_get_owned_monitor_stack_depth_info and
+ * can_get_current_contended_monitor - without them, threads are reported with no monitors and no
+ * deadlocks are found.
+ */
+class ThreadDump(
+  val threads: List<ThreadInfo>,
+  val deadlocks: List<List<ThreadInfo>>,
+) {
+  override fun toString(): String {
+    val sb = StringBuilder()
+    threads.forEach { sb.append(it).append('\n') }
+    deadlocks.forEach { cycle ->
+      sb.append("Deadlock: ${cycle.joinToString(" -> ") { "\"${it.thread.name}\"" }}\n")
+    }
+    return sb.toString()
+  }
+
+  companion object {
+    /**
+     * Dumps all threads, keeping up to `maxDepth` frames of each stack.
+     */
+    fun capture(maxDepth: Int = 64): ThreadDump {
+      val result = VirtualMachine.nativeDumpThreads(maxDepth)
+      // threadCount, then per thread: state (-1 if not alive), contendedMonitor (-1 if none),
+      //   ownedCount, (monitor, depth)*, frameCount, (methodId, location)*
+      // cycleCount, then per cycle: length, thread*
+      val packed = result[0] as LongArray
+      @Suppress("UNCHECKED_CAST")
+      val threads = result[1] as Array<Thread>
+      @Suppress("UNCHECKED_CAST")
+      val monitors = result[2] as Array<Any>
+
+      var i = 0
+      val threadCount = packed[i++].toInt()
+      val infos = (0 until threadCount).map { t ->
+        val state = packed[i++].toInt().let { if (it == -1) null else SampledThreadState.entries[it] }
+        val contended = packed[i++].toInt().let { if (it == -1) null else monitors[it] }
+        val owned = (0 until packed[i++].toInt()).map {
+          val monitor = monitors[packed[i++].toInt()]
+          OwnedMonitor(monitor, packed[i++].toInt())
+        }
+        val stack = (0 until packed[i++].toInt()).map {
+          val method = JvmtiMethod[packed[i++]]
+          Location(method, packed[i++])
+        }
+        ThreadInfo(threads[t], state, stack, owned, contended)
+      }
+
+      val cycleCount = packed[i++].toInt()
+      val deadlocks = (0 until cycleCount).map {
+        (0 until packed[i++].toInt()).map { infos[packed[i++].toInt()] }
+      }
+
+      return ThreadDump(infos, deadlocks)
+    }
+  }
+}
@@ -143,10 +143,10 @@ class MappedMethodEvaluator(
   private val localVars: List<Pair<LocalVariable<*>, ValueEvaluator>>
 ): MethodEvaluator(method) {
   override fun apply(frame: StackFrame): ResultTree {
+    val values = frame.getAll(localVars.map { it.first })
     return ResultNode(
       method.simpleQualifiedName,
-      localVars.map { (localVar, objEval) ->
-        val value = frame.get(localVar)
+      localVars.zip(values) { (localVar, objEval), value ->
         Pair(localVar.name, objEval.apply(value))
       })
   }
@@ -599,9 +599,12 @@ fun traceUntilExit(breakpointFrame: StackFrame) {
   val bpMethod = breakpointFrame.location.method
   println("-> called ${bpMethod.name}(...)")
 
+  // Resolved now, since the height can't be found lazily from the entry/exit callbacks
+  val bpHeight = breakpointFrame.height
+
   val entryRequest = jvmti.methodEntries { frame ->
     val method = frame.location.method
-    val level = frame.height - breakpointFrame.height
+    val level = frame.height - bpHeight
     val indent = "  ".repeat(level)
     //println("$indent-> ${method.clazz.name}.${method.name} (...)")
 
@@ -609,8 +612,8 @@ fun traceUntilExit(breakpointFrame: StackFrame) {
   var exitRequest: MethodExitRequest? = null
   exitRequest = jvmti.methodExits { frame, value, wasPoppedByException ->
     val method = frame.location.method
-    if (frame.height <= breakpointFrame.height) {
-      if (frame.height == breakpointFrame.height) {
+    if (frame.height <= bpHeight) {
+      if (frame.height == bpHeight) {
         check(bpMethod.methodId == frame.location.method.methodId)
         println("<- exiting from ${bpMethod.name} (${java.lang.Long.toHexString(value as Long)})")
       } else {
@@ -620,7 +623,7 @@ fun traceUntilExit(breakpointFrame: StackFrame) {
       exitRequest!!.close()
       println(Stack(frame.stackTrace).stackTraceToString())
     } else {
-      val level = frame.height - breakpointFrame.height
+      val level = frame.height - bpHeight
       val indent = "  ".repeat(level)
       //println("$indent<- ${method.clazz.name}.${method.name} (...)")
     }
@@ -4,6 +4,8 @@ import android.util.Log
 import com.squareup.stoic.StoicJvmti
 import com.squareup.stoic.common.LogLevel
 import com.squareup.stoic.common.minLogLevel
+import com.squareup.stoic.jvmti.SymbolIndex
+import kotlin.concurrent.thread
 
 @Suppress("unused")
 fun main(stoicDir: String) {
@@ -14,5 +16,17 @@ fun main(stoicDir: String) {
 
   minLogLevel = LogLevel.DEBUG
 
+  // Write the symbol index for later attaches. This scans every loaded class, so it's done in the
+  // background - and it's skipped if the index loaded at startup already covers them.
+  thread(name = "stoic-symbol-index", isDaemon = true, priority = Thread.MIN_PRIORITY) {
+    try {
+      if (SymbolIndex.build()) {
+        Log.d("stoic", "Wrote symbol index")
+      }
+    } catch (e: Exception) {
+      Log.e("stoic", "Failed to build the symbol index", e)
+    }
+  }
+
   ensureServer(stoicDir)
 }
\ No newline at end of file
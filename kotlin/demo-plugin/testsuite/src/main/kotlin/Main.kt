@@ -1,4 +1,16 @@
+import com.squareup.stoic.highlander
+import com.squareup.stoic.jvmti.FieldPredicate
+import com.squareup.stoic.jvmti.JvmtiClass
+import com.squareup.stoic.jvmti.JvmtiField
 import com.squareup.stoic.jvmti.JvmtiMethod
+import com.squareup.stoic.jvmti.Location
+import com.squareup.stoic.jvmti.MethodFilter
+import com.squareup.stoic.jvmti.MethodExitListener
+import com.squareup.stoic.jvmti.StackFrame
+import com.squareup.stoic.jvmti.StepRequest
+import com.squareup.stoic.profiler.LineCoverage
+import com.squareup.stoic.profiler.LogPoints
+import com.squareup.stoic.profiler.ThreadDump
 import com.squareup.stoic.trace.Include
 import com.squareup.stoic.trace.IncludeEach
 import com.squareup.stoic.trace.OmitThis
@@ -8,11 +20,23 @@ import com.squareup.stoic.trace.rules
 import com.squareup.stoic.trace.trace
 import com.squareup.stoic.trace.traceExpect
 import com.squareup.stoic.helpers.*
+import com.squareup.stoic.threadlocals.jvmti
 import com.squareup.stoic.threadlocals.stoic
+import java.lang.reflect.Modifier
+import java.util.concurrent.CountDownLatch
 
 fun main(args: Array<String>) {
   testDuplicateArguments()
   testTrace()
+  testMethodExitValues()
+  testUnboxedMethodExitValues()
+  testDeadlockDetection()
+  testResolve()
+  testNativeMethodEntry()
+  testLogPoints()
+  testStep()
+  testFieldModifications()
+  testLineCoverage()
 }
 
 // Verify that we don't include duplicate arguments. The local variable table may contain duplicate
@@ -27,6 +51,306 @@ fun testDuplicateArguments() {
   check(method.arguments.map { it.name } == listOf("this", "view", "root", "outInfos"))
 }
 
+// Verify that return values of each type survive the trip from native (primitives are now passed
+// through unboxed)
+fun testMethodExitValues() {
+  eprintln("testMethodExitValues")
+
+  fun returnValueOf(sig: String, runnable: Runnable): Any? {
+    val values = mutableListOf<Any?>()
+    val request = jvmti.breakpoint(JvmtiMethod.bySig(sig).startLocation) { frame ->
+      frame.onExit { _, value, _ -> values.add(value) }
+    }
+    runnable.run()
+    request.close()
+    return highlander(values)
+  }
+
+  check(returnValueOf("Foo.isTrue()Z") { Foo.isTrue() } == true)
+  check(returnValueOf("Foo.bigInt()I") { Foo.bigInt() } == 123456789)
+  check(returnValueOf("Foo.bigLong()J") { Foo.bigLong() } == 1234567890123L)
+  check(returnValueOf("Foo.half()D") { Foo.half() } == 0.5)
+  check(returnValueOf("Foo.letter()C") { Foo.letter() } == 'x')
+  check(returnValueOf("Foo.name()Ljava/lang/String;") { Foo.name() } == "foo")
+}
+
+// Verify that primitive return values reach the typed MethodExitListener overloads, and that the
+// boxing onExit isn't called for them
+fun testUnboxedMethodExitValues() {
+  eprintln("testUnboxedMethodExitValues")
+
+  var intValue = 0
+  var doubleValue = 0.0
+  var boxedCount = 0
+  val listener = object : MethodExitListener {
+    override fun onExit(frame: StackFrame, value: Any?, wasPoppedByException: Boolean) {
+      boxedCount++
+    }
+
+    override fun onExitI(frame: StackFrame, value: Int, wasPoppedByException: Boolean) {
+      intValue = value
+    }
+
+    override fun onExitD(frame: StackFrame, value: Double, wasPoppedByException: Boolean) {
+      doubleValue = value
+    }
+  }
+
+  fun exitOf(sig: String, runnable: Runnable) {
+    val request = jvmti.breakpoint(JvmtiMethod.bySig(sig).startLocation) { frame ->
+      frame.onExit(true, listener)
+    }
+    runnable.run()
+    request.close()
+  }
+
+  exitOf("Foo.bigInt()I") { Foo.bigInt() }
+  exitOf("Foo.half()D") { Foo.half() }
+  check(intValue == 123456789)
+  check(doubleValue == 0.5)
+  check(boxedCount == 0)
+}
+
+// Verify that ThreadDump finds a deadlock between two threads that each hold the lock the other
+// wants. The threads can never finish, so they're daemons and are left behind.
+fun testDeadlockDetection() {
+  eprintln("testDeadlockDetection")
+
+  val lockA = Any()
+  val lockB = Any()
+  val bothLocked = CountDownLatch(2)
+  fun deadlocker(name: String, first: Any, second: Any) = Thread({
+    synchronized(first) {
+      bothLocked.countDown()
+      bothLocked.await()
+      synchronized(second) {}
+    }
+  }, name).apply {
+    isDaemon = true
+    start()
+  }
+
+  val threadA = deadlocker("stoic-deadlock-a", lockA, lockB)
+  val threadB = deadlocker("stoic-deadlock-b", lockB, lockA)
+
+  // The threads block shortly after the latch opens
+  var dump = ThreadDump.capture()
+  val deadline = System.currentTimeMillis() + 5000
+  while (dump.deadlocks.isEmpty() && System.currentTimeMillis() < deadline) {
+    Thread.sleep(10)
+    dump = ThreadDump.capture()
+  }
+
+  val cycle = highlander(dump.deadlocks)
+  check(cycle.map { it.thread }.toSet() == setOf(threadA, threadB))
+  check(cycle.all { it.contendedMonitor === lockA || it.contendedMonitor === lockB })
+}
+
+// Verify JvmtiMethod.resolve's globs: `*` spans packages, `?` matches exactly one character,
+// signatures may be globbed, and static methods are found too
+fun testResolve() {
+  eprintln("testResolve")
+
+  // Make sure the classes are loaded
+  Foo.bar()
+  Foo.staticBaz()
+
+  fun resolved(pattern: String): Set<String> {
+    return JvmtiMethod.resolve(pattern).map { "${it.clazz.name}.${it.name}${it.signature}" }.toSet()
+  }
+
+  check("java.util.concurrent.ConcurrentHashMap.size()I" in resolved("java.*.ConcurrentHashMap.size"))
+  check(resolved("Fo?.ba?") == setOf("Foo.bar()V", "Foo.bar(I)V", "Foo.bar(ILjava/lang/String;)V"))
+  check(resolved("F?.bar").isEmpty())
+  check(resolved("Foo.bar(I*)V") == setOf("Foo.bar(I)V", "Foo.bar(ILjava/lang/String;)V"))
+  check(resolved("Foo.bar(*)*") == resolved("Foo.bar"))
+
+  val staticMethod = highlander(JvmtiMethod.resolve("Foo.static*"))
+  check(staticMethod.name == "staticBaz")
+  check(Modifier.isStatic(staticMethod.modifiers))
+  check("java.lang.Math.abs(I)I" in resolved("java.lang.Math.abs(?)?"))
+}
+
+// Verify that entering a native method (which has no bytecode, and so no location) is reported with
+// a location of -1 rather than taking down the app
+fun testNativeMethodEntry() {
+  eprintln("testNativeMethodEntry")
+
+  val intern = JvmtiMethod.bySig("java/lang/String.intern()Ljava/lang/String;")
+  check(Modifier.isNative(intern.modifiers))
+
+  val locations = mutableListOf<Long>()
+  val request = jvmti.methodEntries(MethodFilter(includeMethods = listOf(intern))) { frame ->
+    locations.add(frame.location.jlocation)
+  }
+  StringBuilder("stoic").toString().intern()
+  request.close()
+  check(locations == listOf(-1L))
+}
+
+// Verify that a log-point captures its locals and `this` when hit, and that hits are no longer
+// reported once it's destroyed - including after a new log-point is created in its place
+fun testLogPoints() {
+  eprintln("testLogPoints")
+
+  val method = JvmtiMethod.bySig("Foo.logged(ID)V")
+  val locals = listOf(method.argumentByName<Int>("count"), method.argumentByName<Double>("ratio"))
+  fun create() = LogPoints.create(method.startLocation, locals, captureThis = true, stackDepth = 1)
+
+  // Discard anything left over from earlier tests
+  LogPoints.drain()
+
+  val first = create()
+  Foo.logged(7, 0.25)
+  val firstHit = highlander(LogPoints.drain())
+  check(firstHit.logPoint === first)
+  check(firstHit.values == listOf(7, 0.25))
+  check(firstHit.thisHash == System.identityHashCode(Foo))
+  check(firstHit.stack.map { it.method.methodId } == listOf(method.methodId))
+
+  // A hit between destroying and recreating belongs to neither log-point
+  first.close()
+  Foo.logged(8, 0.5)
+  val second = create()
+  Foo.logged(9, 1.5)
+  second.close()
+
+  val secondHit = highlander(LogPoints.drain())
+  check(secondHit.logPoint === second)
+  check(secondHit.values == listOf(9, 1.5))
+}
+
+// Verify where each step depth completes when stepping from the start of Stepper.outer: OVER stays
+// in outer, INTO enters the first call on the line that passes the filter, and OUT returns to the
+// caller
+fun testStep() {
+  eprintln("testStep")
+
+  // Make sure the class is loaded
+  Stepper.outer()
+
+  val outer = JvmtiMethod.bySig("Stepper.outer()I")
+  val inner = JvmtiMethod.bySig("Stepper.inner()I")
+  val other = JvmtiMethod.bySig("Stepper.other()I")
+
+  // Returns the location the step completed at, and its frame's height relative to outer's
+  fun stepFrom(depth: StepRequest.Depth, filter: MethodFilter? = null): Pair<Location, Int> {
+    val results = mutableListOf<Pair<Location, Int>>()
+    val request = jvmti.breakpoint(outer.startLocation) { frame ->
+      val startHeight = frame.height
+      jvmti.step(frame, depth, filter) { stepFrame ->
+        results.add(stepFrame.location to stepFrame.height - startHeight)
+      }
+    }
+    check(Stepper.outer() == 6)
+    request.close()
+    return highlander(results)
+  }
+
+  val (overLocation, overHeight) = stepFrom(StepRequest.Depth.OVER)
+  check(overLocation.method.methodId == outer.methodId)
+  check(overLocation.jlocation > outer.startLocation.jlocation)
+  check(overHeight == 0)
+
+  val (intoLocation, intoHeight) = stepFrom(StepRequest.Depth.INTO)
+  check(intoLocation.method.methodId == inner.methodId)
+  check(intoHeight == 1)
+
+  val filter = MethodFilter(includeMethods = listOf(other))
+  val (filteredLocation, filteredHeight) = stepFrom(StepRequest.Depth.INTO, filter)
+  check(filteredLocation.method.methodId == other.methodId)
+  check(filteredHeight == 1)
+
+  val (outLocation, outHeight) = stepFrom(StepRequest.Depth.OUT)
+  check(outLocation.method.methodId != outer.methodId)
+  check(outHeight == -1)
+}
+
+// Verify that field modification watchpoints deliver the object and the old and new values, that
+// onlyChanges and predicates filter natively, and that float/double raw bits and object identities
+// survive the round trip
+fun testFieldModifications() {
+  eprintln("testFieldModifications")
+
+  val watched = Watched()
+  val clazz = JvmtiClass[Watched::class.java]
+
+  // Returns (old, new) for each modification that reached the callback
+  fun modificationsOf(
+    field: JvmtiField,
+    onlyChanges: Boolean = false,
+    predicate: FieldPredicate = FieldPredicate.any,
+    runnable: Runnable,
+  ): List<Pair<Any?, Any?>> {
+    val values = mutableListOf<Pair<Any?, Any?>>()
+    val request = jvmti.fieldModifications(field, onlyChanges = onlyChanges, predicate = predicate) { _, obj, oldValue, newValue ->
+      check(obj === watched)
+      values.add(oldValue to newValue)
+    }
+    runnable.run()
+    check(request.hits == values.size.toLong())
+    request.close()
+    return values
+  }
+
+  val count = clazz.declaredField("count", "I")
+  check(modificationsOf(count) {
+    watched.count = 1
+    watched.count = 1
+    watched.count = 5
+  } == listOf(0 to 1, 1 to 1, 1 to 5))
+  check(modificationsOf(count, onlyChanges = true) {
+    watched.count = 5
+    watched.count = 6
+  } == listOf(5 to 6))
+  check(modificationsOf(count, predicate = FieldPredicate.greaterThan(10)) {
+    watched.count = 3
+    watched.count = 11
+  } == listOf(3 to 11))
+
+  // Compared by raw bits, since -0.0 == 0.0
+  val ratio = highlander(modificationsOf(clazz.declaredField("ratio", "F")) { watched.ratio = -0.0f })
+  check((ratio.first as Float).toRawBits() == 0.1f.toRawBits())
+  check((ratio.second as Float).toRawBits() == (-0.0f).toRawBits())
+  val total = highlander(modificationsOf(clazz.declaredField("total", "D")) { watched.total = -0.0 })
+  check((total.first as Double).toRawBits() == 1e-300.toRawBits())
+  check((total.second as Double).toRawBits() == (-0.0).toRawBits())
+
+  val first = Any()
+  val second = Any()
+  val labels = modificationsOf(clazz.declaredField("label", "Ljava/lang/Object;")) {
+    watched.label = first
+    watched.label = second
+  }
+  check(labels.size == 2)
+  check(labels[0].first === null && labels[0].second === first)
+  check(labels[1].first === first && labels[1].second === second)
+}
+
+// Verify that LineCoverage reports the line of a branch that ran as covered, and the line of the
+// branch that didn't as uncovered
+fun testLineCoverage() {
+  eprintln("testLineCoverage")
+
+  // The line of the untaken branch, found before coverage starts so that it stays uncovered
+  val uncoveredLine = Covered.branch(false)
+
+  LineCoverage.reset()
+  LineCoverage.start(Covered::class.java)
+  val coveredLine = Covered.branch(true)
+  LineCoverage.stop()
+
+  val method = highlander(LineCoverage.snapshot().filter {
+    it.className == Covered::class.java.name && it.methodName == "branch"
+  })
+  check(method.lines[coveredLine] == true)
+  check(method.lines[uncoveredLine] == false)
+  LineCoverage.reset()
+}
+
+// The line number of the caller
+fun callerLine() = Throwable().stackTrace[1].lineNumber
+
 fun testTrace() {
   eprintln("testTrace")
 
@@ -105,6 +429,44 @@ object Foo {
   fun bar(baz: Int) {}
 
   fun bar(baz: Int, taz: String) { }
+
+  fun isTrue() = true
+  fun bigInt() = 123456789
+  fun bigLong() = 1234567890123L
+  fun half() = 0.5
+  fun letter() = 'x'
+  fun name() = "foo"
+
+  fun logged(count: Int, ratio: Double) {}
+
+  @JvmStatic
+  fun staticBaz() = 42
+}
+
+object Stepper {
+  fun outer(): Int {
+    val sum = inner() + other()
+    return sum * 2
+  }
+
+  fun inner() = 1
+  fun other() = 2
+}
+
+object Covered {
+  fun branch(flag: Boolean): Int {
+    if (flag) {
+      return callerLine()
+    }
+    return callerLine()
+  }
+}
+
+class Watched {
+  @JvmField var count = 0
+  @JvmField var ratio = 0.1f
+  @JvmField var total = 1e-300
+  @JvmField var label: Any? = null
 }
 
 class Bar(val baz: Int) {
@@ -1,11 +1,27 @@
+#include <cerrno>
 #include <cstddef>
 #include <fcntl.h>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/system_properties.h>
+#include <tuple>
 #include <unistd.h>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 #define LOG_TAG "stoic"
 
@@ -18,6 +34,7 @@
 #include <jni.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "jvmti.h"
 
@@ -28,34 +45,49 @@
 // Note: Art jvmti capabilities are documented here:
 // https://android.googlesource.com/platform/art/+/refs/heads/main/openjdkjvmti/art_jvmti.h#256
 
+// The primitive JVM types, as V(type, type char, jvalue member). This is used to generate the typed
+// nativeCallbackOnMethodExit<type> upcalls so that primitive return values reach Kotlin without
+// being boxed.
+#define FOR_EACH_PRIMITIVE_TYPE(V) \
+  V(Z, 'Z', z) \
+  V(B, 'B', b) \
+  V(C, 'C', c) \
+  V(S, 'S', s) \
+  V(I, 'I', i) \
+  V(J, 'J', j) \
+  V(F, 'F', f) \
+  V(D, 'D', d)
+
 //using namespace std;
 //
 typedef struct {
   jvmtiEnv *jvmti;
   jclass stoicJvmtiVmClass;
+
+  // The thread of Looper.getMainLooper()
+  jthread mainThread;
+
+  // A second jvmtiEnv whose tags belong to the ClassTagIndex
+  jvmtiEnv* classTagJvmti;
+
+  // android.os.Message stuff
+  jfieldID messageWhat;
+  jfieldID messageCallback;
  
   // callbacks
   jmethodID nativeCallbackOnBreakpoint;
   jmethodID nativeCallbackOnMethodEntry;
-  jmethodID nativeCallbackOnMethodExit;
- 
-  // boxing stuff
-  jclass booleanClass;
-  jclass byteClass;
-  jclass characterClass;
-  jclass shortClass;
-  jclass integerClass;
-  jclass longClass;
-  jclass floatClass;
-  jclass doubleClass;
-  jmethodID booleanCtor;
-  jmethodID byteCtor;
-  jmethodID characterCtor;
-  jmethodID shortCtor;
-  jmethodID integerCtor;
-  jmethodID longCtor;
-  jmethodID floatCtor;
-  jmethodID doubleCtor;
+
+  // One nativeCallbackOnMethodExit<type> per return type - see FOR_EACH_PRIMITIVE_TYPE
+#define DECLARE_METHOD_EXIT_CALLBACK(type, typeChar, member) jmethodID nativeCallbackOnMethodExit##type;
+  FOR_EACH_PRIMITIVE_TYPE(DECLARE_METHOD_EXIT_CALLBACK)
+#undef DECLARE_METHOD_EXIT_CALLBACK
+  jmethodID nativeCallbackOnMethodExitL;
+  jmethodID nativeCallbackOnMethodExitV;
+  jmethodID nativeCallbackOnFramePop;
+  jmethodID nativeCallbackOnException;
+  jmethodID nativeCallbackOnFieldWatch;
+  jmethodID nativeCallbackOnStep;
  
   // com.squareup.stoic.jvmti.JvmtiMethod stuff
   jclass stoicJvmtiMethodClass;
@@ -90,667 +122,5633 @@ static GlobalAgentData *gdata;
 // temporarily re-enabled
 thread_local bool callbacksAllowed = true;
 
-static void
-throwJvmtiError(JNIEnv* jni, int result, const char* desc) {
-  ScopedLocalRef<jclass> jvmtiExceptionClass(jni, jni->FindClass("com/squareup/stoic/jvmti/JvmtiException"));
-  CHECK(jvmtiExceptionClass.get() != NULL);
-  jmethodID ctor = jni->GetMethodID(jvmtiExceptionClass.get(), "<init>", "(ILjava/lang/String;)V");
-  CHECK(ctor != NULL);
-  ScopedLocalRef<jstring> jdesc(jni, jni->NewStringUTF(desc));
-  ScopedLocalRef<jthrowable> exc(jni, (jthrowable) jni->NewObject(jvmtiExceptionClass.get(), ctor, result, jdesc.get()));
-  CHECK(exc.get() != NULL);
-  jni->Throw(exc.get());
-}
- 
-jvmtiIterationControl JNICALL
-jvmtiHeapObjectCallback_tagUnconditionally(jlong class_tag, jlong size, jlong* tag_ptr, void* user_data) {
-  *tag_ptr = 1;
-  return JVMTI_ITERATION_CONTINUE;
-}
-
-jvmtiIterationControl JNICALL
-jvmtiHeapObjectCallback_untagUnconditionally(jlong class_tag, jlong size, jlong* tag_ptr, void* user_data) {
-  *tag_ptr = 0;
-  return JVMTI_ITERATION_CONTINUE;
-}
-
-jint JNICALL
-jvmtiHeapIterationCallback_tagUnconditionally(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
-  *tag_ptr = *static_cast<jlong*>(user_data);
-  return 0;
-}
-
-jint JNICALL
-jvmtiHeapIterationCallback_untagUnconditionally(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
-  *tag_ptr = 0;
-  return 0;
-}
-
-JNIEXPORT jobject JNICALL
-Jvmti_VirtualMachine_nativeInstances(JNIEnv *jni, jobject vmClass, jclass klass, jboolean includeSubclasses) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-
-  // Clear all tags in the heap
-  {
-    jvmtiHeapCallbacks callbacks = {
-      .heap_iteration_callback = jvmtiHeapIterationCallback_untagUnconditionally,
-    };
+// Expensive consistency checks, enabled by building with -DSTOIC_DEBUG
+#ifdef STOIC_DEBUG
+static constexpr bool kIsDebug = true;
+#else
+static constexpr bool kIsDebug = false;
+#endif
+
+// Passed to Kotlin in place of a frame count we didn't need natively. GetFrameCount walks the
+// whole stack, so Kotlin only computes the height (via nativeGetEventFrameHeight) if something
+// actually asks for it. Must match StackFrame.UNKNOWN_HEIGHT.
+static constexpr jint kUnknownHeight = -1;
+
+// The Kotlin methods that native upcalls to with an event's frame. Used by nativeGetEventFrameHeight
+// to find the event frame beneath the upcall.
+static std::unordered_set<jmethodID> eventUpcallMethodIds;
+
+// A trie of class name prefixes, in signature form (e.g. "Lcom/example/checkout/"). Used to match
+// the signature of a method's declaring class against a set of prefixes in a single pass.
+class ClassPrefixTrie {
+ public:
+  void Add(const std::string& prefix) {
+    int node = 0;
+    for (char c : prefix) {
+      int child = FindChild(node, c);
+      if (child == -1) {
+        child = nodes.size();
+        nodes[node].children.push_back({c, child});
+        nodes.emplace_back();
+      }
+      node = child;
+    }
+    nodes[node].isTerminal = true;
+  }
 
-    CHECK_JVMTI(jvmti->IterateThroughHeap(
-          JVMTI_HEAP_FILTER_UNTAGGED,
-          nullptr,
-          &callbacks,
-          nullptr));
+  bool IsEmpty() const {
+    return nodes.size() == 1 && !nodes[0].isTerminal;
   }
 
-  if (includeSubclasses) {
-    // klassClass = java.lang.Class
-    ScopedLocalRef<jclass> klassClass(jni, jni->FindClass("java/lang/Class"));
-    if (!klassClass.get()) {
-        jni->ExceptionDescribe();
-        jni->ExceptionClear();
-        return nullptr;
+  // Whether any of the prefixes is a prefix of signature
+  bool MatchesPrefixOf(const char* signature) const {
+    int node = 0;
+    for (const char* p = signature; !nodes[node].isTerminal; ++p) {
+      if (*p == '\0') {
+        return false;
+      }
+      node = FindChild(node, *p);
+      if (node == -1) {
+        return false;
+      }
     }
+    return true;
+  }
 
-    // Tag every Class object
-    jlong tag = 1;
-    CHECK_JVMTI(jvmti->IterateOverInstancesOfClass(
-          klassClass.get(),
-          JVMTI_HEAP_OBJECT_EITHER,
-          jvmtiHeapObjectCallback_tagUnconditionally,
-          &tag));
-
-    // Iterate through every Class object, clearing the tags of classes that aren't subclasses of klass
-    jobject* obj_list;
-    jint obj_len;
-    jlong tagOne = 1;
-    CHECK_JVMTI(jvmti->GetObjectsWithTags(1, &tagOne, &obj_len, &obj_list, nullptr));
-    jmethodID method_isAssignableFrom = jni->GetMethodID(klassClass.get(), "isAssignableFrom", "(Ljava/lang/Class;)Z");
-    CHECK(method_isAssignableFrom != nullptr);
-    for (int i = 0; i < obj_len; i++) {
-      ScopedLocalRef<jobject> klassCandidate(jni, obj_list[i]);
+ private:
+  struct Node {
+    // Few nodes have more than a handful of children, so a linear scan beats a map here
+    std::vector<std::pair<char, int>> children;
+    bool isTerminal = false;
+  };
 
-      // Never throws (famous last words?)
-      jboolean isAssignable = jni->CallBooleanMethod(klass, method_isAssignableFrom, klassCandidate.get());
-      
-      if (!isAssignable) {
-        jlong tagZero = 0;
-        CHECK_JVMTI(jvmti->SetTag(klassCandidate.get(), tagZero));
+  int FindChild(int node, char c) const {
+    for (auto& child : nodes[node].children) {
+      if (child.first == c) {
+        return child.second;
       }
     }
+    return -1;
+  }
 
-    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) obj_list));
-    obj_list = NULL;
+  std::vector<Node> nodes = std::vector<Node>(1);  // The root
+};
 
-    // Tag every object whose class is tagged
-    {
-      jvmtiHeapCallbacks callbacks = {
-        .heap_iteration_callback = jvmtiHeapIterationCallback_tagUnconditionally,
-      };
-      CHECK_JVMTI(jvmti->IterateThroughHeap(
-          JVMTI_HEAP_FILTER_CLASS_UNTAGGED,
-          nullptr,
-          &callbacks,
-          &tagOne));
+// Incremented whenever a class is unloaded (see CbClassTagFree). The IDs of an unloaded class's
+// methods may be reused, so caches keyed by jmethodID that can't afford a lock compare against this
+// and start over when it changes.
+static std::atomic<uint64_t> classUnloadGeneration{0};
+
+// Restricts MethodEntry/MethodExit upcalls to the methods that a request cares about. A method
+// matches if it's included (or nothing is explicitly included) and it isn't excluded. The decision
+// for each method is cached, so after the first event for a method it costs a single lookup.
+class MethodFilter {
+ public:
+  std::unordered_set<jmethodID> includeMethods;
+  ClassPrefixTrie includeClasses;
+  std::unordered_set<jmethodID> excludeMethods;
+  ClassPrefixTrie excludeClasses;
+
+  // Decisions are cached per thread, so a repeat lookup is a single unlocked hash lookup
+  bool Matches(jvmtiEnv* jvmti, JNIEnv* jni, jmethodID methodId) {
+    DecisionCache& cache = decisionCache;
+    uint64_t generation = classUnloadGeneration.load(std::memory_order_relaxed);
+    if (cache.generation != generation || cache.decisions.size() >= kMaxCachedDecisions) {
+      cache.decisions.clear();
+      cache.generation = generation;
     }
 
-    // TODO: This wouldn't work for subclasses of java.lang.Class
-    // java.lang.Class is final so there aren't any, but if people
-    // asked for instances of java.lang.Class and subclasses, this
-    // will give the wrong answer. So I need to special-case that.
+    DecisionKey key = {id, methodId};
+    auto it = cache.decisions.find(key);
+    if (it != cache.decisions.end()) {
+      return it->second;
+    }
 
-    // Untag instances of java.lang.Class
-    CHECK_JVMTI(jvmti->IterateOverInstancesOfClass(
-          klassClass.get(),
-          JVMTI_HEAP_OBJECT_TAGGED,
-          jvmtiHeapObjectCallback_untagUnconditionally,
-          nullptr));
-  } else {
-    // tag every object whose Class is exactly klass
-    jlong tag = 1;
-    CHECK_JVMTI(jvmti->IterateOverInstancesOfClass(
-          klass,
-          JVMTI_HEAP_OBJECT_EITHER,
-          jvmtiHeapObjectCallback_tagUnconditionally,
-          &tag));
-  }
- 
-  // Get all of the tagged objects
-  jobject* obj_list;
-  jint obj_len;
-  jlong tag = 1;
-  CHECK_JVMTI(jvmti->GetObjectsWithTags(1, &tag, &obj_len, &obj_list, nullptr));
- 
-  jobjectArray klassArray = jni->NewObjectArray(obj_len, klass, NULL);
-  if (klassArray == nullptr) {
-    LOG(ERROR) << "NewObjectArray failed";
-    return nullptr;
-  }
- 
-  for (int i = 0; i < obj_len; i++) {
-    ScopedLocalRef<jobject> obj(jni, obj_list[i]);
-    jni->SetObjectArrayElement(klassArray, i, obj.get());
+    bool isMatch = Decide(jvmti, jni, methodId);
+    cache.decisions.emplace(key, isMatch);
+    return isMatch;
   }
 
-  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) obj_list));
-  obj_list = NULL;
-
-  return klassArray;
-}
-
-JNIEXPORT jobject JNICALL
-Jvmti_VirtualMachine_nativeSubclasses(JNIEnv *jni, jobject vmClass, jclass klass) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-  // TODO: verify VirtualMachine.class lock held
+ private:
+  bool Decide(jvmtiEnv* jvmti, JNIEnv* jni, jmethodID methodId) {
+    bool isIncluded = (includeMethods.empty() && includeClasses.IsEmpty()) || includeMethods.count(methodId) != 0;
+    bool isExcluded = excludeMethods.count(methodId) != 0;
+    if ((isIncluded || includeClasses.IsEmpty()) && (isExcluded || excludeClasses.IsEmpty())) {
+      // We don't need to look at the class
+      return isIncluded && !isExcluded;
+    }
 
-  // Clear all tags in the heap
-  {
-    jvmtiHeapCallbacks callbacks = {
-      .heap_iteration_callback = jvmtiHeapIterationCallback_untagUnconditionally,
-    };
+    jclass declaringClass = nullptr;
+    CHECK_JVMTI(jvmti->GetMethodDeclaringClass(methodId, &declaringClass));
+    char* signature = nullptr;
+    CHECK_JVMTI(jvmti->GetClassSignature(declaringClass, &signature, nullptr));
+    jni->DeleteLocalRef(declaringClass);
 
-    CHECK_JVMTI(jvmti->IterateThroughHeap(
-          JVMTI_HEAP_FILTER_UNTAGGED,
-          nullptr,
-          &callbacks,
-          nullptr));
-  }
+    isIncluded = isIncluded || includeClasses.MatchesPrefixOf(signature);
+    isExcluded = isExcluded || excludeClasses.MatchesPrefixOf(signature);
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) signature));
 
-  // klassClass = java.lang.Class
-  ScopedLocalRef<jclass> klassClass(jni, jni->FindClass("java/lang/Class"));
-  if (!klassClass.get()) {
-      jni->ExceptionDescribe();
-      jni->ExceptionClear();
-      return nullptr;
+    return isIncluded && !isExcluded;
   }
 
-  // Tag every Class object
-  jlong tag = 1;
-  CHECK_JVMTI(jvmti->IterateOverInstancesOfClass(
-        klassClass.get(),
-        JVMTI_HEAP_OBJECT_EITHER,
-        jvmtiHeapObjectCallback_tagUnconditionally,
-        &tag));
+  // Filters are keyed by a unique ID rather than their address, which may be reused once a filter
+  // is destroyed
+  struct DecisionKey {
+    uint64_t filterId;
+    jmethodID methodId;
 
-  // Iterate through every Class object, clearing the tags of classes that aren't subclasses of klass
-  jobject* obj_list = NULL;
-  jint obj_len = -1;
-  const jlong tagOne = 1;
-  CHECK_JVMTI(jvmti->GetObjectsWithTags(1, &tagOne, &obj_len, &obj_list, nullptr));
-  jmethodID method_isAssignableFrom = jni->GetMethodID(klassClass.get(), "isAssignableFrom", "(Ljava/lang/Class;)Z");
-  CHECK(method_isAssignableFrom != nullptr);
-  for (int i = 0; i < obj_len; i++) {
-    ScopedLocalRef<jobject> klassCandidate(jni, obj_list[i]);
+    bool operator==(const DecisionKey& other) const {
+      return filterId == other.filterId && methodId == other.methodId;
+    }
+  };
 
-    // Never throws (famous last words?)
-    jboolean isAssignable = jni->CallBooleanMethod(klass, method_isAssignableFrom, klassCandidate.get());
-    
-    if (!isAssignable) {
-      jlong tagZero = 0;
-      CHECK_JVMTI(jvmti->SetTag(klassCandidate.get(), tagZero));
+  struct DecisionKeyHash {
+    size_t operator()(const DecisionKey& key) const {
+      return std::hash<uint64_t>()(key.filterId) * 31 + std::hash<jmethodID>()(key.methodId);
     }
-  }
+  };
 
-  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) obj_list));
-  obj_list = NULL;
+  struct DecisionCache {
+    uint64_t generation = 0;
+    std::unordered_map<DecisionKey, bool, DecisionKeyHash> decisions;
+  };
 
-  // Get all of the objects tagged with 1
-  obj_len = -1;
-  CHECK_JVMTI(jvmti->GetObjectsWithTags(1, &tagOne, &obj_len, &obj_list, nullptr));
- 
-  jobjectArray klassArray = jni->NewObjectArray(obj_len, klassClass.get(), NULL);
-  if (klassArray == nullptr) {
-    LOG(ERROR) << "NewObjectArray failed";
-    return nullptr;
-  }
- 
-  for (int i = 0; i < obj_len; i++) {
-    ScopedLocalRef<jobject> obj(jni, obj_list[i]);
-    jni->SetObjectArrayElement(klassArray, i, obj.get());
-  }
+  // Each thread's cache is cleared when it reaches this size, to bound memory on threads that run a
+  // lot of distinct methods
+  static constexpr size_t kMaxCachedDecisions = 16384;
 
-  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) obj_list));
-  obj_list = NULL;
+  static inline std::atomic<uint64_t> nextId{1};
+  static thread_local DecisionCache decisionCache;
 
-  return klassArray;
-}
+  const uint64_t id = nextId++;
+};
 
-JNIEXPORT jlong JNICALL
-Jvmti_VirtualMachine_nativeGetMethodId(JNIEnv *jni, jobject vmClass, jclass clazz, jstring methodName, jstring methodSignature) {
-  const char* methodNameChars = jni->GetStringUTFChars(methodName, NULL);
-  const char* methodSignatureChars = jni->GetStringUTFChars(methodSignature, NULL);
-  jmethodID methodId = jni->GetMethodID(clazz, methodNameChars, methodSignatureChars);
-  jni->ReleaseStringUTFChars(methodName, methodNameChars);
-  jni->ReleaseStringUTFChars(methodSignature, methodSignatureChars);
+thread_local MethodFilter::DecisionCache MethodFilter::decisionCache;
+
+// Per-thread state that may be modified from other threads (e.g. when a request is closed on a
+// different thread than the one it was created on). These are stored in JVMTI thread-local storage,
+// created on demand and live as long as their thread.
+struct ThreadState {
+  // Whether Kotlin has MethodExitRequests for this thread. MethodExit events are also enabled on
+  // behalf of frame exit watches that want a return value, and in that case we only upcall for the
+  // watched frames.
+  std::atomic<bool> methodExitUpcalls{false};
+
+  // The number of frame exit watches on this thread that want a return value.
+  int methodExitWatches = 0;
+
+  // Whether Kotlin has MethodEntryRequests for this thread. MethodEntry is also enabled while a step
+  // on this thread is tracking its height, in which case we only upcall if Kotlin wants it.
+  std::atomic<bool> methodEntryUpcalls{false};
+  bool stepWantsMethodEntries = false;
+
+  // The filters of the thread's MethodEntryRequests/MethodExitRequests, where nullptr means that a
+  // request is unfiltered. Kotlin only destroys a filter after removing it from here, and we hold
+  // filterMutex while filtering, so an event never sees a destroyed filter.
+  std::mutex filterMutex;
+  std::vector<MethodFilter*> methodEntryFilters;
+  std::vector<MethodFilter*> methodExitFilters;
+
+  // Whether any request wants an upcall for methodId
+  bool PassesFilters(jvmtiEnv* jvmti, JNIEnv* jni, const std::vector<MethodFilter*>& filters, jmethodID methodId) {
+    std::lock_guard<std::mutex> lock(filterMutex);
+    for (MethodFilter* filter : filters) {
+      if (filter == nullptr || filter->Matches(jvmti, jni, methodId)) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
 
-  return (jlong) methodId;
-}
+// Guards creating ThreadStates and enabling/disabling events based on their contents
+static std::mutex threadStateMutex;
 
-JNIEXPORT void JNICALL
-Jvmti_VirtualMachine_nativeSetBreakpoint(JNIEnv *jni, jobject vmClass, jlong methodId, jlong location) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-  jmethodID castMethodId = reinterpret_cast<jmethodID>(methodId);
-  JVMTI_THROW_IF_ERROR(jvmti->SetBreakpoint(castMethodId, location), ;);
-}
+// The current thread's ThreadState, cached to avoid GetThreadLocalStorage on hot paths
+thread_local ThreadState* currentThreadState = nullptr;
 
-JNIEXPORT void JNICALL
-Jvmti_VirtualMachine_nativeClearBreakpoint(JNIEnv *jni, jobject vmClass, jlong methodId, jlong location) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-  CHECK_JVMTI(jvmti->ClearBreakpoint((jmethodID) methodId, (jlocation) location));
-}
+// A frame that we've called NotifyFramePop for on behalf of StackFrame.onExit
+struct FrameExitWatch {
+  jmethodID methodId;
+  jint height;
+  bool wantsReturnValue;
 
-JNIEXPORT void JNICALL
-Jvmti_VirtualMachine_nativeGetMethodCoreMetadata(JNIEnv *jni, jobject vmClass, jobject jvmtiMethod) {
-  jvmtiEnv* jvmti = gdata->jvmti;
+  // Set when the return value has been delivered via MethodExit (which ART reports before FramePop)
+  bool delivered;
+};
 
-  jlong longMethodId = jni->GetLongField(jvmtiMethod, gdata->stoicJvmtiMethodMethodId);
-  jmethodID castMethodId = reinterpret_cast<jmethodID>(longMethodId);
+// Watches are only ever armed on the current thread, and only ever fire on the thread that armed
+// them, so these don't need any locking.
+thread_local std::vector<FrameExitWatch> frameExitWatches;
 
-  char* name = NULL;
-  char* signature = NULL;
-  char* generic = NULL;
-  CHECK_JVMTI(jvmti->GetMethodName(castMethodId, &name, &signature, &generic));
-  ScopedLocalRef<jstring> jname(jni, jni->NewStringUTF(name));
-  ScopedLocalRef<jstring> jsignature(jni, jni->NewStringUTF(signature));
-  ScopedLocalRef<jstring> jgeneric(jni, jni->NewStringUTF(generic));
+// The consumers of a JVMTI breakpoint. Kotlin BreakpointRequests and native instrumentation may
+// share a location, so the breakpoint is only set when its first consumer arrives and only cleared
+// when its last consumer leaves.
+struct BreakpointSite {
+  // Kotlin has at least one BreakpointRequest here, so CbBreakpoint upcalls
+  bool hasKotlinRequests = false;
 
-  jlocation startLocation = -1;
-  jlocation endLocation = -1;
+  // The method timing profiler uses this as the entry of a profiled method
+  bool isProfilerEntry = false;
 
-  jvmtiError error = JVMTI_ERROR_NONE;
-  error = jvmti->GetMethodLocation(castMethodId, &startLocation, &endLocation);
-  if (error != JVMTI_ERROR_NATIVE_METHOD) { CHECK_JVMTI(error); }
+  // The start of Handler.dispatchMessage, used by the jank watchdog and looper stats
+  bool isMainLooperDispatch = false;
 
-  jint argsSize = -1;
-  error = jvmti->GetArgumentsSize(castMethodId, &argsSize);
-  if (error != JVMTI_ERROR_NATIVE_METHOD) { CHECK_JVMTI(error); }
+  // A line start whose first execution hasn't been recorded by coverage yet
+  bool isCoverageProbe = false;
 
-  jint maxLocals = -1;
-  error = jvmti->GetMaxLocals(castMethodId, &maxLocals);
-  if (error != JVMTI_ERROR_NATIVE_METHOD) { CHECK_JVMTI(error); }
+  // At least one LogPoint captures here
+  bool isLogPoint = false;
 
-  jint modifiers = -1;
-  CHECK_JVMTI(jvmti->GetMethodModifiers(castMethodId, &modifiers));
+  bool IsUnused() const {
+    return !hasKotlinRequests && !isProfilerEntry && !isMainLooperDispatch && !isCoverageProbe && !isLogPoint;
+  }
+};
 
-  jclass declaringClass = nullptr;
-  CHECK_JVMTI(jvmti->GetMethodDeclaringClass(castMethodId, &declaringClass));
+typedef bool BreakpointSite::*BreakpointConsumer;
+
+static std::mutex breakpointSitesMutex;
+static std::map<std::pair<jmethodID, jlocation>, BreakpointSite> breakpointSites;
+
+// If isNewlyAcquired is non-null, it's set to whether consumer wasn't already using the site, i.e.
+// whether the caller owns the release
+static jvmtiError
+AcquireBreakpointSite(
+    jvmtiEnv* jvmti,
+    jmethodID methodId,
+    jlocation location,
+    BreakpointConsumer consumer,
+    bool* isNewlyAcquired = nullptr) {
+  std::lock_guard<std::mutex> lock(breakpointSitesMutex);
+  auto key = std::make_pair(methodId, location);
+  auto it = breakpointSites.find(key);
+  if (it == breakpointSites.end()) {
+    jvmtiError error = jvmti->SetBreakpoint(methodId, location);
+    if (error != JVMTI_ERROR_NONE) {
+      return error;
+    }
+    it = breakpointSites.emplace(key, BreakpointSite()).first;
+  }
+  if (isNewlyAcquired != nullptr) {
+    *isNewlyAcquired = !(it->second.*consumer);
+  }
+  it->second.*consumer = true;
+  return JVMTI_ERROR_NONE;
+}
+
+static void
+ReleaseBreakpointSite(jvmtiEnv* jvmti, jmethodID methodId, jlocation location, BreakpointConsumer consumer) {
+  std::lock_guard<std::mutex> lock(breakpointSitesMutex);
+  auto it = breakpointSites.find(std::make_pair(methodId, location));
+  if (it == breakpointSites.end()) {
+    return;
+  }
+  it->second.*consumer = false;
+  if (it->second.IsUnused()) {
+    CHECK_JVMTI(jvmti->ClearBreakpoint(methodId, location));
+    breakpointSites.erase(it);
+  }
+}
+
+static BreakpointSite
+GetBreakpointSite(jmethodID methodId, jlocation location) {
+  std::lock_guard<std::mutex> lock(breakpointSitesMutex);
+  auto it = breakpointSites.find(std::make_pair(methodId, location));
+  return it == breakpointSites.end() ? BreakpointSite() : it->second;
+}
+
+static jlong
+MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<jlong>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// A log-linear (HDR-style) histogram of durations in nanoseconds. Values are bucketed by their
+// power of two, and each power of two is split into kSubBuckets linear sub-buckets, so every
+// recorded value is within 1/kSubBuckets of its bucket's bounds. Recording is lock-free.
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  static constexpr int kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  void Record(jlong nanos) {
+    uint64_t value = nanos < 0 ? 0 : nanos;
+    buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t prevMax = max.load(std::memory_order_relaxed);
+    while (value > prevMax && !max.compare_exchange_weak(prevMax, value, std::memory_order_relaxed)) {}
+    uint64_t prevMin = min.load(std::memory_order_relaxed);
+    while (value < prevMin && !min.compare_exchange_weak(prevMin, value, std::memory_order_relaxed)) {}
+  }
+
+  void Reset() {
+    for (auto& bucket : buckets) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+    min.store(UINT64_MAX, std::memory_order_relaxed);
+  }
+
+  // Appends [count, sum, min, max, N, (bucket upper bound, bucket count) * N] where only the
+  // non-empty buckets are included
+  void AppendTo(std::vector<jlong>* out) const {
+    uint64_t snapshotCount = count.load(std::memory_order_relaxed);
+    out->push_back(snapshotCount);
+    out->push_back(sum.load(std::memory_order_relaxed));
+    out->push_back(snapshotCount == 0 ? 0 : min.load(std::memory_order_relaxed));
+    out->push_back(max.load(std::memory_order_relaxed));
+    size_t sizeIndex = out->size();
+    out->push_back(0);
+    for (int i = 0; i < kBuckets; i++) {
+      uint64_t bucketCount = buckets[i].load(std::memory_order_relaxed);
+      if (bucketCount != 0) {
+        out->push_back(BucketUpperBound(i));
+        out->push_back(bucketCount);
+        (*out)[sizeIndex]++;
+      }
+    }
+  }
+
+ private:
+  static int BucketIndex(uint64_t value) {
+    if (value < kSubBuckets) {
+      return value;
+    }
+    int shift = (63 - __builtin_clzll(value)) - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
+  }
+
+  // The largest value that maps to the bucket at index
+  static jlong BucketUpperBound(int index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    int shift = index / kSubBuckets - 1;
+    uint64_t subBucket = index % kSubBuckets;
+    uint64_t lowerBound = (kSubBuckets + subBucket) << shift;
+    return static_cast<jlong>(lowerBound + ((1ULL << shift) - 1));
+  }
+
+  std::atomic<uint64_t> buckets[kBuckets] = {};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> min{UINT64_MAX};
+  std::atomic<uint64_t> max{0};
+};
+
+// A method whose durations are recorded by the timing profiler. These are never freed (only reset),
+// so the hot path can record into one without holding profiledMethodsMutex.
+struct ProfiledMethod {
+  jmethodID methodId;
+  jlocation entryLocation;
+  bool isEnabled = false;
+  LatencyHistogram histogram;
+};
+
+static std::mutex profiledMethodsMutex;
+static std::unordered_map<jmethodID, ProfiledMethod*> profiledMethods;
+
+// An entry of a profiled method that hasn't exited yet
+struct ShadowFrame {
+  ProfiledMethod* method;
+  jint height;
+  jlong startNanos;
+};
+
+// The profiled frames that are running on the current thread, innermost last. Timing is entirely
+// native - the profiler never calls into Kotlin.
+thread_local std::vector<ShadowFrame> profilerShadowStack;
+
+// What a sampled thread was doing, as far as JVMTI can tell. The order must match
+// com.squareup.stoic.profiler.SampledThreadState.
+enum SampledThreadState {
+  kSampledRunnable,
+  kSampledBlockedOnMonitor,
+  kSampledWaiting,
+  kSampledSleeping,
+  kSampledThreadStateCount,
+};
+
+// Returns kSampledThreadStateCount for threads that aren't alive
+static SampledThreadState
+ToSampledThreadState(jint state) {
+  // Note: SLEEPING threads are also WAITING, so it's checked first
+  if ((state & JVMTI_THREAD_STATE_SLEEPING) != 0) {
+    return kSampledSleeping;
+  } else if ((state & JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER) != 0) {
+    return kSampledBlockedOnMonitor;
+  } else if ((state & JVMTI_THREAD_STATE_WAITING) != 0) {
+    return kSampledWaiting;
+  } else if ((state & JVMTI_THREAD_STATE_RUNNABLE) != 0) {
+    return kSampledRunnable;
+  }
+  return kSampledThreadStateCount;
+}
+
+// A trie of sampled stacks, keyed by (method, location) from the outermost frame inwards
+class CallTree {
+ public:
+  // frames are innermost first, as JVMTI reports them. Each sample stands for the wall-clock time
+  // since the previous one.
+  void Add(const jvmtiFrameInfo* frames, jint frameCount, SampledThreadState state, jlong micros) {
+    int node = 0;
+    for (jint i = frameCount - 1; i >= 0; i--) {
+      node = GetOrAddChild(node, frames[i].method, frames[i].location);
+    }
+    nodes[node].samples++;
+    nodes[node].stateMicros[state] += micros;
+  }
+
+  void Clear() {
+    nodes.resize(1);
+    nodes[0] = Node{nullptr, -1, -1};
+  }
+
+  // The number of nodes that AppendTo appends
+  size_t NodeCount() const {
+    return nodes.size() - 1;
+  }
+
+  // Appends [parent index, methodId, location, samples, stateMicros * kSampledThreadStateCount] for
+  // every node other than the root, in an order where parents always precede their children. The
+  // root has index -1, and the other nodes are numbered in the order they're appended.
+  void AppendTo(std::vector<jlong>* out) const {
+    for (size_t i = 1; i < nodes.size(); i++) {
+      const Node& node = nodes[i];
+      out->push_back(node.parent - 1);
+      out->push_back(reinterpret_cast<jlong>(node.methodId));
+      out->push_back(node.location);
+      out->push_back(node.samples);
+      for (uint64_t micros : node.stateMicros) {
+        out->push_back(micros);
+      }
+    }
+  }
+
+ private:
+  struct Node {
+    jmethodID methodId;
+    jlocation location;
+    int parent;
+    // The number of samples where this was the innermost frame
+    uint64_t samples = 0;
+    // The wall-clock time of those samples, by the state of the thread
+    uint64_t stateMicros[kSampledThreadStateCount] = {};
+    std::vector<int> children;
+  };
+
+  int GetOrAddChild(int node, jmethodID methodId, jlocation location) {
+    for (int child : nodes[node].children) {
+      if (nodes[child].methodId == methodId && nodes[child].location == location) {
+        return child;
+      }
+    }
+    int child = nodes.size();
+    nodes[node].children.push_back(child);
+    nodes.push_back({methodId, location, node});
+    return child;
+  }
+
+  std::vector<Node> nodes = std::vector<Node>(1, Node{nullptr, -1, -1});  // The root
+};
+
+// A message that took longer than the jank threshold, along with main thread stacks sampled after
+// the threshold was crossed
+struct JankReport {
+  jlong startNanos;
+  jlong durationNanos;
+  CallTree tree;
+};
+
+// Watches the main looper for messages that take too long to dispatch. The main thread marks the
+// start and end of each message (via a breakpoint at Handler.dispatchMessage and its FramePop), and
+// a watchdog thread samples the main thread's stack once a message exceeds the threshold.
+struct JankWatchdog {
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // These are guarded by mutex
+  bool isEnabled = false;
+  jlong thresholdNanos = 0;
+  jint sampleIntervalMicros = 0;
+
+  // The message being dispatched, if messageStartNanos != 0
+  uint64_t messageSeq = 0;
+  jlong messageStartNanos = 0;
+  bool isMessageSlow = false;
+  CallTree messageTree;
+
+  // Completed reports, oldest first, waiting to be polled by Kotlin
+  std::deque<JankReport> reports;
+};
+
+static constexpr size_t kMaxJankReports = 32;
+
+static JankWatchdog jankWatchdog;
+
+// Gives each class we've seen a small, stable ID, stored as its tag in a jvmtiEnv of its own (so
+// that it isn't disturbed by nativeInstances, which clears the tags of gdata->jvmti). Once a class
+// has an ID, looking it up is a single GetTag, so native aggregations can key by class without
+// fetching signatures on hot paths.
+class ClassTagIndex {
+ public:
+  // Returns the ID of klass, assigning one if needed. IDs start at 1.
+  jlong GetClassId(jvmtiEnv* tagJvmti, jvmtiEnv* jvmti, jclass klass) {
+    jlong tag = 0;
+    CHECK_JVMTI(tagJvmti->GetTag(klass, &tag));
+    if (tag != 0) {
+      return tag;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // Another thread may have gotten here first
+    CHECK_JVMTI(tagJvmti->GetTag(klass, &tag));
+    if (tag != 0) {
+      return tag;
+    }
+
+    char* signature = nullptr;
+    CHECK_JVMTI(jvmti->GetClassSignature(klass, &signature, nullptr));
+    signatures.push_back(signature);
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) signature));
+    tag = signatures.size();
+    CHECK_JVMTI(tagJvmti->SetTag(klass, tag));
+    return tag;
+  }
+
+  // Returns the signature of the class with the given ID (e.g. "Ljava/lang/String;"), or "" if the
+  // ID is unknown
+  std::string GetSignature(jlong classId) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (classId < 1 || classId > (jlong) signatures.size()) {
+      return "";
+    }
+    return signatures[classId - 1];
+  }
+
+ private:
+  std::mutex mutex;
+  std::vector<std::string> signatures;
+};
+
+static ClassTagIndex classTagIndex;
+
+// Line number tables, fetched once per method. Methods without line numbers (e.g. native methods or
+// stripped classes) cache an empty table.
+class LineTableCache {
+ public:
+  // Returns the line containing location, or -1 if unknown. Sets *isLineStart if location is the
+  // first location of a line table entry.
+  jint GetLine(jvmtiEnv* jvmti, jmethodID methodId, jlocation location, bool* isLineStart) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const std::vector<jvmtiLineNumberEntry>& table = GetTableLocked(jvmti, methodId);
+
+    // The table is sorted by start_location, so find the last entry starting at or before location
+    auto it = std::upper_bound(
+        table.begin(), table.end(), location,
+        [](jlocation loc, const jvmtiLineNumberEntry& entry) { return loc < entry.start_location; });
+    if (it == table.begin()) {
+      *isLineStart = false;
+      return -1;
+    }
+    --it;
+    *isLineStart = it->start_location == location;
+    return it->line_number;
+  }
+
+  // Returns a copy of the method's line table, sorted by start_location
+  std::vector<jvmtiLineNumberEntry> GetTable(jvmtiEnv* jvmti, jmethodID methodId) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return GetTableLocked(jvmti, methodId);
+  }
+
+  // Seeds the cache with a table from the symbol index, unless the method already has one. entries
+  // must be sorted by start_location.
+  void Put(jmethodID methodId, std::vector<jvmtiLineNumberEntry> entries) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tables.emplace(methodId, std::move(entries));
+  }
+
+  // Forgets the tables of methods whose class was unloaded, since their IDs may be reused
+  void Erase(const std::vector<jmethodID>& methodIds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (jmethodID methodId : methodIds) {
+      tables.erase(methodId);
+    }
+  }
+
+ private:
+  const std::vector<jvmtiLineNumberEntry>& GetTableLocked(jvmtiEnv* jvmti, jmethodID methodId) {
+    auto it = tables.find(methodId);
+    if (it != tables.end()) {
+      return it->second;
+    }
+
+    std::vector<jvmtiLineNumberEntry>& table = tables[methodId];
+    jint entryCount = 0;
+    jvmtiLineNumberEntry* entries = nullptr;
+    if (jvmti->GetLineNumberTable(methodId, &entryCount, &entries) == JVMTI_ERROR_NONE) {
+      table.assign(entries, entries + entryCount);
+      CHECK_JVMTI(jvmti->Deallocate((unsigned char*) entries));
+      std::sort(
+          table.begin(), table.end(),
+          [](const jvmtiLineNumberEntry& a, const jvmtiLineNumberEntry& b) { return a.start_location < b.start_location; });
+    }
+    return table;
+  }
+
+  std::mutex mutex;
+
+  // Guarded by mutex
+  std::unordered_map<jmethodID, std::vector<jvmtiLineNumberEntry>> tables;
+};
+
+static LineTableCache lineTableCache;
+
+// The start of a line within a method
+struct LineLocation {
+  jint line;
+  jmethodID methodId;
+  jlocation location;
+
+  bool operator<(const LineLocation& other) const {
+    return std::tie(line, methodId, location) < std::tie(other.line, other.methodId, other.location);
+  }
+};
+
+struct ClassLines {
+  // Empty if the class has no SourceFile attribute
+  std::string sourceFile;
+
+  // Sorted by line. A line may have several locations, e.g. if it contains a lambda or if the
+  // compiler duplicated code (as in finally blocks).
+  std::vector<LineLocation> locations;
+};
+
+// Per-class line index, built from the line tables of all of the class's methods. Classes are keyed
+// by their ClassTagIndex ID.
+class LineIndex {
+ public:
+  std::shared_ptr<const ClassLines> Get(jvmtiEnv* jvmti, JNIEnv* jni, jclass klass) {
+    jlong classId = classTagIndex.GetClassId(gdata->classTagJvmti, jvmti, klass);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = classes.find(classId);
+      if (it != classes.end()) {
+        return it->second;
+      }
+    }
+
+    // Built outside of the lock - if two threads race then they'll build identical indexes
+    std::shared_ptr<ClassLines> lines = Build(jvmti, klass);
+    std::lock_guard<std::mutex> lock(mutex);
+    classes[classId] = lines;
+    return lines;
+  }
+
+  // Forgets an unloaded class, adding its methods to *methodIds
+  void Invalidate(jlong classId, std::vector<jmethodID>* methodIds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = classes.find(classId);
+    if (it == classes.end()) {
+      return;
+    }
+    for (const LineLocation& location : it->second->locations) {
+      methodIds->push_back(location.methodId);
+    }
+    classes.erase(it);
+  }
+
+ private:
+  static std::shared_ptr<ClassLines> Build(jvmtiEnv* jvmti, jclass klass) {
+    std::shared_ptr<ClassLines> lines = std::make_shared<ClassLines>();
+
+    char* sourceFile = nullptr;
+    if (jvmti->GetSourceFileName(klass, &sourceFile) == JVMTI_ERROR_NONE) {
+      lines->sourceFile = sourceFile;
+      CHECK_JVMTI(jvmti->Deallocate((unsigned char*) sourceFile));
+    }
+
+    jint methodCount = 0;
+    jmethodID* methods = nullptr;
+    CHECK_JVMTI(jvmti->GetClassMethods(klass, &methodCount, &methods));
+    for (jint i = 0; i < methodCount; i++) {
+      for (const jvmtiLineNumberEntry& entry : lineTableCache.GetTable(jvmti, methods[i])) {
+        lines->locations.push_back({entry.line_number, methods[i], entry.start_location});
+      }
+    }
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) methods));
+
+    std::sort(lines->locations.begin(), lines->locations.end());
+    return lines;
+  }
+
+  std::mutex mutex;
+
+  // Guarded by mutex
+  std::unordered_map<jlong, std::shared_ptr<const ClassLines>> classes;
+};
+
+static LineIndex lineIndex;
+
+// The symbol index: the metadata and line tables of every class seen by a full scan
+// (nativeBuildSymbolIndex), saved in stoicDir so that later attaches to the same app can skip
+// fetching them from JVMTI. The file is
+//   SymbolIndexHeader
+//   SymbolIndexClass[classCount], sorted by signature
+//   SymbolIndexMethod[methodCount]
+//   SymbolIndexField[fieldCount]
+//   SymbolIndexLine[lineCount]
+//   stringBytes of NUL-terminated strings
+// with each section starting 8-byte aligned. Strings are referred to by their offset.
+static constexpr uint32_t kSymbolIndexMagic = 0x49535453;  // "STSI"
+static constexpr uint32_t kSymbolIndexVersion = 2;
+static constexpr uint32_t kSymbolIndexNoString = UINT32_MAX;
+
+struct SymbolIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  // See SymbolIndexKey
+  uint64_t key;
+  // The number of classes loaded at the time of the scan
+  uint32_t loadedClassCount;
+  uint32_t classCount;
+  uint32_t methodCount;
+  uint32_t fieldCount;
+  uint32_t lineCount;
+  uint32_t stringBytes;
+};
+
+struct SymbolIndexClass {
+  uint32_t signature;
+  uint32_t firstMethod;
+  uint32_t methodCount;
+  uint32_t firstField;
+  uint32_t fieldCount;
+};
+
+// Methods and fields are in the order JVMTI returned them, which is fixed for a given APK
+struct SymbolIndexMethod {
+  int64_t startLocation;
+  int64_t endLocation;
+  uint32_t name;
+  uint32_t signature;
+  uint32_t generic;
+  int32_t argsSize;
+  int32_t maxLocals;
+  int32_t modifiers;
+  uint32_t firstLine;
+  uint32_t lineCount;
+};
+
+struct SymbolIndexField {
+  uint32_t name;
+  uint32_t signature;
+  uint32_t generic;
+  int32_t modifiers;
+};
+
+struct SymbolIndexLine {
+  int64_t startLocation;
+  int32_t line;
+  int32_t padding;
+};
+
+static size_t
+AlignSymbolIndexOffset(size_t offset) {
+  return (offset + 7) & ~static_cast<size_t>(7);
+}
+
+// The section offsets of an index with the counts in header. Returns the total size.
+static size_t
+GetSymbolIndexLayout(const SymbolIndexHeader& header, size_t* classes, size_t* methods, size_t* fields, size_t* lines, size_t* strings) {
+  *classes = AlignSymbolIndexOffset(sizeof(SymbolIndexHeader));
+  *methods = AlignSymbolIndexOffset(*classes + header.classCount * sizeof(SymbolIndexClass));
+  *fields = AlignSymbolIndexOffset(*methods + header.methodCount * sizeof(SymbolIndexMethod));
+  *lines = AlignSymbolIndexOffset(*fields + header.fieldCount * sizeof(SymbolIndexField));
+  *strings = AlignSymbolIndexOffset(*lines + header.lineCount * sizeof(SymbolIndexLine));
+  return *strings + header.stringBytes;
+}
+
+// A hash of the content of the app's APKs (including splits), found via /proc/self/maps. Rather
+// than reading whole APKs, it hashes each zip's central directory, which holds the CRC of every
+// entry. Returns 0 if no APK is mapped.
+static uint64_t
+ApkContentHash() {
+  std::vector<std::string> apkPaths;
+  std::ifstream maps("/proc/self/maps");
+  std::string line;
+  while (std::getline(maps, line)) {
+    size_t pathStart = line.find('/');
+    if (pathStart != std::string::npos && line.size() > 4 && line.compare(line.size() - 4, 4, ".apk") == 0) {
+      apkPaths.push_back(line.substr(pathStart));
+    }
+  }
+  std::sort(apkPaths.begin(), apkPaths.end());
+  apkPaths.erase(std::unique(apkPaths.begin(), apkPaths.end()), apkPaths.end());
+
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash](const uint8_t* bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+  };
+
+  bool foundApk = false;
+  for (const std::string& path : apkPaths) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      continue;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= 22) {
+      // The end of central directory record is the last 22 bytes plus a comment of up to 64K
+      size_t tailSize = std::min<size_t>(st.st_size, 22 + 0xffff);
+      std::vector<uint8_t> tail(tailSize);
+      if (pread(fd, tail.data(), tailSize, st.st_size - tailSize) == (ssize_t) tailSize) {
+        for (size_t i = tailSize - 22; i != (size_t) -1; i--) {
+          uint32_t signature;
+          memcpy(&signature, &tail[i], 4);
+          if (signature != 0x06054b50) {
+            continue;
+          }
+          uint32_t cdSize;
+          uint32_t cdOffset;
+          memcpy(&cdSize, &tail[i + 12], 4);
+          memcpy(&cdOffset, &tail[i + 16], 4);
+          std::vector<uint8_t> cd(cdSize);
+          if (pread(fd, cd.data(), cdSize, cdOffset) == (ssize_t) cdSize) {
+            mix(cd.data(), cd.size());
+            foundApk = true;
+          }
+          break;
+        }
+      }
+    }
+    close(fd);
+  }
+
+  return foundApk ? hash : 0;
+}
+
+// The key that a symbol index must match to be loaded: ApkContentHash mixed with the build
+// fingerprint, since the index also holds boot classes, which change with system updates. Returns 0
+// if no APK is mapped.
+static uint64_t
+SymbolIndexKey() {
+  uint64_t hash = ApkContentHash();
+  if (hash == 0) {
+    return 0;
+  }
+  char fingerprint[PROP_VALUE_MAX] = {};
+  __system_property_get("ro.build.fingerprint", fingerprint);
+  for (const char* p = fingerprint; *p != '\0'; p++) {
+    hash = (hash ^ static_cast<uint8_t>(*p)) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// A symbol index mapped from disk. It's loaded once, at startup, and read-only after that.
+class SymbolIndex {
+ public:
+  // Maps the index at path if it's valid and was built with the given SymbolIndexKey. Returns
+  // whether it was loaded.
+  //
+  // The index isn't rejected when more classes are loaded now than when it was built: a
+  // long-running app almost always will have, and classes missing from the index just fall back to
+  // JVMTI. The loaded class count only decides whether nativeBuildSymbolIndex rewrites the index.
+  bool Load(const std::string& path, uint64_t key) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(SymbolIndexHeader)) {
+      mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      return false;
+    }
+
+    const uint8_t* base = static_cast<const uint8_t*>(mapped);
+    const SymbolIndexHeader* header = reinterpret_cast<const SymbolIndexHeader*>(base);
+    size_t classes, methods, fields, lines, strings;
+    if (header->magic != kSymbolIndexMagic || header->version != kSymbolIndexVersion ||
+        header->key != key ||
+        GetSymbolIndexLayout(*header, &classes, &methods, &fields, &lines, &strings) != (size_t) st.st_size ||
+        header->stringBytes == 0 || base[st.st_size - 1] != '\0') {
+      munmap(mapped, st.st_size);
+      return false;
+    }
+
+    header_ = header;
+    classes_ = reinterpret_cast<const SymbolIndexClass*>(base + classes);
+    methods_ = reinterpret_cast<const SymbolIndexMethod*>(base + methods);
+    fields_ = reinterpret_cast<const SymbolIndexField*>(base + fields);
+    lines_ = reinterpret_cast<const SymbolIndexLine*>(base + lines);
+    strings_ = reinterpret_cast<const char*>(base + strings);
+    return true;
+  }
+
+  bool IsLoaded() const {
+    return header_ != nullptr;
+  }
+
+  uint32_t LoadedClassCount() const {
+    return header_->loadedClassCount;
+  }
+
+  // Returns the class with the given signature, or null if it isn't in the index (or the index
+  // isn't loaded)
+  const SymbolIndexClass* FindClass(const std::string& signature) const {
+    if (header_ == nullptr) {
+      return nullptr;
+    }
+    const SymbolIndexClass* end = classes_ + header_->classCount;
+    const SymbolIndexClass* it = std::lower_bound(
+        classes_, end, signature,
+        [this](const SymbolIndexClass& entry, const std::string& sig) { return strcmp(String(entry.signature), sig.c_str()) < 0; });
+    if (it == end || signature != String(it->signature)) {
+      return nullptr;
+    }
+    return CheckClass(*it) ? it : nullptr;
+  }
+
+  const SymbolIndexMethod& Method(uint32_t index) const { return methods_[index]; }
+  const SymbolIndexField& Field(uint32_t index) const { return fields_[index]; }
+  const SymbolIndexLine& Line(uint32_t index) const { return lines_[index]; }
+
+  // Returns null for kSymbolIndexNoString. Offsets past the end of the strings read as "", so a
+  // corrupt index can't send us off the end of the mapping.
+  const char* String(uint32_t offset) const {
+    if (offset == kSymbolIndexNoString) {
+      return nullptr;
+    }
+    return offset < header_->stringBytes ? strings_ + offset : "";
+  }
+
+ private:
+  // Checks that a class's members and their lines are within the index
+  bool CheckClass(const SymbolIndexClass& entry) const {
+    if ((uint64_t) entry.firstMethod + entry.methodCount > header_->methodCount ||
+        (uint64_t) entry.firstField + entry.fieldCount > header_->fieldCount) {
+      return false;
+    }
+    for (uint32_t i = 0; i < entry.methodCount; i++) {
+      const SymbolIndexMethod& method = methods_[entry.firstMethod + i];
+      if ((uint64_t) method.firstLine + method.lineCount > header_->lineCount) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const SymbolIndexHeader* header_ = nullptr;
+  const SymbolIndexClass* classes_ = nullptr;
+  const SymbolIndexMethod* methods_ = nullptr;
+  const SymbolIndexField* fields_ = nullptr;
+  const SymbolIndexLine* lines_ = nullptr;
+  const char* strings_ = nullptr;
+};
+
+static SymbolIndex symbolIndex;
+
+// Where the symbol index is written, and its SymbolIndexKey (0 if there are no APKs, in which case
+// there's no index). Set once by AgentMain.
+static std::string symbolIndexPath;
+static uint64_t symbolIndexKey = 0;
+
+// Global refs to the app's class loader and its ancestors. Only their classes (and boot classes)
+// are indexed, since SymbolIndexKey covers their content - a class of the same name from any other
+// loader (e.g. a plugin's) may be entirely different. Set once by AgentMain.
+static std::vector<jobject> symbolIndexClassLoaders;
+
+static bool
+IsSymbolIndexClass(jvmtiEnv* jvmti, JNIEnv* jni, jclass klass) {
+  jobject loader = nullptr;
+  if (jvmti->GetClassLoader(klass, &loader) != JVMTI_ERROR_NONE) {
+    return false;
+  }
+  if (loader == nullptr) {
+    return true;
+  }
+  bool isIndexed = std::any_of(
+      symbolIndexClassLoaders.begin(), symbolIndexClassLoaders.end(),
+      [jni, loader](jobject indexed) { return jni->IsSameObject(indexed, loader); });
+  jni->DeleteLocalRef(loader);
+  return isIndexed;
+}
+
+struct MethodMetadata {
+  jmethodID methodId;
+  // Interned by MetadataCache, and never freed. generic is null if the method has no generic
+  // signature.
+  const std::string* name;
+  const std::string* signature;
+  const std::string* generic;
+  // These are -1 for native methods
+  jlocation startLocation;
+  jlocation endLocation;
+  jint argsSize;
+  jint maxLocals;
+  jint modifiers;
+};
+
+struct FieldMetadata {
+  jfieldID fieldId;
+  const std::string* name;
+  const std::string* signature;
+  const std::string* generic;
+  jint modifiers;
+};
+
+struct ClassMetadata {
+  jlong classId;
+  std::vector<MethodMetadata> methods;
+  std::vector<FieldMetadata> fields;
+};
+
+// Classes that have been unloaded since the caches were last cleaned up, by ClassTagIndex ID. The
+// ObjectFree callback only records them here: it runs during GC, so it mustn't wait on locks that
+// other threads hold across JVMTI calls. The caches are cleaned up by ProcessClassUnloads.
+struct ClassUnloads {
+  std::mutex mutex;
+  std::atomic<bool> isPending = false;
+
+  // Guarded by mutex
+  std::vector<jlong> classIds;
+};
+
+static ClassUnloads classUnloads;
+
+// ObjectFree for gdata->classTagJvmti, where only classes are tagged
+static void JNICALL
+CbClassTagFree(jvmtiEnv* jvmti, jlong tag) {
+  std::lock_guard<std::mutex> lock(classUnloads.mutex);
+  classUnloads.classIds.push_back(tag);
+  classUnloads.isPending = true;
+  classUnloadGeneration++;
+}
+
+// Method and field metadata for the whole process, fetched a class at a time and kept until the
+// class is unloaded. Every plugin shares it, so a method's name and signature are fetched from JVMTI
+// once no matter how many plugins (or JvmtiMethod caches) ask for it.
+class MetadataCache {
+ public:
+  // Returns the metadata of klass's declared members, or null (setting *error) if they can't be
+  // fetched, e.g. because klass isn't prepared yet
+  std::shared_ptr<const ClassMetadata> GetClass(JNIEnv* jni, jvmtiEnv* jvmti, jclass klass, jvmtiError* error) {
+    jlong classId = classTagIndex.GetClassId(gdata->classTagJvmti, jvmti, klass);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = classes.find(classId);
+      if (it != classes.end()) {
+        return it->second;
+      }
+    }
+
+    // Fetched outside of the lock - if two threads race then the second result is dropped. Strings
+    // from the symbol index point into its mapping, while those from JVMTI must be deallocated.
+    std::vector<const char*> strings;
+    std::shared_ptr<ClassMetadata> metadata = FetchFromSymbolIndex(jni, jvmti, klass, classTagIndex.GetSignature(classId), &strings);
+    bool isFromSymbolIndex = metadata != nullptr;
+    if (!isFromSymbolIndex) {
+      metadata = Fetch(jvmti, klass, &strings, error);
+    }
+    if (metadata == nullptr) {
+      return nullptr;
+    }
+    metadata->classId = classId;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = classes.find(classId);
+    if (it == classes.end()) {
+      // strings holds name, signature, generic for each method and then each field
+      size_t s = 0;
+      for (size_t i = 0; i < metadata->methods.size(); i++) {
+        MethodMetadata& method = metadata->methods[i];
+        method.name = InternLocked(strings[s++]);
+        method.signature = InternLocked(strings[s++]);
+        method.generic = InternLocked(strings[s++]);
+        methods[method.methodId] = {classId, i};
+      }
+      for (size_t i = 0; i < metadata->fields.size(); i++) {
+        FieldMetadata& field = metadata->fields[i];
+        field.name = InternLocked(strings[s++]);
+        field.signature = InternLocked(strings[s++]);
+        field.generic = InternLocked(strings[s++]);
+        fields[field.fieldId] = {classId, i};
+      }
+      it = classes.emplace(classId, metadata).first;
+    }
+    if (!isFromSymbolIndex) {
+      for (const char* str : strings) {
+        jvmti->Deallocate((unsigned char*) str);
+      }
+    }
+    return it->second;
+  }
+
+  // Returns the metadata of methodId, fetching its declaring class's metadata if needed
+  std::shared_ptr<const MethodMetadata> GetMethod(JNIEnv* jni, jvmtiEnv* jvmti, jmethodID methodId) {
+    std::shared_ptr<const ClassMetadata> metadata;
+    size_t index = 0;
+    if (!Find(&methods, methodId, &metadata, &index)) {
+      jclass declaringClass = nullptr;
+      CHECK_JVMTI(jvmti->GetMethodDeclaringClass(methodId, &declaringClass));
+      ScopedLocalRef<jclass> klass(jni, declaringClass);
+      jvmtiError error = JVMTI_ERROR_NONE;
+      if (GetClass(jni, jvmti, klass.get(), &error) == nullptr) {
+        CHECK_JVMTI(error);
+      }
+      CHECK(Find(&methods, methodId, &metadata, &index));
+    }
+    return std::shared_ptr<const MethodMetadata>(metadata, &metadata->methods[index]);
+  }
+
+  // Returns the metadata of fieldId, fetching klass's metadata if needed
+  std::shared_ptr<const FieldMetadata> GetField(JNIEnv* jni, jvmtiEnv* jvmti, jclass klass, jfieldID fieldId) {
+    std::shared_ptr<const ClassMetadata> metadata;
+    size_t index = 0;
+    if (!Find(&fields, fieldId, &metadata, &index)) {
+      jvmtiError error = JVMTI_ERROR_NONE;
+      if (GetClass(jni, jvmti, klass, &error) == nullptr) {
+        CHECK_JVMTI(error);
+      }
+      CHECK(Find(&fields, fieldId, &metadata, &index));
+    }
+    return std::shared_ptr<const FieldMetadata>(metadata, &metadata->fields[index]);
+  }
+
+  // Forgets an unloaded class, adding its methods to *methodIds. Interned strings are kept, since
+  // other classes may share them.
+  void Invalidate(jlong classId, std::vector<jmethodID>* methodIds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = classes.find(classId);
+    if (it == classes.end()) {
+      return;
+    }
+    for (const MethodMetadata& method : it->second->methods) {
+      methods.erase(method.methodId);
+      methodIds->push_back(method.methodId);
+    }
+    for (const FieldMetadata& field : it->second->fields) {
+      fields.erase(field.fieldId);
+    }
+    classes.erase(it);
+  }
+
+ private:
+  // The index of a member within its ClassMetadata
+  struct MemberIndex {
+    jlong classId;
+    size_t index;
+  };
+
+  // Appends name, signature and generic of each method and then each field to *strings, to be
+  // interned (and deallocated) by the caller
+  static std::shared_ptr<ClassMetadata>
+  Fetch(jvmtiEnv* jvmti, jclass klass, std::vector<const char*>* strings, jvmtiError* error) {
+    std::shared_ptr<ClassMetadata> metadata = std::make_shared<ClassMetadata>();
+
+    jint methodCount = 0;
+    jmethodID* methodIds = nullptr;
+    *error = jvmti->GetClassMethods(klass, &methodCount, &methodIds);
+    if (*error != JVMTI_ERROR_NONE) {
+      return nullptr;
+    }
+    jint fieldCount = 0;
+    jfieldID* fieldIds = nullptr;
+    *error = jvmti->GetClassFields(klass, &fieldCount, &fieldIds);
+    if (*error != JVMTI_ERROR_NONE) {
+      CHECK_JVMTI(jvmti->Deallocate((unsigned char*) methodIds));
+      return nullptr;
+    }
+
+    for (jint i = 0; i < methodCount; i++) {
+      MethodMetadata method = {
+        .methodId = methodIds[i],
+        .startLocation = -1,
+        .endLocation = -1,
+        .argsSize = -1,
+        .maxLocals = -1,
+        .modifiers = -1,
+      };
+      char* name = nullptr;
+      char* signature = nullptr;
+      char* generic = nullptr;
+      CHECK_JVMTI(jvmti->GetMethodName(method.methodId, &name, &signature, &generic));
+      strings->push_back(name);
+      strings->push_back(signature);
+      strings->push_back(generic);
+
+      jvmtiError error = jvmti->GetMethodLocation(method.methodId, &method.startLocation, &method.endLocation);
+      if (error != JVMTI_ERROR_NATIVE_METHOD) { CHECK_JVMTI(error); }
+      error = jvmti->GetArgumentsSize(method.methodId, &method.argsSize);
+      if (error != JVMTI_ERROR_NATIVE_METHOD) { CHECK_JVMTI(error); }
+      error = jvmti->GetMaxLocals(method.methodId, &method.maxLocals);
+      if (error != JVMTI_ERROR_NATIVE_METHOD) { CHECK_JVMTI(error); }
+      CHECK_JVMTI(jvmti->GetMethodModifiers(method.methodId, &method.modifiers));
+      metadata->methods.push_back(method);
+    }
+
+    for (jint i = 0; i < fieldCount; i++) {
+      FieldMetadata field = {
+        .fieldId = fieldIds[i],
+        .modifiers = -1,
+      };
+      char* name = nullptr;
+      char* signature = nullptr;
+      char* generic = nullptr;
+      CHECK_JVMTI(jvmti->GetFieldName(klass, field.fieldId, &name, &signature, &generic));
+      strings->push_back(name);
+      strings->push_back(signature);
+      strings->push_back(generic);
+      CHECK_JVMTI(jvmti->GetFieldModifiers(klass, field.fieldId, &field.modifiers));
+      metadata->fields.push_back(field);
+    }
+
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) methodIds));
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) fieldIds));
+    return metadata;
+  }
+
+  // Like Fetch, but takes names and signatures (and line tables, which go to lineTableCache) from
+  // the symbol index, so the only JVMTI calls are for member IDs. Returns null if the class isn't
+  // in the index, isn't from an indexed class loader or doesn't have the members the index expects.
+  static std::shared_ptr<ClassMetadata>
+  FetchFromSymbolIndex(JNIEnv* jni, jvmtiEnv* jvmti, jclass klass, const std::string& signature, std::vector<const char*>* strings) {
+    const SymbolIndexClass* entry = symbolIndex.FindClass(signature);
+    if (entry == nullptr || !IsSymbolIndexClass(jvmti, jni, klass)) {
+      return nullptr;
+    }
+
+    jint methodCount = 0;
+    jmethodID* methodIds = nullptr;
+    if (jvmti->GetClassMethods(klass, &methodCount, &methodIds) != JVMTI_ERROR_NONE) {
+      return nullptr;
+    }
+    jint fieldCount = 0;
+    jfieldID* fieldIds = nullptr;
+    if (jvmti->GetClassFields(klass, &fieldCount, &fieldIds) != JVMTI_ERROR_NONE) {
+      CHECK_JVMTI(jvmti->Deallocate((unsigned char*) methodIds));
+      return nullptr;
+    }
+
+    std::shared_ptr<ClassMetadata> metadata;
+    if ((uint32_t) methodCount == entry->methodCount && (uint32_t) fieldCount == entry->fieldCount) {
+      metadata = std::make_shared<ClassMetadata>();
+      for (jint i = 0; i < methodCount; i++) {
+        const SymbolIndexMethod& method = symbolIndex.Method(entry->firstMethod + i);
+        metadata->methods.push_back({
+          .methodId = methodIds[i],
+          .startLocation = method.startLocation,
+          .endLocation = method.endLocation,
+          .argsSize = method.argsSize,
+          .maxLocals = method.maxLocals,
+          .modifiers = method.modifiers,
+        });
+        strings->push_back(symbolIndex.String(method.name));
+        strings->push_back(symbolIndex.String(method.signature));
+        strings->push_back(symbolIndex.String(method.generic));
+
+        std::vector<jvmtiLineNumberEntry> table;
+        for (uint32_t j = 0; j < method.lineCount; j++) {
+          const SymbolIndexLine& line = symbolIndex.Line(method.firstLine + j);
+          table.push_back({line.startLocation, line.line});
+        }
+        lineTableCache.Put(methodIds[i], std::move(table));
+      }
+      for (jint i = 0; i < fieldCount; i++) {
+        const SymbolIndexField& field = symbolIndex.Field(entry->firstField + i);
+        metadata->fields.push_back({
+          .fieldId = fieldIds[i],
+          .modifiers = field.modifiers,
+        });
+        strings->push_back(symbolIndex.String(field.name));
+        strings->push_back(symbolIndex.String(field.signature));
+        strings->push_back(symbolIndex.String(field.generic));
+      }
+    }
+
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) methodIds));
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) fieldIds));
+    return metadata;
+  }
+
+  template <typename Id>
+  bool Find(
+      std::unordered_map<Id, MemberIndex>* index, Id id,
+      std::shared_ptr<const ClassMetadata>* metadata, size_t* memberIndex) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index->find(id);
+    if (it == index->end()) {
+      return false;
+    }
+    *metadata = classes.at(it->second.classId);
+    *memberIndex = it->second.index;
+    return true;
+  }
+
+  const std::string* InternLocked(const char* str) {
+    if (str == nullptr) {
+      return nullptr;
+    }
+    return &*strings.emplace(str).first;
+  }
+
+  std::mutex mutex;
+
+  // Guarded by mutex
+  std::unordered_map<jlong, std::shared_ptr<const ClassMetadata>> classes;
+  std::unordered_map<jmethodID, MemberIndex> methods;
+  std::unordered_map<jfieldID, MemberIndex> fields;
+  std::unordered_set<std::string> strings;
+};
+
+static MetadataCache metadataCache;
+
+// How to find a method's arguments among its locals
+struct MethodArguments {
+  // The first char of each argument's type, excluding `this`
+  std::string types;
+
+  // The slot of the first argument (after `this`). Arguments occupy the last argsSize slots, with
+  // longs and doubles taking two slots each.
+  jint firstSlot;
+};
+
+static std::mutex methodArgumentsMutex;
+
+// Guarded by methodArgumentsMutex
+static std::unordered_map<jmethodID, MethodArguments> methodArgumentsCache;
+
+// Drops cached metadata, line tables and method arguments for classes unloaded since the last
+// call. The IDs of an unloaded class's methods and fields may be reused by a later class, so this
+// must be called before reading the caches by ID.
+static void
+ProcessClassUnloads() {
+  if (!classUnloads.isPending) {
+    return;
+  }
+
+  std::vector<jlong> classIds;
+  {
+    std::lock_guard<std::mutex> lock(classUnloads.mutex);
+    classIds.swap(classUnloads.classIds);
+    classUnloads.isPending = false;
+  }
+
+  std::vector<jmethodID> methodIds;
+  for (jlong classId : classIds) {
+    metadataCache.Invalidate(classId, &methodIds);
+    lineIndex.Invalidate(classId, &methodIds);
+  }
+  lineTableCache.Erase(methodIds);
+
+  // Arguments are cached for any method on a stack, not by class, so they're cheaper to rebuild
+  // than to track
+  std::lock_guard<std::mutex> lock(methodArgumentsMutex);
+  methodArgumentsCache.clear();
+}
+
+// The breakpoint at the start of Handler.dispatchMessage, shared by the jank watchdog and looper
+// stats. The breakpoint fires on every thread, but only the main thread's dispatches are tracked.
+struct MainLooperDispatchProbe {
+  std::mutex mutex;
+
+  // These are guarded by mutex
+  int users = 0;
+  jmethodID methodId = nullptr;
+  jlocation location = -1;
+
+  // The local variable slots of dispatchMessage's `this` and `msg`. These are written once, before
+  // the breakpoint is first set.
+  jint thisSlot = -1;
+  jint messageSlot = -1;
+};
+
+static MainLooperDispatchProbe mainLooperDispatchProbe;
+
+// The key of a LooperStats histogram
+struct LooperMessageKey {
+  jlong handlerClassId;
+  jlong callbackClassId;  // 0 if the message has no callback
+  jint what;
+
+  bool operator==(const LooperMessageKey& other) const {
+    return handlerClassId == other.handlerClassId && callbackClassId == other.callbackClassId && what == other.what;
+  }
+};
+
+struct LooperMessageKeyHash {
+  size_t operator()(const LooperMessageKey& key) const {
+    size_t hash = std::hash<jlong>()(key.handlerClassId);
+    hash = hash * 31 + std::hash<jlong>()(key.callbackClassId);
+    return hash * 31 + std::hash<jint>()(key.what);
+  }
+};
+
+// Continuous accounting of main looper time by (handler class, callback class, what). Histograms
+// are never freed, only reset, and are only ever recorded by the main thread.
+struct LooperStats {
+  std::atomic<bool> isEnabled{false};
+
+  std::mutex mutex;
+  std::unordered_map<LooperMessageKey, LatencyHistogram*, LooperMessageKeyHash> histograms;
+
+  // Main thread only: the message being dispatched
+  bool hasMessage = false;
+  LooperMessageKey messageKey;
+  jlong messageStartNanos = 0;
+};
+
+static LooperStats looperStats;
+
+// 1 if this is the main thread, 0 if it isn't, or -1 if we haven't checked yet
+thread_local int isMainThread = -1;
+
+// The height of the outermost Handler.dispatchMessage frame on the main thread, or 0 if the main
+// thread isn't dispatching a message (that we know of)
+thread_local jint mainLooperDispatchHeight = 0;
+
+// Must match StepRequest.Depth in Kotlin
+enum StepDepth {
+  kStepInto,
+  kStepOver,
+  kStepOut,
+};
+
+// The step in progress on a thread. All the per-instruction work happens here - Kotlin only hears
+// about a step once it's complete.
+struct StepState {
+  bool isActive = false;
+  StepDepth depth;
+
+  // Where the step started
+  jint startHeight;
+  jmethodID startMethod;
+  jint startLine;
+  jlocation lastLocation;
+
+  // The height of the top frame, tracked with MethodEntry and FramePop so that single steps don't
+  // each need a GetFrameCount. It's kUnknownHeight when we've lost track (before we're back in the
+  // start frame, or in Java called from a native method), and then single steps count the frames
+  // until they find one at or below resyncHeight, every frame of which we've armed.
+  jint height = kUnknownHeight;
+  jint resyncHeight = 0;
+
+  // The events enabled on this thread on behalf of the step (see UpdateStepEventModes)
+  bool isSingleStepEnabled = false;
+  bool wantsMethodEntries = false;
+
+  // For kStepInto: only stop in methods that pass this filter (if non-null). Owned by the
+  // StepRequest.
+  MethodFilter* filter;
+  jmethodID lastFilteredMethod;
+};
+
+thread_local StepState stepState;
+
+// Whether FramePop is enabled for this thread. ART has to deoptimize everything to deliver FramePop
+// for all threads, so it's only enabled per thread, and only while the thread has frames armed with
+// NotifyFramePop (for frame exit watches, the method profiler, the main looper probe or a step).
+thread_local bool isFramePopEnabled = false;
+
+// Enables or disables FramePop for the current thread (which is `thread`) to match whether it has
+// any frames armed
+static void
+UpdateFramePopMode(jvmtiEnv* jvmti, jthread thread) {
+  bool wantsFramePops = !frameExitWatches.empty() || !profilerShadowStack.empty() || mainLooperDispatchHeight != 0
+      || stepState.isActive;
+  if (wantsFramePops == isFramePopEnabled) {
+    return;
+  }
+  CHECK_JVMTI(jvmti->SetEventNotificationMode(wantsFramePops ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_FRAME_POP, thread));
+  isFramePopEnabled = wantsFramePops;
+}
+
+static void
+throwJvmtiError(JNIEnv* jni, int result, const char* desc) {
+  ScopedLocalRef<jclass> jvmtiExceptionClass(jni, jni->FindClass("com/squareup/stoic/jvmti/JvmtiException"));
+  CHECK(jvmtiExceptionClass.get() != NULL);
+  jmethodID ctor = jni->GetMethodID(jvmtiExceptionClass.get(), "<init>", "(ILjava/lang/String;)V");
+  CHECK(ctor != NULL);
+  ScopedLocalRef<jstring> jdesc(jni, jni->NewStringUTF(desc));
+  ScopedLocalRef<jthrowable> exc(jni, (jthrowable) jni->NewObject(jvmtiExceptionClass.get(), ctor, result, jdesc.get()));
+  CHECK(exc.get() != NULL);
+  jni->Throw(exc.get());
+}
+ 
+jvmtiIterationControl JNICALL
+jvmtiHeapObjectCallback_tagUnconditionally(jlong class_tag, jlong size, jlong* tag_ptr, void* user_data) {
+  *tag_ptr = 1;
+  return JVMTI_ITERATION_CONTINUE;
+}
+
+jvmtiIterationControl JNICALL
+jvmtiHeapObjectCallback_untagUnconditionally(jlong class_tag, jlong size, jlong* tag_ptr, void* user_data) {
+  *tag_ptr = 0;
+  return JVMTI_ITERATION_CONTINUE;
+}
+
+jint JNICALL
+jvmtiHeapIterationCallback_tagUnconditionally(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+  *tag_ptr = *static_cast<jlong*>(user_data);
+  return 0;
+}
+
+jint JNICALL
+jvmtiHeapIterationCallback_untagUnconditionally(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+  *tag_ptr = 0;
+  return 0;
+}
+
+JNIEXPORT jobject JNICALL
+Jvmti_VirtualMachine_nativeInstances(JNIEnv *jni, jobject vmClass, jclass klass, jboolean includeSubclasses) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+
+  // Clear all tags in the heap
+  {
+    jvmtiHeapCallbacks callbacks = {
+      .heap_iteration_callback = jvmtiHeapIterationCallback_untagUnconditionally,
+    };
+
+    CHECK_JVMTI(jvmti->IterateThroughHeap(
+          JVMTI_HEAP_FILTER_UNTAGGED,
+          nullptr,
+          &callbacks,
+          nullptr));
+  }
+
+  if (includeSubclasses) {
+    // klassClass = java.lang.Class
+    ScopedLocalRef<jclass> klassClass(jni, jni->FindClass("java/lang/Class"));
+    if (!klassClass.get()) {
+        jni->ExceptionDescribe();
+        jni->ExceptionClear();
+        return nullptr;
+    }
+
+    // Tag every Class object
+    jlong tag = 1;
+    CHECK_JVMTI(jvmti->IterateOverInstancesOfClass(
+          klassClass.get(),
+          JVMTI_HEAP_OBJECT_EITHER,
+          jvmtiHeapObjectCallback_tagUnconditionally,
+          &tag));
+
+    // Iterate through every Class object, clearing the tags of classes that aren't subclasses of klass
+    jobject* obj_list;
+    jint obj_len;
+    jlong tagOne = 1;
+    CHECK_JVMTI(jvmti->GetObjectsWithTags(1, &tagOne, &obj_len, &obj_list, nullptr));
+    jmethodID method_isAssignableFrom = jni->GetMethodID(klassClass.get(), "isAssignableFrom", "(Ljava/lang/Class;)Z");
+    CHECK(method_isAssignableFrom != nullptr);
+    for (int i = 0; i < obj_len; i++) {
+      ScopedLocalRef<jobject> klassCandidate(jni, obj_list[i]);
+
+      // Never throws (famous last words?)
+      jboolean isAssignable = jni->CallBooleanMethod(klass, method_isAssignableFrom, klassCandidate.get());
+      
+      if (!isAssignable) {
+        jlong tagZero = 0;
+        CHECK_JVMTI(jvmti->SetTag(klassCandidate.get(), tagZero));
+      }
+    }
+
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) obj_list));
+    obj_list = NULL;
+
+    // Tag every object whose class is tagged
+    {
+      jvmtiHeapCallbacks callbacks = {
+        .heap_iteration_callback = jvmtiHeapIterationCallback_tagUnconditionally,
+      };
+      CHECK_JVMTI(jvmti->IterateThroughHeap(
+          JVMTI_HEAP_FILTER_CLASS_UNTAGGED,
+          nullptr,
+          &callbacks,
+          &tagOne));
+    }
+
+    // TODO: This wouldn't work for subclasses of java.lang.Class
+    // java.lang.Class is final so there aren't any, but if people
+    // asked for instances of java.lang.Class and subclasses, this
+    // will give the wrong answer. So I need to special-case that.
+
+    // Untag instances of java.lang.Class
+    CHECK_JVMTI(jvmti->IterateOverInstancesOfClass(
+          klassClass.get(),
+          JVMTI_HEAP_OBJECT_TAGGED,
+          jvmtiHeapObjectCallback_untagUnconditionally,
+          nullptr));
+  } else {
+    // tag every object whose Class is exactly klass
+    jlong tag = 1;
+    CHECK_JVMTI(jvmti->IterateOverInstancesOfClass(
+          klass,
+          JVMTI_HEAP_OBJECT_EITHER,
+          jvmtiHeapObjectCallback_tagUnconditionally,
+          &tag));
+  }
+ 
+  // Get all of the tagged objects
+  jobject* obj_list;
+  jint obj_len;
+  jlong tag = 1;
+  CHECK_JVMTI(jvmti->GetObjectsWithTags(1, &tag, &obj_len, &obj_list, nullptr));
+ 
+  jobjectArray klassArray = jni->NewObjectArray(obj_len, klass, NULL);
+  if (klassArray == nullptr) {
+    LOG(ERROR) << "NewObjectArray failed";
+    return nullptr;
+  }
+ 
+  for (int i = 0; i < obj_len; i++) {
+    ScopedLocalRef<jobject> obj(jni, obj_list[i]);
+    jni->SetObjectArrayElement(klassArray, i, obj.get());
+  }
+
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) obj_list));
+  obj_list = NULL;
+
+  return klassArray;
+}
+
+JNIEXPORT jobject JNICALL
+Jvmti_VirtualMachine_nativeSubclasses(JNIEnv *jni, jobject vmClass, jclass klass) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  // TODO: verify VirtualMachine.class lock held
+
+  // Clear all tags in the heap
+  {
+    jvmtiHeapCallbacks callbacks = {
+      .heap_iteration_callback = jvmtiHeapIterationCallback_untagUnconditionally,
+    };
+
+    CHECK_JVMTI(jvmti->IterateThroughHeap(
+          JVMTI_HEAP_FILTER_UNTAGGED,
+          nullptr,
+          &callbacks,
+          nullptr));
+  }
+
+  // klassClass = java.lang.Class
+  ScopedLocalRef<jclass> klassClass(jni, jni->FindClass("java/lang/Class"));
+  if (!klassClass.get()) {
+      jni->ExceptionDescribe();
+      jni->ExceptionClear();
+      return nullptr;
+  }
+
+  // Tag every Class object
+  jlong tag = 1;
+  CHECK_JVMTI(jvmti->IterateOverInstancesOfClass(
+        klassClass.get(),
+        JVMTI_HEAP_OBJECT_EITHER,
+        jvmtiHeapObjectCallback_tagUnconditionally,
+        &tag));
+
+  // Iterate through every Class object, clearing the tags of classes that aren't subclasses of klass
+  jobject* obj_list = NULL;
+  jint obj_len = -1;
+  const jlong tagOne = 1;
+  CHECK_JVMTI(jvmti->GetObjectsWithTags(1, &tagOne, &obj_len, &obj_list, nullptr));
+  jmethodID method_isAssignableFrom = jni->GetMethodID(klassClass.get(), "isAssignableFrom", "(Ljava/lang/Class;)Z");
+  CHECK(method_isAssignableFrom != nullptr);
+  for (int i = 0; i < obj_len; i++) {
+    ScopedLocalRef<jobject> klassCandidate(jni, obj_list[i]);
+
+    // Never throws (famous last words?)
+    jboolean isAssignable = jni->CallBooleanMethod(klass, method_isAssignableFrom, klassCandidate.get());
+    
+    if (!isAssignable) {
+      jlong tagZero = 0;
+      CHECK_JVMTI(jvmti->SetTag(klassCandidate.get(), tagZero));
+    }
+  }
+
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) obj_list));
+  obj_list = NULL;
+
+  // Get all of the objects tagged with 1
+  obj_len = -1;
+  CHECK_JVMTI(jvmti->GetObjectsWithTags(1, &tagOne, &obj_len, &obj_list, nullptr));
+ 
+  jobjectArray klassArray = jni->NewObjectArray(obj_len, klassClass.get(), NULL);
+  if (klassArray == nullptr) {
+    LOG(ERROR) << "NewObjectArray failed";
+    return nullptr;
+  }
+ 
+  for (int i = 0; i < obj_len; i++) {
+    ScopedLocalRef<jobject> obj(jni, obj_list[i]);
+    jni->SetObjectArrayElement(klassArray, i, obj.get());
+  }
+
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) obj_list));
+  obj_list = NULL;
+
+  return klassArray;
+}
+
+JNIEXPORT jlong JNICALL
+Jvmti_VirtualMachine_nativeGetMethodId(JNIEnv *jni, jobject vmClass, jclass clazz, jstring methodName, jstring methodSignature) {
+  const char* methodNameChars = jni->GetStringUTFChars(methodName, NULL);
+  const char* methodSignatureChars = jni->GetStringUTFChars(methodSignature, NULL);
+  jmethodID methodId = jni->GetMethodID(clazz, methodNameChars, methodSignatureChars);
+  jni->ReleaseStringUTFChars(methodName, methodNameChars);
+  jni->ReleaseStringUTFChars(methodSignature, methodSignatureChars);
+
+  return (jlong) methodId;
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeSetBreakpoint(JNIEnv *jni, jobject vmClass, jlong methodId, jlong location) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jmethodID castMethodId = reinterpret_cast<jmethodID>(methodId);
+  JVMTI_THROW_IF_ERROR(AcquireBreakpointSite(jvmti, castMethodId, location, &BreakpointSite::hasKotlinRequests), ;);
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeClearBreakpoint(JNIEnv *jni, jobject vmClass, jlong methodId, jlong location) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  ReleaseBreakpointSite(jvmti, (jmethodID) methodId, (jlocation) location, &BreakpointSite::hasKotlinRequests);
+}
+
+// Starts timing each of methodIds: a breakpoint at the start of the method pushes a ShadowFrame,
+// and the FramePop of that frame records its duration.
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeProfileMethods(JNIEnv *jni, jobject vmClass, jlongArray methodIds) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+
+  jvmtiCapabilities caps;
+  CHECK_JVMTI(jvmti->GetCapabilities(&caps));
+  if (!caps.can_generate_frame_pop_events) {
+    throwJvmtiError(jni, JVMTI_ERROR_MUST_POSSESS_CAPABILITY, "can_generate_frame_pop_events");
+    return;
+  }
+
+  jsize count = jni->GetArrayLength(methodIds);
+  std::vector<jlong> ids(count);
+  jni->GetLongArrayRegion(methodIds, 0, count, ids.data());
+
+  std::lock_guard<std::mutex> lock(profiledMethodsMutex);
+  for (jlong id : ids) {
+    jmethodID methodId = reinterpret_cast<jmethodID>(id);
+    ProfiledMethod*& method = profiledMethods[methodId];
+    if (method == nullptr) {
+      jlocation start = -1;
+      jlocation end = -1;
+      jvmtiError error = jvmti->GetMethodLocation(methodId, &start, &end);
+      if (error != JVMTI_ERROR_NONE) {
+        profiledMethods.erase(methodId);
+        JVMTI_THROW_IF_ERROR(error, return);
+      }
+      method = new ProfiledMethod;
+      method->methodId = methodId;
+      method->entryLocation = start;
+    }
+
+    if (!method->isEnabled) {
+      JVMTI_THROW_IF_ERROR(
+          AcquireBreakpointSite(jvmti, methodId, method->entryLocation, &BreakpointSite::isProfilerEntry),
+          return);
+      method->isEnabled = true;
+    }
+  }
+}
+
+// Stops timing each of methodIds. Their histograms are kept until nativeResetMethodProfiles.
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeUnprofileMethods(JNIEnv *jni, jobject vmClass, jlongArray methodIds) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jsize count = jni->GetArrayLength(methodIds);
+  std::vector<jlong> ids(count);
+  jni->GetLongArrayRegion(methodIds, 0, count, ids.data());
+
+  std::lock_guard<std::mutex> lock(profiledMethodsMutex);
+  for (jlong id : ids) {
+    auto it = profiledMethods.find(reinterpret_cast<jmethodID>(id));
+    if (it == profiledMethods.end() || !it->second->isEnabled) {
+      continue;
+    }
+    ProfiledMethod* method = it->second;
+    ReleaseBreakpointSite(jvmti, method->methodId, method->entryLocation, &BreakpointSite::isProfilerEntry);
+    method->isEnabled = false;
+  }
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeResetMethodProfiles(JNIEnv *jni, jobject vmClass) {
+  std::lock_guard<std::mutex> lock(profiledMethodsMutex);
+  for (auto& entry : profiledMethods) {
+    entry.second->histogram.Reset();
+  }
+}
+
+// Returns every profiled method's histogram in one go, packed as
+// [methodId, <LatencyHistogram::AppendTo>]*
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativeGetMethodProfiles(JNIEnv *jni, jobject vmClass) {
+  std::vector<jlong> packed;
+  {
+    std::lock_guard<std::mutex> lock(profiledMethodsMutex);
+    for (auto& entry : profiledMethods) {
+      packed.push_back(reinterpret_cast<jlong>(entry.first));
+      entry.second->histogram.AppendTo(&packed);
+    }
+  }
+
+  jlongArray result = jni->NewLongArray(packed.size());
+  jni->SetLongArrayRegion(result, 0, packed.size(), packed.data());
+  return result;
+}
+
+// Metadata comes from metadataCache, so only the first request for a class's metadata (from any
+// plugin) calls into JVMTI for strings
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeGetMethodCoreMetadata(JNIEnv *jni, jobject vmClass, jobject jvmtiMethod) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  ProcessClassUnloads();
+
+  jlong longMethodId = jni->GetLongField(jvmtiMethod, gdata->stoicJvmtiMethodMethodId);
+  jmethodID castMethodId = reinterpret_cast<jmethodID>(longMethodId);
+  std::shared_ptr<const MethodMetadata> metadata = metadataCache.GetMethod(jni, jvmti, castMethodId);
+
+  ScopedLocalRef<jstring> jname(jni, jni->NewStringUTF(metadata->name->c_str()));
+  ScopedLocalRef<jstring> jsignature(jni, jni->NewStringUTF(metadata->signature->c_str()));
+  ScopedLocalRef<jstring> jgeneric(jni, metadata->generic == nullptr ? nullptr : jni->NewStringUTF(metadata->generic->c_str()));
+
+  jclass declaringClass = nullptr;
+  CHECK_JVMTI(jvmti->GetMethodDeclaringClass(castMethodId, &declaringClass));
   jni->SetObjectField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateClazz, declaringClass);
   jni->DeleteLocalRef(declaringClass);
   declaringClass = nullptr;
 
-  jni->SetObjectField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateName, jname.get());
-  jni->SetObjectField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateSignature, jsignature.get());
-  jni->SetObjectField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateGeneric, jgeneric.get());
-  jni->SetLongField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateStartLocation, startLocation);
-  jni->SetLongField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateEndLocation, endLocation);
-  jni->SetIntField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateArgsSize, argsSize);
-  jni->SetIntField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateMaxLocals, maxLocals);
-  jni->SetIntField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateModifiers, modifiers);
+  jni->SetObjectField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateName, jname.get());
+  jni->SetObjectField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateSignature, jsignature.get());
+  jni->SetObjectField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateGeneric, jgeneric.get());
+  jni->SetLongField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateStartLocation, metadata->startLocation);
+  jni->SetLongField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateEndLocation, metadata->endLocation);
+  jni->SetIntField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateArgsSize, metadata->argsSize);
+  jni->SetIntField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateMaxLocals, metadata->maxLocals);
+  jni->SetIntField(jvmtiMethod, gdata->stoicJvmtiMethodPrivateModifiers, metadata->modifiers);
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeGetFieldCoreMetadata(JNIEnv *jni, jobject vmClass, jobject jvmtiField) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  ProcessClassUnloads();
+
+  jlong longFieldId = jni->GetLongField(jvmtiField, gdata->stoicJvmtiFieldFieldId);
+  jfieldID castFieldId = reinterpret_cast<jfieldID>(longFieldId);
+
+  ScopedLocalRef<jclass> clazz(jni, (jclass) jni->GetObjectField(jvmtiField, gdata->stoicJvmtiFieldClazz));
+  std::shared_ptr<const FieldMetadata> metadata = metadataCache.GetField(jni, jvmti, clazz.get(), castFieldId);
+
+  ScopedLocalRef<jstring> jname(jni, jni->NewStringUTF(metadata->name->c_str()));
+  ScopedLocalRef<jstring> jsignature(jni, jni->NewStringUTF(metadata->signature->c_str()));
+  ScopedLocalRef<jstring> jgeneric(jni, metadata->generic == nullptr ? nullptr : jni->NewStringUTF(metadata->generic->c_str()));
+
+  jni->SetObjectField(jvmtiField, gdata->stoicJvmtiFieldPrivateName, jname.get());
+  jni->SetObjectField(jvmtiField, gdata->stoicJvmtiFieldPrivateSignature, jsignature.get());
+  jni->SetObjectField(jvmtiField, gdata->stoicJvmtiFieldPrivateGeneric, jgeneric.get());
+  jni->SetIntField(jvmtiField, gdata->stoicJvmtiFieldPrivateModifiers, metadata->modifiers);
+}
+
+JNIEXPORT jobject JNICALL
+Jvmti_VirtualMachine_nativeGetLocalVariables(JNIEnv *jni, jobject vmClass, jlong methodId) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jmethodID castMethodId = reinterpret_cast<jmethodID>(methodId);
+  jint entryCount = -1;
+  jvmtiLocalVariableEntry* table = NULL;
+
+  // This can fail if local variable information isn't available
+  JVMTI_THROW_IF_ERROR(jvmti->GetLocalVariableTable(castMethodId, &entryCount, &table), return NULL);
+
+  ScopedLocalRef<jclass> LocalVariable(jni, jni->FindClass("com/squareup/stoic/jvmti/LocalVariable"));
+  CHECK(LocalVariable.get() != NULL);
+  jmethodID ctor = jni->GetMethodID(LocalVariable.get(), "<init>", "(JILjava/lang/String;Ljava/lang/String;Ljava/lang/String;I)V");
+  CHECK(ctor != NULL);
+  ScopedLocalRef<jobjectArray> jTable(jni, jni->NewObjectArray(entryCount, LocalVariable.get(), NULL));
+  CHECK(jTable.get() != NULL);
+
+  for (int i = 0; i < entryCount; i++) {
+    jlong startLocation = table[i].start_location;
+    jint length = table[i].length;
+    ScopedLocalRef<jstring> name(jni, jni->NewStringUTF(table[i].name));
+    ScopedLocalRef<jstring> signature(jni, jni->NewStringUTF(table[i].signature));
+    ScopedLocalRef<jstring> genericSignature(jni, jni->NewStringUTF(table[i].generic_signature));
+    jint slot = table[i].slot;
+    ScopedLocalRef<jobject> localVar(jni, jni->NewObject(LocalVariable.get(), ctor, startLocation, length, name.get(), signature.get(), genericSignature.get(), slot));
+    CHECK(localVar.get() != NULL);
+    jni->SetObjectArrayElement(jTable.get(), i, localVar.get());
+  }
+
+  // Deallocate
+  for (int i = 0; i < entryCount; i++) {
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) table[i].name));
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) table[i].signature));
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) table[i].generic_signature));
+    table[i].name = table[i].signature = table[i].generic_signature = NULL;
+  }
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) table));
+  table = NULL;
+
+  return jTable.release();
+}
+
+JNIEXPORT jobject JNICALL
+Jvmti_VirtualMachine_nativeGetLocalObject(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint frameCount = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
+  jobject result = NULL;
+  CHECK_JVMTI(jvmti->GetLocalObject(thread, frameCount - height, slot, &result));
+  return result;
+}
+
+// Reads several locals of the frame at `height` with a single stack walk. types holds the first char
+// of each local's signature. Returns {long[] primitives, Object[] objects}, each with an entry per
+// slot: primitives are in the long[] (floats/doubles as their raw bits) and objects in the Object[].
+JNIEXPORT jobjectArray JNICALL
+Jvmti_VirtualMachine_nativeGetFrameLocals(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jintArray slots, jstring types) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint frameCount = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
+  jint depth = frameCount - height;
+
+  jsize count = jni->GetArrayLength(slots);
+  std::vector<jint> slotValues(count);
+  jni->GetIntArrayRegion(slots, 0, count, slotValues.data());
+  ScopedUtfChars typeChars(jni, types);
+  CHECK((size_t) count == strlen(typeChars.c_str()));
+
+  ScopedLocalRef<jclass> objectClass(jni, jni->FindClass("java/lang/Object"));
+  ScopedLocalRef<jobjectArray> objects(jni, jni->NewObjectArray(count, objectClass.get(), nullptr));
+  std::vector<jlong> primitives(count);
+  for (jsize i = 0; i < count; i++) {
+    jint slot = slotValues[i];
+    switch (typeChars.c_str()[i]) {
+      case 'J':
+        JVMTI_THROW_IF_ERROR(jvmti->GetLocalLong(thread, depth, slot, &primitives[i]), return nullptr);
+        break;
+      case 'F': {
+        jfloat value = 0;
+        JVMTI_THROW_IF_ERROR(jvmti->GetLocalFloat(thread, depth, slot, &value), return nullptr);
+        int32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        primitives[i] = bits;
+        break;
+      }
+      case 'D': {
+        jdouble value = 0;
+        JVMTI_THROW_IF_ERROR(jvmti->GetLocalDouble(thread, depth, slot, &value), return nullptr);
+        memcpy(&primitives[i], &value, sizeof(value));
+        break;
+      }
+      case 'L':
+      case '[': {
+        jobject value = nullptr;
+        JVMTI_THROW_IF_ERROR(jvmti->GetLocalObject(thread, depth, slot, &value), return nullptr);
+        jni->SetObjectArrayElement(objects.get(), i, value);
+        jni->DeleteLocalRef(value);
+        break;
+      }
+      default: {
+        jint value = 0;
+        JVMTI_THROW_IF_ERROR(jvmti->GetLocalInt(thread, depth, slot, &value), return nullptr);
+        primitives[i] = value;
+        break;
+      }
+    }
+  }
+
+  ScopedLocalRef<jlongArray> primitivesArray(jni, jni->NewLongArray(count));
+  jni->SetLongArrayRegion(primitivesArray.get(), 0, count, primitives.data());
+
+  jobjectArray result = jni->NewObjectArray(2, objectClass.get(), nullptr);
+  jni->SetObjectArrayElement(result, 0, primitivesArray.get());
+  jni->SetObjectArrayElement(result, 1, objects.get());
+  return result;
+}
+
+JNIEXPORT jint JNICALL
+Jvmti_VirtualMachine_nativeGetLocalInt(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint frameCount = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
+  jint result = 0;
+  CHECK_JVMTI(jvmti->GetLocalInt(thread, frameCount - height, slot, &result));
+  return result;
+}
+
+JNIEXPORT jlong JNICALL
+Jvmti_VirtualMachine_nativeGetLocalLong(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint frameCount = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
+  jlong result = 0;
+  CHECK_JVMTI(jvmti->GetLocalLong(thread, frameCount - height, slot, &result));
+  return result;
+}
+
+JNIEXPORT jfloat JNICALL
+Jvmti_VirtualMachine_nativeGetLocalFloat(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint frameCount = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
+  jfloat result = 0.0f;
+  CHECK_JVMTI(jvmti->GetLocalFloat(thread, frameCount - height, slot, &result));
+  return result;
+}
+
+JNIEXPORT jdouble JNICALL
+Jvmti_VirtualMachine_nativeGetLocalDouble(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint frameCount = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
+  jdouble result = 0.0;
+  CHECK_JVMTI(jvmti->GetLocalDouble(thread, frameCount - height, slot, &result));
+  return result;
+}
+
+JNIEXPORT jobject JNICALL
+Jvmti_VirtualMachine_nativeGetClassMethods(JNIEnv *jni, jobject vmClass, jclass clazz) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint methodCount = -1;
+  jmethodID* methods = NULL;
+  CHECK_JVMTI(jvmti->GetClassMethods(clazz, &methodCount, &methods));
+
+  ScopedLocalRef<jobjectArray> jmethods(jni, jni->NewObjectArray(methodCount, gdata->stoicJvmtiMethodClass, NULL));
+  CHECK(jmethods.get() != NULL);
+  for (int i = 0; i < methodCount; i++) {
+    jlong longMethodId = reinterpret_cast<jlong>(methods[i]);
+    ScopedLocalRef<jobject> method(jni, jni->NewObject(
+          gdata->stoicJvmtiMethodClass,
+          gdata->stoicJvmtiMethodCtor,
+          longMethodId));
+
+    jni->SetObjectArrayElement(jmethods.get(), i, method.get());
+  }
+
+  jvmti->Deallocate((unsigned char*) methods);
+
+  return jmethods.release();
+}
+
+JNIEXPORT jobject JNICALL
+Jvmti_VirtualMachine_nativeGetClassFields(JNIEnv *jni, jobject vmClass, jclass clazz) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint fieldCount = -1;
+  jfieldID* fields = NULL;
+  CHECK_JVMTI(jvmti->GetClassFields(clazz, &fieldCount, &fields));
+
+  ScopedLocalRef<jobjectArray> jfields(jni, jni->NewObjectArray(fieldCount, gdata->stoicJvmtiFieldClass, NULL));
+  CHECK(jfields.get() != NULL);
+  for (int i = 0; i < fieldCount; i++) {
+    jlong longFieldId = reinterpret_cast<jlong>(fields[i]);
+    ScopedLocalRef<jobject> field(jni, jni->NewObject(
+          gdata->stoicJvmtiFieldClass,
+          gdata->stoicJvmtiFieldCtor,
+          clazz,
+          longFieldId));
+
+    jni->SetObjectArrayElement(jfields.get(), i, field.get());
+  }
+
+  jvmti->Deallocate((unsigned char*) fields);
+
+  return jfields.release();
+}
+
+// The string table of nativeGetClassMetadata. Strings are already interned by metadataCache, so
+// they're deduplicated by address.
+class MetadataStrings {
+ public:
+  // Returns the index of str, or -1 for null
+  jlong Add(const std::string* str) {
+    if (str == nullptr) {
+      return -1;
+    }
+    auto result = indexes_.emplace(str, strings_.size());
+    if (result.second) {
+      strings_.push_back(str);
+    }
+    return result.first->second;
+  }
+
+  jobjectArray ToArray(JNIEnv* jni) {
+    ScopedLocalRef<jclass> stringClass(jni, jni->FindClass("java/lang/String"));
+    jobjectArray result = jni->NewObjectArray(strings_.size(), stringClass.get(), nullptr);
+    for (size_t i = 0; i < strings_.size(); i++) {
+      ScopedLocalRef<jstring> str(jni, jni->NewStringUTF(strings_[i]->c_str()));
+      jni->SetObjectArrayElement(result, i, str.get());
+    }
+    return result;
+  }
+
+ private:
+  std::unordered_map<const std::string*, jlong> indexes_;
+  std::vector<const std::string*> strings_;
+};
+
+// The metadata of every method and field declared by clazz, in one call so Kotlin doesn't need a
+// nativeGetMethodCoreMetadata/nativeGetFieldCoreMetadata call per member. Returns
+// {long[] packed, String[] strings} where packed is
+//   methodCount, (methodId, name, signature, generic, startLocation, endLocation, argsSize,
+//     maxLocals, modifiers)*
+//   fieldCount, (fieldId, name, signature, generic, modifiers)*
+// Names, signatures and generics are indexes into strings (-1 for null). Locations, argsSize and
+// maxLocals are -1 for native methods, as with nativeGetMethodCoreMetadata.
+JNIEXPORT jobjectArray JNICALL
+Jvmti_VirtualMachine_nativeGetClassMetadata(JNIEnv *jni, jobject vmClass, jclass clazz) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  ProcessClassUnloads();
+
+  jvmtiError error = JVMTI_ERROR_NONE;
+  std::shared_ptr<const ClassMetadata> metadata = metadataCache.GetClass(jni, jvmti, clazz, &error);
+  JVMTI_THROW_IF_ERROR(error, return nullptr);
+
+  MetadataStrings strings;
+  std::vector<jlong> packed;
+  packed.reserve(2 + 9 * metadata->methods.size() + 5 * metadata->fields.size());
+  packed.push_back(metadata->methods.size());
+  for (const MethodMetadata& method : metadata->methods) {
+    packed.push_back(reinterpret_cast<jlong>(method.methodId));
+    packed.push_back(strings.Add(method.name));
+    packed.push_back(strings.Add(method.signature));
+    packed.push_back(strings.Add(method.generic));
+    packed.push_back(method.startLocation);
+    packed.push_back(method.endLocation);
+    packed.push_back(method.argsSize);
+    packed.push_back(method.maxLocals);
+    packed.push_back(method.modifiers);
+  }
+  packed.push_back(metadata->fields.size());
+  for (const FieldMetadata& field : metadata->fields) {
+    packed.push_back(reinterpret_cast<jlong>(field.fieldId));
+    packed.push_back(strings.Add(field.name));
+    packed.push_back(strings.Add(field.signature));
+    packed.push_back(strings.Add(field.generic));
+    packed.push_back(field.modifiers);
+  }
+
+  ScopedLocalRef<jclass> objectClass(jni, jni->FindClass("java/lang/Object"));
+  ScopedLocalRef<jlongArray> packedArray(jni, jni->NewLongArray(packed.size()));
+  jni->SetLongArrayRegion(packedArray.get(), 0, packed.size(), packed.data());
+  ScopedLocalRef<jobjectArray> stringsArray(jni, strings.ToArray(jni));
+
+  jobjectArray result = jni->NewObjectArray(2, objectClass.get(), nullptr);
+  jni->SetObjectArrayElement(result, 0, packedArray.get());
+  jni->SetObjectArrayElement(result, 1, stringsArray.get());
+  return result;
+}
+
+// Returns whether str matches glob, where '*' matches any run of characters (including none) and
+// '?' matches any one character
+static bool
+GlobMatches(const char* glob, const char* str) {
+  // On a mismatch, backtrack to just after the last '*' and let it swallow one more character
+  const char* starGlob = nullptr;
+  const char* starStr = nullptr;
+  while (*str != '\0') {
+    if (*glob == '*') {
+      starGlob = ++glob;
+      starStr = str;
+    } else if (*glob == '?' || *glob == *str) {
+      glob++;
+      str++;
+    } else if (starGlob != nullptr) {
+      glob = starGlob;
+      str = ++starStr;
+    } else {
+      return false;
+    }
+  }
+  while (*glob == '*') {
+    glob++;
+  }
+  return *glob == '\0';
+}
+
+// A pattern like "com.example.*Repository.fetch*" or "com.example.Foo.bar(I)V", parsed into globs
+// over class signatures, method names and (optionally) method signatures
+struct MethodPattern {
+  // In signature form, e.g. "Lcom/example/*Repository;"
+  std::string classGlob;
+  // The part of classGlob before its first wildcard, to reject most classes with a prefix compare
+  std::string classPrefix;
+  std::string methodGlob;
+  // Empty to match any signature
+  std::string signatureGlob;
+
+  explicit MethodPattern(const std::string& pattern) {
+    size_t signatureStart = pattern.find('(');
+    std::string qualifiedName = pattern.substr(0, signatureStart);
+    if (signatureStart != std::string::npos) {
+      signatureGlob = pattern.substr(signatureStart);
+    }
+
+    size_t lastDot = qualifiedName.rfind('.');
+    std::string className = lastDot == std::string::npos ? qualifiedName : qualifiedName.substr(0, lastDot);
+    methodGlob = lastDot == std::string::npos ? "*" : qualifiedName.substr(lastDot + 1);
+    std::replace(className.begin(), className.end(), '.', '/');
+    classGlob = "L" + className + ";";
+    classPrefix = classGlob.substr(0, classGlob.find_first_of("*?"));
+  }
+
+  bool MatchesClass(const std::string& signature) const {
+    return signature.compare(0, classPrefix.size(), classPrefix) == 0 &&
+        GlobMatches(classGlob.c_str(), signature.c_str());
+  }
+
+  bool MatchesMethod(const MethodMetadata& method) const {
+    return GlobMatches(methodGlob.c_str(), method.name->c_str()) &&
+        (signatureGlob.empty() || GlobMatches(signatureGlob.c_str(), method.signature->c_str()));
+  }
+};
+
+// Returns the IDs of every method (static or not) declared by a loaded class that matches pattern
+// (see MethodPattern). Class signatures come from classTagIndex and method names from metadataCache,
+// so resolving again (even a different pattern) mostly avoids JVMTI string allocations.
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativeResolveMethods(JNIEnv *jni, jobject vmClass, jstring pattern) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  ProcessClassUnloads();
+
+  const char* patternChars = jni->GetStringUTFChars(pattern, nullptr);
+  MethodPattern methodPattern(patternChars);
+  jni->ReleaseStringUTFChars(pattern, patternChars);
+
+  jint classCount = 0;
+  jclass* classes = nullptr;
+  JVMTI_THROW_IF_ERROR(jvmti->GetLoadedClasses(&classCount, &classes), return nullptr);
+
+  std::vector<jlong> methodIds;
+  for (jint i = 0; i < classCount; i++) {
+    ScopedLocalRef<jclass> klass(jni, classes[i]);
+    jint status = 0;
+    CHECK_JVMTI(jvmti->GetClassStatus(klass.get(), &status));
+    if ((status & JVMTI_CLASS_STATUS_PREPARED) == 0 ||
+        (status & (JVMTI_CLASS_STATUS_ARRAY | JVMTI_CLASS_STATUS_PRIMITIVE)) != 0) {
+      continue;
+    }
+
+    jlong classId = classTagIndex.GetClassId(gdata->classTagJvmti, jvmti, klass.get());
+    if (!methodPattern.MatchesClass(classTagIndex.GetSignature(classId))) {
+      continue;
+    }
+
+    jvmtiError error = JVMTI_ERROR_NONE;
+    std::shared_ptr<const ClassMetadata> metadata = metadataCache.GetClass(jni, jvmti, klass.get(), &error);
+    if (metadata == nullptr) {
+      continue;
+    }
+    for (const MethodMetadata& method : metadata->methods) {
+      if (methodPattern.MatchesMethod(method)) {
+        methodIds.push_back(reinterpret_cast<jlong>(method.methodId));
+      }
+    }
+  }
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) classes));
+
+  jlongArray result = jni->NewLongArray(methodIds.size());
+  jni->SetLongArrayRegion(result, 0, methodIds.size(), methodIds.data());
+  return result;
+}
+
+// Builds the symbol index from every loaded class and writes it to symbolIndexPath, warming
+// metadataCache along the way. Unless force, this is skipped (returning false) if the index loaded at
+// startup already covers at least as many classes as are loaded now. Also returns false if there's
+// no APK to key the index by.
+JNIEXPORT jboolean JNICALL
+Jvmti_VirtualMachine_nativeBuildSymbolIndex(JNIEnv *jni, jobject vmClass, jboolean force) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  ProcessClassUnloads();
+  if (symbolIndexKey == 0) {
+    return false;
+  }
+
+  jint classCount = 0;
+  jclass* classes = nullptr;
+  JVMTI_THROW_IF_ERROR(jvmti->GetLoadedClasses(&classCount, &classes), return false);
+  if (!force && symbolIndex.IsLoaded() && (uint32_t) classCount <= symbolIndex.LoadedClassCount()) {
+    for (jint i = 0; i < classCount; i++) {
+      jni->DeleteLocalRef(classes[i]);
+    }
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) classes));
+    return false;
+  }
+
+  // Only classes from the app's class loaders (or boot classes) are indexed - see
+  // symbolIndexClassLoaders. A signature may still be loaded by several of those, in which case we
+  // can't tell which one a later attach will find, so those classes are left out.
+  std::map<std::string, std::shared_ptr<const ClassMetadata>> classMetadata;
+  std::unordered_set<std::string> duplicates;
+  for (jint i = 0; i < classCount; i++) {
+    ScopedLocalRef<jclass> klass(jni, classes[i]);
+    jint status = 0;
+    CHECK_JVMTI(jvmti->GetClassStatus(klass.get(), &status));
+    if ((status & JVMTI_CLASS_STATUS_PREPARED) == 0 ||
+        (status & (JVMTI_CLASS_STATUS_ARRAY | JVMTI_CLASS_STATUS_PRIMITIVE)) != 0 ||
+        !IsSymbolIndexClass(jvmti, jni, klass.get())) {
+      continue;
+    }
+
+    jlong classId = classTagIndex.GetClassId(gdata->classTagJvmti, jvmti, klass.get());
+    jvmtiError error = JVMTI_ERROR_NONE;
+    std::shared_ptr<const ClassMetadata> metadata = metadataCache.GetClass(jni, jvmti, klass.get(), &error);
+    if (metadata != nullptr && !classMetadata.emplace(classTagIndex.GetSignature(classId), metadata).second) {
+      duplicates.insert(classTagIndex.GetSignature(classId));
+    }
+  }
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) classes));
+  for (const std::string& signature : duplicates) {
+    classMetadata.erase(signature);
+  }
+
+  std::vector<SymbolIndexClass> indexClasses;
+  std::vector<SymbolIndexMethod> indexMethods;
+  std::vector<SymbolIndexField> indexFields;
+  std::vector<SymbolIndexLine> indexLines;
+  std::string indexStrings;
+  std::unordered_map<std::string, uint32_t> stringOffsets;
+  auto addString = [&](const std::string* str) {
+    if (str == nullptr) {
+      return kSymbolIndexNoString;
+    }
+    auto result = stringOffsets.emplace(*str, indexStrings.size());
+    if (result.second) {
+      indexStrings.append(*str);
+      indexStrings.push_back('\0');
+    }
+    return result.first->second;
+  };
+
+  // classMetadata is a std::map, so classes come out sorted by signature as the index requires
+  for (const auto& entry : classMetadata) {
+    const ClassMetadata& metadata = *entry.second;
+    indexClasses.push_back({
+      .signature = addString(&entry.first),
+      .firstMethod = (uint32_t) indexMethods.size(),
+      .methodCount = (uint32_t) metadata.methods.size(),
+      .firstField = (uint32_t) indexFields.size(),
+      .fieldCount = (uint32_t) metadata.fields.size(),
+    });
+    for (const MethodMetadata& method : metadata.methods) {
+      uint32_t firstLine = indexLines.size();
+      for (const jvmtiLineNumberEntry& line : lineTableCache.GetTable(jvmti, method.methodId)) {
+        indexLines.push_back({line.start_location, line.line_number, 0});
+      }
+      indexMethods.push_back({
+        .startLocation = method.startLocation,
+        .endLocation = method.endLocation,
+        .name = addString(method.name),
+        .signature = addString(method.signature),
+        .generic = addString(method.generic),
+        .argsSize = method.argsSize,
+        .maxLocals = method.maxLocals,
+        .modifiers = method.modifiers,
+        .firstLine = firstLine,
+        .lineCount = (uint32_t) (indexLines.size() - firstLine),
+      });
+    }
+    for (const FieldMetadata& field : metadata.fields) {
+      indexFields.push_back({
+        .name = addString(field.name),
+        .signature = addString(field.signature),
+        .generic = addString(field.generic),
+        .modifiers = field.modifiers,
+      });
+    }
+  }
+
+  SymbolIndexHeader header = {
+    .magic = kSymbolIndexMagic,
+    .version = kSymbolIndexVersion,
+    .key = symbolIndexKey,
+    .loadedClassCount = (uint32_t) classCount,
+    .classCount = (uint32_t) indexClasses.size(),
+    .methodCount = (uint32_t) indexMethods.size(),
+    .fieldCount = (uint32_t) indexFields.size(),
+    .lineCount = (uint32_t) indexLines.size(),
+    .stringBytes = (uint32_t) indexStrings.size(),
+  };
+  size_t classesOffset, methodsOffset, fieldsOffset, linesOffset, stringsOffset;
+  size_t size = GetSymbolIndexLayout(header, &classesOffset, &methodsOffset, &fieldsOffset, &linesOffset, &stringsOffset);
+  std::vector<uint8_t> buffer(size);
+  memcpy(buffer.data(), &header, sizeof(header));
+  memcpy(buffer.data() + classesOffset, indexClasses.data(), indexClasses.size() * sizeof(SymbolIndexClass));
+  memcpy(buffer.data() + methodsOffset, indexMethods.data(), indexMethods.size() * sizeof(SymbolIndexMethod));
+  memcpy(buffer.data() + fieldsOffset, indexFields.data(), indexFields.size() * sizeof(SymbolIndexField));
+  memcpy(buffer.data() + linesOffset, indexLines.data(), indexLines.size() * sizeof(SymbolIndexLine));
+  memcpy(buffer.data() + stringsOffset, indexStrings.data(), indexStrings.size());
+
+  // Written to a temporary file and renamed, so a concurrent attach never maps a partial index
+  std::string tmpPath = symbolIndexPath + ".tmp";
+  {
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+    out.close();
+    if (!out) {
+      __android_log_print(ANDROID_LOG_ERROR, "stoic", "Failed to write %s\n", tmpPath.c_str());
+      unlink(tmpPath.c_str());
+      return false;
+    }
+  }
+  if (rename(tmpPath.c_str(), symbolIndexPath.c_str()) != 0) {
+    __android_log_print(ANDROID_LOG_ERROR, "stoic", "Failed to rename %s: %s\n", tmpPath.c_str(), strerror(errno));
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Whether a symbol index was loaded at startup
+JNIEXPORT jboolean JNICALL
+Jvmti_VirtualMachine_nativeIsSymbolIndexLoaded(JNIEnv *jni, jobject vmClass) {
+  return symbolIndex.IsLoaded();
+}
+
+JNIEXPORT jobject JNICALL
+Jvmti_VirtualMachine_nativeToReflectedField(JNIEnv *jni, jobject vmClass, jclass clazz, jlong fieldId, jboolean isStatic) {
+  jfieldID castFieldId = reinterpret_cast<jfieldID>(fieldId);
+  return jni->ToReflectedField(clazz, castFieldId, isStatic);
+}
+
+JNIEXPORT jobject JNICALL
+Jvmti_VirtualMachine_nativeToReflectedMethod(JNIEnv *jni, jobject vmClass, jclass clazz, jlong methodId, jboolean isStatic) {
+  jmethodID castMethodId = reinterpret_cast<jmethodID>(methodId);
+  return jni->ToReflectedMethod(clazz, castMethodId, isStatic);
+}
+
+JNIEXPORT jlong JNICALL
+Jvmti_VirtualMachine_nativeFromReflectedMethod(JNIEnv *jni, jobject vmClass, jobject method) {
+  jmethodID methodId = jni->FromReflectedMethod(method);
+  return reinterpret_cast<jlong>(methodId);
+}
+
+JNIEXPORT jstring JNICALL
+Jvmti_VirtualMachine_nativeGetClassSignature(JNIEnv *jni, jobject vmClass, jclass clazz) {
+  char* signature = NULL;
+  char* generic = NULL;
+  CHECK_JVMTI(gdata->jvmti->GetClassSignature(clazz, &signature, &generic));
+  ScopedLocalRef<jstring> jsignature(jni, jni->NewStringUTF(signature));
+  //ScopedLocalRef<jstring> jgeneric(jni, jni->NewStringUTF(generic));
+  gdata->jvmti->Deallocate((unsigned char*) signature);
+  gdata->jvmti->Deallocate((unsigned char*) generic);
+
+  return jsignature.release();
+}
+
+// Must be called with threadStateMutex held. Returns nullptr if the thread is no longer alive.
+static ThreadState*
+GetThreadStateLocked(jvmtiEnv* jvmti, jthread thread) {
+  ThreadState* state = nullptr;
+  jvmtiError error = jvmti->GetThreadLocalStorage(thread, reinterpret_cast<void**>(&state));
+  if (error == JVMTI_ERROR_THREAD_NOT_ALIVE) {
+    return nullptr;
+  }
+  CHECK_JVMTI(error);
+
+  if (state == nullptr) {
+    state = new ThreadState;
+    CHECK_JVMTI(jvmti->SetThreadLocalStorage(thread, state));
+  }
+
+  return state;
+}
+
+static ThreadState*
+GetCurrentThreadState(jvmtiEnv* jvmti) {
+  if (currentThreadState == nullptr) {
+    std::lock_guard<std::mutex> lock(threadStateMutex);
+    currentThreadState = GetThreadStateLocked(jvmti, nullptr);
+    CHECK(currentThreadState != nullptr);
+  }
+
+  return currentThreadState;
+}
+
+// Must be called with threadStateMutex held
+static void
+UpdateMethodExitMode(jvmtiEnv* jvmti, jthread thread, ThreadState* state) {
+  bool isEnabled = state->methodExitUpcalls || state->methodExitWatches > 0;
+  CHECK_JVMTI(jvmti->SetEventNotificationMode(isEnabled ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_METHOD_EXIT, thread));
+}
+
+// Adjusts the number of return-value watches on the current thread
+static void
+AddMethodExitWatches(jvmtiEnv* jvmti, int delta) {
+  ThreadState* state = GetCurrentThreadState(jvmti);
+  std::lock_guard<std::mutex> lock(threadStateMutex);
+  state->methodExitWatches += delta;
+  CHECK_GE(state->methodExitWatches, 0);
+  UpdateMethodExitMode(jvmti, nullptr, state);
+}
+
+// Must be called with threadStateMutex held
+static void
+UpdateMethodEntryMode(jvmtiEnv* jvmti, jthread thread, ThreadState* state) {
+  bool isEnabled = state->methodEntryUpcalls || state->stepWantsMethodEntries;
+  CHECK_JVMTI(jvmti->SetEventNotificationMode(isEnabled ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_METHOD_ENTRY, thread));
+}
+
+// Enables the events that the current thread's step needs at its current height. Stepping over (or
+// out of) a call turns SingleStep off until the callee's frame pops, so the callee runs at full
+// speed rather than stopping at every instruction.
+static void
+UpdateStepEventModes(jvmtiEnv* jvmti, jthread thread) {
+  bool isHeightKnown = stepState.height != kUnknownHeight;
+  bool wantsSingleSteps = false;
+  bool wantsMethodEntries = false;
+  if (stepState.isActive) {
+    switch (stepState.depth) {
+      case kStepInto:
+        wantsSingleSteps = true;
+        wantsMethodEntries = isHeightKnown;
+        break;
+      case kStepOver:
+        wantsSingleSteps = !isHeightKnown || stepState.height <= stepState.startHeight;
+        wantsMethodEntries = stepState.height == stepState.startHeight;
+        break;
+      case kStepOut:
+        // The start frame is armed, so there's nothing to do until it pops
+        wantsSingleSteps = !isHeightKnown || stepState.height < stepState.startHeight;
+        break;
+    }
+  }
+
+  if (wantsSingleSteps != stepState.isSingleStepEnabled) {
+    CHECK_JVMTI(jvmti->SetEventNotificationMode(wantsSingleSteps ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_SINGLE_STEP, thread));
+    stepState.isSingleStepEnabled = wantsSingleSteps;
+  }
+  if (wantsMethodEntries != stepState.wantsMethodEntries) {
+    ThreadState* state = GetCurrentThreadState(jvmti);
+    std::lock_guard<std::mutex> lock(threadStateMutex);
+    state->stepWantsMethodEntries = wantsMethodEntries;
+    UpdateMethodEntryMode(jvmti, thread, state);
+    stepState.wantsMethodEntries = wantsMethodEntries;
+  }
+  UpdateFramePopMode(jvmti, thread);
+}
+
+// Called on every MethodEntry, while the current thread's step is tracking its height
+static void
+OnStepMethodEntry(jvmtiEnv* jvmti, jthread thread) {
+  if (!stepState.isActive || !stepState.wantsMethodEntries || stepState.height == kUnknownHeight) {
+    return;
+  }
+
+  // We need to hear when the new frame pops, which isn't possible for native methods
+  jvmtiError error = jvmti->NotifyFramePop(thread, 0);
+  if (error == JVMTI_ERROR_NONE || error == JVMTI_ERROR_DUPLICATE) {
+    stepState.height++;
+  } else {
+    stepState.resyncHeight = stepState.height;
+    stepState.height = kUnknownHeight;
+  }
+  UpdateStepEventModes(jvmti, thread);
+}
+
+// Called on every FramePop on the current thread. count is the height of the popped frame.
+static void
+OnStepFramePop(jvmtiEnv* jvmti, jthread thread, jint count) {
+  if (!stepState.isActive) {
+    return;
+  }
+  if (stepState.height == kUnknownHeight && count - 1 > stepState.resyncHeight) {
+    // A frame armed by someone else, above frames we haven't armed
+    return;
+  }
+  stepState.height = count - 1;
+  UpdateStepEventModes(jvmti, thread);
+}
+
+static void
+AddClassPrefixes(JNIEnv* jni, jobjectArray prefixes, ClassPrefixTrie* trie) {
+  jsize count = jni->GetArrayLength(prefixes);
+  for (jsize i = 0; i < count; i++) {
+    ScopedLocalRef<jstring> prefix(jni, (jstring) jni->GetObjectArrayElement(prefixes, i));
+    ScopedUtfChars prefixChars(jni, prefix.get());
+
+    // Class.getName form (com.example.) to signature form (Lcom/example/), with no trailing ';'
+    // since this is only a prefix
+    std::string signaturePrefix = "L";
+    for (const char* p = prefixChars.c_str(); *p != '\0'; ++p) {
+      signaturePrefix += (*p == '.' ? '/' : *p);
+    }
+    trie->Add(signaturePrefix);
+  }
+}
+
+static void
+AddMethodIds(JNIEnv* jni, jlongArray methodIds, std::unordered_set<jmethodID>* set) {
+  jsize count = jni->GetArrayLength(methodIds);
+  std::vector<jlong> ids(count);
+  jni->GetLongArrayRegion(methodIds, 0, count, ids.data());
+  for (jlong id : ids) {
+    set->insert(reinterpret_cast<jmethodID>(id));
+  }
+}
+
+static std::vector<MethodFilter*>
+ToMethodFilters(JNIEnv* jni, jlongArray handles) {
+  jsize count = jni->GetArrayLength(handles);
+  std::vector<jlong> rawHandles(count);
+  jni->GetLongArrayRegion(handles, 0, count, rawHandles.data());
+  std::vector<MethodFilter*> filters;
+  for (jlong handle : rawHandles) {
+    filters.push_back(reinterpret_cast<MethodFilter*>(handle));
+  }
+  return filters;
+}
+
+// Compiles a filter once, when the request is created. The returned handle must be destroyed with
+// nativeDestroyMethodFilter.
+JNIEXPORT jlong JNICALL
+Jvmti_VirtualMachine_nativeCreateMethodFilter(
+    JNIEnv *jni,
+    jobject vmClass,
+    jlongArray includeMethodIds,
+    jobjectArray includeClassPrefixes,
+    jlongArray excludeMethodIds,
+    jobjectArray excludeClassPrefixes) {
+  MethodFilter* filter = new MethodFilter;
+  AddMethodIds(jni, includeMethodIds, &filter->includeMethods);
+  AddClassPrefixes(jni, includeClassPrefixes, &filter->includeClasses);
+  AddMethodIds(jni, excludeMethodIds, &filter->excludeMethods);
+  AddClassPrefixes(jni, excludeClassPrefixes, &filter->excludeClasses);
+  return reinterpret_cast<jlong>(filter);
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeDestroyMethodFilter(JNIEnv *jni, jobject vmClass, jlong handle) {
+  delete reinterpret_cast<MethodFilter*>(handle);
+}
+
+// filters contains the filter handle of each of the thread's requests (0 for unfiltered requests)
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeMethodEntryCallbacks(JNIEnv *jni, jobject vmClass, jthread thread, jboolean isEnabled, jlongArray filters) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::lock_guard<std::mutex> lock(threadStateMutex);
+  ThreadState* state = GetThreadStateLocked(jvmti, thread);
+  if (state == nullptr) {
+    // The thread died - there's nothing to enable/disable
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> filterLock(state->filterMutex);
+    state->methodEntryFilters = ToMethodFilters(jni, filters);
+  }
+  state->methodEntryUpcalls = isEnabled;
+  UpdateMethodEntryMode(jvmti, thread, state);
+}
+
+// filters contains the filter handle of each of the thread's requests (0 for unfiltered requests)
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeMethodExitCallbacks(JNIEnv *jni, jobject vmClass, jthread thread, jboolean isEnabled, jlongArray filters) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::lock_guard<std::mutex> lock(threadStateMutex);
+  ThreadState* state = GetThreadStateLocked(jvmti, thread);
+  if (state == nullptr) {
+    // The thread died - there's nothing to enable/disable
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> filterLock(state->filterMutex);
+    state->methodExitFilters = ToMethodFilters(jni, filters);
+  }
+  state->methodExitUpcalls = isEnabled;
+  UpdateMethodExitMode(jvmti, thread, state);
+}
+
+// Returns the height of the frame of the event that the current thread is handling, i.e. the frame
+// just beneath the most recent event upcall. Only valid during the upcall - if the frame there
+// isn't running expectedMethodId then the caller has held on to a frame from an earlier event, and
+// this throws.
+JNIEXPORT jint JNICALL
+Jvmti_VirtualMachine_nativeGetEventFrameHeight(JNIEnv *jni, jobject vmClass, jlong expectedMethodId) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint count = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(nullptr, &count));
+
+  // The upcall is near the top, so walk down in small chunks rather than fetching the whole stack
+  constexpr jint kChunkSize = 32;
+  jvmtiFrameInfo frames[kChunkSize];
+  for (jint start = 0; start < count; start += kChunkSize) {
+    jint frameCount = 0;
+    CHECK_JVMTI(jvmti->GetStackTrace(nullptr, start, kChunkSize, frames, &frameCount));
+    for (jint i = 0; i < frameCount; i++) {
+      if (eventUpcallMethodIds.count(frames[i].method) == 0) {
+        continue;
+      }
+
+      // The event frame is the one beneath the upcall
+      jint depth = start + i + 1;
+      jmethodID methodId = nullptr;
+      jlocation location = -1;
+      jvmtiError error = jvmti->GetFrameLocation(nullptr, depth, &methodId, &location);
+      if (error != JVMTI_ERROR_NONE || methodId != reinterpret_cast<jmethodID>(expectedMethodId)) {
+        break;
+      }
+      return count - depth;
+    }
+  }
+
+  throwJvmtiError(jni, JVMTI_ERROR_NO_MORE_FRAMES, "the frame's height is only available during its event");
+  return -1;
+}
+
+// Arms a notification for when the frame at `height` on the current thread exits. This costs a
+// single FramePop event. If the return value is wanted then MethodExit is also enabled for the
+// thread until the frame exits, but exits of other frames are filtered out here rather than being
+// sent to Kotlin.
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeWatchFrameExit(JNIEnv *jni, jobject vmClass, jint height, jboolean wantsReturnValue) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jint frameCount = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(nullptr, &frameCount));
+  jint depth = frameCount - height;
+
+  jmethodID methodId = nullptr;
+  jlocation location = -1;
+  JVMTI_THROW_IF_ERROR(jvmti->GetFrameLocation(nullptr, depth, &methodId, &location), return);
+
+  // Another watch may have already armed this frame
+  jvmtiError error = jvmti->NotifyFramePop(nullptr, depth);
+  if (error != JVMTI_ERROR_DUPLICATE) {
+    JVMTI_THROW_IF_ERROR(error, return);
+  }
+
+  if (wantsReturnValue) {
+    AddMethodExitWatches(jvmti, 1);
+  }
+
+  frameExitWatches.push_back({
+    .methodId = methodId,
+    .height = height,
+    .wantsReturnValue = wantsReturnValue == JNI_TRUE,
+    .delivered = false,
+  });
+
+  jthread thread = nullptr;
+  CHECK_JVMTI(jvmti->GetCurrentThread(&thread));
+  UpdateFramePopMode(jvmti, thread);
+  jni->DeleteLocalRef(thread);
+}
+
+struct AgentInfo {
+  std::string options;
+};
+
+// Converts a class name to a type descriptor
+// (ex. "java.lang.String" to "Ljava/lang/String;")
+std::string classNameToDescriptor(const char* className) {
+  std::stringstream ss;
+  ss << "L";
+  for (auto p = className; *p != '\0'; ++p) {
+    ss << (*p == '.' ? '/' : *p);
+  }
+  ss << ";";
+  return ss.str();
+}
+
+// Converts a descriptor (Lthis/style/of/name;) to a jni-FindClass style Fully-qualified class name
+// (this/style/of/name).
+std::string DescriptorToFQCN(const std::string& descriptor) {
+  return descriptor.substr(1, descriptor.size() - 2);
+}
+
+static AgentInfo* GetAgentInfo(jvmtiEnv* jvmti) {
+  AgentInfo* ai = nullptr;
+  CHECK_EQ(jvmti->GetEnvironmentLocalStorage(reinterpret_cast<void**>(&ai)), JVMTI_ERROR_NONE);
+  CHECK(ai != nullptr);
+  return ai;
+}
+
+// Returns the key for the message being dispatched by the Handler.dispatchMessage frame at the top
+// of the main thread's stack
+static LooperMessageKey
+GetLooperMessageKey(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
+  LooperMessageKey key = {0, 0, 0};
+
+  jobject handler = nullptr;
+  jobject message = nullptr;
+  if (jvmti->GetLocalObject(thread, 0, mainLooperDispatchProbe.thisSlot, &handler) != JVMTI_ERROR_NONE ||
+      jvmti->GetLocalObject(thread, 0, mainLooperDispatchProbe.messageSlot, &message) != JVMTI_ERROR_NONE) {
+    return key;
+  }
+  ScopedLocalRef<jobject> handlerRef(jni, handler);
+  ScopedLocalRef<jobject> messageRef(jni, message);
+
+  jvmtiEnv* tagJvmti = gdata->classTagJvmti;
+  ScopedLocalRef<jclass> handlerClass(jni, jni->GetObjectClass(handler));
+  key.handlerClassId = classTagIndex.GetClassId(tagJvmti, jvmti, handlerClass.get());
+
+  if (message != nullptr) {
+    key.what = jni->GetIntField(message, gdata->messageWhat);
+    ScopedLocalRef<jobject> callback(jni, jni->GetObjectField(message, gdata->messageCallback));
+    if (callback.get() != nullptr) {
+      ScopedLocalRef<jclass> callbackClass(jni, jni->GetObjectClass(callback.get()));
+      key.callbackClassId = classTagIndex.GetClassId(tagJvmti, jvmti, callbackClass.get());
+    }
+  }
+
+  return key;
+}
+
+// Whether a Handler message dispatch on this thread starts a new main looper message. It's false
+// off the main thread, and for nested dispatches (which belong to the outer message). This is
+// checked before OnMainLooperDispatchStart so that other threads don't pay for GetFrameCount.
+static bool
+IsMainLooperDispatchStart(JNIEnv* jni, jthread thread) {
+  if (isMainThread == -1) {
+    isMainThread = jni->IsSameObject(thread, gdata->mainThread) ? 1 : 0;
+  }
+  return isMainThread == 1 && mainLooperDispatchHeight == 0;
+}
+
+// Called on the main thread when IsMainLooperDispatchStart
+static void
+OnMainLooperDispatchStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jint count) {
+  jvmtiError error = jvmti->NotifyFramePop(thread, 0);
+  if (error != JVMTI_ERROR_NONE && error != JVMTI_ERROR_DUPLICATE) {
+    __android_log_print(ANDROID_LOG_ERROR, "stoic", "NotifyFramePop failed: %d\n", error);
+    return;
+  }
+  mainLooperDispatchHeight = count;
+  UpdateFramePopMode(jvmti, thread);
+
+  if (looperStats.isEnabled) {
+    looperStats.messageKey = GetLooperMessageKey(jvmti, jni, thread);
+    looperStats.hasMessage = true;
+    looperStats.messageStartNanos = MonotonicNanos();
+  }
+
+  std::lock_guard<std::mutex> lock(jankWatchdog.mutex);
+  if (jankWatchdog.isEnabled) {
+    jankWatchdog.messageSeq++;
+    jankWatchdog.messageStartNanos = MonotonicNanos();
+    jankWatchdog.isMessageSlow = false;
+  }
+}
+
+// Called on the main thread when the message started by OnMainLooperDispatchStart finishes
+static void
+OnMainLooperDispatchEnd() {
+  mainLooperDispatchHeight = 0;
+  jlong now = MonotonicNanos();
+
+  if (looperStats.hasMessage) {
+    looperStats.hasMessage = false;
+    std::lock_guard<std::mutex> lock(looperStats.mutex);
+    LatencyHistogram*& histogram = looperStats.histograms[looperStats.messageKey];
+    if (histogram == nullptr) {
+      histogram = new LatencyHistogram;
+    }
+    histogram->Record(now - looperStats.messageStartNanos);
+  }
+
+  std::lock_guard<std::mutex> lock(jankWatchdog.mutex);
+  if (jankWatchdog.isMessageSlow) {
+    jankWatchdog.reports.push_back({
+      jankWatchdog.messageStartNanos,
+      now - jankWatchdog.messageStartNanos,
+      std::move(jankWatchdog.messageTree),
+    });
+    jankWatchdog.messageTree = CallTree();
+    if (jankWatchdog.reports.size() > kMaxJankReports) {
+      jankWatchdog.reports.pop_front();
+    }
+  }
+  jankWatchdog.messageStartNanos = 0;
+  jankWatchdog.isMessageSlow = false;
+}
+
+// Called when a profiled method is entered
+static void
+OnProfilerEntry(jvmtiEnv* jvmti, jthread thread, jmethodID methodId, jint count) {
+  ProfiledMethod* method = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(profiledMethodsMutex);
+    auto it = profiledMethods.find(methodId);
+    if (it == profiledMethods.end() || !it->second->isEnabled) {
+      return;
+    }
+    method = it->second;
+  }
+
+  if (!profilerShadowStack.empty() && profilerShadowStack.back().height == count) {
+    // A loop at the very start of the method jumped back to the entry location. This isn't a new
+    // call.
+    return;
+  }
+
+  jvmtiError error = jvmti->NotifyFramePop(thread, 0);
+  // DUPLICATE means Kotlin is already watching this frame. That's fine - CbFramePop handles both.
+  if (error != JVMTI_ERROR_NONE && error != JVMTI_ERROR_DUPLICATE) {
+    __android_log_print(ANDROID_LOG_ERROR, "stoic", "NotifyFramePop failed: %d\n", error);
+    return;
+  }
+
+  profilerShadowStack.push_back({method, count, MonotonicNanos()});
+  UpdateFramePopMode(jvmti, thread);
+}
+
+static constexpr int kMaxLogPointValues = 8;
+static constexpr int kMaxLogPointFrames = 16;
+static constexpr size_t kLogPointRingCapacity = 1024;
+
+// What a log-point captures when hit. This is fixed when the log-point is created so that a hit
+// never calls into Kotlin.
+struct LogPoint {
+  jmethodID methodId;
+  jlocation location;
+
+  // Local slots and their types (a primitive type char, or 'L' for an object's identity hash)
+  int valueCount;
+  jint slots[kMaxLogPointValues];
+  char types[kMaxLogPointValues];
+
+  bool captureThis;
+  int stackDepth;
+
+  // The log-point's handle. A unique ID rather than the LogPoint's address, since addresses are
+  // reused after a log-point is destroyed and a stale handle or record must never match a new one.
+  static inline std::atomic<jlong> nextId{1};
+  const jlong id = nextId++;
+};
+
+// A single log-point hit, copied into the ring buffer as-is. Floats and doubles are stored as their
+// raw bits.
+struct LogPointRecord {
+  // The LogPoint's id. The LogPoint may be gone by the time the record is drained.
+  jlong logPoint;
+  jlong timestampNanos;
+  jint tid;
+
+  // Bit i is set if values[i] was read (a local may not be live at the log-point)
+  uint32_t validValues;
+  jint valueCount;
+  jlong values[kMaxLogPointValues];
+  jint thisHash;
+  jint depth;
+  jvmtiFrameInfo frames[kMaxLogPointFrames];
+};
+
+// Log-point hits, waiting to be drained by a Kotlin thread. When full the oldest records are
+// overwritten, since the app thread must never wait for the drain.
+struct LogPointRing {
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // These are guarded by mutex
+  std::vector<LogPointRecord> records = std::vector<LogPointRecord>(kLogPointRingCapacity);
+  size_t head = 0;
+  size_t size = 0;
+  uint64_t dropped = 0;
+
+  // Guarded by mutex. Keyed by breakpoint site, since several log-points may share one. Hits hold
+  // a reference while capturing, so destroying a log-point never races with a capture.
+  std::map<std::pair<jmethodID, jlocation>, std::vector<std::shared_ptr<const LogPoint>>> logPoints;
+};
+
+static LogPointRing logPointRing;
+
+static void
+CaptureLogPoint(jvmtiEnv* jvmti, jthread thread, const LogPoint& logPoint, LogPointRecord* record) {
+  record->logPoint = logPoint.id;
+  record->timestampNanos = MonotonicNanos();
+  record->tid = gettid();
+  record->validValues = 0;
+  record->valueCount = logPoint.valueCount;
+  for (int i = 0; i < logPoint.valueCount; i++) {
+    jvmtiError error = JVMTI_ERROR_NONE;
+    jlong value = 0;
+    switch (logPoint.types[i]) {
+      case 'J':
+        error = jvmti->GetLocalLong(thread, 0, logPoint.slots[i], &value);
+        break;
+      case 'F': {
+        jfloat f = 0;
+        error = jvmti->GetLocalFloat(thread, 0, logPoint.slots[i], &f);
+        int32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        value = bits;
+        break;
+      }
+      case 'D': {
+        jdouble d = 0;
+        error = jvmti->GetLocalDouble(thread, 0, logPoint.slots[i], &d);
+        memcpy(&value, &d, sizeof(value));
+        break;
+      }
+      case 'L':
+      case '[': {
+        jobject object = nullptr;
+        error = jvmti->GetLocalObject(thread, 0, logPoint.slots[i], &object);
+        if (error == JVMTI_ERROR_NONE && object != nullptr) {
+          jint hash = 0;
+          error = jvmti->GetObjectHashCode(object, &hash);
+          value = hash;
+        }
+        break;
+      }
+      default: {
+        jint intValue = 0;
+        error = jvmti->GetLocalInt(thread, 0, logPoint.slots[i], &intValue);
+        value = intValue;
+        break;
+      }
+    }
+    record->values[i] = value;
+    if (error == JVMTI_ERROR_NONE) {
+      record->validValues |= 1u << i;
+    }
+  }
+
+  record->thisHash = 0;
+  if (logPoint.captureThis) {
+    jobject self = nullptr;
+    if (jvmti->GetLocalInstance(thread, 0, &self) == JVMTI_ERROR_NONE && self != nullptr) {
+      jvmti->GetObjectHashCode(self, &record->thisHash);
+    }
+  }
+
+  record->depth = 0;
+  if (logPoint.stackDepth > 0) {
+    // A log-point must never take down the app, so a failed stack walk is recorded as no stack
+    if (jvmti->GetStackTrace(thread, 0, logPoint.stackDepth, record->frames, &record->depth) != JVMTI_ERROR_NONE) {
+      record->depth = 0;
+    }
+  }
+}
+
+// Captures each log-point at (methodId, location) into the ring. This is all native, so it runs
+// even when callbacks aren't allowed.
+static void
+OnLogPoint(jvmtiEnv* jvmti, jthread thread, jmethodID methodId, jlocation location) {
+  std::vector<std::shared_ptr<const LogPoint>> logPoints;
+  {
+    std::lock_guard<std::mutex> lock(logPointRing.mutex);
+    auto it = logPointRing.logPoints.find({methodId, location});
+    if (it == logPointRing.logPoints.end()) {
+      return;
+    }
+    logPoints = it->second;
+  }
+
+  for (const std::shared_ptr<const LogPoint>& logPoint : logPoints) {
+    // Captured without the lock held, so hits on different threads don't serialize on JVMTI calls
+    LogPointRecord record;
+    CaptureLogPoint(jvmti, thread, *logPoint, &record);
+
+    std::lock_guard<std::mutex> lock(logPointRing.mutex);
+    if (logPointRing.size == kLogPointRingCapacity) {
+      logPointRing.head = (logPointRing.head + 1) % kLogPointRingCapacity;
+      logPointRing.size--;
+      logPointRing.dropped++;
+    }
+    logPointRing.records[(logPointRing.head + logPointRing.size) % kLogPointRingCapacity] = record;
+    logPointRing.size++;
+  }
+  logPointRing.cv.notify_one();
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeDestroyLogPoint(JNIEnv *jni, jobject vmClass, jlong handle) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+
+  // Unknown handles (already destroyed) are ignored
+  std::pair<jmethodID, jlocation> key;
+  bool isSiteUnused = false;
+  {
+    std::lock_guard<std::mutex> lock(logPointRing.mutex);
+    for (auto it = logPointRing.logPoints.begin(); it != logPointRing.logPoints.end(); ++it) {
+      auto& logPoints = it->second;
+      auto logPoint = std::find_if(
+          logPoints.begin(), logPoints.end(),
+          [handle](const std::shared_ptr<const LogPoint>& p) { return p->id == handle; });
+      if (logPoint == logPoints.end()) {
+        continue;
+      }
+
+      logPoints.erase(logPoint);
+      if (logPoints.empty()) {
+        key = it->first;
+        logPointRing.logPoints.erase(it);
+        isSiteUnused = true;
+      }
+      break;
+    }
+  }
+
+  if (isSiteUnused) {
+    ReleaseBreakpointSite(jvmti, key.first, key.second, &BreakpointSite::isLogPoint);
+  }
+}
+
+// Creates a log-point at (methodId, location). types holds a type char per slot (the first char of
+// the local's signature - objects are captured as their identity hash). Returns a handle for
+// nativeDestroyLogPoint.
+JNIEXPORT jlong JNICALL
+Jvmti_VirtualMachine_nativeCreateLogPoint(
+    JNIEnv *jni,
+    jobject vmClass,
+    jlong methodId,
+    jlong location,
+    jintArray slots,
+    jstring types,
+    jboolean captureThis,
+    jint stackDepth) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jmethodID castMethodId = reinterpret_cast<jmethodID>(methodId);
+
+  jsize valueCount = jni->GetArrayLength(slots);
+  ScopedUtfChars typeChars(jni, types);
+  if ((size_t) valueCount != strlen(typeChars.c_str())) {
+    throwJvmtiError(jni, JVMTI_ERROR_ILLEGAL_ARGUMENT, "log-point slots and types differ in length");
+    return 0;
+  }
+  if (valueCount > kMaxLogPointValues || stackDepth > kMaxLogPointFrames) {
+    throwJvmtiError(jni, JVMTI_ERROR_ILLEGAL_ARGUMENT, "too many log-point values or frames");
+    return 0;
+  }
+
+  jvmtiCapabilities caps;
+  CHECK_JVMTI(jvmti->GetCapabilities(&caps));
+  if ((valueCount > 0 || captureThis) && !caps.can_access_local_variables) {
+    throwJvmtiError(jni, JVMTI_ERROR_MUST_POSSESS_CAPABILITY, "can_access_local_variables");
+    return 0;
+  }
+
+  std::shared_ptr<LogPoint> logPoint = std::make_shared<LogPoint>();
+  logPoint->methodId = castMethodId;
+  logPoint->location = location;
+  logPoint->valueCount = valueCount;
+  jni->GetIntArrayRegion(slots, 0, valueCount, logPoint->slots);
+  memcpy(logPoint->types, typeChars.c_str(), valueCount);
+  logPoint->captureThis = captureThis;
+  logPoint->stackDepth = stackDepth;
+  jlong handle = logPoint->id;
+
+  {
+    std::lock_guard<std::mutex> lock(logPointRing.mutex);
+    logPointRing.logPoints[{castMethodId, location}].push_back(logPoint);
+  }
+
+  jvmtiError error = AcquireBreakpointSite(jvmti, castMethodId, location, &BreakpointSite::isLogPoint);
+  if (error != JVMTI_ERROR_NONE) {
+    Jvmti_VirtualMachine_nativeDestroyLogPoint(jni, vmClass, handle);
+    JVMTI_THROW_IF_ERROR(error, return 0);
+  }
+
+  return handle;
+}
+
+// Waits up to timeoutMillis for log-point hits, then removes and returns them packed as
+// [dropped, (logPoint, timestampNanos, tid, validValues, valueCount, value*, thisHash, depth,
+// (methodId, location)*)*], where dropped is the number of hits overwritten since the last drain
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativeDrainLogPoints(JNIEnv *jni, jobject vmClass, jint timeoutMillis) {
+  std::vector<LogPointRecord> records;
+  uint64_t dropped = 0;
+  {
+    std::unique_lock<std::mutex> lock(logPointRing.mutex);
+    logPointRing.cv.wait_for(lock, std::chrono::milliseconds(timeoutMillis), [] { return logPointRing.size > 0; });
+    for (size_t i = 0; i < logPointRing.size; i++) {
+      records.push_back(logPointRing.records[(logPointRing.head + i) % kLogPointRingCapacity]);
+    }
+    logPointRing.head = 0;
+    logPointRing.size = 0;
+    dropped = logPointRing.dropped;
+    logPointRing.dropped = 0;
+  }
+
+  std::vector<jlong> packed;
+  packed.push_back(dropped);
+  for (const LogPointRecord& record : records) {
+    packed.push_back(record.logPoint);
+    packed.push_back(record.timestampNanos);
+    packed.push_back(record.tid);
+    packed.push_back(record.validValues);
+    packed.push_back(record.valueCount);
+    packed.insert(packed.end(), record.values, record.values + record.valueCount);
+    packed.push_back(record.thisHash);
+    packed.push_back(record.depth);
+    for (jint i = 0; i < record.depth; i++) {
+      packed.push_back(reinterpret_cast<jlong>(record.frames[i].method));
+      packed.push_back(record.frames[i].location);
+    }
+  }
+
+  jlongArray result = jni->NewLongArray(packed.size());
+  jni->SetLongArrayRegion(result, 0, packed.size(), packed.data());
+  return result;
+}
+
+// Line coverage for a method: one probe per line start, recorded in a bitmap
+struct MethodCoverage {
+  // Sorted by location
+  std::vector<jlocation> locations;
+  std::vector<jint> lines;
+
+  // Bit i is set once locations[i] has executed
+  std::vector<uint8_t> bits;
+
+  bool IsCovered(size_t i) const {
+    return (bits[i / 8] >> (i % 8)) & 1;
+  }
+
+  void SetCovered(size_t i) {
+    bits[i / 8] |= 1 << (i % 8);
+  }
+
+  // Adds an uncovered probe, keeping the coverage of existing probes
+  void AddProbe(jlocation location, jint line) {
+    auto it = std::lower_bound(locations.begin(), locations.end(), location);
+    if (it != locations.end() && *it == location) {
+      return;
+    }
+    size_t index = it - locations.begin();
+
+    std::vector<uint8_t> oldBits(std::move(bits));
+    bits.assign((locations.size() + 1 + 7) / 8, 0);
+    for (size_t i = 0; i < locations.size(); i++) {
+      if ((oldBits[i / 8] >> (i % 8)) & 1) {
+        SetCovered(i < index ? i : i + 1);
+      }
+    }
+
+    locations.insert(it, location);
+    lines.insert(lines.begin() + index, line);
+  }
+};
+
+// Each probe is a breakpoint that clears itself the first time it's hit, so a line costs a single
+// event over the whole session no matter how hot it is.
+struct Coverage {
+  std::mutex mutex;
+
+  // Guarded by mutex
+  std::unordered_map<jmethodID, MethodCoverage> methods;
+};
+
+static Coverage coverage;
+
+static void
+OnCoverageProbe(jvmtiEnv* jvmti, jmethodID methodId, jlocation location) {
+  {
+    std::lock_guard<std::mutex> lock(coverage.mutex);
+    auto it = coverage.methods.find(methodId);
+    if (it == coverage.methods.end()) {
+      return;
+    }
+
+    MethodCoverage& method = it->second;
+    auto probe = std::lower_bound(method.locations.begin(), method.locations.end(), location);
+    if (probe == method.locations.end() || *probe != location) {
+      return;
+    }
+    method.SetCovered(probe - method.locations.begin());
+  }
+
+  ReleaseBreakpointSite(jvmti, methodId, location, &BreakpointSite::isCoverageProbe);
+}
+
+static void JNICALL
+CbBreakpoint(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jmethodID methodId, jlocation location) {
+  BreakpointSite site = GetBreakpointSite(methodId, location);
+
+  // Native instrumentation runs regardless of callbacksAllowed, since it never calls into Kotlin
+  bool isMainLooperDispatchStart = site.isMainLooperDispatch && IsMainLooperDispatchStart(jni, thread);
+  jint count = -1;
+  if (site.isProfilerEntry || isMainLooperDispatchStart) {
+    CHECK_JVMTI(jvmti->GetFrameCount(thread, &count));
+  }
+  if (site.isProfilerEntry) {
+    OnProfilerEntry(jvmti, thread, methodId, count);
+  }
+  if (isMainLooperDispatchStart) {
+    OnMainLooperDispatchStart(jvmti, jni, thread, count);
+  }
+  if (site.isCoverageProbe) {
+    OnCoverageProbe(jvmti, methodId, location);
+  }
+  if (site.isLogPoint) {
+    OnLogPoint(jvmti, thread, methodId, location);
+  }
+
+  if (!site.hasKotlinRequests || !callbacksAllowed) {
+    return;
+  }
+
+  if (count == -1) {
+    count = kUnknownHeight;
+  }
+
+  jlong methodIdAsLong = reinterpret_cast<jlong>(methodId);
+
+  callbacksAllowed = false;
+  jni->CallStaticVoidMethod(
+      gdata->stoicJvmtiVmClass,
+      gdata->nativeCallbackOnBreakpoint,
+      methodIdAsLong,
+      location,
+      count);
+  callbacksAllowed = true;
+}
+
+static void JNICALL
+CbMethodEntry(
+    jvmtiEnv* jvmti,
+    JNIEnv* jni,
+    jthread thread,
+    jmethodID methodId) {
+  // The step tracks frames pushed by callbacks too, so it sees their pops balance out
+  OnStepMethodEntry(jvmti, thread);
+
+  if (!callbacksAllowed) {
+    return;
+  }
+
+  // MethodEntry may only be enabled for the sake of a step
+  ThreadState* state = GetCurrentThreadState(jvmti);
+  if (!state->methodEntryUpcalls || !state->PassesFilters(jvmti, jni, state->methodEntryFilters, methodId)) {
+    return;
+  }
+
+  // On entry we're at the start of the method, which doesn't require a stack walk to find. Native
+  // methods have no location, which is reported as -1 just as GetFrameLocation would.
+  jlocation location = -1;
+  jlocation endLocation = -1;
+  jvmtiError error = jvmti->GetMethodLocation(methodId, &location, &endLocation);
+  if (error == JVMTI_ERROR_NATIVE_METHOD) {
+    location = -1;
+  } else {
+    CHECK_JVMTI(error);
+  }
+  if (kIsDebug) {
+    jmethodID frameMethodId = nullptr;
+    jlocation frameLocation = -1;
+    CHECK_JVMTI(jvmti->GetFrameLocation(thread, 0, &frameMethodId, &frameLocation));
+    CHECK_EQ(frameMethodId, methodId);
+    CHECK_EQ(frameLocation, location);
+  }
+
+  jint count = kUnknownHeight;
+  jlong methodIdAsLong = reinterpret_cast<jlong>(methodId);
+
+  callbacksAllowed = false;
+  jni->CallStaticVoidMethod(
+      gdata->stoicJvmtiVmClass,
+      gdata->nativeCallbackOnMethodEntry,
+      methodIdAsLong,
+      location,
+      count);
+  callbacksAllowed = true;
+}
+
+static void JNICALL
+CbMethodExit(
+    jvmtiEnv* jvmti,
+    JNIEnv* jni,
+    jthread thread,
+    jmethodID methodId,
+    jboolean was_popped_by_exception,
+    jvalue return_value) {
+  if (!callbacksAllowed) {
+    return;
+  }
+
+  jint count = -1;
+  bool isWatchedFrame = false;
+  for (auto& watch : frameExitWatches) {
+    // Comparing jmethodIDs is cheap, so we only compute the frame count for the watched method(s)
+    if (watch.wantsReturnValue && !watch.delivered && watch.methodId == methodId) {
+      if (count == -1) {
+        CHECK_JVMTI(jvmti->GetFrameCount(thread, &count));
+      }
+      if (watch.height == count) {
+        watch.delivered = true;
+        isWatchedFrame = true;
+      }
+    }
+  }
+
+  if (!isWatchedFrame) {
+    // MethodExit may only be enabled for the sake of a frame exit watch, in which case this isn't an
+    // exit that Kotlin wants
+    ThreadState* state = GetCurrentThreadState(jvmti);
+    if (!state->methodExitUpcalls || !state->PassesFilters(jvmti, jni, state->methodExitFilters, methodId)) {
+      return;
+    }
+  }
+
+  if (count == -1) {
+    count = kUnknownHeight;
+  }
+
+  // Only the top frame is visited to find the location, so this is cheap even for deep stacks
+  jmethodID frameMethodId = nullptr;
+  jlocation location = -1;
+  CHECK_JVMTI(jvmti->GetFrameLocation(thread, 0, &frameMethodId, &location));
+  if (kIsDebug) {
+    CHECK_EQ(frameMethodId, methodId);
+  }
+  jlong methodIdAsLong = reinterpret_cast<jlong>(methodId);
+
+  char* signature = NULL;
+  CHECK_JVMTI(jvmti->GetMethodName(methodId, NULL, &signature, NULL));
+  char* closingParen = strchr(signature, ')');
+  CHECK(closingParen != NULL);
+  // The return type is the first character after the ')' - for objects this will be L
+  char returnType = closingParen[1];
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) signature));
+
+  // Primitives are passed through unboxed - only object return values pass a reference
+  callbacksAllowed = false;
+  switch (returnType) {
+#define CALL_METHOD_EXIT_CALLBACK(type, typeChar, member) \
+    case typeChar: \
+      jni->CallStaticVoidMethod( \
+          gdata->stoicJvmtiVmClass, \
+          gdata->nativeCallbackOnMethodExit##type, \
+          methodIdAsLong, \
+          location, \
+          count, \
+          return_value.member, \
+          was_popped_by_exception); \
+      break;
+    FOR_EACH_PRIMITIVE_TYPE(CALL_METHOD_EXIT_CALLBACK)
+#undef CALL_METHOD_EXIT_CALLBACK
+
+    case 'L':
+    case '[':
+      jni->CallStaticVoidMethod(
+          gdata->stoicJvmtiVmClass,
+          gdata->nativeCallbackOnMethodExitL,
+          methodIdAsLong,
+          location,
+          count,
+          return_value.l,
+          was_popped_by_exception);
+      break;
+
+    case 'V':
+      jni->CallStaticVoidMethod(
+          gdata->stoicJvmtiVmClass,
+          gdata->nativeCallbackOnMethodExitV,
+          methodIdAsLong,
+          location,
+          count,
+          was_popped_by_exception);
+      break;
+
+    default:
+      __android_log_print(ANDROID_LOG_ERROR, "stoic", "unhandled return type: %c\n", returnType);
+      break;
+  }
+  callbacksAllowed = true;
+}
+
+static void JNICALL
+CbFramePop(
+    jvmtiEnv* jvmti,
+    JNIEnv* jni,
+    jthread thread,
+    jmethodID methodId,
+    jboolean was_popped_by_exception) {
+  // Note: We must process the pop even if callbacks aren't allowed, otherwise the watch would never
+  // be removed
+  if (frameExitWatches.empty() && profilerShadowStack.empty() && mainLooperDispatchHeight == 0 && !stepState.isActive) {
+    UpdateFramePopMode(jvmti, thread);
+    return;
+  }
+
+  jint count = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(thread, &count));
+
+  OnStepFramePop(jvmti, thread, count);
+
+  if (mainLooperDispatchHeight != 0 && mainLooperDispatchHeight >= count) {
+    OnMainLooperDispatchEnd();
+  }
+
+  if (!profilerShadowStack.empty()) {
+    jlong now = MonotonicNanos();
+    // As with watches, shadow frames above this one were popped without a FramePop, and their
+    // durations are unknown
+    while (!profilerShadowStack.empty() && profilerShadowStack.back().height >= count) {
+      ShadowFrame& frame = profilerShadowStack.back();
+      if (frame.height == count && frame.method->methodId == methodId) {
+        frame.method->histogram.Record(now - frame.startNanos);
+      }
+      profilerShadowStack.pop_back();
+    }
+  }
+
+  if (frameExitWatches.empty()) {
+    UpdateFramePopMode(jvmti, thread);
+    return;
+  }
+
+  bool needsUpcall = false;
+  int methodExitWatches = 0;
+  for (auto it = frameExitWatches.begin(); it != frameExitWatches.end();) {
+    // A watch for a frame above this one can only remain if its frame was popped without generating
+    // a FramePop, so we clean it up here too
+    if (it->height >= count) {
+      needsUpcall |= !it->delivered;
+      methodExitWatches += it->wantsReturnValue ? 1 : 0;
+      it = frameExitWatches.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  if (methodExitWatches > 0) {
+    AddMethodExitWatches(jvmti, -methodExitWatches);
+  }
+  UpdateFramePopMode(jvmti, thread);
+
+  if (!needsUpcall || !callbacksAllowed) {
+    return;
+  }
+
+  jmethodID frameMethodId = nullptr;
+  jlocation location = -1;
+  CHECK_JVMTI(jvmti->GetFrameLocation(thread, 0, &frameMethodId, &location));
+  if (kIsDebug) {
+    CHECK_EQ(frameMethodId, methodId);
+  }
+
+  callbacksAllowed = false;
+  jni->CallStaticVoidMethod(
+      gdata->stoicJvmtiVmClass,
+      gdata->nativeCallbackOnFramePop,
+      reinterpret_cast<jlong>(methodId),
+      location,
+      count,
+      was_popped_by_exception);
+  callbacksAllowed = true;
+}
+
+// Matches exceptions whose class is one of (or a subclass of) a set of classes, identified by their
+// ClassTagIndex IDs. The decision for each thrown class is cached, so after the first throw of a
+// class, filtering it costs a GetTag and a lookup.
+class ExceptionClassFilter {
+ public:
+  // Empty classIds matches every exception
+  explicit ExceptionClassFilter(std::unordered_set<jlong> classIds) : classIds(std::move(classIds)) {}
+
+  // Must be called with exceptionTracer.mutex held
+  bool Matches(jvmtiEnv* jvmti, JNIEnv* jni, jclass exceptionClass, jlong exceptionClassId) {
+    if (classIds.empty()) {
+      return true;
+    }
+
+    auto it = decisions.find(exceptionClassId);
+    if (it != decisions.end()) {
+      return it->second;
+    }
+
+    bool isMatch = false;
+    ScopedLocalRef<jclass> klass(jni, (jclass) jni->NewLocalRef(exceptionClass));
+    while (klass.get() != nullptr && !isMatch) {
+      isMatch = classIds.count(classTagIndex.GetClassId(gdata->classTagJvmti, jvmti, klass.get())) != 0;
+      klass.reset(jni->GetSuperclass(klass.get()));
+    }
+    decisions[exceptionClassId] = isMatch;
+    return isMatch;
+  }
+
+ private:
+  std::unordered_set<jlong> classIds;
+  std::unordered_map<jlong, bool> decisions;
+};
+
+// Where an exception was thrown and caught. catchMethod is nullptr for exceptions that weren't
+// caught by Java code.
+struct ExceptionSiteKey {
+  jlong classId;
+  jmethodID throwMethod;
+  jlocation throwLocation;
+  jmethodID catchMethod;
+  jlocation catchLocation;
+
+  bool operator<(const ExceptionSiteKey& other) const {
+    return std::tie(classId, throwMethod, throwLocation, catchMethod, catchLocation)
+        < std::tie(other.classId, other.throwMethod, other.throwLocation, other.catchMethod, other.catchLocation);
+  }
+};
+
+// Exception handling. Exceptions may be aggregated natively by site (for finding
+// hotspots), forwarded to Kotlin (for ExceptionRequests), or both, each with its own class filter.
+struct ExceptionTracer {
+  std::mutex mutex;
+
+  // These are guarded by mutex. A null filter means that mode is off.
+  std::unique_ptr<ExceptionClassFilter> statsFilter;
+  std::unique_ptr<ExceptionClassFilter> forwardFilter;
+  std::map<ExceptionSiteKey, uint64_t> stats;
+};
+
+static ExceptionTracer exceptionTracer;
+
+static void JNICALL
+CbException(
+    jvmtiEnv* jvmti,
+    JNIEnv* jni,
+    jthread thread,
+    jmethodID methodId,
+    jlocation location,
+    jobject exception,
+    jmethodID catchMethodId,
+    jlocation catchLocation) {
+  ScopedLocalRef<jclass> exceptionClass(jni, jni->GetObjectClass(exception));
+  jlong classId = classTagIndex.GetClassId(gdata->classTagJvmti, jvmti, exceptionClass.get());
+
+  bool isForwarded = false;
+  {
+    std::lock_guard<std::mutex> lock(exceptionTracer.mutex);
+    // Exceptions are counted as they're thrown, using the VM's prediction of where they'll be caught.
+    // Waiting for ExceptionCatch would mean enabling it globally (which deoptimizes everything on
+    // ART), and would miss exceptions that are caught by native code.
+    if (exceptionTracer.statsFilter != nullptr
+        && exceptionTracer.statsFilter->Matches(jvmti, jni, exceptionClass.get(), classId)) {
+      ExceptionSiteKey key = {classId, methodId, location, catchMethodId, catchMethodId == nullptr ? -1 : catchLocation};
+      exceptionTracer.stats[key]++;
+    }
+    isForwarded = exceptionTracer.forwardFilter != nullptr
+        && exceptionTracer.forwardFilter->Matches(jvmti, jni, exceptionClass.get(), classId);
+  }
+
+  if (!isForwarded || !callbacksAllowed) {
+    return;
+  }
+
+  jint count = kUnknownHeight;
+
+  callbacksAllowed = false;
+  jni->CallStaticVoidMethod(
+      gdata->stoicJvmtiVmClass,
+      gdata->nativeCallbackOnException,
+      reinterpret_cast<jlong>(methodId),
+      location,
+      count,
+      exception,
+      reinterpret_cast<jlong>(catchMethodId),
+      catchMethodId == nullptr ? (jlocation) -1 : catchLocation);
+  callbacksAllowed = true;
+}
+
+// Must be called with exceptionTracer.mutex held
+static void
+UpdateExceptionEvents(jvmtiEnv* jvmti) {
+  bool isEnabled = exceptionTracer.statsFilter != nullptr || exceptionTracer.forwardFilter != nullptr;
+  jvmtiEventMode mode = isEnabled ? JVMTI_ENABLE : JVMTI_DISABLE;
+  CHECK_JVMTI(jvmti->SetEventNotificationMode(mode, JVMTI_EVENT_EXCEPTION, nullptr));
+}
+
+// Returns null (with an exception thrown) if exception events aren't available
+static std::unique_ptr<ExceptionClassFilter>
+NewExceptionClassFilter(JNIEnv* jni, jvmtiEnv* jvmti, jobjectArray classes) {
+  jvmtiCapabilities caps;
+  CHECK_JVMTI(jvmti->GetCapabilities(&caps));
+  if (!caps.can_generate_exception_events) {
+    throwJvmtiError(jni, JVMTI_ERROR_MUST_POSSESS_CAPABILITY, "can_generate_exception_events");
+    return nullptr;
+  }
+
+  std::unordered_set<jlong> classIds;
+  jsize count = jni->GetArrayLength(classes);
+  for (jsize i = 0; i < count; i++) {
+    ScopedLocalRef<jclass> klass(jni, (jclass) jni->GetObjectArrayElement(classes, i));
+    classIds.insert(classTagIndex.GetClassId(gdata->classTagJvmti, jvmti, klass.get()));
+  }
+  return std::unique_ptr<ExceptionClassFilter>(new ExceptionClassFilter(std::move(classIds)));
+}
+
+// Aggregates exceptions of the given classes (and their subclasses), or of all classes if classes
+// is empty
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStartExceptionStats(JNIEnv *jni, jobject vmClass, jobjectArray classes) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::unique_ptr<ExceptionClassFilter> filter = NewExceptionClassFilter(jni, jvmti, classes);
+  if (filter == nullptr) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(exceptionTracer.mutex);
+  exceptionTracer.statsFilter = std::move(filter);
+  UpdateExceptionEvents(jvmti);
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStopExceptionStats(JNIEnv *jni, jobject vmClass) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::lock_guard<std::mutex> lock(exceptionTracer.mutex);
+  exceptionTracer.statsFilter.reset();
+  UpdateExceptionEvents(jvmti);
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeResetExceptionStats(JNIEnv *jni, jobject vmClass) {
+  std::lock_guard<std::mutex> lock(exceptionTracer.mutex);
+  exceptionTracer.stats.clear();
+}
+
+// Returns the counts packed as
+// [classId, throwMethodId, throwLocation, catchMethodId (0 if uncaught), catchLocation, count]*
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativeGetExceptionStats(JNIEnv *jni, jobject vmClass) {
+  std::vector<jlong> packed;
+  {
+    std::lock_guard<std::mutex> lock(exceptionTracer.mutex);
+    for (auto& entry : exceptionTracer.stats) {
+      const ExceptionSiteKey& key = entry.first;
+      packed.push_back(key.classId);
+      packed.push_back(reinterpret_cast<jlong>(key.throwMethod));
+      packed.push_back(key.throwLocation);
+      packed.push_back(reinterpret_cast<jlong>(key.catchMethod));
+      packed.push_back(key.catchLocation);
+      packed.push_back(entry.second);
+    }
+  }
+
+  jlongArray result = jni->NewLongArray(packed.size());
+  jni->SetLongArrayRegion(result, 0, packed.size(), packed.data());
+  return result;
+}
+
+// Forwards exceptions of the given classes (or all, if classes is empty) to Kotlin via
+// nativeCallbackOnException
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeExceptionCallbacks(JNIEnv *jni, jobject vmClass, jboolean isEnabled, jobjectArray classes) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::unique_ptr<ExceptionClassFilter> filter;
+  if (isEnabled) {
+    filter = NewExceptionClassFilter(jni, jvmti, classes);
+    if (filter == nullptr) {
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(exceptionTracer.mutex);
+  exceptionTracer.forwardFilter = std::move(filter);
+  UpdateExceptionEvents(jvmti);
+}
+
+// Tests applied natively to a watched field's value. Must match FieldWatch.Predicate in Kotlin.
+enum FieldPredicateOp {
+  kFieldAny,
+  kFieldEquals,
+  kFieldNotEquals,
+  kFieldLessThan,
+  kFieldGreaterThan,
+  kFieldIsNull,
+  kFieldIsNotNull,
+};
+
+// A field access or modification watch. Values are filtered natively so that only the interesting
+// accesses/modifications of a hot field reach Kotlin.
+struct FieldWatch {
+  jclass klass;
+  jfieldID fieldId;
+
+  // The first char of the field's signature - 'L' or '[' for objects
+  char typeChar;
+  bool isModification;
+
+  // Only report events on this thread (a global ref), or on all threads if null
+  jthread thread;
+
+  // Only report modifications that change the value
+  bool onlyChanges;
+
+  // Applied to the new value for modifications or to the current value for accesses. The operand
+  // is encoded like FieldValueBits.
+  FieldPredicateOp op;
+  jlong operandBits;
+
+  // If false, matching events are only counted
+  bool isForwarded;
+
+  std::atomic<uint64_t> hits{0};
+};
+
+static std::mutex fieldWatchesMutex;
+
+// Guarded by fieldWatchesMutex. Keyed by (field, isModification) - JVMTI has one access watch and
+// one modification watch per field, shared by all the FieldWatches on it.
+static std::map<std::pair<jfieldID, bool>, std::vector<FieldWatch*>> fieldWatches;
+
+// The threads that FIELD_ACCESS (index 0) and FIELD_MODIFICATION (index 1) are enabled on. Guarded
+// by fieldWatchesMutex.
+struct FieldEventMode {
+  bool isGlobal = false;
+
+  // Global refs
+  std::vector<jthread> threads;
+};
+
+static FieldEventMode fieldEventModes[2];
+
+// Must be called with fieldWatchesMutex held, whenever the watches change. Enables the event for
+// all threads if some watch wants every thread, otherwise only on the threads the watches are
+// restricted to, and not at all once no watches remain.
+static void
+UpdateFieldEventMode(jvmtiEnv* jvmti, JNIEnv* jni, bool isModification) {
+  jvmtiEvent event = isModification ? JVMTI_EVENT_FIELD_MODIFICATION : JVMTI_EVENT_FIELD_ACCESS;
+  auto contains = [jni](const std::vector<jthread>& threads, jthread thread) {
+    return std::any_of(threads.begin(), threads.end(), [jni, thread](jthread t) { return jni->IsSameObject(t, thread); });
+  };
+
+  bool wantsGlobal = false;
+  std::vector<jthread> wantedThreads;
+  for (auto& entry : fieldWatches) {
+    if (entry.first.second != isModification) {
+      continue;
+    }
+    for (FieldWatch* watch : entry.second) {
+      if (watch->thread == nullptr) {
+        wantsGlobal = true;
+      } else if (!contains(wantedThreads, watch->thread)) {
+        wantedThreads.push_back(watch->thread);
+      }
+    }
+  }
+  if (wantsGlobal) {
+    wantedThreads.clear();
+  }
+
+  FieldEventMode& mode = fieldEventModes[isModification ? 1 : 0];
+  if (wantsGlobal != mode.isGlobal) {
+    CHECK_JVMTI(jvmti->SetEventNotificationMode(wantsGlobal ? JVMTI_ENABLE : JVMTI_DISABLE, event, nullptr));
+    mode.isGlobal = wantsGlobal;
+  }
+
+  // Threads that have since died can't be enabled or disabled, and won't generate events anyway
+  std::vector<jthread> enabledThreads;
+  for (jthread thread : mode.threads) {
+    if (contains(wantedThreads, thread)) {
+      enabledThreads.push_back(thread);
+      continue;
+    }
+    jvmtiError err = jvmti->SetEventNotificationMode(JVMTI_DISABLE, event, thread);
+    CHECK(err == JVMTI_ERROR_NONE || err == JVMTI_ERROR_THREAD_NOT_ALIVE);
+    jni->DeleteGlobalRef(thread);
+  }
+  for (jthread thread : wantedThreads) {
+    if (contains(enabledThreads, thread)) {
+      continue;
+    }
+    jvmtiError err = jvmti->SetEventNotificationMode(JVMTI_ENABLE, event, thread);
+    CHECK(err == JVMTI_ERROR_NONE || err == JVMTI_ERROR_THREAD_NOT_ALIVE);
+    enabledThreads.push_back((jthread) jni->NewGlobalRef(thread));
+  }
+  mode.threads = std::move(enabledThreads);
+}
+
+// Reading a watched field via JNI may itself be reported as a field access, so we ignore field
+// events that happen while we're handling one
+thread_local bool isInFieldWatch = false;
+
+static bool
+IsObjectType(char typeChar) {
+  return typeChar == 'L' || typeChar == '[';
+}
+
+// Reads a field via JNI. object is null for static fields.
+static jvalue
+ReadFieldValue(JNIEnv* jni, char typeChar, jclass klass, jobject object, jfieldID fieldId) {
+  jvalue value = {};
+  switch (typeChar) {
+    case 'Z': value.z = object ? jni->GetBooleanField(object, fieldId) : jni->GetStaticBooleanField(klass, fieldId); break;
+    case 'B': value.b = object ? jni->GetByteField(object, fieldId) : jni->GetStaticByteField(klass, fieldId); break;
+    case 'C': value.c = object ? jni->GetCharField(object, fieldId) : jni->GetStaticCharField(klass, fieldId); break;
+    case 'S': value.s = object ? jni->GetShortField(object, fieldId) : jni->GetStaticShortField(klass, fieldId); break;
+    case 'I': value.i = object ? jni->GetIntField(object, fieldId) : jni->GetStaticIntField(klass, fieldId); break;
+    case 'J': value.j = object ? jni->GetLongField(object, fieldId) : jni->GetStaticLongField(klass, fieldId); break;
+    case 'F': value.f = object ? jni->GetFloatField(object, fieldId) : jni->GetStaticFloatField(klass, fieldId); break;
+    case 'D': value.d = object ? jni->GetDoubleField(object, fieldId) : jni->GetStaticDoubleField(klass, fieldId); break;
+    default: value.l = object ? jni->GetObjectField(object, fieldId) : jni->GetStaticObjectField(klass, fieldId); break;
+  }
+  return value;
+}
+
+// Primitive values cross to Kotlin as raw bits (floats via their IEEE representation) so that they
+// don't need to be boxed. FieldWatch.decode reverses this.
+static jlong
+FieldValueBits(char typeChar, jvalue value) {
+  switch (typeChar) {
+    case 'Z': return value.z;
+    case 'B': return value.b;
+    case 'C': return value.c;
+    case 'S': return value.s;
+    case 'I': return value.i;
+    case 'J': return value.j;
+    case 'F': {
+      int32_t bits;
+      memcpy(&bits, &value.f, sizeof(bits));
+      return bits;
+    }
+    case 'D': {
+      jlong bits;
+      memcpy(&bits, &value.d, sizeof(bits));
+      return bits;
+    }
+    default: return 0;
+  }
+}
+
+static bool
+FieldValuesEqual(JNIEnv* jni, char typeChar, jvalue a, jvalue b) {
+  if (IsObjectType(typeChar)) {
+    return jni->IsSameObject(a.l, b.l);
+  }
+  return FieldValueBits(typeChar, a) == FieldValueBits(typeChar, b);
+}
+
+static bool
+FieldPredicateMatches(JNIEnv* jni, const FieldWatch& watch, jvalue value) {
+  if (watch.op == kFieldAny) {
+    return true;
+  } else if (IsObjectType(watch.typeChar)) {
+    bool isNull = jni->IsSameObject(value.l, nullptr);
+    return watch.op == kFieldIsNull ? isNull : watch.op == kFieldIsNotNull ? !isNull : false;
+  }
+
+  // Compare numerically, so that e.g. -1 < 0 for ints and 0.5 < 1.0 for floats
+  int cmp;
+  if (watch.typeChar == 'F' || watch.typeChar == 'D') {
+    jvalue operand;
+    operand.j = watch.operandBits;
+    double lhs = watch.typeChar == 'F' ? value.f : value.d;
+    double rhs;
+    if (watch.typeChar == 'F') {
+      int32_t bits = (int32_t) watch.operandBits;
+      memcpy(&operand.f, &bits, sizeof(bits));
+      rhs = operand.f;
+    } else {
+      rhs = operand.d;
+    }
+    cmp = lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+  } else {
+    jlong lhs = FieldValueBits(watch.typeChar, value);
+    cmp = lhs < watch.operandBits ? -1 : lhs > watch.operandBits ? 1 : 0;
+  }
+
+  switch (watch.op) {
+    case kFieldEquals: return cmp == 0;
+    case kFieldNotEquals: return cmp != 0;
+    case kFieldLessThan: return cmp < 0;
+    case kFieldGreaterThan: return cmp > 0;
+    default: return false;
+  }
+}
+
+// Handles both FieldAccess and FieldModification. newValue is only meaningful for modifications.
+static void
+OnFieldWatchEvent(
+    jvmtiEnv* jvmti,
+    JNIEnv* jni,
+    jthread thread,
+    jmethodID methodId,
+    jlocation location,
+    jclass fieldClass,
+    jobject object,
+    jfieldID fieldId,
+    bool isModification,
+    jvalue newValue) {
+  if (isInFieldWatch) {
+    return;
+  }
+  isInFieldWatch = true;
+
+  // The value before the event, read lazily since most unfiltered watches won't need it
+  bool hasOldValue = false;
+  jvalue oldValue = {};
+  std::vector<jlong> forwarded;
+  char typeChar = 0;
+  {
+    std::lock_guard<std::mutex> lock(fieldWatchesMutex);
+    auto it = fieldWatches.find({fieldId, isModification});
+    if (it != fieldWatches.end()) {
+      for (FieldWatch* watch : it->second) {
+        if (watch->thread != nullptr && !jni->IsSameObject(watch->thread, thread)) {
+          continue;
+        }
+
+        typeChar = watch->typeChar;
+        bool needsOldValue = !isModification || watch->onlyChanges || watch->isForwarded;
+        if (needsOldValue && !hasOldValue) {
+          oldValue = ReadFieldValue(jni, typeChar, fieldClass, object, fieldId);
+          hasOldValue = true;
+        }
+
+        if (isModification && watch->onlyChanges && FieldValuesEqual(jni, typeChar, oldValue, newValue)) {
+          continue;
+        }
+        if (!FieldPredicateMatches(jni, *watch, isModification ? newValue : oldValue)) {
+          continue;
+        }
+
+        watch->hits++;
+        if (watch->isForwarded) {
+          forwarded.push_back(reinterpret_cast<jlong>(watch));
+        }
+      }
+    }
+  }
+
+  if (!forwarded.empty() && callbacksAllowed) {
+    jint count = kUnknownHeight;
+
+    // For accesses the "new" value is just the value that was read
+    jvalue reportedValue = isModification ? newValue : oldValue;
+    bool isObject = IsObjectType(typeChar);
+
+    callbacksAllowed = false;
+    for (jlong handle : forwarded) {
+      jni->CallStaticVoidMethod(
+          gdata->stoicJvmtiVmClass,
+          gdata->nativeCallbackOnFieldWatch,
+          handle,
+          reinterpret_cast<jlong>(methodId),
+          location,
+          count,
+          object,
+          FieldValueBits(typeChar, oldValue),
+          isObject ? oldValue.l : nullptr,
+          FieldValueBits(typeChar, reportedValue),
+          isObject ? reportedValue.l : nullptr);
+    }
+    callbacksAllowed = true;
+  }
+
+  if (hasOldValue && IsObjectType(typeChar)) {
+    jni->DeleteLocalRef(oldValue.l);
+  }
+  isInFieldWatch = false;
+}
+
+static void JNICALL
+CbFieldAccess(
+    jvmtiEnv* jvmti,
+    JNIEnv* jni,
+    jthread thread,
+    jmethodID methodId,
+    jlocation location,
+    jclass fieldClass,
+    jobject object,
+    jfieldID fieldId) {
+  OnFieldWatchEvent(jvmti, jni, thread, methodId, location, fieldClass, object, fieldId, false, jvalue{});
+}
+
+static void JNICALL
+CbFieldModification(
+    jvmtiEnv* jvmti,
+    JNIEnv* jni,
+    jthread thread,
+    jmethodID methodId,
+    jlocation location,
+    jclass fieldClass,
+    jobject object,
+    jfieldID fieldId,
+    char signatureType,
+    jvalue newValue) {
+  OnFieldWatchEvent(jvmti, jni, thread, methodId, location, fieldClass, object, fieldId, true, newValue);
+}
+
+// Returns a handle to the watch, to be passed to nativeGetFieldWatchHits/nativeDestroyFieldWatch.
+// thread may be null to watch all threads.
+JNIEXPORT jlong JNICALL
+Jvmti_VirtualMachine_nativeCreateFieldWatch(
+    JNIEnv *jni,
+    jobject vmClass,
+    jclass klass,
+    jlong fieldId,
+    jboolean isModification,
+    jthread thread,
+    jboolean onlyChanges,
+    jint op,
+    jlong operandBits,
+    jboolean isForwarded) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  jfieldID castFieldId = reinterpret_cast<jfieldID>(fieldId);
+
+  char* signature = nullptr;
+  JVMTI_THROW_IF_ERROR(jvmti->GetFieldName(klass, castFieldId, nullptr, &signature, nullptr), return 0);
+  char typeChar = signature[0];
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) signature));
+
+  FieldWatch* watch = new FieldWatch;
+  watch->klass = (jclass) jni->NewGlobalRef(klass);
+  watch->fieldId = castFieldId;
+  watch->typeChar = typeChar;
+  watch->isModification = isModification;
+  watch->thread = thread == nullptr ? nullptr : (jthread) jni->NewGlobalRef(thread);
+  watch->onlyChanges = onlyChanges;
+  watch->op = (FieldPredicateOp) op;
+  watch->operandBits = operandBits;
+  watch->isForwarded = isForwarded;
+
+  std::lock_guard<std::mutex> lock(fieldWatchesMutex);
+  std::vector<FieldWatch*>& watches = fieldWatches[{castFieldId, watch->isModification}];
+  if (watches.empty()) {
+    jvmtiError err = isModification
+        ? jvmti->SetFieldModificationWatch(klass, castFieldId)
+        : jvmti->SetFieldAccessWatch(klass, castFieldId);
+    if (err != JVMTI_ERROR_NONE) {
+      fieldWatches.erase({castFieldId, watch->isModification});
+      jni->DeleteGlobalRef(watch->klass);
+      if (watch->thread != nullptr) {
+        jni->DeleteGlobalRef(watch->thread);
+      }
+      delete watch;
+      JVMTI_THROW_IF_ERROR(err, return 0);
+    }
+  }
+  watches.push_back(watch);
+  UpdateFieldEventMode(jvmti, jni, watch->isModification);
+
+  return reinterpret_cast<jlong>(watch);
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeDestroyFieldWatch(JNIEnv *jni, jobject vmClass, jlong handle) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  FieldWatch* watch = reinterpret_cast<FieldWatch*>(handle);
+
+  {
+    std::lock_guard<std::mutex> lock(fieldWatchesMutex);
+    auto key = std::make_pair(watch->fieldId, watch->isModification);
+    std::vector<FieldWatch*>& watches = fieldWatches[key];
+    watches.erase(std::remove(watches.begin(), watches.end(), watch), watches.end());
+    if (watches.empty()) {
+      fieldWatches.erase(key);
+      jvmtiError err = watch->isModification
+          ? jvmti->ClearFieldModificationWatch(watch->klass, watch->fieldId)
+          : jvmti->ClearFieldAccessWatch(watch->klass, watch->fieldId);
+      // The watch goes away on its own if the class was unloaded
+      CHECK(err == JVMTI_ERROR_NONE || err == JVMTI_ERROR_NOT_FOUND);
+    }
+    UpdateFieldEventMode(jvmti, jni, watch->isModification);
+  }
+
+  jni->DeleteGlobalRef(watch->klass);
+  if (watch->thread != nullptr) {
+    jni->DeleteGlobalRef(watch->thread);
+  }
+  delete watch;
+}
+
+// The number of events that passed the watch's filters, whether or not they were forwarded
+JNIEXPORT jlong JNICALL
+Jvmti_VirtualMachine_nativeGetFieldWatchHits(JNIEnv *jni, jobject vmClass, jlong handle) {
+  return reinterpret_cast<FieldWatch*>(handle)->hits;
+}
+
+// Returns the line starts of klass packed as [line, methodId, location]*, sorted by line
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativeGetLineLocations(JNIEnv *jni, jobject vmClass, jclass klass) {
+  ProcessClassUnloads();
+  std::shared_ptr<const ClassLines> lines = lineIndex.Get(gdata->jvmti, jni, klass);
+  std::vector<jlong> packed;
+  packed.reserve(3 * lines->locations.size());
+  for (const LineLocation& loc : lines->locations) {
+    packed.push_back(loc.line);
+    packed.push_back(reinterpret_cast<jlong>(loc.methodId));
+    packed.push_back(loc.location);
+  }
+
+  jlongArray result = jni->NewLongArray(packed.size());
+  jni->SetLongArrayRegion(result, 0, packed.size(), packed.data());
+  return result;
+}
+
+// Returns null if the class has no SourceFile attribute
+JNIEXPORT jstring JNICALL
+Jvmti_VirtualMachine_nativeGetSourceFileName(JNIEnv *jni, jobject vmClass, jclass klass) {
+  std::shared_ptr<const ClassLines> lines = lineIndex.Get(gdata->jvmti, jni, klass);
+  return lines->sourceFile.empty() ? nullptr : jni->NewStringUTF(lines->sourceFile.c_str());
+}
+
+// Arms a Kotlin breakpoint at the start of each of lines in klass - one per method containing the
+// line. Returns the armed locations packed as [line, methodId, location]*. Lines without code are
+// skipped. If arming fails then no breakpoints are left armed.
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativeSetBreakpointsAtLines(JNIEnv *jni, jobject vmClass, jclass klass, jintArray lines) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  ProcessClassUnloads();
+  std::shared_ptr<const ClassLines> classLines = lineIndex.Get(jvmti, jni, klass);
+
+  jsize lineCount = jni->GetArrayLength(lines);
+  std::vector<jint> requested(lineCount);
+  jni->GetIntArrayRegion(lines, 0, lineCount, requested.data());
+
+  std::vector<LineLocation> armed;
+
+  // The subset of armed that already had Kotlin requests is left alone on failure
+  std::vector<LineLocation> newlyArmed;
+  for (jint line : requested) {
+    auto it = std::lower_bound(
+        classLines->locations.begin(), classLines->locations.end(), line,
+        [](const LineLocation& loc, jint line) { return loc.line < line; });
+
+    // Locations are sorted by (line, method, location), so the first location of each method is
+    // where that method's part of the line starts
+    jmethodID lastMethod = nullptr;
+    for (; it != classLines->locations.end() && it->line == line; ++it) {
+      if (it->methodId == lastMethod) {
+        continue;
+      }
+      lastMethod = it->methodId;
+
+      bool isNewlyAcquired = false;
+      jvmtiError error = AcquireBreakpointSite(
+          jvmti, it->methodId, it->location, &BreakpointSite::hasKotlinRequests, &isNewlyAcquired);
+      if (error != JVMTI_ERROR_NONE) {
+        for (const LineLocation& loc : newlyArmed) {
+          ReleaseBreakpointSite(jvmti, loc.methodId, loc.location, &BreakpointSite::hasKotlinRequests);
+        }
+        JVMTI_THROW_IF_ERROR(error, return nullptr);
+      }
+      armed.push_back(*it);
+      if (isNewlyAcquired) {
+        newlyArmed.push_back(*it);
+      }
+    }
+  }
+
+  std::vector<jlong> packed;
+  packed.reserve(3 * armed.size());
+  for (const LineLocation& loc : armed) {
+    packed.push_back(loc.line);
+    packed.push_back(reinterpret_cast<jlong>(loc.methodId));
+    packed.push_back(loc.location);
+  }
+
+  jlongArray result = jni->NewLongArray(packed.size());
+  jni->SetLongArrayRegion(result, 0, packed.size(), packed.data());
+  return result;
+}
+
+// Arms a coverage probe at every line start of each of classes that isn't covered yet. Classes
+// already being covered keep their coverage.
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStartCoverage(JNIEnv *jni, jobject vmClass, jobjectArray classes) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::lock_guard<std::mutex> lock(coverage.mutex);
+
+  jsize classCount = jni->GetArrayLength(classes);
+  for (jsize i = 0; i < classCount; i++) {
+    ScopedLocalRef<jclass> klass(jni, (jclass) jni->GetObjectArrayElement(classes, i));
+    std::shared_ptr<const ClassLines> classLines = lineIndex.Get(jvmti, jni, klass.get());
+    for (const LineLocation& loc : classLines->locations) {
+      auto it = coverage.methods.find(loc.methodId);
+      if (it == coverage.methods.end()) {
+        it = coverage.methods.emplace(loc.methodId, MethodCoverage()).first;
+      }
+      it->second.AddProbe(loc.location, loc.line);
+    }
+  }
+
+  for (auto& entry : coverage.methods) {
+    MethodCoverage& method = entry.second;
+    for (size_t i = 0; i < method.locations.size(); i++) {
+      if (!method.IsCovered(i)) {
+        JVMTI_THROW_IF_ERROR(AcquireBreakpointSite(jvmti, entry.first, method.locations[i], &BreakpointSite::isCoverageProbe), return);
+      }
+    }
+  }
+}
+
+// Disarms the remaining probes. Coverage recorded so far is kept until nativeResetCoverage.
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStopCoverage(JNIEnv *jni, jobject vmClass) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::lock_guard<std::mutex> lock(coverage.mutex);
+  for (auto& entry : coverage.methods) {
+    MethodCoverage& method = entry.second;
+    for (size_t i = 0; i < method.locations.size(); i++) {
+      if (!method.IsCovered(i)) {
+        ReleaseBreakpointSite(jvmti, entry.first, method.locations[i], &BreakpointSite::isCoverageProbe);
+      }
+    }
+  }
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeResetCoverage(JNIEnv *jni, jobject vmClass) {
+  Jvmti_VirtualMachine_nativeStopCoverage(jni, vmClass);
+  std::lock_guard<std::mutex> lock(coverage.mutex);
+  coverage.methods.clear();
+}
+
+static void
+AppendU32(std::vector<uint8_t>* out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back((value >> (8 * i)) & 0xff);
+  }
+}
+
+static void
+AppendString(std::vector<uint8_t>* out, const char* str) {
+  size_t length = strlen(str);
+  CHECK(length <= 0xffff);
+  out->push_back(length & 0xff);
+  out->push_back(length >> 8);
+  out->insert(out->end(), str, str + length);
+}
+
+// Returns the coverage as a self-describing binary report, in little-endian:
+//   "STCV", u32 version (1), u32 methodCount, then for each method:
+//   u16-length-prefixed class signature, name and signature (modified UTF-8), u32 probeCount,
+//   i32 line[probeCount], u8 bitmap[(probeCount + 7) / 8] (bit i set if probe i executed)
+JNIEXPORT jbyteArray JNICALL
+Jvmti_VirtualMachine_nativeGetCoverageReport(JNIEnv *jni, jobject vmClass) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::vector<uint8_t> report = {'S', 'T', 'C', 'V'};
+  AppendU32(&report, 1);
+
+  std::lock_guard<std::mutex> lock(coverage.mutex);
+  AppendU32(&report, coverage.methods.size());
+  for (auto& entry : coverage.methods) {
+    const MethodCoverage& method = entry.second;
+
+    jclass declaringClass = nullptr;
+    CHECK_JVMTI(jvmti->GetMethodDeclaringClass(entry.first, &declaringClass));
+    char* classSignature = nullptr;
+    CHECK_JVMTI(jvmti->GetClassSignature(declaringClass, &classSignature, nullptr));
+    jni->DeleteLocalRef(declaringClass);
+    char* name = nullptr;
+    char* signature = nullptr;
+    CHECK_JVMTI(jvmti->GetMethodName(entry.first, &name, &signature, nullptr));
+
+    AppendString(&report, classSignature);
+    AppendString(&report, name);
+    AppendString(&report, signature);
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) classSignature));
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) name));
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) signature));
+
+    AppendU32(&report, method.locations.size());
+    for (jint line : method.lines) {
+      AppendU32(&report, line);
+    }
+    report.insert(report.end(), method.bits.begin(), method.bits.end());
+  }
+
+  jbyteArray result = jni->NewByteArray(report.size());
+  jni->SetByteArrayRegion(result, 0, report.size(), reinterpret_cast<const jbyte*>(report.data()));
+  return result;
+}
+
+// java.lang.reflect.Modifier flags, as returned by GetMethodModifiers
+static constexpr jint kAccStatic = 0x0008;
+static constexpr jint kAccNative = 0x0100;
+
+static MethodArguments
+GetMethodArguments(jvmtiEnv* jvmti, jmethodID methodId) {
+  std::lock_guard<std::mutex> lock(methodArgumentsMutex);
+  auto it = methodArgumentsCache.find(methodId);
+  if (it != methodArgumentsCache.end()) {
+    return it->second;
+  }
+
+  MethodArguments args;
+  char* signature = nullptr;
+  CHECK_JVMTI(jvmti->GetMethodName(methodId, nullptr, &signature, nullptr));
+  for (const char* p = signature + 1; *p != ')'; p++) {
+    args.types.push_back(*p);
+    // Skip the rest of the type: array dimensions, then a class name
+    while (*p == '[') {
+      p++;
+    }
+    if (*p == 'L') {
+      p = strchr(p, ';');
+    }
+  }
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) signature));
+
+  jint modifiers = 0;
+  CHECK_JVMTI(jvmti->GetMethodModifiers(methodId, &modifiers));
+  jint maxLocals = 0;
+  jint argsSize = 0;
+  if ((modifiers & kAccNative) == 0) {
+    CHECK_JVMTI(jvmti->GetMaxLocals(methodId, &maxLocals));
+    CHECK_JVMTI(jvmti->GetArgumentsSize(methodId, &argsSize));
+  }
+  bool isStatic = (modifiers & kAccStatic) != 0;
+  args.firstSlot = maxLocals - argsSize + (isStatic ? 0 : 1);
+
+  methodArgumentsCache[methodId] = args;
+  return args;
+}
+
+// Returns the stack of `thread` (innermost first, up to maxDepth frames) as
+// {long[] packed, Object[] objectArgs}, where packed is
+// [methodId, location, line, argCount, argBits*]* - line is -1 if unknown, and argCount is -1 if
+// the arguments weren't captured. Primitive arguments are packed as bits (floats/doubles as their
+// raw bits), and object arguments are in objectArgs, which has an entry for every packed argument.
+//
+// Arguments can only be read from the current thread (JVMTI requires other threads to be
+// suspended), and only with can_access_local_variables.
+JNIEXPORT jobjectArray JNICALL
+Jvmti_VirtualMachine_nativeSnapshotStack(JNIEnv *jni, jobject vmClass, jthread thread, jint maxDepth, jboolean captureArgs) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  if (maxDepth < 0) {
+    throwJvmtiError(jni, JVMTI_ERROR_ILLEGAL_ARGUMENT, "maxDepth must not be negative");
+    return nullptr;
+  }
+
+  ProcessClassUnloads();
+  std::vector<jvmtiFrameInfo> frames(maxDepth);
+  jint depth = 0;
+  JVMTI_THROW_IF_ERROR(jvmti->GetStackTrace(thread, 0, maxDepth, frames.data(), &depth), return nullptr);
+
+  if (captureArgs) {
+    jvmtiCapabilities caps;
+    CHECK_JVMTI(jvmti->GetCapabilities(&caps));
+    jthread current = nullptr;
+    CHECK_JVMTI(jvmti->GetCurrentThread(&current));
+    captureArgs = caps.can_access_local_variables && (thread == nullptr || jni->IsSameObject(thread, current));
+    jni->DeleteLocalRef(current);
+  }
+
+  std::vector<jlong> packed;
+  std::vector<jobject> objectArgs;
+  for (jint i = 0; i < depth; i++) {
+    jmethodID methodId = frames[i].method;
+    jlocation location = frames[i].location;
+    bool isLineStart = false;
+    packed.push_back(reinterpret_cast<jlong>(methodId));
+    packed.push_back(location);
+    packed.push_back(location == -1 ? -1 : lineTableCache.GetLine(jvmti, methodId, location, &isLineStart));
+
+    if (!captureArgs || location == -1) {
+      packed.push_back(-1);
+      continue;
+    }
+
+    MethodArguments args = GetMethodArguments(jvmti, methodId);
+    size_t argCountIndex = packed.size();
+    size_t firstObjectArg = objectArgs.size();
+    packed.push_back(args.types.size());
+    jint slot = args.firstSlot;
+    for (char type : args.types) {
+      jvmtiError error = JVMTI_ERROR_NONE;
+      jlong bits = 0;
+      jobject object = nullptr;
+      switch (type) {
+        case 'J':
+          error = jvmti->GetLocalLong(thread, i, slot, &bits);
+          slot += 2;
+          break;
+        case 'D': {
+          jdouble value = 0;
+          error = jvmti->GetLocalDouble(thread, i, slot, &value);
+          memcpy(&bits, &value, sizeof(bits));
+          slot += 2;
+          break;
+        }
+        case 'F': {
+          jfloat value = 0;
+          error = jvmti->GetLocalFloat(thread, i, slot, &value);
+          int32_t floatBits;
+          memcpy(&floatBits, &value, sizeof(floatBits));
+          bits = floatBits;
+          slot++;
+          break;
+        }
+        case 'L':
+        case '[':
+          error = jvmti->GetLocalObject(thread, i, slot, &object);
+          slot++;
+          break;
+        default: {
+          jint value = 0;
+          error = jvmti->GetLocalInt(thread, i, slot, &value);
+          bits = value;
+          slot++;
+          break;
+        }
+      }
+
+      if (error != JVMTI_ERROR_NONE) {
+        // e.g. the argument's register was reused by the optimizing compiler - report the frame
+        // without arguments
+        packed.resize(argCountIndex + 1);
+        packed[argCountIndex] = -1;
+        for (size_t j = firstObjectArg; j < objectArgs.size(); j++) {
+          jni->DeleteLocalRef(objectArgs[j]);
+        }
+        objectArgs.resize(firstObjectArg);
+        break;
+      }
+      packed.push_back(bits);
+      objectArgs.push_back(object);
+    }
+  }
+
+  ScopedLocalRef<jclass> objectClass(jni, jni->FindClass("java/lang/Object"));
+  ScopedLocalRef<jlongArray> packedArray(jni, jni->NewLongArray(packed.size()));
+  jni->SetLongArrayRegion(packedArray.get(), 0, packed.size(), packed.data());
+  ScopedLocalRef<jobjectArray> objectsArray(jni, jni->NewObjectArray(objectArgs.size(), objectClass.get(), nullptr));
+  for (size_t i = 0; i < objectArgs.size(); i++) {
+    jni->SetObjectArrayElement(objectsArray.get(), i, objectArgs[i]);
+    jni->DeleteLocalRef(objectArgs[i]);
+  }
+
+  jobjectArray result = jni->NewObjectArray(2, objectClass.get(), nullptr);
+  jni->SetObjectArrayElement(result, 0, packedArray.get());
+  jni->SetObjectArrayElement(result, 1, objectsArray.get());
+  return result;
+}
+
+// Decides whether the step is complete at (height, methodId, location)
+static bool
+IsStepComplete(jvmtiEnv* jvmti, JNIEnv* jni, jint height, jmethodID methodId, jlocation location) {
+  if (height < stepState.startHeight) {
+    // Returned from the frame we started in
+    return true;
+  } else if (stepState.depth == kStepOut) {
+    return false;
+  } else if (height > stepState.startHeight) {
+    if (stepState.depth == kStepOver || methodId == stepState.lastFilteredMethod) {
+      return false;
+    }
+
+    // Stepped into a method - only check the filter when the method changes
+    if (stepState.filter == nullptr || stepState.filter->Matches(jvmti, jni, methodId)) {
+      return true;
+    }
+    stepState.lastFilteredMethod = methodId;
+    return false;
+  }
+
+  // Back at the starting height. This is a new line if the line number changed, or if we jumped
+  // back to the start of the same line (e.g. the next iteration of a one-line loop).
+  bool isLineStart = false;
+  jint line = lineTableCache.GetLine(jvmti, methodId, location, &isLineStart);
+  bool isLoopBack = isLineStart && location <= stepState.lastLocation;
+  stepState.lastLocation = location;
+  return methodId != stepState.startMethod || line != stepState.startLine || isLoopBack;
+}
+
+static void JNICALL
+CbSingleStep(
+    jvmtiEnv* jvmti,
+    JNIEnv* jni,
+    jthread thread,
+    jmethodID methodId,
+    jlocation location) {
+  if (!stepState.isActive || !callbacksAllowed) {
+    return;
+  }
+
+  // Only count the frames if we've lost track of the height
+  jint count = stepState.height;
+  if (count == kUnknownHeight) {
+    CHECK_JVMTI(jvmti->GetFrameCount(thread, &count));
+    if (count <= stepState.resyncHeight) {
+      stepState.height = count;
+      UpdateStepEventModes(jvmti, thread);
+    }
+  }
+  if (!IsStepComplete(jvmti, jni, count, methodId, location)) {
+    return;
+  }
 
-  jvmti->Deallocate((unsigned char*) name);
-  jvmti->Deallocate((unsigned char*) signature);
-  jvmti->Deallocate((unsigned char*) generic);
+  stepState.isActive = false;
+  UpdateStepEventModes(jvmti, thread);
+
+  callbacksAllowed = false;
+  jni->CallStaticVoidMethod(
+      gdata->stoicJvmtiVmClass,
+      gdata->nativeCallbackOnStep,
+      reinterpret_cast<jlong>(methodId),
+      location,
+      count);
+  callbacksAllowed = true;
 }
 
+// Starts a step on the current thread from the frame at `height`, replacing any step in progress.
+// The step completes (with a call to nativeCallbackOnStep) at the next line of that frame, when the
+// frame returns, or - for kStepInto - on entry to a method that passes filter (0 for no filter).
 JNIEXPORT void JNICALL
-Jvmti_VirtualMachine_nativeGetFieldCoreMetadata(JNIEnv *jni, jobject vmClass, jobject jvmtiField) {
+Jvmti_VirtualMachine_nativeStartStep(JNIEnv *jni, jobject vmClass, jint height, jint depth, jlong filter) {
   jvmtiEnv* jvmti = gdata->jvmti;
+  jvmtiCapabilities caps;
+  CHECK_JVMTI(jvmti->GetCapabilities(&caps));
+  if (!caps.can_generate_single_step_events) {
+    throwJvmtiError(jni, JVMTI_ERROR_MUST_POSSESS_CAPABILITY, "can_generate_single_step_events");
+    return;
+  }
 
-  jlong longFieldId = jni->GetLongField(jvmtiField, gdata->stoicJvmtiFieldFieldId);
-  jfieldID castFieldId = reinterpret_cast<jfieldID>(longFieldId);
+  jint count = -1;
+  CHECK_JVMTI(jvmti->GetFrameCount(nullptr, &count));
+  jmethodID methodId = nullptr;
+  jlocation location = -1;
+  JVMTI_THROW_IF_ERROR(jvmti->GetFrameLocation(nullptr, count - height, &methodId, &location), return);
 
-  ScopedLocalRef<jclass> clazz(jni, (jclass) jni->GetObjectField(jvmtiField, gdata->stoicJvmtiFieldClazz));
+  // The step always ends once the start frame pops
+  jvmtiError error = jvmti->NotifyFramePop(nullptr, count - height);
+  if (error != JVMTI_ERROR_DUPLICATE) {
+    JVMTI_THROW_IF_ERROR(error, return);
+  }
 
-  char* name = NULL;
-  char* signature = NULL;
-  char* generic = NULL;
-  CHECK_JVMTI(jvmti->GetFieldName(clazz.get(), castFieldId, &name, &signature, &generic));
-  ScopedLocalRef<jstring> jname(jni, jni->NewStringUTF(name));
-  ScopedLocalRef<jstring> jsignature(jni, jni->NewStringUTF(signature));
-  ScopedLocalRef<jstring> jgeneric(jni, jni->NewStringUTF(generic));
+  bool isLineStart = false;
+  stepState.depth = (StepDepth) depth;
+  stepState.startHeight = height;
+  stepState.startMethod = methodId;
+  stepState.startLine = lineTableCache.GetLine(jvmti, methodId, location, &isLineStart);
+  stepState.lastLocation = location;
+  stepState.filter = reinterpret_cast<MethodFilter*>(filter);
+  stepState.lastFilteredMethod = nullptr;
+  stepState.height = kUnknownHeight;
+  stepState.resyncHeight = height;
+  stepState.isActive = true;
+
+  // Events are only enabled for this thread, since enabling SingleStep (or FramePop) for all threads
+  // deoptimizes everything
+  jthread thread = nullptr;
+  CHECK_JVMTI(jvmti->GetCurrentThread(&thread));
+  UpdateStepEventModes(jvmti, thread);
+  jni->DeleteLocalRef(thread);
+}
 
-  jint modifiers = -1;
-  CHECK_JVMTI(jvmti->GetFieldModifiers(clazz.get(), castFieldId, &modifiers));
+// Cancels the step in progress on the current thread, if any
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeCancelStep(JNIEnv *jni, jobject vmClass) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  if (!stepState.isActive) {
+    return;
+  }
+  stepState.isActive = false;
 
-  jni->SetObjectField(jvmtiField, gdata->stoicJvmtiFieldPrivateName, jname.get());
-  jni->SetObjectField(jvmtiField, gdata->stoicJvmtiFieldPrivateSignature, jsignature.get());
-  jni->SetObjectField(jvmtiField, gdata->stoicJvmtiFieldPrivateGeneric, jgeneric.get());
-  jni->SetIntField(jvmtiField, gdata->stoicJvmtiFieldPrivateModifiers, modifiers);
+  jthread thread = nullptr;
+  CHECK_JVMTI(jvmti->GetCurrentThread(&thread));
+  UpdateStepEventModes(jvmti, thread);
+  jni->DeleteLocalRef(thread);
+}
 
-  jvmti->Deallocate((unsigned char*) name);
-  jvmti->Deallocate((unsigned char*) signature);
-  jvmti->Deallocate((unsigned char*) generic);
+// Returns the index of monitor in monitors, adding it if it isn't there yet. Takes ownership of the
+// local ref. Monitors are compared by identity, so hash codes are only used to skip the
+// IsSameObject calls.
+static jint
+InternMonitor(JNIEnv* jni, jvmtiEnv* jvmti, jobject monitor, std::vector<jobject>* monitors, std::vector<jint>* hashes) {
+  jint hash = 0;
+  CHECK_JVMTI(jvmti->GetObjectHashCode(monitor, &hash));
+  for (size_t i = 0; i < monitors->size(); i++) {
+    if ((*hashes)[i] == hash && jni->IsSameObject((*monitors)[i], monitor)) {
+      // monitors holds its own ref, so this one would otherwise leak until we return to Java
+      jni->DeleteLocalRef(monitor);
+      return i;
+    }
+  }
+  monitors->push_back(monitor);
+  hashes->push_back(hash);
+  return monitors->size() - 1;
 }
 
-JNIEXPORT jobject JNICALL
-Jvmti_VirtualMachine_nativeGetLocalVariables(JNIEnv *jni, jobject vmClass, jlong methodId) {
+// Dumps every thread with its stack (up to maxDepth frames), owned monitors and contended monitor,
+// and finds deadlocks: cycles of threads each blocked entering a monitor owned by the next.
+//
+// Returns {long[] packed, Thread[] threads, Object[] monitors} where packed is
+//   threadCount, then per thread: state (a SampledThreadState, or -1 if not alive),
+//     contendedMonitor (index, or -1), ownedCount, (monitor, depth)*, frameCount,
+//     (methodId, location)*
+//   cycleCount, then per cycle: length, thread*
+// Owned monitors have a depth of -1 if they were acquired by JNI rather than by a frame. Monitor
+// info is omitted if the capabilities for it aren't available.
+JNIEXPORT jobjectArray JNICALL
+Jvmti_VirtualMachine_nativeDumpThreads(JNIEnv *jni, jobject vmClass, jint maxDepth) {
   jvmtiEnv* jvmti = gdata->jvmti;
-  jmethodID castMethodId = reinterpret_cast<jmethodID>(methodId);
-  jint entryCount = -1;
-  jvmtiLocalVariableEntry* table = NULL;
+  jvmtiCapabilities caps;
+  CHECK_JVMTI(jvmti->GetCapabilities(&caps));
+
+  jint threadCount = 0;
+  jthread* threads = nullptr;
+  CHECK_JVMTI(jvmti->GetAllThreads(&threadCount, &threads));
+  jvmtiStackInfo* stackInfos = nullptr;
+  CHECK_JVMTI(jvmti->GetThreadListStackTraces(threadCount, threads, maxDepth, &stackInfos));
+
+  std::vector<jobject> monitors;
+  std::vector<jint> monitorHashes;
+
+  // The thread that owns each monitor, and the monitor each thread is blocked entering
+  std::unordered_map<jint, jint> monitorOwners;
+  std::vector<jint> blockedOn(threadCount, -1);
+
+  std::vector<jlong> packed;
+  packed.push_back(threadCount);
+  for (jint t = 0; t < threadCount; t++) {
+    const jvmtiStackInfo& info = stackInfos[t];
+    SampledThreadState state = ToSampledThreadState(info.state);
+    packed.push_back(state == kSampledThreadStateCount ? -1 : state);
+
+    jint contended = -1;
+    if (caps.can_get_current_contended_monitor && state != kSampledThreadStateCount) {
+      jobject monitor = nullptr;
+      if (jvmti->GetCurrentContendedMonitor(threads[t], &monitor) == JVMTI_ERROR_NONE && monitor != nullptr) {
+        contended = InternMonitor(jni, jvmti, monitor, &monitors, &monitorHashes);
+        // Threads in Object.wait() also report the monitor, but they aren't waiting on its owner
+        if (state == kSampledBlockedOnMonitor) {
+          blockedOn[t] = contended;
+        }
+      }
+    }
+    packed.push_back(contended);
+
+    jint ownedCount = 0;
+    jvmtiMonitorStackDepthInfo* owned = nullptr;
+    if (!caps.can_get_owned_monitor_stack_depth_info || state == kSampledThreadStateCount ||
+        jvmti->GetOwnedMonitorStackDepthInfo(threads[t], &ownedCount, &owned) != JVMTI_ERROR_NONE) {
+      ownedCount = 0;
+      owned = nullptr;
+    }
+    packed.push_back(ownedCount);
+    for (jint i = 0; i < ownedCount; i++) {
+      jint monitor = InternMonitor(jni, jvmti, owned[i].monitor, &monitors, &monitorHashes);
+      monitorOwners[monitor] = t;
+      packed.push_back(monitor);
+      packed.push_back(owned[i].stack_depth);
+    }
+    if (owned != nullptr) {
+      CHECK_JVMTI(jvmti->Deallocate((unsigned char*) owned));
+    }
 
-  // This can fail if local variable information isn't available
-  JVMTI_THROW_IF_ERROR(jvmti->GetLocalVariableTable(castMethodId, &entryCount, &table), return NULL);
+    packed.push_back(info.frame_count);
+    for (jint i = 0; i < info.frame_count; i++) {
+      packed.push_back(reinterpret_cast<jlong>(info.frame_buffer[i].method));
+      packed.push_back(info.frame_buffer[i].location);
+    }
+  }
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) stackInfos));
+
+  // Each thread waits for at most one other (the owner of the monitor it's blocked on), so the
+  // wait-for graph is a functional graph: follow each chain, and a chain that runs into a thread
+  // visited on the same walk has found a cycle.
+  std::vector<jint> waitsFor(threadCount, -1);
+  for (jint t = 0; t < threadCount; t++) {
+    if (blockedOn[t] != -1) {
+      auto it = monitorOwners.find(blockedOn[t]);
+      if (it != monitorOwners.end() && it->second != t) {
+        waitsFor[t] = it->second;
+      }
+    }
+  }
 
-  ScopedLocalRef<jclass> LocalVariable(jni, jni->FindClass("com/squareup/stoic/jvmti/LocalVariable"));
-  CHECK(LocalVariable.get() != NULL);
-  jmethodID ctor = jni->GetMethodID(LocalVariable.get(), "<init>", "(JILjava/lang/String;Ljava/lang/String;Ljava/lang/String;I)V");
-  CHECK(ctor != NULL);
-  ScopedLocalRef<jobjectArray> jTable(jni, jni->NewObjectArray(entryCount, LocalVariable.get(), NULL));
-  CHECK(jTable.get() != NULL);
+  std::vector<jint> walkId(threadCount, -1);
+  std::vector<std::vector<jint>> cycles;
+  for (jint start = 0; start < threadCount; start++) {
+    jint t = start;
+    while (t != -1 && walkId[t] == -1) {
+      walkId[t] = start;
+      t = waitsFor[t];
+    }
+    if (t != -1 && walkId[t] == start) {
+      std::vector<jint> cycle;
+      jint u = t;
+      do {
+        cycle.push_back(u);
+        u = waitsFor[u];
+      } while (u != t);
+      cycles.push_back(cycle);
+    }
+  }
 
-  for (int i = 0; i < entryCount; i++) {
-    jlong startLocation = table[i].start_location;
-    jint length = table[i].length;
-    ScopedLocalRef<jstring> name(jni, jni->NewStringUTF(table[i].name));
-    ScopedLocalRef<jstring> signature(jni, jni->NewStringUTF(table[i].signature));
-    ScopedLocalRef<jstring> genericSignature(jni, jni->NewStringUTF(table[i].generic_signature));
-    jint slot = table[i].slot;
-    ScopedLocalRef<jobject> localVar(jni, jni->NewObject(LocalVariable.get(), ctor, startLocation, length, name.get(), signature.get(), genericSignature.get(), slot));
-    CHECK(localVar.get() != NULL);
-    jni->SetObjectArrayElement(jTable.get(), i, localVar.get());
+  packed.push_back(cycles.size());
+  for (const std::vector<jint>& cycle : cycles) {
+    packed.push_back(cycle.size());
+    packed.insert(packed.end(), cycle.begin(), cycle.end());
   }
 
-  // Deallocate
-  for (int i = 0; i < entryCount; i++) {
-    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) table[i].name));
-    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) table[i].signature));
-    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) table[i].generic_signature));
-    table[i].name = table[i].signature = table[i].generic_signature = NULL;
+  ScopedLocalRef<jclass> objectClass(jni, jni->FindClass("java/lang/Object"));
+  ScopedLocalRef<jclass> threadClass(jni, jni->FindClass("java/lang/Thread"));
+  ScopedLocalRef<jlongArray> packedArray(jni, jni->NewLongArray(packed.size()));
+  jni->SetLongArrayRegion(packedArray.get(), 0, packed.size(), packed.data());
+  ScopedLocalRef<jobjectArray> threadsArray(jni, jni->NewObjectArray(threadCount, threadClass.get(), nullptr));
+  for (jint t = 0; t < threadCount; t++) {
+    jni->SetObjectArrayElement(threadsArray.get(), t, threads[t]);
+    jni->DeleteLocalRef(threads[t]);
+  }
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) threads));
+  ScopedLocalRef<jobjectArray> monitorsArray(jni, jni->NewObjectArray(monitors.size(), objectClass.get(), nullptr));
+  for (size_t i = 0; i < monitors.size(); i++) {
+    jni->SetObjectArrayElement(monitorsArray.get(), i, monitors[i]);
+    jni->DeleteLocalRef(monitors[i]);
   }
-  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) table));
-  table = NULL;
 
-  return jTable.release();
+  jobjectArray result = jni->NewObjectArray(3, objectClass.get(), nullptr);
+  jni->SetObjectArrayElement(result, 0, packedArray.get());
+  jni->SetObjectArrayElement(result, 1, threadsArray.get());
+  jni->SetObjectArrayElement(result, 2, monitorsArray.get());
+  return result;
 }
 
-JNIEXPORT jobject JNICALL
-Jvmti_VirtualMachine_nativeGetLocalObject(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-  jint frameCount = -1;
-  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
-  jobject result = NULL;
-  CHECK_JVMTI(jvmti->GetLocalObject(thread, frameCount - height, slot, &result));
-  return result;
+// Where monitor contention happened: the class of the contended monitor, the stack of the thread
+// that had to wait, and the name of the thread that held the monitor at the time
+struct ContentionKey {
+  jlong monitorClassId;
+  std::vector<std::pair<jmethodID, jlocation>> waiterStack;  // Innermost first
+  std::string ownerName;
+
+  bool operator<(const ContentionKey& other) const {
+    return std::tie(monitorClassId, waiterStack, ownerName)
+        < std::tie(other.monitorClassId, other.waiterStack, other.ownerName);
+  }
+};
+
+struct ContentionStats {
+  uint64_t count = 0;
+  uint64_t totalNanos = 0;
+  uint64_t maxNanos = 0;
+};
+
+// Aggregates MonitorContendedEnter/Entered natively. Contention is already the slow path (the
+// thread is about to block), so we can afford to look at the stack and the owner there, but nothing
+// is sent to Kotlin until it asks.
+struct ContentionProfiler {
+  std::mutex mutex;
+
+  // These are guarded by mutex
+  bool isEnabled = false;
+  jint maxDepth = 16;
+  std::map<ContentionKey, ContentionStats> stats;
+};
+
+static ContentionProfiler contentionProfiler;
+
+// The contended monitor enter that the current thread is blocked on
+struct PendingContention {
+  bool isPending = false;
+  jlong startNanos = 0;
+  ContentionKey key;
+};
+
+thread_local PendingContention pendingContention;
+
+// Returns the name of the thread that owns object's monitor, or "" if that can't be determined
+static std::string
+GetMonitorOwnerName(jvmtiEnv* jvmti, JNIEnv* jni, jobject object) {
+  jvmtiMonitorUsage usage = {};
+  if (jvmti->GetObjectMonitorUsage(object, &usage) != JVMTI_ERROR_NONE) {
+    // e.g. we don't have can_get_monitor_info
+    return "";
+  }
+
+  std::string name;
+  if (usage.owner != nullptr) {
+    jvmtiThreadInfo info = {};
+    if (jvmti->GetThreadInfo(usage.owner, &info) == JVMTI_ERROR_NONE) {
+      name = info.name;
+      CHECK_JVMTI(jvmti->Deallocate((unsigned char*) info.name));
+      jni->DeleteLocalRef(info.thread_group);
+      jni->DeleteLocalRef(info.context_class_loader);
+    }
+    jni->DeleteLocalRef(usage.owner);
+  }
+
+  for (jint i = 0; i < usage.waiter_count; i++) {
+    jni->DeleteLocalRef(usage.waiters[i]);
+  }
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) usage.waiters));
+  for (jint i = 0; i < usage.notify_waiter_count; i++) {
+    jni->DeleteLocalRef(usage.notify_waiters[i]);
+  }
+  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) usage.notify_waiters));
+
+  return name;
 }
 
-JNIEXPORT jint JNICALL
-Jvmti_VirtualMachine_nativeGetLocalInt(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-  jint frameCount = -1;
-  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
-  jint result = 0;
-  CHECK_JVMTI(jvmti->GetLocalInt(thread, frameCount - height, slot, &result));
-  return result;
+static void JNICALL
+CbMonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jobject object) {
+  jint maxDepth;
+  {
+    std::lock_guard<std::mutex> lock(contentionProfiler.mutex);
+    if (!contentionProfiler.isEnabled) {
+      return;
+    }
+    maxDepth = contentionProfiler.maxDepth;
+  }
+
+  ContentionKey& key = pendingContention.key;
+  ScopedLocalRef<jclass> monitorClass(jni, jni->GetObjectClass(object));
+  key.monitorClassId = classTagIndex.GetClassId(gdata->classTagJvmti, jvmti, monitorClass.get());
+
+  std::vector<jvmtiFrameInfo> frames(maxDepth);
+  jint frameCount = 0;
+  CHECK_JVMTI(jvmti->GetStackTrace(thread, 0, maxDepth, frames.data(), &frameCount));
+  key.waiterStack.clear();
+  for (jint i = 0; i < frameCount; i++) {
+    key.waiterStack.push_back({frames[i].method, frames[i].location});
+  }
+
+  key.ownerName = GetMonitorOwnerName(jvmti, jni, object);
+
+  // Measured last, so that the time spent looking at the stack isn't counted as waiting
+  pendingContention.startNanos = MonotonicNanos();
+  pendingContention.isPending = true;
 }
 
-JNIEXPORT jlong JNICALL
-Jvmti_VirtualMachine_nativeGetLocalLong(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-  jint frameCount = -1;
-  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
-  jlong result = 0;
-  CHECK_JVMTI(jvmti->GetLocalLong(thread, frameCount - height, slot, &result));
-  return result;
+static void JNICALL
+CbMonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jobject object) {
+  if (!pendingContention.isPending) {
+    return;
+  }
+  pendingContention.isPending = false;
+  uint64_t waitNanos = MonotonicNanos() - pendingContention.startNanos;
+
+  std::lock_guard<std::mutex> lock(contentionProfiler.mutex);
+  ContentionStats& stats = contentionProfiler.stats[pendingContention.key];
+  stats.count++;
+  stats.totalNanos += waitNanos;
+  stats.maxNanos = std::max(stats.maxNanos, waitNanos);
 }
 
-JNIEXPORT jfloat JNICALL
-Jvmti_VirtualMachine_nativeGetLocalFloat(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStartMonitorContention(JNIEnv *jni, jobject vmClass, jint maxDepth) {
   jvmtiEnv* jvmti = gdata->jvmti;
-  jint frameCount = -1;
-  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
-  jfloat result = 0.0f;
-  CHECK_JVMTI(jvmti->GetLocalFloat(thread, frameCount - height, slot, &result));
-  return result;
+  if (maxDepth < 0) {
+    throwJvmtiError(jni, JVMTI_ERROR_ILLEGAL_ARGUMENT, "maxDepth must not be negative");
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(contentionProfiler.mutex);
+  contentionProfiler.maxDepth = maxDepth;
+  if (contentionProfiler.isEnabled) {
+    return;
+  }
+
+  JVMTI_THROW_IF_ERROR(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, nullptr), return);
+  JVMTI_THROW_IF_ERROR(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, nullptr), return);
+  contentionProfiler.isEnabled = true;
 }
 
-JNIEXPORT jdouble JNICALL
-Jvmti_VirtualMachine_nativeGetLocalDouble(JNIEnv *jni, jobject vmClass, jthread thread, jint height, jint slot) {
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStopMonitorContention(JNIEnv *jni, jobject vmClass) {
   jvmtiEnv* jvmti = gdata->jvmti;
-  jint frameCount = -1;
-  CHECK_JVMTI(jvmti->GetFrameCount(thread, &frameCount));
-  jdouble result = 0.0;
-  CHECK_JVMTI(jvmti->GetLocalDouble(thread, frameCount - height, slot, &result));
+  std::lock_guard<std::mutex> lock(contentionProfiler.mutex);
+  if (!contentionProfiler.isEnabled) {
+    return;
+  }
+
+  CHECK_JVMTI(jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, nullptr));
+  CHECK_JVMTI(jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, nullptr));
+  contentionProfiler.isEnabled = false;
+}
+
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeResetMonitorContention(JNIEnv *jni, jobject vmClass) {
+  std::lock_guard<std::mutex> lock(contentionProfiler.mutex);
+  contentionProfiler.stats.clear();
+}
+
+// Returns {long[] packed, String[] ownerNames}, where packed is
+// [monitorClassId, ownerNameIndex, count, totalNanos, maxNanos, N, (methodId, location) * N]*
+// and the waiter stack (of N frames) is innermost first
+JNIEXPORT jobjectArray JNICALL
+Jvmti_VirtualMachine_nativeGetMonitorContention(JNIEnv *jni, jobject vmClass) {
+  std::vector<jlong> packed;
+  std::vector<std::string> ownerNames;
+  {
+    std::lock_guard<std::mutex> lock(contentionProfiler.mutex);
+    std::map<std::string, jlong> ownerNameIndices;
+    for (auto& entry : contentionProfiler.stats) {
+      const ContentionKey& key = entry.first;
+      auto inserted = ownerNameIndices.emplace(key.ownerName, ownerNames.size());
+      if (inserted.second) {
+        ownerNames.push_back(key.ownerName);
+      }
+
+      packed.push_back(key.monitorClassId);
+      packed.push_back(inserted.first->second);
+      packed.push_back(entry.second.count);
+      packed.push_back(entry.second.totalNanos);
+      packed.push_back(entry.second.maxNanos);
+      packed.push_back(key.waiterStack.size());
+      for (auto& frame : key.waiterStack) {
+        packed.push_back(reinterpret_cast<jlong>(frame.first));
+        packed.push_back(frame.second);
+      }
+    }
+  }
+
+  ScopedLocalRef<jlongArray> packedArray(jni, jni->NewLongArray(packed.size()));
+  jni->SetLongArrayRegion(packedArray.get(), 0, packed.size(), packed.data());
+
+  ScopedLocalRef<jclass> stringClass(jni, jni->FindClass("java/lang/String"));
+  ScopedLocalRef<jobjectArray> namesArray(jni, jni->NewObjectArray(ownerNames.size(), stringClass.get(), nullptr));
+  for (size_t i = 0; i < ownerNames.size(); i++) {
+    ScopedLocalRef<jstring> name(jni, jni->NewStringUTF(ownerNames[i].c_str()));
+    jni->SetObjectArrayElement(namesArray.get(), i, name.get());
+  }
+
+  ScopedLocalRef<jclass> objectClass(jni, jni->FindClass("java/lang/Object"));
+  jobjectArray result = jni->NewObjectArray(2, objectClass.get(), nullptr);
+  jni->SetObjectArrayElement(result, 0, packedArray.get());
+  jni->SetObjectArrayElement(result, 1, namesArray.get());
   return result;
 }
 
-JNIEXPORT jobject JNICALL
-Jvmti_VirtualMachine_nativeGetClassMethods(JNIEnv *jni, jobject vmClass, jclass clazz) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-  jint methodCount = -1;
-  jmethodID* methods = NULL;
-  CHECK_JVMTI(jvmti->GetClassMethods(clazz, &methodCount, &methods));
+// The sampling profiler. It runs on its own agent thread (started by AgentMain) that sleeps until
+// Kotlin starts sampling, so its overhead is bounded by the sampling interval rather than by how
+// much work the app does.
+struct Sampler {
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // These are guarded by mutex
+  bool isRunning = false;
+  jint intervalMicros = 1000;
+  jint maxDepth = 128;
+  std::vector<jthread> threads;  // Global refs. Empty means all threads.
+  CallTree tree;
+};
 
-  ScopedLocalRef<jobjectArray> jmethods(jni, jni->NewObjectArray(methodCount, gdata->stoicJvmtiMethodClass, NULL));
-  CHECK(jmethods.get() != NULL);
-  for (int i = 0; i < methodCount; i++) {
-    jlong longMethodId = reinterpret_cast<jlong>(methods[i]);
-    ScopedLocalRef<jobject> method(jni, jni->NewObject(
-          gdata->stoicJvmtiMethodClass,
-          gdata->stoicJvmtiMethodCtor,
-          longMethodId));
+static Sampler sampler;
 
-    jni->SetObjectArrayElement(jmethods.get(), i, method.get());
+// Runs forever on the "Stoic Sampler" thread
+static void JNICALL
+SamplerMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg) {
+  jthread self = nullptr;
+  CHECK_JVMTI(jvmti->GetCurrentThread(&self));
+
+  std::unique_lock<std::mutex> lock(sampler.mutex);
+  jlong lastSampleNanos = 0;
+  while (true) {
+    if (!sampler.isRunning) {
+      sampler.cv.wait(lock, [] { return sampler.isRunning; });
+      lastSampleNanos = 0;
+    }
+    jint maxDepth = sampler.maxDepth;
+
+    // nativeStartSampling may delete sampler.threads once we unlock, so sample through our own refs
+    std::vector<jthread> threads;
+    threads.reserve(sampler.threads.size());
+    for (jthread thread : sampler.threads) {
+      threads.push_back((jthread) jni->NewLocalRef(thread));
+    }
+
+    // Stacks are collected without the lock held, since that suspends the sampled threads
+    lock.unlock();
+    jvmtiStackInfo* stackInfos = nullptr;
+    jint threadCount = threads.size();
+    jvmtiError error = threads.empty()
+        ? jvmti->GetAllStackTraces(maxDepth, &stackInfos, &threadCount)
+        : jvmti->GetThreadListStackTraces(threadCount, threads.data(), maxDepth, &stackInfos);
+    lock.lock();
+
+    // Weight each sample by the actual time since the last one, since we won't always wake up on
+    // time
+    jlong now = MonotonicNanos();
+    jlong elapsedMicros = lastSampleNanos == 0 ? sampler.intervalMicros : (now - lastSampleNanos) / 1000;
+    lastSampleNanos = now;
+
+    if (error != JVMTI_ERROR_NONE) {
+      __android_log_print(ANDROID_LOG_ERROR, "stoic", "Failed to sample stacks: %d\n", error);
+    } else {
+      for (jint i = 0; i < threadCount; i++) {
+        jvmtiStackInfo& info = stackInfos[i];
+        SampledThreadState state = ToSampledThreadState(info.state);
+        if (info.frame_count > 0 && state != kSampledThreadStateCount && !jni->IsSameObject(info.thread, self)) {
+          sampler.tree.Add(info.frame_buffer, info.frame_count, state, elapsedMicros);
+        }
+        if (threads.empty()) {
+          // GetAllStackTraces returns local refs, and this thread never returns to Java to free them
+          jni->DeleteLocalRef(info.thread);
+        }
+      }
+      CHECK_JVMTI(jvmti->Deallocate((unsigned char*) stackInfos));
+    }
+    for (jthread thread : threads) {
+      jni->DeleteLocalRef(thread);
+    }
+
+    sampler.cv.wait_for(lock, std::chrono::microseconds(sampler.intervalMicros), [] { return !sampler.isRunning; });
   }
+}
 
-  jvmti->Deallocate((unsigned char*) methods);
+// threads may be empty, in which case all threads are sampled
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStartSampling(JNIEnv *jni, jobject vmClass, jint intervalMicros, jint maxDepth, jobjectArray threads) {
+  std::lock_guard<std::mutex> lock(sampler.mutex);
+  for (jthread thread : sampler.threads) {
+    jni->DeleteGlobalRef(thread);
+  }
+  sampler.threads.clear();
 
-  return jmethods.release();
+  jsize threadCount = jni->GetArrayLength(threads);
+  for (jsize i = 0; i < threadCount; i++) {
+    ScopedLocalRef<jobject> thread(jni, jni->GetObjectArrayElement(threads, i));
+    sampler.threads.push_back(jni->NewGlobalRef(thread.get()));
+  }
+  sampler.intervalMicros = intervalMicros;
+  sampler.maxDepth = maxDepth;
+  sampler.isRunning = true;
+  sampler.cv.notify_all();
 }
 
-JNIEXPORT jobject JNICALL
-Jvmti_VirtualMachine_nativeGetClassFields(JNIEnv *jni, jobject vmClass, jclass clazz) {
-  jvmtiEnv* jvmti = gdata->jvmti;
-  jint fieldCount = -1;
-  jfieldID* fields = NULL;
-  CHECK_JVMTI(jvmti->GetClassFields(clazz, &fieldCount, &fields));
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStopSampling(JNIEnv *jni, jobject vmClass) {
+  std::lock_guard<std::mutex> lock(sampler.mutex);
+  sampler.isRunning = false;
+  sampler.cv.notify_all();
+}
 
-  ScopedLocalRef<jobjectArray> jfields(jni, jni->NewObjectArray(fieldCount, gdata->stoicJvmtiFieldClass, NULL));
-  CHECK(jfields.get() != NULL);
-  for (int i = 0; i < fieldCount; i++) {
-    jlong longFieldId = reinterpret_cast<jlong>(fields[i]);
-    ScopedLocalRef<jobject> field(jni, jni->NewObject(
-          gdata->stoicJvmtiFieldClass,
-          gdata->stoicJvmtiFieldCtor,
-          clazz,
-          longFieldId));
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeResetSamples(JNIEnv *jni, jobject vmClass) {
+  std::lock_guard<std::mutex> lock(sampler.mutex);
+  sampler.tree.Clear();
+}
 
-    jni->SetObjectArrayElement(jfields.get(), i, field.get());
+// See CallTree::AppendTo for the format
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativeGetSamples(JNIEnv *jni, jobject vmClass) {
+  std::vector<jlong> packed;
+  {
+    std::lock_guard<std::mutex> lock(sampler.mutex);
+    sampler.tree.AppendTo(&packed);
   }
 
-  jvmti->Deallocate((unsigned char*) fields);
+  jlongArray result = jni->NewLongArray(packed.size());
+  jni->SetLongArrayRegion(result, 0, packed.size(), packed.data());
+  return result;
+}
+
+// Per-thread CPU accounting. Like the sampler, it runs on its own agent thread that sleeps until
+// Kotlin starts it. Each tick reads every live thread's CPU time and records the delta since the
+// previous tick, so the CPU used over the last windowTicks ticks is available without touching
+// Java.
+struct ThreadCpu {
+  jthread thread;  // Global ref
+  jint hash;  // Identity hash code of thread, to find it again on the next tick
+  jlong lastCpuNanos;
+  jlong totalCpuNanos = 0;
+  std::vector<jlong> deltas;  // A ring of the last windowTicks deltas
+  jlong windowCpuNanos = 0;
+  bool isLive = true;
+};
+
+struct CpuPoller {
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // These are guarded by mutex
+  bool isRunning = false;
+  jint intervalMillis = 1000;
+  jint windowTicks = 5;
+  uint64_t tickCount = 0;
+  std::vector<jlong> tickNanos;  // A ring of the wall time of the last windowTicks ticks
+  std::vector<ThreadCpu> threads;
+};
+
+static CpuPoller cpuPoller;
+
+static void
+ClearCpuPoller(JNIEnv* jni) {
+  for (ThreadCpu& cpu : cpuPoller.threads) {
+    jni->DeleteGlobalRef(cpu.thread);
+  }
+  cpuPoller.threads.clear();
+  cpuPoller.tickCount = 0;
+  cpuPoller.tickNanos.assign(cpuPoller.windowTicks, 0);
+}
+
+// Runs forever on the "Stoic CPU Poller" thread
+static void JNICALL
+CpuPollerMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg) {
+  std::unique_lock<std::mutex> lock(cpuPoller.mutex);
+  jlong lastTickNanos = 0;
+  while (true) {
+    if (!cpuPoller.isRunning) {
+      cpuPoller.cv.wait(lock, [] { return cpuPoller.isRunning; });
+      lastTickNanos = 0;
+    }
+
+    jint threadCount = 0;
+    jthread* threads = nullptr;
+    CHECK_JVMTI(jvmti->GetAllThreads(&threadCount, &threads));
+
+    // Threads are matched to the previous tick by identity hash code, falling back to IsSameObject
+    std::unordered_multimap<jint, size_t> byHash;
+    for (size_t i = 0; i < cpuPoller.threads.size(); i++) {
+      cpuPoller.threads[i].isLive = false;
+      byHash.emplace(cpuPoller.threads[i].hash, i);
+    }
 
-  return jfields.release();
-}
+    jlong now = MonotonicNanos();
+    size_t slot = cpuPoller.tickCount % cpuPoller.windowTicks;
+    cpuPoller.tickNanos[slot] = lastTickNanos == 0 ? 0 : now - lastTickNanos;
+    lastTickNanos = now;
+
+    for (jint i = 0; i < threadCount; i++) {
+      jlong cpuNanos = 0;
+      jint hash = 0;
+      if (jvmti->GetThreadCpuTime(threads[i], &cpuNanos) != JVMTI_ERROR_NONE ||
+          jvmti->GetObjectHashCode(threads[i], &hash) != JVMTI_ERROR_NONE) {
+        // Most likely the thread exited since GetAllThreads
+        jni->DeleteLocalRef(threads[i]);
+        continue;
+      }
 
-JNIEXPORT jobject JNICALL
-Jvmti_VirtualMachine_nativeToReflectedField(JNIEnv *jni, jobject vmClass, jclass clazz, jlong fieldId, jboolean isStatic) {
-  jfieldID castFieldId = reinterpret_cast<jfieldID>(fieldId);
-  return jni->ToReflectedField(clazz, castFieldId, isStatic);
-}
+      ThreadCpu* cpu = nullptr;
+      auto range = byHash.equal_range(hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (jni->IsSameObject(cpuPoller.threads[it->second].thread, threads[i])) {
+          cpu = &cpuPoller.threads[it->second];
+          break;
+        }
+      }
 
-JNIEXPORT jobject JNICALL
-Jvmti_VirtualMachine_nativeToReflectedMethod(JNIEnv *jni, jobject vmClass, jclass clazz, jlong methodId, jboolean isStatic) {
-  jmethodID castMethodId = reinterpret_cast<jmethodID>(methodId);
-  return jni->ToReflectedMethod(clazz, castMethodId, isStatic);
-}
+      if (cpu == nullptr) {
+        // New threads start with no delta, since we don't know how much of their CPU time was used
+        // within the window
+        cpuPoller.threads.push_back(ThreadCpu {
+          .thread = jni->NewGlobalRef(threads[i]),
+          .hash = hash,
+          .lastCpuNanos = cpuNanos,
+          .totalCpuNanos = cpuNanos,
+          .deltas = std::vector<jlong>(cpuPoller.windowTicks, 0),
+        });
+      } else {
+        jlong delta = cpuNanos - cpu->lastCpuNanos;
+        cpu->windowCpuNanos += delta - cpu->deltas[slot];
+        cpu->deltas[slot] = delta;
+        cpu->lastCpuNanos = cpuNanos;
+        cpu->totalCpuNanos = cpuNanos;
+        cpu->isLive = true;
+      }
 
-JNIEXPORT jlong JNICALL
-Jvmti_VirtualMachine_nativeFromReflectedMethod(JNIEnv *jni, jobject vmClass, jobject method) {
-  jmethodID methodId = jni->FromReflectedMethod(method);
-  return reinterpret_cast<jlong>(methodId);
-}
+      // This thread never returns to Java to free local refs
+      jni->DeleteLocalRef(threads[i]);
+    }
+    CHECK_JVMTI(jvmti->Deallocate((unsigned char*) threads));
 
-JNIEXPORT jstring JNICALL
-Jvmti_VirtualMachine_nativeGetClassSignature(JNIEnv *jni, jobject vmClass, jclass clazz) {
-  char* signature = NULL;
-  char* generic = NULL;
-  CHECK_JVMTI(gdata->jvmti->GetClassSignature(clazz, &signature, &generic));
-  ScopedLocalRef<jstring> jsignature(jni, jni->NewStringUTF(signature));
-  //ScopedLocalRef<jstring> jgeneric(jni, jni->NewStringUTF(generic));
-  gdata->jvmti->Deallocate((unsigned char*) signature);
-  gdata->jvmti->Deallocate((unsigned char*) generic);
+    // Forget threads that have exited
+    auto deadBegin = std::remove_if(cpuPoller.threads.begin(), cpuPoller.threads.end(), [jni](ThreadCpu& cpu) {
+      if (!cpu.isLive) {
+        jni->DeleteGlobalRef(cpu.thread);
+      }
+      return !cpu.isLive;
+    });
+    cpuPoller.threads.erase(deadBegin, cpuPoller.threads.end());
+    cpuPoller.tickCount++;
 
-  return jsignature.release();
+    cpuPoller.cv.wait_for(lock, std::chrono::milliseconds(cpuPoller.intervalMillis), [] { return !cpuPoller.isRunning; });
+  }
 }
 
+// Starts polling every intervalMillis, keeping a window of the last windowTicks polls. Restarting
+// discards what was collected.
 JNIEXPORT void JNICALL
-Jvmti_VirtualMachine_nativeMethodEntryCallbacks(JNIEnv *jni, jobject vmClass, jthread thread, jboolean isEnabled) {
-  CHECK_JVMTI(gdata->jvmti->SetEventNotificationMode(isEnabled ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_METHOD_ENTRY, thread));
+Jvmti_VirtualMachine_nativeStartCpuPoller(JNIEnv *jni, jobject vmClass, jint intervalMillis, jint windowTicks) {
+  jvmtiCapabilities caps;
+  CHECK_JVMTI(gdata->jvmti->GetCapabilities(&caps));
+  if (!caps.can_get_thread_cpu_time) {
+    throwJvmtiError(jni, JVMTI_ERROR_MUST_POSSESS_CAPABILITY, "can_get_thread_cpu_time");
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(cpuPoller.mutex);
+  cpuPoller.intervalMillis = intervalMillis;
+  cpuPoller.windowTicks = std::max(windowTicks, 1);
+  ClearCpuPoller(jni);
+  cpuPoller.isRunning = true;
+  cpuPoller.cv.notify_all();
 }
 
 JNIEXPORT void JNICALL
-Jvmti_VirtualMachine_nativeMethodExitCallbacks(JNIEnv *jni, jobject vmClass, jthread thread, jboolean isEnabled) {
-  CHECK_JVMTI(gdata->jvmti->SetEventNotificationMode(isEnabled ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_METHOD_EXIT, thread));
+Jvmti_VirtualMachine_nativeStopCpuPoller(JNIEnv *jni, jobject vmClass) {
+  std::lock_guard<std::mutex> lock(cpuPoller.mutex);
+  cpuPoller.isRunning = false;
+  ClearCpuPoller(jni);
+  cpuPoller.cv.notify_all();
 }
 
-struct AgentInfo {
-  std::string options;
-};
+// Returns the topN threads by CPU used within the window as {long[] packed, Thread[] threads} where
+// packed is [windowNanos, (windowCpuNanos, totalCpuNanos)*] with an entry per thread, most CPU
+// first. windowNanos is the wall time the window covers.
+JNIEXPORT jobjectArray JNICALL
+Jvmti_VirtualMachine_nativeGetTopCpuThreads(JNIEnv *jni, jobject vmClass, jint topN) {
+  std::vector<jlong> packed;
+  std::vector<jthread> top;
+  {
+    std::lock_guard<std::mutex> lock(cpuPoller.mutex);
+    jlong windowNanos = 0;
+    for (jlong nanos : cpuPoller.tickNanos) {
+      windowNanos += nanos;
+    }
+    packed.push_back(windowNanos);
 
-// Converts a class name to a type descriptor
-// (ex. "java.lang.String" to "Ljava/lang/String;")
-std::string classNameToDescriptor(const char* className) {
-  std::stringstream ss;
-  ss << "L";
-  for (auto p = className; *p != '\0'; ++p) {
-    ss << (*p == '.' ? '/' : *p);
+    std::vector<const ThreadCpu*> sorted;
+    for (const ThreadCpu& cpu : cpuPoller.threads) {
+      sorted.push_back(&cpu);
+    }
+    size_t count = std::min<size_t>(std::max(topN, 0), sorted.size());
+    std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), [](const ThreadCpu* a, const ThreadCpu* b) {
+      return a->windowCpuNanos > b->windowCpuNanos;
+    });
+    for (size_t i = 0; i < count; i++) {
+      packed.push_back(sorted[i]->windowCpuNanos);
+      packed.push_back(sorted[i]->totalCpuNanos);
+      top.push_back(jni->NewLocalRef(sorted[i]->thread));
+    }
   }
-  ss << ";";
-  return ss.str();
-}
 
-// Converts a descriptor (Lthis/style/of/name;) to a jni-FindClass style Fully-qualified class name
-// (this/style/of/name).
-std::string DescriptorToFQCN(const std::string& descriptor) {
-  return descriptor.substr(1, descriptor.size() - 2);
-}
+  ScopedLocalRef<jclass> objectClass(jni, jni->FindClass("java/lang/Object"));
+  ScopedLocalRef<jclass> threadClass(jni, jni->FindClass("java/lang/Thread"));
+  ScopedLocalRef<jlongArray> packedArray(jni, jni->NewLongArray(packed.size()));
+  jni->SetLongArrayRegion(packedArray.get(), 0, packed.size(), packed.data());
+  ScopedLocalRef<jobjectArray> threadsArray(jni, jni->NewObjectArray(top.size(), threadClass.get(), nullptr));
+  for (size_t i = 0; i < top.size(); i++) {
+    jni->SetObjectArrayElement(threadsArray.get(), i, top[i]);
+    jni->DeleteLocalRef(top[i]);
+  }
 
-static AgentInfo* GetAgentInfo(jvmtiEnv* jvmti) {
-  AgentInfo* ai = nullptr;
-  CHECK_EQ(jvmti->GetEnvironmentLocalStorage(reinterpret_cast<void**>(&ai)), JVMTI_ERROR_NONE);
-  CHECK(ai != nullptr);
-  return ai;
+  jobjectArray result = jni->NewObjectArray(2, objectClass.get(), nullptr);
+  jni->SetObjectArrayElement(result, 0, packedArray.get());
+  jni->SetObjectArrayElement(result, 1, threadsArray.get());
+  return result;
 }
 
+// Runs forever on the "Stoic Jank Watchdog" thread
 static void JNICALL
-CbBreakpoint(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread, jmethodID methodId, jlocation location) {
-  if (!callbacksAllowed) {
-    return;
+JankWatchdogMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg) {
+  std::unique_lock<std::mutex> lock(jankWatchdog.mutex);
+  jlong lastSampleNanos = 0;
+  while (true) {
+    if (!jankWatchdog.isEnabled) {
+      jankWatchdog.cv.wait(lock, [] { return jankWatchdog.isEnabled; });
+      continue;
+    }
+
+    jlong now = MonotonicNanos();
+    jlong start = jankWatchdog.messageStartNanos;
+    if (start == 0) {
+      // We poll rather than having the main thread wake us for every message. Nothing is lost by
+      // noticing a message late, since we only sample after the threshold anyway.
+      jankWatchdog.cv.wait_for(lock, std::chrono::nanoseconds(jankWatchdog.thresholdNanos / 4));
+      continue;
+    }
+    if (now < start + jankWatchdog.thresholdNanos) {
+      jankWatchdog.cv.wait_for(lock, std::chrono::nanoseconds(start + jankWatchdog.thresholdNanos - now));
+      continue;
+    }
+
+    uint64_t seq = jankWatchdog.messageSeq;
+    if (!jankWatchdog.isMessageSlow) {
+      jankWatchdog.isMessageSlow = true;
+      jankWatchdog.messageTree.Clear();
+      lastSampleNanos = 0;
+    }
+
+    // The stack is collected without the lock held, since that suspends the main thread
+    lock.unlock();
+    jvmtiStackInfo* stackInfo = nullptr;
+    jvmtiError error = jvmti->GetThreadListStackTraces(1, &gdata->mainThread, 128, &stackInfo);
+    lock.lock();
+
+    now = MonotonicNanos();
+    jlong elapsedMicros = lastSampleNanos == 0 ? jankWatchdog.sampleIntervalMicros : (now - lastSampleNanos) / 1000;
+    lastSampleNanos = now;
+
+    if (error != JVMTI_ERROR_NONE) {
+      __android_log_print(ANDROID_LOG_ERROR, "stoic", "Failed to sample main thread: %d\n", error);
+    } else {
+      SampledThreadState state = ToSampledThreadState(stackInfo->state);
+      // The message may have finished while we were sampling, in which case the sample belongs to
+      // whatever the main thread is doing now
+      if (seq == jankWatchdog.messageSeq && jankWatchdog.isMessageSlow && state != kSampledThreadStateCount) {
+        jankWatchdog.messageTree.Add(stackInfo->frame_buffer, stackInfo->frame_count, state, elapsedMicros);
+      }
+      CHECK_JVMTI(jvmti->Deallocate((unsigned char*) stackInfo));
+    }
+
+    jankWatchdog.cv.wait_for(lock, std::chrono::microseconds(jankWatchdog.sampleIntervalMicros));
   }
+}
 
-  jint count = -1;
-  CHECK_JVMTI(jvmti->GetFrameCount(thread, &count));
+// Sets the breakpoint at Handler.dispatchMessage if this is its first user. Throws on failure.
+static bool
+AcquireMainLooperDispatchProbe(JNIEnv* jni, jvmtiEnv* jvmti) {
+  jvmtiCapabilities caps;
+  CHECK_JVMTI(jvmti->GetCapabilities(&caps));
+  if (!caps.can_generate_frame_pop_events) {
+    throwJvmtiError(jni, JVMTI_ERROR_MUST_POSSESS_CAPABILITY, "can_generate_frame_pop_events");
+    return false;
+  }
 
-  jlong methodIdAsLong = reinterpret_cast<jlong>(methodId);
+  MainLooperDispatchProbe& probe = mainLooperDispatchProbe;
+  std::lock_guard<std::mutex> lock(probe.mutex);
+  if (probe.users == 0) {
+    ScopedLocalRef<jclass> handlerClass(jni, jni->FindClass("android/os/Handler"));
+    CHECK(handlerClass.get() != nullptr);
+    jmethodID methodId = jni->GetMethodID(handlerClass.get(), "dispatchMessage", "(Landroid/os/Message;)V");
+    CHECK(methodId != nullptr);
+
+    jlocation start = -1;
+    jlocation end = -1;
+    JVMTI_THROW_IF_ERROR(jvmti->GetMethodLocation(methodId, &start, &end), return false);
+    jint maxLocals = -1;
+    jint argsSize = -1;
+    JVMTI_THROW_IF_ERROR(jvmti->GetMaxLocals(methodId, &maxLocals), return false);
+    JVMTI_THROW_IF_ERROR(jvmti->GetArgumentsSize(methodId, &argsSize), return false);
+    // Arguments occupy the last slots, starting with `this`
+    probe.thisSlot = maxLocals - argsSize;
+    probe.messageSlot = probe.thisSlot + 1;
+
+    JVMTI_THROW_IF_ERROR(
+        AcquireBreakpointSite(jvmti, methodId, start, &BreakpointSite::isMainLooperDispatch),
+        return false);
+    probe.methodId = methodId;
+    probe.location = start;
+  }
+  probe.users++;
+  return true;
+}
 
-  callbacksAllowed = false;
-  jni->CallStaticVoidMethod(
-      gdata->stoicJvmtiVmClass,
-      gdata->nativeCallbackOnBreakpoint,
-      methodIdAsLong,
-      location,
-      count);
-  callbacksAllowed = true;
+static void
+ReleaseMainLooperDispatchProbe(jvmtiEnv* jvmti) {
+  MainLooperDispatchProbe& probe = mainLooperDispatchProbe;
+  std::lock_guard<std::mutex> lock(probe.mutex);
+  CHECK_GT(probe.users, 0);
+  probe.users--;
+  if (probe.users == 0) {
+    // A message in progress still gets its FramePop, which harmlessly finds nothing to record
+    ReleaseBreakpointSite(jvmti, probe.methodId, probe.location, &BreakpointSite::isMainLooperDispatch);
+  }
 }
 
-static void JNICALL
-CbMethodEntry(
-    jvmtiEnv* jvmti,
-    JNIEnv* jni,
-    jthread thread,
-    jmethodID methodId) {
-  if (!callbacksAllowed) {
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStartJankWatchdog(JNIEnv *jni, jobject vmClass, jint thresholdMillis, jint sampleIntervalMicros) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  if (thresholdMillis <= 0 || sampleIntervalMicros <= 0) {
+    // The watchdog thread would otherwise spin without ever sleeping
+    throwJvmtiError(jni, JVMTI_ERROR_ILLEGAL_ARGUMENT, "thresholdMillis and sampleIntervalMicros must be positive");
     return;
   }
 
-  jint count = -1;
-  CHECK_JVMTI(jvmti->GetFrameCount(thread, &count));
+  std::lock_guard<std::mutex> lock(jankWatchdog.mutex);
+  jankWatchdog.thresholdNanos = thresholdMillis * 1000000LL;
+  jankWatchdog.sampleIntervalMicros = sampleIntervalMicros;
+  if (jankWatchdog.isEnabled || !AcquireMainLooperDispatchProbe(jni, jvmti)) {
+    return;
+  }
 
-  jmethodID frameMethodId = nullptr;
-  jlocation location = -1;
-  CHECK_JVMTI(jvmti->GetFrameLocation(thread, 0, &frameMethodId, &location));
-  CHECK_EQ(frameMethodId, methodId);
+  jankWatchdog.isEnabled = true;
+  jankWatchdog.cv.notify_all();
+}
 
-  jlong methodIdAsLong = reinterpret_cast<jlong>(methodId);
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStopJankWatchdog(JNIEnv *jni, jobject vmClass) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::lock_guard<std::mutex> lock(jankWatchdog.mutex);
+  if (!jankWatchdog.isEnabled) {
+    return;
+  }
 
-  callbacksAllowed = false;
-  jni->CallStaticVoidMethod(
-      gdata->stoicJvmtiVmClass,
-      gdata->nativeCallbackOnMethodEntry,
-      methodIdAsLong,
-      location,
-      count);
-  callbacksAllowed = true;
+  ReleaseMainLooperDispatchProbe(jvmti);
+  jankWatchdog.isEnabled = false;
+  jankWatchdog.isMessageSlow = false;
+  jankWatchdog.messageStartNanos = 0;
+  jankWatchdog.cv.notify_all();
 }
 
-static jobject
-Box(JNIEnv* jni, char type, jvalue value) {
-  switch (type) {
-    case 'Z': return jni->NewObject(gdata->booleanClass, gdata->booleanCtor, value.z);
-    case 'B': return jni->NewObject(gdata->byteClass, gdata->byteCtor, value.b);
-    case 'C': return jni->NewObject(gdata->characterClass, gdata->characterCtor, value.c);
-    case 'S': return jni->NewObject(gdata->shortClass, gdata->shortCtor, value.s);
-    case 'I': return jni->NewObject(gdata->integerClass, gdata->integerCtor, value.i);
-    case 'J': return jni->NewObject(gdata->longClass, gdata->longCtor, value.j);
-    case 'F': return jni->NewObject(gdata->floatClass, gdata->floatCtor, value.f);
-    case 'D': return jni->NewObject(gdata->doubleClass, gdata->doubleCtor, value.d);
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStartLooperStats(JNIEnv *jni, jobject vmClass) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::lock_guard<std::mutex> lock(looperStats.mutex);
+  if (looperStats.isEnabled || !AcquireMainLooperDispatchProbe(jni, jvmti)) {
+    return;
+  }
+  looperStats.isEnabled = true;
+}
 
-    case 'L':
-    case '[':
-      // NewLocalRef so we can clean it up, just like the others
-      return jni->NewLocalRef(value.l);
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeStopLooperStats(JNIEnv *jni, jobject vmClass) {
+  jvmtiEnv* jvmti = gdata->jvmti;
+  std::lock_guard<std::mutex> lock(looperStats.mutex);
+  if (!looperStats.isEnabled) {
+    return;
+  }
+  ReleaseMainLooperDispatchProbe(jvmti);
+  looperStats.isEnabled = false;
+}
 
-    case 'V': return nullptr;
+JNIEXPORT void JNICALL
+Jvmti_VirtualMachine_nativeResetLooperStats(JNIEnv *jni, jobject vmClass) {
+  std::lock_guard<std::mutex> lock(looperStats.mutex);
+  for (auto& entry : looperStats.histograms) {
+    entry.second->Reset();
+  }
+}
 
-    default:
-      __android_log_print(ANDROID_LOG_ERROR, "stoic", "unhandled return type: %c\n", type);
-      return NULL;
+// Returns every histogram, packed as
+// [handlerClassId, callbackClassId, what, <LatencyHistogram::AppendTo>]*
+// Class IDs can be resolved with nativeGetClassSignatureById.
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativeGetLooperStats(JNIEnv *jni, jobject vmClass) {
+  std::vector<jlong> packed;
+  {
+    std::lock_guard<std::mutex> lock(looperStats.mutex);
+    for (auto& entry : looperStats.histograms) {
+      packed.push_back(entry.first.handlerClassId);
+      packed.push_back(entry.first.callbackClassId);
+      packed.push_back(entry.first.what);
+      entry.second->AppendTo(&packed);
+    }
   }
+
+  jlongArray result = jni->NewLongArray(packed.size());
+  jni->SetLongArrayRegion(result, 0, packed.size(), packed.data());
+  return result;
 }
 
-static void JNICALL
-CbMethodExit(
-    jvmtiEnv* jvmti,
-    JNIEnv* jni,
-    jthread thread,
-    jmethodID methodId,
-    jboolean was_popped_by_exception,
-    jvalue return_value) {
-  if (!callbacksAllowed) {
-    return;
+// Resolves an ID from the ClassTagIndex to a class signature
+JNIEXPORT jstring JNICALL
+Jvmti_VirtualMachine_nativeGetClassSignatureById(JNIEnv *jni, jobject vmClass, jlong classId) {
+  return jni->NewStringUTF(classTagIndex.GetSignature(classId).c_str());
+}
+
+// Removes and returns the completed reports, packed as
+// [startNanos, durationNanos, N, <CallTree::AppendTo with N nodes>]*
+JNIEXPORT jlongArray JNICALL
+Jvmti_VirtualMachine_nativePollJankReports(JNIEnv *jni, jobject vmClass) {
+  std::deque<JankReport> reports;
+  {
+    std::lock_guard<std::mutex> lock(jankWatchdog.mutex);
+    reports.swap(jankWatchdog.reports);
   }
 
-  jint count = -1;
-  CHECK_JVMTI(jvmti->GetFrameCount(thread, &count));
+  std::vector<jlong> packed;
+  for (const JankReport& report : reports) {
+    packed.push_back(report.startNanos);
+    packed.push_back(report.durationNanos);
+    size_t sizeIndex = packed.size();
+    packed.push_back(0);
+    report.tree.AppendTo(&packed);
+    packed[sizeIndex] = report.tree.NodeCount();
+  }
 
-  jmethodID frameMethodId = nullptr;
-  jlocation location = -1;
-  CHECK_JVMTI(jvmti->GetFrameLocation(thread, 0, &frameMethodId, &location));
-  CHECK_EQ(frameMethodId, methodId);
-  jlong methodIdAsLong = reinterpret_cast<jlong>(methodId);
+  jlongArray result = jni->NewLongArray(packed.size());
+  jni->SetLongArrayRegion(result, 0, packed.size(), packed.data());
+  return result;
+}
 
-  char* signature = NULL;
-  CHECK_JVMTI(jvmti->GetMethodName(methodId, NULL, &signature, NULL));
-  char* closingParen = strchr(signature, ')');
-  CHECK(closingParen != NULL);
-  // The return type is the first character after the ')' - for objects this will be L
-  char returnType = closingParen[1];
-  CHECK_JVMTI(jvmti->Deallocate((unsigned char*) signature));
+// Starts a daemon thread that runs proc. Returns false if the thread couldn't be created.
+static bool
+RunNewAgentThread(jvmtiEnv* jvmti, JNIEnv* env, const char* name, jvmtiStartFunction proc, jint priority) {
+  // Create a Thread object.
+  ScopedLocalRef<jobject> thread_name(env, env->NewStringUTF(name));
+  if (thread_name.get() == nullptr) {
+    env->ExceptionDescribe();
+    env->ExceptionClear();
+    return false;
+  }
+  ScopedLocalRef<jclass> thread_klass(env, env->FindClass("java/lang/Thread"));
+  if (thread_klass.get() == nullptr) {
+    env->ExceptionDescribe();
+    env->ExceptionClear();
+    return false;
+  }
+  ScopedLocalRef<jobject> thread(env, env->AllocObject(thread_klass.get()));
+  if (thread.get() == nullptr) {
+    env->ExceptionDescribe();
+    env->ExceptionClear();
+    return false;
+  }
 
-  ScopedLocalRef<jobject> box(jni, Box(jni, returnType, return_value));
+  env->CallNonvirtualVoidMethod(
+      thread.get(),
+      thread_klass.get(),
+      env->GetMethodID(thread_klass.get(), "<init>", "(Ljava/lang/String;)V"),
+      thread_name.get());
+  env->CallVoidMethod(thread.get(), env->GetMethodID(thread_klass.get(), "setPriority", "(I)V"), priority);
+  env->CallVoidMethod(
+      thread.get(), env->GetMethodID(thread_klass.get(), "setDaemon", "(Z)V"), JNI_TRUE);
 
-  // TODO: surface return_value (it's complicated because its a union)
-  callbacksAllowed = false;
-  jni->CallStaticVoidMethod(
-      gdata->stoicJvmtiVmClass,
-      gdata->nativeCallbackOnMethodExit,
-      methodIdAsLong,
-      location,
-      count,
-      box.get(),
-      was_popped_by_exception);
-  callbacksAllowed = true;
+  return jvmti->RunAgentThread(thread.get(), proc, nullptr, priority) == JVMTI_ERROR_NONE;
 }
 
 static void AgentMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg) {
@@ -765,6 +5763,13 @@ static void AgentMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg)
   std::string stoicDir = GetAgentInfo(jvmti)->options;
   LOG(DEBUG) << "Found stoicDir: " << stoicDir.c_str();
 
+  // Map the symbol index from a previous attach, if it was built from the same APKs
+  symbolIndexKey = SymbolIndexKey();
+  symbolIndexPath = stoicDir + "/symbols.idx";
+  if (symbolIndexKey != 0 && symbolIndex.Load(symbolIndexPath, symbolIndexKey)) {
+    LOG(DEBUG) << "Loaded symbol index: " << symbolIndexPath;
+  }
+
 
   // In order to setup the ClassLoader correctly, we need to chain it to the
   // Application ClassLoader. Otherwise we might end up with duplicate classes
@@ -785,6 +5790,36 @@ static void AgentMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg)
   jmethodID mthGetThread = jni->GetMethodID(clsLooper.get(), "getThread", "()Ljava/lang/Thread;");
   CHECK(mthGetThread != nullptr);
   ScopedLocalRef<jobject> mainThread(jni, jni->CallObjectMethod(mainLooper.get(), mthGetThread));
+  gdata->mainThread = jni->NewGlobalRef(mainThread.get());
+
+  {
+    JavaVM* vm = nullptr;
+    CHECK(jni->GetJavaVM(&vm) == JNI_OK);
+    CHECK(vm->GetEnv(reinterpret_cast<void**>(&gdata->classTagJvmti), JVMTI_VERSION_1_2) == JNI_OK);
+    jvmtiCapabilities potentialTagCaps;
+    CHECK_JVMTI(gdata->classTagJvmti->GetPotentialCapabilities(&potentialTagCaps));
+    jvmtiCapabilities tagCaps = {
+      .can_tag_objects = JNI_TRUE,
+      .can_generate_object_free_events = potentialTagCaps.can_generate_object_free_events,
+    };
+    CHECK_JVMTI(gdata->classTagJvmti->AddCapabilities(&tagCaps));
+
+    // Only classes are tagged in this env, so ObjectFree tells us when a class is unloaded
+    if (tagCaps.can_generate_object_free_events) {
+      jvmtiEventCallbacks tagCallbacks = {
+        .ObjectFree = &CbClassTagFree,
+      };
+      CHECK_JVMTI(gdata->classTagJvmti->SetEventCallbacks(&tagCallbacks, sizeof(tagCallbacks)));
+      CHECK_JVMTI(gdata->classTagJvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, nullptr));
+    }
+
+    ScopedLocalRef<jclass> clsMessage(jni, jni->FindClass("android/os/Message"));
+    CHECK(clsMessage.get() != nullptr);
+    gdata->messageWhat = jni->GetFieldID(clsMessage.get(), "what", "I");
+    CHECK(gdata->messageWhat != nullptr);
+    gdata->messageCallback = jni->GetFieldID(clsMessage.get(), "callback", "Ljava/lang/Runnable;");
+    CHECK(gdata->messageCallback != nullptr);
+  }
 
   ScopedLocalRef<jclass> clsThread(jni, jni->FindClass("java/lang/Thread"));
   CHECK(clsThread.get() != nullptr);
@@ -796,6 +5831,20 @@ static void AgentMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg)
   CHECK(originalClassLoader.get() != nullptr);
   LOG(DEBUG) << "Found originalClassLoader";
 
+  {
+    ScopedLocalRef<jclass> clsClassLoader(jni, jni->FindClass("java/lang/ClassLoader"));
+    CHECK(clsClassLoader.get() != nullptr);
+    jmethodID mthGetParent = jni->GetMethodID(clsClassLoader.get(), "getParent", "()Ljava/lang/ClassLoader;");
+    CHECK(mthGetParent != nullptr);
+    jobject loader = jni->NewLocalRef(originalClassLoader.get());
+    while (loader != nullptr) {
+      symbolIndexClassLoaders.push_back(jni->NewGlobalRef(loader));
+      jobject parent = jni->CallObjectMethod(loader, mthGetParent);
+      jni->DeleteLocalRef(loader);
+      loader = parent;
+    }
+  }
+
 
   //
   // Setup args that we need for our ClassLoader
@@ -935,31 +5984,38 @@ static void AgentMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg)
     CHECK(gdata->stoicJvmtiFieldPrivateModifiers != NULL);
   }
 
-  // Boxing stuff
-  {
-    // TODO: this leaks local refs
-    gdata->booleanClass = (jclass) jni->NewGlobalRef(jni->FindClass("java/lang/Boolean"));
-    gdata->byteClass = (jclass) jni->NewGlobalRef(jni->FindClass("java/lang/Byte"));
-    gdata->characterClass = (jclass) jni->NewGlobalRef(jni->FindClass("java/lang/Character"));
-    gdata->shortClass = (jclass) jni->NewGlobalRef(jni->FindClass("java/lang/Short"));
-    gdata->integerClass = (jclass) jni->NewGlobalRef(jni->FindClass("java/lang/Integer"));
-    gdata->longClass = (jclass) jni->NewGlobalRef(jni->FindClass("java/lang/Long"));
-    gdata->floatClass = (jclass) jni->NewGlobalRef(jni->FindClass("java/lang/Float"));
-    gdata->doubleClass = (jclass) jni->NewGlobalRef(jni->FindClass("java/lang/Double"));
-
-    gdata->booleanCtor = jni->GetMethodID(gdata->booleanClass, "<init>", "(Z)V");
-    gdata->byteCtor = jni->GetMethodID(gdata->byteClass, "<init>", "(B)V");
-    gdata->characterCtor = jni->GetMethodID(gdata->characterClass, "<init>", "(C)V");
-    gdata->shortCtor = jni->GetMethodID(gdata->shortClass, "<init>", "(S)V");
-    gdata->integerCtor = jni->GetMethodID(gdata->integerClass, "<init>", "(I)V");
-    gdata->longCtor = jni->GetMethodID(gdata->longClass, "<init>", "(J)V");
-    gdata->floatCtor = jni->GetMethodID(gdata->floatClass, "<init>", "(F)V");
-    gdata->doubleCtor = jni->GetMethodID(gdata->doubleClass, "<init>", "(D)V");
-  }
-
   gdata->nativeCallbackOnBreakpoint = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnBreakpoint", "(JJI)V");
   gdata->nativeCallbackOnMethodEntry = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnMethodEntry", "(JJI)V");
-  gdata->nativeCallbackOnMethodExit = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnMethodExit", "(JJILjava/lang/Object;Z)V");
+#define LOOKUP_METHOD_EXIT_CALLBACK(type, typeChar, member) \
+  gdata->nativeCallbackOnMethodExit##type = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnMethodExit" #type, "(JJI" #type "Z)V"); \
+  CHECK(gdata->nativeCallbackOnMethodExit##type != nullptr);
+  FOR_EACH_PRIMITIVE_TYPE(LOOKUP_METHOD_EXIT_CALLBACK)
+#undef LOOKUP_METHOD_EXIT_CALLBACK
+  gdata->nativeCallbackOnMethodExitL = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnMethodExitL", "(JJILjava/lang/Object;Z)V");
+  CHECK(gdata->nativeCallbackOnMethodExitL != nullptr);
+  gdata->nativeCallbackOnMethodExitV = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnMethodExitV", "(JJIZ)V");
+  CHECK(gdata->nativeCallbackOnMethodExitV != nullptr);
+  gdata->nativeCallbackOnFramePop = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnFramePop", "(JJIZ)V");
+  CHECK(gdata->nativeCallbackOnFramePop != nullptr);
+  gdata->nativeCallbackOnException = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnException", "(JJILjava/lang/Throwable;JJ)V");
+  CHECK(gdata->nativeCallbackOnException != nullptr);
+  gdata->nativeCallbackOnFieldWatch = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnFieldWatch", "(JJJILjava/lang/Object;JLjava/lang/Object;JLjava/lang/Object;)V");
+  CHECK(gdata->nativeCallbackOnFieldWatch != nullptr);
+  gdata->nativeCallbackOnStep = jni->GetStaticMethodID(gdata->stoicJvmtiVmClass, "nativeCallbackOnStep", "(JJI)V");
+  CHECK(gdata->nativeCallbackOnStep != nullptr);
+
+  // Upcalls that may pass kUnknownHeight
+  eventUpcallMethodIds = {
+    gdata->nativeCallbackOnBreakpoint,
+    gdata->nativeCallbackOnMethodEntry,
+#define ADD_METHOD_EXIT_CALLBACK(type, typeChar, member) gdata->nativeCallbackOnMethodExit##type,
+    FOR_EACH_PRIMITIVE_TYPE(ADD_METHOD_EXIT_CALLBACK)
+#undef ADD_METHOD_EXIT_CALLBACK
+    gdata->nativeCallbackOnMethodExitL,
+    gdata->nativeCallbackOnMethodExitV,
+    gdata->nativeCallbackOnException,
+    gdata->nativeCallbackOnFieldWatch,
+  };
 
   JNINativeMethod methods[] = {
     {"nativeInstances",                 "(Ljava/lang/Class;Z)[Ljava/lang/Object;",                      (void *)&Jvmti_VirtualMachine_nativeInstances},
@@ -967,26 +6023,86 @@ static void AgentMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg)
     {"nativeGetMethodId",               "(Ljava/lang/Class;Ljava/lang/String;Ljava/lang/String;)J",     (void *)&Jvmti_VirtualMachine_nativeGetMethodId},
     {"nativeSetBreakpoint",             "(JJ)V",                                                        (void *)&Jvmti_VirtualMachine_nativeSetBreakpoint},
     {"nativeClearBreakpoint",           "(JJ)V",                                                        (void *)&Jvmti_VirtualMachine_nativeClearBreakpoint},
+    {"nativeProfileMethods",            "([J)V",                                                        (void *)&Jvmti_VirtualMachine_nativeProfileMethods},
+    {"nativeUnprofileMethods",          "([J)V",                                                        (void *)&Jvmti_VirtualMachine_nativeUnprofileMethods},
+    {"nativeResetMethodProfiles",       "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeResetMethodProfiles},
+    {"nativeGetMethodProfiles",         "()[J",                                                         (void *)&Jvmti_VirtualMachine_nativeGetMethodProfiles},
+    {"nativeStartSampling",             "(II[Ljava/lang/Thread;)V",                                     (void *)&Jvmti_VirtualMachine_nativeStartSampling},
+    {"nativeStopSampling",              "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeStopSampling},
+    {"nativeResetSamples",              "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeResetSamples},
+    {"nativeGetSamples",                "()[J",                                                         (void *)&Jvmti_VirtualMachine_nativeGetSamples},
+    {"nativeStartJankWatchdog",         "(II)V",                                                        (void *)&Jvmti_VirtualMachine_nativeStartJankWatchdog},
+    {"nativeStopJankWatchdog",          "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeStopJankWatchdog},
+    {"nativePollJankReports",           "()[J",                                                         (void *)&Jvmti_VirtualMachine_nativePollJankReports},
+    {"nativeStartLooperStats",          "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeStartLooperStats},
+    {"nativeStopLooperStats",           "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeStopLooperStats},
+    {"nativeResetLooperStats",          "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeResetLooperStats},
+    {"nativeGetLooperStats",            "()[J",                                                         (void *)&Jvmti_VirtualMachine_nativeGetLooperStats},
+    {"nativeGetClassSignatureById",     "(J)Ljava/lang/String;",                                        (void *)&Jvmti_VirtualMachine_nativeGetClassSignatureById},
+    {"nativeStartMonitorContention",    "(I)V",                                                         (void *)&Jvmti_VirtualMachine_nativeStartMonitorContention},
+    {"nativeStopMonitorContention",     "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeStopMonitorContention},
+    {"nativeResetMonitorContention",    "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeResetMonitorContention},
+    {"nativeGetMonitorContention",      "()[Ljava/lang/Object;",                                        (void *)&Jvmti_VirtualMachine_nativeGetMonitorContention},
+    {"nativeStartExceptionStats",       "([Ljava/lang/Class;)V",                                        (void *)&Jvmti_VirtualMachine_nativeStartExceptionStats},
+    {"nativeStopExceptionStats",        "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeStopExceptionStats},
+    {"nativeResetExceptionStats",       "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeResetExceptionStats},
+    {"nativeGetExceptionStats",         "()[J",                                                         (void *)&Jvmti_VirtualMachine_nativeGetExceptionStats},
+    {"nativeExceptionCallbacks",        "(Z[Ljava/lang/Class;)V",                                       (void *)&Jvmti_VirtualMachine_nativeExceptionCallbacks},
     {"nativeGetMethodCoreMetadata",     "(Lcom/squareup/stoic/jvmti/JvmtiMethod;)V",                    (void *)&Jvmti_VirtualMachine_nativeGetMethodCoreMetadata},
     {"nativeGetFieldCoreMetadata",      "(Lcom/squareup/stoic/jvmti/JvmtiField;)V",                     (void *)&Jvmti_VirtualMachine_nativeGetFieldCoreMetadata},
     {"nativeGetLocalVariables",         "(J)[Lcom/squareup/stoic/jvmti/LocalVariable;",                 (void *)&Jvmti_VirtualMachine_nativeGetLocalVariables},
     {"nativeGetLocalObject",            "(Ljava/lang/Thread;II)Ljava/lang/Object;",                     (void *)&Jvmti_VirtualMachine_nativeGetLocalObject},
+    {"nativeGetFrameLocals",            "(Ljava/lang/Thread;I[ILjava/lang/String;)[Ljava/lang/Object;",  (void *)&Jvmti_VirtualMachine_nativeGetFrameLocals},
     {"nativeGetLocalInt",               "(Ljava/lang/Thread;II)I",                                      (void *)&Jvmti_VirtualMachine_nativeGetLocalInt},
     {"nativeGetLocalLong",              "(Ljava/lang/Thread;II)J",                                      (void *)&Jvmti_VirtualMachine_nativeGetLocalLong},
     {"nativeGetLocalFloat",             "(Ljava/lang/Thread;II)F",                                      (void *)&Jvmti_VirtualMachine_nativeGetLocalFloat},
     {"nativeGetLocalDouble",            "(Ljava/lang/Thread;II)D",                                      (void *)&Jvmti_VirtualMachine_nativeGetLocalDouble},
     {"nativeGetClassMethods",           "(Ljava/lang/Class;)[Lcom/squareup/stoic/jvmti/JvmtiMethod;",   (void *)&Jvmti_VirtualMachine_nativeGetClassMethods},
+    {"nativeGetClassMetadata",          "(Ljava/lang/Class;)[Ljava/lang/Object;",                       (void *)&Jvmti_VirtualMachine_nativeGetClassMetadata},
+    {"nativeResolveMethods",            "(Ljava/lang/String;)[J",                                       (void *)&Jvmti_VirtualMachine_nativeResolveMethods},
+    {"nativeBuildSymbolIndex",          "(Z)Z",                                                         (void *)&Jvmti_VirtualMachine_nativeBuildSymbolIndex},
+    {"nativeIsSymbolIndexLoaded",       "()Z",                                                          (void *)&Jvmti_VirtualMachine_nativeIsSymbolIndexLoaded},
     {"nativeGetClassFields",            "(Ljava/lang/Class;)[Lcom/squareup/stoic/jvmti/JvmtiField;",    (void *)&Jvmti_VirtualMachine_nativeGetClassFields},
     {"nativeToReflectedField",          "(Ljava/lang/Class;JZ)Ljava/lang/reflect/Field;",               (void *)&Jvmti_VirtualMachine_nativeToReflectedField},
     {"nativeToReflectedMethod",         "(Ljava/lang/Class;JZ)Ljava/lang/Object;",                      (void *)&Jvmti_VirtualMachine_nativeToReflectedMethod},
     {"nativeFromReflectedMethod",       "(Ljava/lang/reflect/Method;)J",                                (void *)&Jvmti_VirtualMachine_nativeFromReflectedMethod},
     {"nativeGetClassSignature",         "(Ljava/lang/Class;)Ljava/lang/String;",                        (void *)&Jvmti_VirtualMachine_nativeGetClassSignature},
-    {"nativeMethodEntryCallbacks",      "(Ljava/lang/Thread;Z)V",                                       (void *)&Jvmti_VirtualMachine_nativeMethodEntryCallbacks},
-    {"nativeMethodExitCallbacks",       "(Ljava/lang/Thread;Z)V",                                       (void *)&Jvmti_VirtualMachine_nativeMethodExitCallbacks},
+    {"nativeCreateMethodFilter",        "([J[Ljava/lang/String;[J[Ljava/lang/String;)J",                (void *)&Jvmti_VirtualMachine_nativeCreateMethodFilter},
+    {"nativeDestroyMethodFilter",       "(J)V",                                                         (void *)&Jvmti_VirtualMachine_nativeDestroyMethodFilter},
+    {"nativeMethodEntryCallbacks",      "(Ljava/lang/Thread;Z[J)V",                                     (void *)&Jvmti_VirtualMachine_nativeMethodEntryCallbacks},
+    {"nativeMethodExitCallbacks",       "(Ljava/lang/Thread;Z[J)V",                                     (void *)&Jvmti_VirtualMachine_nativeMethodExitCallbacks},
+    {"nativeCreateFieldWatch",          "(Ljava/lang/Class;JZLjava/lang/Thread;ZIJZ)J",                 (void *)&Jvmti_VirtualMachine_nativeCreateFieldWatch},
+    {"nativeDestroyFieldWatch",         "(J)V",                                                         (void *)&Jvmti_VirtualMachine_nativeDestroyFieldWatch},
+    {"nativeGetFieldWatchHits",         "(J)J",                                                         (void *)&Jvmti_VirtualMachine_nativeGetFieldWatchHits},
+    {"nativeGetLineLocations",          "(Ljava/lang/Class;)[J",                                        (void *)&Jvmti_VirtualMachine_nativeGetLineLocations},
+    {"nativeGetSourceFileName",         "(Ljava/lang/Class;)Ljava/lang/String;",                        (void *)&Jvmti_VirtualMachine_nativeGetSourceFileName},
+    {"nativeSetBreakpointsAtLines",     "(Ljava/lang/Class;[I)[J",                                      (void *)&Jvmti_VirtualMachine_nativeSetBreakpointsAtLines},
+    {"nativeStartCoverage",             "([Ljava/lang/Class;)V",                                        (void *)&Jvmti_VirtualMachine_nativeStartCoverage},
+    {"nativeStopCoverage",              "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeStopCoverage},
+    {"nativeResetCoverage",             "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeResetCoverage},
+    {"nativeGetCoverageReport",         "()[B",                                                         (void *)&Jvmti_VirtualMachine_nativeGetCoverageReport},
+    {"nativeCreateLogPoint",            "(JJ[ILjava/lang/String;ZI)J",                                  (void *)&Jvmti_VirtualMachine_nativeCreateLogPoint},
+    {"nativeDestroyLogPoint",           "(J)V",                                                         (void *)&Jvmti_VirtualMachine_nativeDestroyLogPoint},
+    {"nativeDrainLogPoints",            "(I)[J",                                                        (void *)&Jvmti_VirtualMachine_nativeDrainLogPoints},
+    {"nativeSnapshotStack",             "(Ljava/lang/Thread;IZ)[Ljava/lang/Object;",                    (void *)&Jvmti_VirtualMachine_nativeSnapshotStack},
+    {"nativeStartCpuPoller",            "(II)V",                                                        (void *)&Jvmti_VirtualMachine_nativeStartCpuPoller},
+    {"nativeStopCpuPoller",             "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeStopCpuPoller},
+    {"nativeGetTopCpuThreads",          "(I)[Ljava/lang/Object;",                                       (void *)&Jvmti_VirtualMachine_nativeGetTopCpuThreads},
+    {"nativeDumpThreads",               "(I)[Ljava/lang/Object;",                                       (void *)&Jvmti_VirtualMachine_nativeDumpThreads},
+    {"nativeStartStep",                 "(IIJ)V",                                                       (void *)&Jvmti_VirtualMachine_nativeStartStep},
+    {"nativeCancelStep",                "()V",                                                          (void *)&Jvmti_VirtualMachine_nativeCancelStep},
+    {"nativeGetEventFrameHeight",       "(J)I",                                                          (void *)&Jvmti_VirtualMachine_nativeGetEventFrameHeight},
+    {"nativeWatchFrameExit",            "(IZ)V",                                                        (void *)&Jvmti_VirtualMachine_nativeWatchFrameExit},
   };
 
   CHECK(jni->RegisterNatives(gdata->stoicJvmtiVmClass, methods, sizeof(methods) / sizeof(methods[0])) == JNI_OK);
 
+  // The sampler sleeps until nativeStartSampling. It runs at max priority so that samples are taken
+  // on time even when the app is busy.
+  CHECK(RunNewAgentThread(jvmti, jni, "Stoic Sampler", SamplerMain, JVMTI_THREAD_MAX_PRIORITY));
+  CHECK(RunNewAgentThread(jvmti, jni, "Stoic Jank Watchdog", JankWatchdogMain, JVMTI_THREAD_MAX_PRIORITY));
+  CHECK(RunNewAgentThread(jvmti, jni, "Stoic CPU Poller", CpuPollerMain, JVMTI_THREAD_NORM_PRIORITY));
+
 
   //
   // Call AndroidServerJarKt.main to start the Android server
@@ -1030,39 +6146,43 @@ static void AgentMain(jvmtiEnv* jvmti, JNIEnv* jni, [[maybe_unused]] void* arg)
 
 static void CbVmInit(jvmtiEnv* jvmti, JNIEnv* env, [[maybe_unused]] jthread thr) {
   LOG(DEBUG) << "Running CbVmInit";
+  RunNewAgentThread(jvmti, env, "Agent Thread", AgentMain, JVMTI_THREAD_MIN_PRIORITY);
+}
 
-  // Create a Thread object.
-  ScopedLocalRef<jobject> thread_name(env, env->NewStringUTF("Agent Thread"));
-  if (thread_name.get() == nullptr) {
-    env->ExceptionDescribe();
-    env->ExceptionClear();
-    return;
-  }
-  ScopedLocalRef<jclass> thread_klass(env, env->FindClass("java/lang/Thread"));
-  if (thread_klass.get() == nullptr) {
-    env->ExceptionDescribe();
-    env->ExceptionClear();
-    return;
-  }
-  ScopedLocalRef<jobject> thread(env, env->AllocObject(thread_klass.get()));
-  if (thread.get() == nullptr) {
-    env->ExceptionDescribe();
-    env->ExceptionClear();
-    return;
-  }
 
-  env->CallNonvirtualVoidMethod(
-      thread.get(),
-      thread_klass.get(),
-      env->GetMethodID(thread_klass.get(), "<init>", "(Ljava/lang/String;)V"),
-      thread_name.get());
-  env->CallVoidMethod(thread.get(), env->GetMethodID(thread_klass.get(), "setPriority", "(I)V"), 1);
-  env->CallVoidMethod(
-      thread.get(), env->GetMethodID(thread_klass.get(), "setDaemon", "(Z)V"), JNI_TRUE);
+// Adds the capabilities that we'd like but that aren't available on all versions of Android. APIs
+// that depend on a missing capability fail with JVMTI_ERROR_MUST_POSSESS_CAPABILITY.
+static void AddOptionalCapabilities(jvmtiEnv* jvmti) {
+  jvmtiCapabilities wanted = {
+    .can_generate_field_modification_events = JNI_TRUE,
+    .can_generate_field_access_events = JNI_TRUE,
+    .can_get_current_contended_monitor = JNI_TRUE,
+    .can_get_monitor_info = JNI_TRUE,
+    .can_get_source_file_name = JNI_TRUE,
+    .can_get_line_numbers = JNI_TRUE,
+    .can_access_local_variables = JNI_TRUE,
+    .can_generate_single_step_events = JNI_TRUE,
+    .can_generate_exception_events = JNI_TRUE,
+    .can_generate_frame_pop_events = JNI_TRUE,
+    .can_get_thread_cpu_time = JNI_TRUE,
+    .can_generate_monitor_events = JNI_TRUE,
+    .can_get_owned_monitor_stack_depth_info = JNI_TRUE,
+  };
 
-  jvmti->RunAgentThread(thread.get(), AgentMain, nullptr, JVMTI_THREAD_MIN_PRIORITY);
-}
+  jvmtiCapabilities potential = {};
+  CHECK_JVMTI(jvmti->GetPotentialCapabilities(&potential));
 
+  // jvmtiCapabilities is a bitfield, so intersect it byte-by-byte
+  jvmtiCapabilities caps = {};
+  auto wantedBytes = reinterpret_cast<const unsigned char*>(&wanted);
+  auto potentialBytes = reinterpret_cast<const unsigned char*>(&potential);
+  auto capsBytes = reinterpret_cast<unsigned char*>(&caps);
+  for (size_t i = 0; i < sizeof(caps); i++) {
+    capsBytes[i] = wantedBytes[i] & potentialBytes[i];
+  }
+
+  CHECK_JVMTI(jvmti->AddCapabilities(&caps));
+}
 
 template <bool kIsOnLoad>
 static jint AgentStart(JavaVM* vm, char* options, [[maybe_unused]] void* reserved) {
@@ -1088,17 +6208,28 @@ static jint AgentStart(JavaVM* vm, char* options, [[maybe_unused]] void* reserve
     //.can_force_early_return = JNI_TRUE,
   };
   CHECK_JVMTI(jvmti->AddCapabilities(&caps) != JVMTI_ERROR_NONE);
+  AddOptionalCapabilities(jvmti);
 
   jvmtiEventCallbacks cb{
     .VMInit = CbVmInit,
+    .Exception = CbException,
+    .SingleStep = CbSingleStep,
+    .FramePop = CbFramePop,
     .Breakpoint = CbBreakpoint,
+    .FieldAccess = CbFieldAccess,
+    .FieldModification = CbFieldModification,
     .MethodEntry = CbMethodEntry,
     .MethodExit = CbMethodExit,
+    .MonitorContendedEnter = CbMonitorContendedEnter,
+    .MonitorContendedEntered = CbMonitorContendedEntered,
   };
   CHECK_JVMTI(jvmti->SetEventCallbacks(&cb, sizeof(cb)));
   CHECK_JVMTI(jvmti->SetEnvironmentLocalStorage(reinterpret_cast<void*>(ai)));
   CHECK_JVMTI(jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_BREAKPOINT, nullptr /* all threads */));
 
+  // FramePop and field events are enabled on demand (see UpdateFramePopMode and
+  // UpdateFieldEventMode), since enabling them for all threads makes ART deoptimize everything
+
   if (kIsOnLoad) {
     LOG(DEBUG) << "kIsOnLoad";
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, nullptr);